@@ -1,31 +1,118 @@
 
 
+#define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING
+#endif
 
 #include "block.h"
+#include "crc32c.h"
 
 const size_t block_disk_magic = 0xabbacddc;
 
+#define BLOCK_CRC32C 0x1 /* cada bloque lleva su crc32c */
+
 struct device_disk {
 	size_t magic;
 	size_t num_blocks;
 	size_t block_size;
 	size_t checksum;
+	size_t flags; /* en dispositivos viejos está a cero */
 };
 
+/* Con BLOCK_CRC32C detrás del último bloque va una tabla con el crc32c de
+ * cada bloque (4 bytes por bloque). Se tiene entera en memoria, así leer
+ * no cuesta ninguna llamada más; al escribir se escribe su trozo después
+ * de los datos
+ */
+struct aio;
+
 struct device {
 	struct device_disk disk;
 	char *name;
 	int fd;
+	uint32_t *crc; /* NULL si no hay */
+	struct aio *aio; /* motor asíncrono (NULL hasta que hace falta) */
 };
 
+#define crc_pos(dev, num) (((dev)->disk.num_blocks + 1) * (dev)->disk.block_size \
+			   + (num) * sizeof(uint32_t))
+
+static size_t disk_checksum(struct device_disk *disk)
+{
+	return disk->magic ^ disk->num_blocks ^ disk->block_size ^ disk->flags;
+}
+
+/* escribe los crc de los bloques [first, first + count) */
+static int crc_store(struct device *dev, size_t first, size_t count)
+{
+	ssize_t len = count * sizeof(uint32_t);
+
+	if (pwrite(dev->fd, dev->crc + first, len, crc_pos(dev, first)) != len) {
+		errno = EIO;
+		return -1;
+	}
+	return 0;
+}
+
+static int crc_load(struct device *dev)
+{
+	ssize_t len = dev->disk.num_blocks * sizeof(uint32_t);
+
+	dev->crc = malloc(len);
+	if (dev->crc == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	if (pread(dev->fd, dev->crc, len, crc_pos(dev, 0)) != len) {
+		free(dev->crc);
+		dev->crc = NULL;
+		errno = EIO;
+		return -1;
+	}
+	return 0;
+}
+
+/* crc de cada bloque de los buffers de iov (un bloque puede estar partido
+ * entre dos buffers: el crc se sigue calculando con el siguiente) */
+static void crc_iov(struct device *dev, const struct iovec *iov, int iovcnt,
+		    uint32_t *out)
+{
+	size_t left = dev->disk.block_size, off, n;
+	uint32_t crc = 0;
+	int i, k = 0;
+
+	for (i = 0; i < iovcnt; i++)
+		for (off = 0; off < iov[i].iov_len; off += n) {
+			n = iov[i].iov_len - off;
+			if (n > left)
+				n = left;
+			crc = crc32c(crc, (char *) iov[i].iov_base + off, n);
+			left -= n;
+			if (left == 0) {
+				out[k++] = crc;
+				crc = 0;
+				left = dev->disk.block_size;
+			}
+		}
+}
+
 struct device *block_create(char *name, size_t num_blocks, size_t block_size)
 {
 	struct device *dev = malloc(sizeof(struct device));
@@ -43,10 +130,10 @@ struct device *block_create(char *name, size_t num_blocks, size_t block_size)
 	dev->disk.magic = block_disk_magic;
 	dev->disk.num_blocks = num_blocks;
 	dev->disk.block_size = block_size;
-
-	dev->disk.checksum  = block_disk_magic;
-	dev->disk.checksum ^= num_blocks;
-	dev->disk.checksum ^= block_size;
+	dev->disk.flags = 0;
+	dev->disk.checksum = disk_checksum(&dev->disk);
+	dev->crc = NULL;
+	dev->aio = NULL;
 
 	dev->fd = open(name, O_RDWR | O_CREAT);
 	if (dev->fd == -1)
@@ -103,10 +190,7 @@ struct device *block_open(char *name)
 		goto close_dev;
 	}
 
-	checksum  = dev->disk.magic;
-	checksum ^= dev->disk.num_blocks;
-	checksum ^= dev->disk.block_size;
-	checksum ^= dev->disk.checksum;
+	checksum = disk_checksum(&dev->disk) ^ dev->disk.checksum;
 
 	if (checksum) {
 		printf("Invalid checksum\n");
@@ -120,6 +204,11 @@ struct device *block_open(char *name)
 		goto close_dev;
 	}
 
+	dev->crc = NULL;
+	dev->aio = NULL;
+	if ((dev->disk.flags & BLOCK_CRC32C) && (crc_load(dev) == -1))
+		goto close_dev;
+
 	dev->name = strdup(name);
 	return dev;
 
@@ -132,18 +221,87 @@ error:
 
 }
 
+static void aio_free(struct device *dev);
+
 int block_close(struct device *dev)
 {
 	if (dev == NULL) {
 		errno = EBADF;
 		return -1;
 	}
+	aio_free(dev);
 	close(dev->fd);
+	free(dev->crc);
 	free(dev->name);
 	free(dev);
 	return 0;
 }
 
+/* Calcula el crc32c de todos los bloques y a partir de aquí se comprueba
+ * en cada lectura
+ */
+int block_set_checksums(struct device *dev)
+{
+	struct device_disk disk;
+	size_t i, n, chunk = 64;
+	ssize_t len;
+	char *buffer;
+
+	if (dev == NULL) {
+		errno = EBADF;
+		return -1;
+	}
+	if (dev->crc != NULL)
+		return 0;
+	buffer = malloc(chunk * dev->disk.block_size);
+	dev->crc = malloc(dev->disk.num_blocks * sizeof(uint32_t));
+	if ((buffer == NULL) || (dev->crc == NULL))
+		goto nomem;
+	for (i = 0; i < dev->disk.num_blocks; i += n) {
+		n = (dev->disk.num_blocks - i < chunk)? dev->disk.num_blocks - i: chunk;
+		len = n * dev->disk.block_size;
+		if (pread(dev->fd, buffer, len, (i + 1) * dev->disk.block_size) != len)
+			goto io;
+		for (len = 0; len < n; len++)
+			dev->crc[i + len] = crc32c(0, buffer + len * dev->disk.block_size,
+						   dev->disk.block_size);
+	}
+	free(buffer);
+	buffer = NULL;
+	if (crc_store(dev, 0, dev->disk.num_blocks) == -1)
+		goto io;
+
+	disk = dev->disk;
+	disk.flags |= BLOCK_CRC32C;
+	disk.checksum = disk_checksum(&disk);
+	if (pwrite(dev->fd, &disk, sizeof(struct device_disk), 0)
+	    != sizeof(struct device_disk))
+		goto io;
+	dev->disk = disk;
+
+	return 0;
+nomem:
+	errno = ENOMEM;
+	goto out;
+io:
+	errno = EIO;
+out:
+	free(buffer);
+	free(dev->crc);
+	dev->crc = NULL;
+	return -1;
+}
+
+/* 1 si los bloques llevan crc32c */
+int block_get_checksums(struct device *dev)
+{
+	if (dev == NULL) {
+		errno = EBADF;
+		return -1;
+	}
+	return dev->crc != NULL;
+}
+
 int block_get_block_size(struct device *dev)
 {
 	if (dev == NULL) {
@@ -153,6 +311,85 @@ int block_get_block_size(struct device *dev)
 	return dev->disk.block_size;
 }
 
+int block_get_num_blocks(struct device *dev)
+{
+	if (dev == NULL) {
+		errno = EBADF;
+		return -1;
+	}
+	return dev->disk.num_blocks;
+}
+
+/* La tabla de crc va detrás del último bloque: al crecer, donde estaba
+ * quedan bloques nuevos (a cero) y la tabla se escribe más allá
+ */
+static int crc_resize(struct device *dev, size_t num_blocks)
+{
+	size_t old = dev->disk.num_blocks, i;
+	ssize_t len = old * sizeof(uint32_t);
+	uint32_t *crc = realloc(dev->crc, num_blocks * sizeof(uint32_t));
+	char *zero = calloc(1, (len > dev->disk.block_size)? len: dev->disk.block_size);
+
+	if ((crc == NULL) || (zero == NULL)) {
+		if (crc != NULL)
+			dev->crc = crc;
+		free(zero);
+		errno = ENOMEM;
+		return -1;
+	}
+	dev->crc = crc;
+	uint32_t empty = crc32c(0, zero, dev->disk.block_size);
+	for (i = old; i < num_blocks; i++)
+		dev->crc[i] = empty;
+	if ((ftruncate(dev->fd, (num_blocks + 1) * dev->disk.block_size +
+		       num_blocks * sizeof(uint32_t)) == -1) ||
+	    (pwrite(dev->fd, zero, len, crc_pos(dev, 0)) != len)) {
+		free(zero);
+		return -1;
+	}
+	free(zero);
+
+	dev->disk.num_blocks = num_blocks; /* para crc_pos */
+	i = crc_store(dev, 0, num_blocks);
+	dev->disk.num_blocks = old;
+
+	return (i == 0)? 0: -1;
+}
+
+/* Hace el dispositivo más grande (los bloques nuevos quedan a cero y, si
+ * el sistema lo permite, sin ocupar sitio hasta que se escriban)
+ */
+int block_resize(struct device *dev, size_t num_blocks)
+{
+	struct device_disk disk;
+
+	if (dev == NULL) {
+		errno = EBADF;
+		return -1;
+	}
+	if (num_blocks < dev->disk.num_blocks) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (dev->crc == NULL) {
+		if (ftruncate(dev->fd, (num_blocks + 1) * dev->disk.block_size) == -1)
+			return -1;
+	} else if (crc_resize(dev, num_blocks) == -1)
+		return -1;
+
+	disk = dev->disk;
+	disk.num_blocks = num_blocks;
+	disk.checksum = disk_checksum(&disk);
+	if (pwrite(dev->fd, &disk, sizeof(struct device_disk), 0)
+	    != sizeof(struct device_disk)) {
+		errno = EIO;
+		return -1;
+	}
+	dev->disk = disk;
+
+	return 0;
+}
+
 int block_get_file_size(struct device *dev)
 {
 	struct stat buf;
@@ -179,10 +416,16 @@ int block_read(struct device *dev, void *buffer, size_t num_block)
 
 	pos = (num_block + 1) * dev->disk.block_size;
 
-	if (lseek(dev->fd, pos, SEEK_SET) == -1)
+	/* pread: no mueve el offset del descriptor, así varios hilos pueden
+	 * usar el mismo dispositivo a la vez */
+	ssize_t n = pread(dev->fd, buffer, dev->disk.block_size, pos);
+	if ((n == (ssize_t) dev->disk.block_size) && (dev->crc != NULL) &&
+	    (crc32c(0, buffer, n) != dev->crc[num_block])) {
+		printf("block %zu: bad checksum\n", num_block);
+		errno = EBADMSG;
 		return -1;
-
-	return read(dev->fd, buffer, dev->disk.block_size);
+	}
+	return n;
 }
 
 int block_write(struct device *dev, void *buffer, size_t num_block)
@@ -201,9 +444,575 @@ int block_write(struct device *dev, void *buffer, size_t num_block)
 
 	pos = (num_block + 1) * dev->disk.block_size;
 
-	if (lseek(dev->fd, pos, SEEK_SET) == -1)
+	/* pwrite: no mueve el offset del descriptor, así varios hilos pueden
+	 * usar el mismo dispositivo a la vez */
+	ssize_t n = pwrite(dev->fd, buffer, dev->disk.block_size, pos);
+	if ((n == (ssize_t) dev->disk.block_size) && (dev->crc != NULL)) {
+		dev->crc[num_block] = crc32c(0, buffer, n);
+		if (crc_store(dev, num_block, 1) == -1)
+			return -1;
+	}
+	return n;
+
+}
+
+/* Copia num_blocks bloques a partir de src en los que empiezan en dst sin
+ * pasar por un buffer del usuario (si el sistema tiene copy_file_range)
+ */
+int block_copy(struct device *dev, size_t src, size_t dst, size_t num_blocks)
+{
+	loff_t in, out;
+	size_t len;
+	ssize_t n;
+
+	if (dev == NULL) {
+		errno = EBADF;
+		return -1;
+	}
+
+	if ((src + num_blocks > dev->disk.num_blocks) ||
+	    (dst + num_blocks > dev->disk.num_blocks)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	in  = (src + 1) * dev->disk.block_size;
+	out = (dst + 1) * dev->disk.block_size;
+	len = num_blocks * dev->disk.block_size;
+
+	while (len > 0) {
+		n = copy_file_range(dev->fd, &in, dev->fd, &out, len, 0);
+		if (n <= 0)
+			break;
+		len -= n;
+	}
+	if (len == 0)
+		goto copy_crc;
+
+	/* no hay copy_file_range (o no sirve): copiamos a mano */
+	size_t chunk = (len > 64 * dev->disk.block_size)?
+		64 * dev->disk.block_size: len;
+	char *buffer = malloc(chunk);
+
+	if (buffer == NULL) {
+		errno = ENOMEM;
 		return -1;
+	}
+	while (len > 0) {
+		n = pread(dev->fd, buffer, (len > chunk)? chunk: len, in);
+		if (n <= 0 || pwrite(dev->fd, buffer, n, out) != n) {
+			free(buffer);
+			errno = EIO;
+			return -1;
+		}
+		in += n;
+		out += n;
+		len -= n;
+	}
+	free(buffer);
 
-	return write(dev->fd, buffer, dev->disk.block_size);
+copy_crc:
+	if (dev->crc != NULL) {
+		memmove(dev->crc + dst, dev->crc + src, num_blocks * sizeof(uint32_t));
+		if (crc_store(dev, dst, num_blocks) == -1)
+			return -1;
+	}
+	return num_blocks;
+}
+
+/* Comprueba que los buffers de iov son bloques enteros y que caben en el
+ * dispositivo a partir de num_block
+ *
+ * Devuelve la posición del fichero donde empiezan o -1
+ */
+static off_t block_iov_pos(struct device *dev, const struct iovec *iov,
+			   int iovcnt, size_t num_block)
+{
+	size_t len = 0;
+	int i;
 
+	if (dev == NULL) {
+		errno = EBADF;
+		return -1;
+	}
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	if ((len % dev->disk.block_size) ||
+	    (num_block + len / dev->disk.block_size > dev->disk.num_blocks)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return (num_block + 1) * dev->disk.block_size;
+}
+
+/* Lee los bloques seguidos que empiezan en num_block repartiéndolos en los
+ * buffers de iov, con una sola llamada al sistema
+ *
+ * Devuelve los bytes leidos o -1
+ */
+int block_readv(struct device *dev, const struct iovec *iov, int iovcnt,
+		size_t num_block)
+{
+	off_t pos = block_iov_pos(dev, iov, iovcnt, num_block);
+	ssize_t n, k;
+
+	if (pos == -1)
+		return -1;
+	n = preadv(dev->fd, iov, iovcnt, pos);
+	if ((n <= 0) || (dev->crc == NULL))
+		return n;
+
+	/* se comprueba toda la tanda de una vez */
+	size_t count = n / dev->disk.block_size;
+	uint32_t *crc = malloc(count * sizeof(uint32_t));
+	if (crc == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	crc_iov(dev, iov, iovcnt, crc);
+	for (k = 0; k < count; k++)
+		if (crc[k] != dev->crc[num_block + k]) {
+			printf("block %zu: bad checksum\n", num_block + k);
+			free(crc);
+			errno = EBADMSG;
+			return -1;
+		}
+	free(crc);
+	return n;
+}
+
+/* Escribe los buffers de iov en los bloques seguidos que empiezan en
+ * num_block, con una sola llamada al sistema
+ *
+ * Devuelve los bytes escritos o -1
+ */
+int block_writev(struct device *dev, const struct iovec *iov, int iovcnt,
+		 size_t num_block)
+{
+	off_t pos = block_iov_pos(dev, iov, iovcnt, num_block);
+	ssize_t n;
+
+	if (pos == -1)
+		return -1;
+	n = pwritev(dev->fd, iov, iovcnt, pos);
+	if ((n <= 0) || (dev->crc == NULL))
+		return n;
+
+	/* los crc de toda la tanda van en una sola escritura */
+	crc_iov(dev, iov, iovcnt, dev->crc + num_block);
+	if (crc_store(dev, num_block, n / dev->disk.block_size) == -1)
+		return -1;
+	return n;
+}
+
+/* Entrada/salida asíncrona. Con io_uring las peticiones se dejan en su
+ * anillo y se mandan todas juntas con una llamada io_uring_enter al ir a
+ * recoger; sin él (o con MFS_AIO=threads) las hacen con pread/pwrite unos
+ * hilos. En los dos casos lo que acaba se procesa en block_complete, en el
+ * hilo del que pide: ahí se miran y guardan los crc y se llama a done
+ */
+struct aio {
+	const char *name;
+	int depth;
+	int inflight; /* mandadas y sin recoger */
+	int failed; /* fallidas desde el último block_drain */
+#ifdef HAVE_IO_URING
+	int ring_fd; /* -1: se usan los hilos */
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_len, cq_len, sqes_len;
+	unsigned pending; /* en el anillo sin pasar al núcleo */
+#endif
+	pthread_t *threads;
+	int num_threads;
+	pthread_mutex_t lock;
+	pthread_cond_t work; /* hay algo en queue (o hay que parar) */
+	pthread_cond_t finished; /* hay algo en done */
+	struct block_req *queue, *queue_tail; /* para los hilos */
+	struct block_req *done; /* hechas por los hilos, sin recoger */
+	bool stop;
+};
+
+#ifdef HAVE_IO_URING
+static int uring_setup(struct aio *aio)
+{
+	struct io_uring_params p;
+
+	memset(&p, '\0', sizeof(p));
+	aio->ring_fd = syscall(__NR_io_uring_setup, aio->depth, &p);
+	if (aio->ring_fd == -1)
+		return -1;
+
+	aio->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	aio->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (aio->cq_len > aio->sq_len)
+			aio->sq_len = aio->cq_len;
+		aio->cq_len = 0;
+	}
+	aio->sq_ptr = mmap(NULL, aio->sq_len, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, aio->ring_fd, IORING_OFF_SQ_RING);
+	if (aio->sq_ptr == MAP_FAILED)
+		goto error;
+	aio->cq_ptr = aio->sq_ptr;
+	if (aio->cq_len != 0) {
+		aio->cq_ptr = mmap(NULL, aio->cq_len, PROT_READ | PROT_WRITE,
+				   MAP_SHARED | MAP_POPULATE, aio->ring_fd,
+				   IORING_OFF_CQ_RING);
+		if (aio->cq_ptr == MAP_FAILED)
+			goto unmap_sq;
+	}
+	aio->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	aio->sqes = mmap(NULL, aio->sqes_len, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, aio->ring_fd, IORING_OFF_SQES);
+	if (aio->sqes == MAP_FAILED)
+		goto unmap_cq;
+
+	aio->sq_head = aio->sq_ptr + p.sq_off.head;
+	aio->sq_tail = aio->sq_ptr + p.sq_off.tail;
+	aio->sq_mask = aio->sq_ptr + p.sq_off.ring_mask;
+	aio->sq_array = aio->sq_ptr + p.sq_off.array;
+	aio->cq_head = aio->cq_ptr + p.cq_off.head;
+	aio->cq_tail = aio->cq_ptr + p.cq_off.tail;
+	aio->cq_mask = aio->cq_ptr + p.cq_off.ring_mask;
+	aio->cqes = aio->cq_ptr + p.cq_off.cqes;
+	aio->depth = p.sq_entries; /* lo redondea a potencia de dos */
+	aio->pending = 0;
+	aio->name = "io_uring";
+	return 0;
+
+unmap_cq:
+	if (aio->cq_len != 0)
+		munmap(aio->cq_ptr, aio->cq_len);
+unmap_sq:
+	munmap(aio->sq_ptr, aio->sq_len);
+error:
+	close(aio->ring_fd);
+	aio->ring_fd = -1;
+	return -1;
+}
+
+static void uring_submit(struct device *dev, struct block_req *req)
+{
+	struct aio *aio = dev->aio;
+	unsigned tail = *aio->sq_tail;
+	unsigned i = tail & *aio->sq_mask;
+	struct io_uring_sqe *sqe = &aio->sqes[i];
+
+	memset(sqe, '\0', sizeof(*sqe));
+	sqe->opcode = req->write? IORING_OP_WRITEV: IORING_OP_READV;
+	sqe->fd = dev->fd;
+	sqe->addr = (unsigned long) &req->iov;
+	sqe->len = 1;
+	sqe->off = (req->num_block + 1) * dev->disk.block_size;
+	sqe->user_data = (unsigned long) req;
+	aio->sq_array[i] = i;
+	__atomic_store_n(aio->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	aio->pending++;
+}
+
+/* Pasa al núcleo lo que haya en el anillo y con wait espera a que acabe
+ * al menos una
+ */
+static int uring_enter(struct aio *aio, bool wait)
+{
+	unsigned flags = wait? IORING_ENTER_GETEVENTS: 0;
+	int n;
+
+	if ((aio->pending == 0) && !wait)
+		return 0;
+	do
+		n = syscall(__NR_io_uring_enter, aio->ring_fd, aio->pending,
+			    wait? 1: 0, flags, NULL, 0);
+	while ((n == -1) && (errno == EINTR));
+	if (n == -1)
+		return -1;
+	aio->pending -= n;
+	return 0;
+}
+#endif
+
+static void *aio_thread(void *arg)
+{
+	struct device *dev = arg;
+	struct aio *aio = dev->aio;
+	struct block_req *req;
+
+	pthread_mutex_lock(&aio->lock);
+	while (1) {
+		while ((aio->queue == NULL) && !aio->stop)
+			pthread_cond_wait(&aio->work, &aio->lock);
+		if (aio->queue == NULL)
+			break;
+		req = aio->queue;
+		aio->queue = req->next;
+		pthread_mutex_unlock(&aio->lock);
+
+		off_t pos = (req->num_block + 1) * dev->disk.block_size;
+		ssize_t n = req->write? pwrite(dev->fd, req->buffer, req->iov.iov_len, pos):
+			pread(dev->fd, req->buffer, req->iov.iov_len, pos);
+		req->res = (n == -1)? -errno: n;
+
+		pthread_mutex_lock(&aio->lock);
+		req->next = aio->done;
+		aio->done = req;
+		pthread_cond_signal(&aio->finished);
+	}
+	pthread_mutex_unlock(&aio->lock);
+	return NULL;
+}
+
+static int threads_setup(struct device *dev)
+{
+	struct aio *aio = dev->aio;
+	int i;
+
+	/* más hilos que peticiones en vuelo no sirven de nada */
+	aio->num_threads = (aio->depth < 16)? aio->depth: 16;
+	aio->threads = malloc(aio->num_threads * sizeof(pthread_t));
+	if (aio->threads == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	for (i = 0; i < aio->num_threads; i++)
+		if (pthread_create(&aio->threads[i], NULL, aio_thread, dev) != 0)
+			break;
+	if (i == 0) {
+		free(aio->threads);
+		aio->threads = NULL;
+		errno = EAGAIN;
+		return -1;
+	}
+	aio->num_threads = i;
+	aio->name = "threads";
+	return 0;
+}
+
+int block_aio_setup(struct device *dev, int depth, const char *engine)
+{
+	struct aio *aio;
+
+	if (dev == NULL) {
+		errno = EBADF;
+		return -1;
+	}
+	if (depth <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	aio_free(dev);
+	aio = calloc(1, sizeof(struct aio));
+	if (aio == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	aio->depth = depth;
+	pthread_mutex_init(&aio->lock, NULL);
+	pthread_cond_init(&aio->work, NULL);
+	pthread_cond_init(&aio->finished, NULL);
+	dev->aio = aio;
+
+	if (engine == NULL)
+		engine = getenv("MFS_AIO");
+#ifdef HAVE_IO_URING
+	aio->ring_fd = -1;
+	if (((engine == NULL) || !strcmp(engine, "io_uring")) &&
+	    (uring_setup(aio) == 0))
+		return 0;
+#endif
+	if ((engine != NULL) && strcmp(engine, "threads") &&
+	    strcmp(engine, "io_uring")) {
+		aio_free(dev);
+		errno = EINVAL;
+		return -1;
+	}
+	/* sin io_uring: los hilos */
+	if (threads_setup(dev) == -1) {
+		aio_free(dev);
+		return -1;
+	}
+	return 0;
+}
+
+const char *block_aio_name(struct device *dev)
+{
+	return ((dev == NULL) || (dev->aio == NULL))? "none": dev->aio->name;
+}
+
+int block_submit(struct device *dev, struct block_req *req)
+{
+	if (dev == NULL) {
+		errno = EBADF;
+		return -1;
+	}
+	if ((req->count == 0) || (req->num_block + req->count > dev->disk.num_blocks)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if ((dev->aio == NULL) && (block_aio_setup(dev, BLOCK_DEPTH, NULL) == -1))
+		return -1;
+
+	struct aio *aio = dev->aio;
+	while (aio->inflight >= aio->depth)
+		if (block_complete(dev, 1) == -1)
+			return -1;
+
+	req->iov.iov_base = req->buffer;
+	req->iov.iov_len = req->count * dev->disk.block_size;
+	req->res = 0;
+	req->err = 0;
+	req->next = NULL;
+	aio->inflight++;
+#ifdef HAVE_IO_URING
+	if (aio->ring_fd != -1) {
+		uring_submit(dev, req);
+		return 0;
+	}
+#endif
+	pthread_mutex_lock(&aio->lock);
+	if (aio->queue == NULL)
+		aio->queue = req;
+	else
+		aio->queue_tail->next = req;
+	aio->queue_tail = req;
+	pthread_cond_signal(&aio->work);
+	pthread_mutex_unlock(&aio->lock);
+	return 0;
+}
+
+/* Lo que se hace con cada petición acabada (res es lo que devolvió la
+ * llamada o -errno) */
+static void aio_finish(struct device *dev, struct block_req *req, int res)
+{
+	size_t k, count = req->count;
+	uint32_t crc;
+
+	dev->aio->inflight--;
+	if ((res >= 0) && (res != req->iov.iov_len))
+		res = -EIO;
+	if ((res >= 0) && (dev->crc != NULL)) {
+		for (k = 0; k < count; k++) {
+			crc = crc32c(0, (char *) req->buffer + k * dev->disk.block_size,
+				     dev->disk.block_size);
+			if (req->write)
+				dev->crc[req->num_block + k] = crc;
+			else if (crc != dev->crc[req->num_block + k]) {
+				printf("block %zu: bad checksum\n", req->num_block + k);
+				res = -EBADMSG;
+				break;
+			}
+		}
+		if (req->write && (crc_store(dev, req->num_block, count) == -1))
+			res = -EIO;
+	}
+	if (res < 0) {
+		req->res = -1;
+		req->err = -res;
+		dev->aio->failed++;
+	} else
+		req->res = res;
+	if (req->done != NULL)
+		req->done(req);
+}
+
+int block_complete(struct device *dev, int wait)
+{
+	struct aio *aio;
+	struct block_req *req, *next;
+	int n = 0;
+
+	if (dev == NULL) {
+		errno = EBADF;
+		return -1;
+	}
+	aio = dev->aio;
+	if ((aio == NULL) || (aio->inflight == 0))
+		return 0;
+	wait = wait? 1: 0;
+
+#ifdef HAVE_IO_URING
+	if (aio->ring_fd != -1) {
+		unsigned head = *aio->cq_head;
+		if ((__atomic_load_n(aio->cq_tail, __ATOMIC_ACQUIRE) != head) && wait)
+			wait = 0; /* ya hay alguna: no hace falta esperar */
+		if (uring_enter(aio, wait) == -1)
+			return -1;
+		while (head != __atomic_load_n(aio->cq_tail, __ATOMIC_ACQUIRE)) {
+			struct io_uring_cqe *cqe = &aio->cqes[head & *aio->cq_mask];
+			req = (struct block_req *) (unsigned long) cqe->user_data;
+			int res = cqe->res;
+			head++;
+			__atomic_store_n(aio->cq_head, head, __ATOMIC_RELEASE);
+			aio_finish(dev, req, res);
+			n++;
+		}
+		return n;
+	}
+#endif
+	pthread_mutex_lock(&aio->lock);
+	while (wait && (aio->done == NULL))
+		pthread_cond_wait(&aio->finished, &aio->lock);
+	req = aio->done;
+	aio->done = NULL;
+	pthread_mutex_unlock(&aio->lock);
+	for (; req != NULL; req = next, n++) {
+		next = req->next;
+		aio_finish(dev, req, req->res);
+	}
+	return n;
+}
+
+int block_drain(struct device *dev)
+{
+	int failed;
+
+	if (dev == NULL) {
+		errno = EBADF;
+		return -1;
+	}
+	if (dev->aio == NULL)
+		return 0;
+	while (dev->aio->inflight > 0)
+		if (block_complete(dev, 1) == -1)
+			return -1;
+	failed = dev->aio->failed;
+	dev->aio->failed = 0;
+	return failed;
+}
+
+static void aio_free(struct device *dev)
+{
+	struct aio *aio = dev->aio;
+	int i;
+
+	if (aio == NULL)
+		return;
+	block_drain(dev);
+	if (aio->threads != NULL) {
+		pthread_mutex_lock(&aio->lock);
+		aio->stop = true;
+		pthread_cond_broadcast(&aio->work);
+		pthread_mutex_unlock(&aio->lock);
+		for (i = 0; i < aio->num_threads; i++)
+			pthread_join(aio->threads[i], NULL);
+		free(aio->threads);
+	}
+#ifdef HAVE_IO_URING
+	if (aio->ring_fd != -1) {
+		munmap(aio->sqes, aio->sqes_len);
+		if (aio->cq_len != 0)
+			munmap(aio->cq_ptr, aio->cq_len);
+		munmap(aio->sq_ptr, aio->sq_len);
+		close(aio->ring_fd);
+	}
+#endif
+	pthread_mutex_destroy(&aio->lock);
+	pthread_cond_destroy(&aio->work);
+	pthread_cond_destroy(&aio->finished);
+	free(aio);
+	dev->aio = NULL;
 }
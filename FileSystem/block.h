@@ -2,6 +2,8 @@
 #ifndef __block_h
 #define __block_h
 
+#include <sys/uio.h>
+
 struct device;
 
 struct device *block_create(char *name, size_t num_blocks, size_t block_size);
@@ -10,9 +12,55 @@ struct device *block_open(char *name);
 int block_close(struct device *dev);
 int block_get_block_size(struct device *dev);
 int block_get_file_size(struct device *dev);
+int block_get_num_blocks(struct device *dev);
+int block_resize(struct device *dev, size_t num_blocks);
+int block_set_checksums(struct device *dev);
+int block_get_checksums(struct device *dev);
 
 int block_read(struct device *dev, void *buffer, size_t block_num);
 int block_write(struct device *dev, void *buffer, size_t block_num);
+int block_copy(struct device *dev, size_t src, size_t dst, size_t num_blocks);
+int block_readv(struct device *dev, const struct iovec *iov, int iovcnt,
+		size_t block_num);
+int block_writev(struct device *dev, const struct iovec *iov, int iovcnt,
+		 size_t block_num);
+
+/* Entrada/salida asíncrona: count bloques seguidos desde num_block. Al
+ * acabar res tiene los bytes leídos o escritos (o -1 y err el errno) y se
+ * llama a done, siempre desde block_complete en el hilo que la pidió.
+ * buffer tiene que seguir ahí hasta entonces
+ */
+struct block_req {
+	int write;
+	void *buffer;
+	size_t num_block;
+	size_t count;
+	void (*done)(struct block_req *req); /* puede ser NULL */
+	void *data; /* para done */
+	int res;
+	int err;
+	/* lo que sigue es de block.c */
+	struct iovec iov;
+	struct block_req *next;
+};
+
+/* Motor con depth peticiones en vuelo como mucho: "io_uring", "threads" o
+ * NULL para el que haya (io_uring si el núcleo lo tiene; se puede forzar
+ * con MFS_AIO). Si no se llama, el primer block_submit lo pone con
+ * BLOCK_DEPTH
+ */
+#define BLOCK_DEPTH 32
+int block_aio_setup(struct device *dev, int depth, const char *engine);
+const char *block_aio_name(struct device *dev);
+
+/* Si ya hay depth en vuelo espera antes a que acabe alguna */
+int block_submit(struct device *dev, struct block_req *req);
+/* Recoge las que hayan acabado (con wait espera al menos a una si hay
+ * alguna en vuelo). Devuelve cuantas */
+int block_complete(struct device *dev, int wait);
+/* Espera a todas las que están en vuelo. Devuelve cuantas fallaron desde
+ * el último block_drain */
+int block_drain(struct device *dev);
 
 #endif /* __block_h */
 
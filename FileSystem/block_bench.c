@@ -0,0 +1,367 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "block.h"
+#include "crc32c.h"
+
+int block_size = 4096;
+int num_blocks = 8192;
+int run = 16; /* bloques por llamada en readv/writev */
+int max_depth = 0; /* con -q: hasta qué profundidad de cola se mide */
+
+static struct option long_options[] = {
+	{ .name = "block-size",
+	  .has_arg = required_argument,
+	  .flag = NULL,
+	  .val = 'b'},
+	{ .name = "num-blocks",
+	  .has_arg = required_argument,
+	  .flag = NULL,
+	  .val = 'n'},
+	{ .name = "run",
+	  .has_arg = required_argument,
+	  .flag = NULL,
+	  .val = 'r'},
+	{ .name = "queue",
+	  .has_arg = required_argument,
+	  .flag = NULL,
+	  .val = 'q'},
+	{ .name = "help",
+	  .has_arg = no_argument,
+	  .flag = NULL,
+	  .val = 'h'},
+	{0, 0, 0, 0}
+};
+
+static void usage(int i)
+{
+	printf(
+		"Usage:  block_bench [OPTION] NAME\n"
+		"Mide lo que cuestan los checksums de los bloques: crea NAME\n"
+		"con y sin crc32c y lo escribe y lee entero\n\n"
+		"Opciones:\n"
+		"  -b, --block-size=<tamaño bloque>\n"
+		"  -n, --num-blocks=<numero de bloques>\n"
+		"  -r, --run=<bloques por llamada en readv/writev>\n"
+		"  -q, --queue=<profundidad>: en vez de lo anterior mide lecturas y\n"
+		"      escrituras asíncronas de bloques al azar con 1, 2, 4... hasta\n"
+		"      esa profundidad de cola, con io_uring y con hilos\n"
+		"  -h, --help: muestra esta ayuda\n\n"
+	);
+	exit(i);
+}
+
+static void get_int(char *arg, int *value)
+{
+	char *end;
+	*value = strtol(arg, &end, 10);
+
+	if ((*end != '\0') || (*value <= 0)) {
+		printf("'%s': no es un entero válido\n", arg);
+		usage(-3);
+	}
+}
+
+static int handle_options(int argc, char **argv)
+{
+	while (1) {
+		int c = getopt_long(argc, argv, "b:n:r:q:h", long_options, NULL);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'b':
+			get_int(optarg, &block_size);
+			break;
+		case 'n':
+			get_int(optarg, &num_blocks);
+			break;
+		case 'r':
+			get_int(optarg, &run);
+			break;
+		case 'q':
+			get_int(optarg, &max_depth);
+			break;
+		case '?':
+		case 'h':
+			usage(0);
+			break;
+		default:
+			printf ("?? getopt returned character code 0%o ??\n", c);
+			usage(-1);
+		}
+	}
+	return 0;
+}
+
+static double now(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static double mb(double bytes, double secs)
+{
+	return bytes / (1024 * 1024) / secs;
+}
+
+/* velocidad del crc solo, sin disco */
+static void bench_crc(char *buffer, size_t len)
+{
+	volatile uint32_t crc = 0;
+	double t;
+	int i, loops = 16;
+
+	t = now();
+	for (i = 0; i < loops; i++)
+		crc = crc32c(crc, buffer, len);
+	t = now() - t;
+	printf("crc32c %-8s: %10.1f MB/s\n", crc32c_name(), mb((double) loops * len, t));
+
+	t = now();
+	for (i = 0; i < loops; i++)
+		crc = crc32c_table(crc, buffer, len);
+	t = now() - t;
+	printf("crc32c %-8s: %10.1f MB/s\n", "table", mb((double) loops * len, t));
+}
+
+/* Escribe y lee el dispositivo entero bloque a bloque y en tandas de run
+ * bloques. Deja en mbs las cuatro velocidades
+ */
+static int bench_device(char *name, char *buffer, bool checksum, double *mbs)
+{
+	size_t len = (size_t) num_blocks * block_size;
+	struct iovec iov;
+	struct device *dev;
+	double t;
+	int i, n;
+
+	dev = block_create(name, num_blocks, block_size);
+	if (dev == NULL) {
+		printf("Error creando %s (%s)\n", name, strerror(errno));
+		return -1;
+	}
+	if (checksum && (block_set_checksums(dev) == -1)) {
+		printf("Error calculando checksums (%s)\n", strerror(errno));
+		block_close(dev);
+		return -1;
+	}
+
+	t = now();
+	for (i = 0; i < num_blocks; i++)
+		if (block_write(dev, buffer + (size_t) i * block_size, i) == -1)
+			goto error;
+	mbs[0] = mb(len, now() - t);
+
+	t = now();
+	for (i = 0; i < num_blocks; i++)
+		if (block_read(dev, buffer + (size_t) i * block_size, i) == -1)
+			goto error;
+	mbs[1] = mb(len, now() - t);
+
+	t = now();
+	for (i = 0; i < num_blocks; i += n) {
+		n = (num_blocks - i < run)? num_blocks - i: run;
+		iov.iov_base = buffer + (size_t) i * block_size;
+		iov.iov_len = (size_t) n * block_size;
+		if (block_writev(dev, &iov, 1, i) == -1)
+			goto error;
+	}
+	mbs[2] = mb(len, now() - t);
+
+	t = now();
+	for (i = 0; i < num_blocks; i += n) {
+		n = (num_blocks - i < run)? num_blocks - i: run;
+		iov.iov_base = buffer + (size_t) i * block_size;
+		iov.iov_len = (size_t) n * block_size;
+		if (block_readv(dev, &iov, 1, i) == -1)
+			goto error;
+	}
+	mbs[3] = mb(len, now() - t);
+
+	block_close(dev);
+	return 0;
+error:
+	printf("Error en el bloque %d (%s)\n", i, strerror(errno));
+	block_close(dev);
+	return -1;
+}
+
+/* Peticiones libres para bench_queue: done devuelve la suya a la pila */
+struct req_pool {
+	struct block_req *req;
+	int *free;
+	int num_free;
+};
+
+static void req_done(struct block_req *req)
+{
+	struct req_pool *pool = req->data;
+
+	pool->free[pool->num_free++] = req - pool->req;
+}
+
+/* num_blocks peticiones de un bloque al azar con depth en vuelo. Devuelve
+ * los segundos que tardó o -1
+ */
+static double bench_depth(struct device *dev, char *buffer, int depth, bool write)
+{
+	struct req_pool pool;
+	double t;
+	int i, k;
+
+	pool.req = calloc(depth, sizeof(struct block_req));
+	pool.free = malloc(depth * sizeof(int));
+	if ((pool.req == NULL) || (pool.free == NULL)) {
+		free(pool.req);
+		free(pool.free);
+		return -1;
+	}
+	for (k = 0; k < depth; k++)
+		pool.free[k] = k;
+	pool.num_free = depth;
+
+	t = now();
+	for (i = 0; i < num_blocks; i++) {
+		while (pool.num_free == 0)
+			if (block_complete(dev, 1) == -1)
+				goto error;
+		k = pool.free[--pool.num_free];
+		pool.req[k].write = write;
+		pool.req[k].buffer = buffer + (size_t) k * block_size;
+		pool.req[k].num_block = rand() % num_blocks;
+		pool.req[k].count = 1;
+		pool.req[k].done = req_done;
+		pool.req[k].data = &pool;
+		if (block_submit(dev, &pool.req[k]) == -1)
+			goto error;
+	}
+	if (block_drain(dev) != 0)
+		goto error;
+	t = now() - t;
+
+	free(pool.req);
+	free(pool.free);
+	return t;
+error:
+	printf("Error en la petición %d (%s)\n", i, strerror(errno));
+	block_drain(dev);
+	free(pool.req);
+	free(pool.free);
+	return -1;
+}
+
+/* Barrido de profundidad de cola: cuantas peticiones por segundo salen con
+ * 1, 2, 4... en vuelo para cada motor
+ */
+static int bench_queue(char *name, char *buffer)
+{
+	char *engines[] = {"io_uring", "threads"};
+	struct device *dev;
+	struct iovec iov;
+	int e, depth;
+	double r, w;
+
+	if (max_depth > num_blocks) {
+		printf("La cola no puede tener más de %d peticiones\n", num_blocks);
+		return -1;
+	}
+	dev = block_create(name, num_blocks, block_size);
+	if (dev == NULL) {
+		printf("Error creando %s (%s)\n", name, strerror(errno));
+		return -1;
+	}
+	/* que se lea algo que está en el fichero */
+	iov.iov_base = buffer;
+	iov.iov_len = (size_t) num_blocks * block_size;
+	if (block_writev(dev, &iov, 1, 0) == -1) {
+		printf("Error escribiendo %s (%s)\n", name, strerror(errno));
+		block_close(dev);
+		return -1;
+	}
+
+	printf("%d bloques de %d bytes al azar\n", num_blocks, block_size);
+	printf("%-9s %6s %12s %12s %12s %12s\n", "motor", "cola",
+	       "lect. IOPS", "MB/s", "escr. IOPS", "MB/s");
+	for (e = 0; e < 2; e++)
+		for (depth = 1; depth <= max_depth; depth *= 2) {
+			if (block_aio_setup(dev, depth, engines[e]) == -1) {
+				printf("%-9s no disponible (%s)\n", engines[e],
+				       strerror(errno));
+				break;
+			}
+			if (((r = bench_depth(dev, buffer, depth, false)) < 0) ||
+			    ((w = bench_depth(dev, buffer, depth, true)) < 0)) {
+				block_close(dev);
+				return -1;
+			}
+			printf("%-9s %6d %12.0f %12.1f %12.0f %12.1f\n",
+			       block_aio_name(dev), depth, num_blocks / r,
+			       mb((double) num_blocks * block_size, r),
+			       num_blocks / w, mb((double) num_blocks * block_size, w));
+		}
+
+	block_close(dev);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	char *names[] = {"write", "read", "writev", "readv"};
+	double raw[4], crc[4];
+	size_t len, i;
+	char *buffer;
+
+	handle_options(argc, argv);
+	if (argc - optind != 1) {
+		printf ("Necesita un argumento que es el nombre del"
+			" dispositivo\n\n");
+		usage(-2);
+	}
+
+	len = (size_t) num_blocks * block_size;
+	buffer = malloc(len);
+	if (buffer == NULL) {
+		printf("No hay memoria para %zu bytes\n", len);
+		exit(-1);
+	}
+	srand(1);
+	for (i = 0; i < len; i++)
+		buffer[i] = rand();
+
+	if (max_depth > 0) {
+		int ret = bench_queue(argv[optind], buffer);
+		unlink(argv[optind]);
+		free(buffer);
+		exit(ret);
+	}
+
+	bench_crc(buffer, len);
+	if ((bench_device(argv[optind], buffer, false, raw) == -1) ||
+	    (bench_device(argv[optind], buffer, true, crc) == -1)) {
+		free(buffer);
+		exit(-1);
+	}
+	unlink(argv[optind]);
+
+	printf("%d bloques de %d bytes, tandas de %d\n", num_blocks, block_size, run);
+	printf("%-8s %12s %12s %8s\n", "", "sin crc", "crc32c", "coste");
+	for (i = 0; i < 4; i++)
+		printf("%-8s %9.1f MB/s %7.1f MB/s %6.1f%%\n", names[i], raw[i], crc[i],
+		       100 * (raw[i] - crc[i]) / raw[i]);
+
+	free(buffer);
+	exit(0);
+}
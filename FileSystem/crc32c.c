@@ -0,0 +1,105 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "crc32c.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#define POLY 0x82f63b78 /* polinomio de Castagnoli, al revés */
+
+static uint32_t table[8][256];
+static uint32_t (*impl)(uint32_t, const void *, size_t);
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+/* tablas para ir de 8 en 8 bytes (slicing-by-8) */
+static void table_init(void)
+{
+	uint32_t crc;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc & 1)? (crc >> 1) ^ POLY: crc >> 1;
+		table[0][i] = crc;
+	}
+	for (i = 0; i < 256; i++)
+		for (j = 1; j < 8; j++)
+			table[j][i] = (table[j-1][i] >> 8) ^ table[0][table[j-1][i] & 0xff];
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	uint32_t lo, hi;
+
+	crc = ~crc;
+	while (len >= 8) {
+		memcpy(&lo, p, 4);
+		memcpy(&hi, p + 4, 4);
+		lo ^= crc;
+		crc = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff] ^
+			table[5][(lo >> 16) & 0xff] ^ table[4][lo >> 24] ^
+			table[3][hi & 0xff] ^ table[2][(hi >> 8) & 0xff] ^
+			table[1][(hi >> 16) & 0xff] ^ table[0][hi >> 24];
+		p += 8;
+		len -= 8;
+	}
+	while (len-- > 0)
+		crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xff];
+
+	return ~crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	uint64_t c = ~crc, v;
+
+	while (len >= 8) {
+		memcpy(&v, p, 8);
+		c = _mm_crc32_u64(c, v);
+		p += 8;
+		len -= 8;
+	}
+	crc = c;
+	while (len-- > 0)
+		crc = _mm_crc32_u8(crc, *p++);
+
+	return ~crc;
+}
+#endif
+
+static void crc32c_init(void)
+{
+	table_init();
+	impl = crc32c_sw;
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("sse4.2"))
+		impl = crc32c_hw;
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	pthread_once(&once, crc32c_init);
+	return impl(crc, buf, len);
+}
+
+/* siempre con tablas (para comparar en block_bench) */
+uint32_t crc32c_table(uint32_t crc, const void *buf, size_t len)
+{
+	pthread_once(&once, crc32c_init);
+	return crc32c_sw(crc, buf, len);
+}
+
+const char *crc32c_name(void)
+{
+	pthread_once(&once, crc32c_init);
+	return (impl == crc32c_sw)? "table": "sse4.2";
+}
@@ -0,0 +1,15 @@
+#ifndef __crc32c_h
+#define __crc32c_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* CRC32C (Castagnoli): con la instrucción crc32 de SSE4.2 si la cpu la
+ * tiene y si no con tablas. crc es lo que devolvió la llamada anterior (0
+ * para empezar), así se puede calcular por trozos
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+uint32_t crc32c_table(uint32_t crc, const void *buf, size_t len);
+const char *crc32c_name(void);
+
+#endif /* __crc32c_h */
@@ -0,0 +1,161 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+/* Formato: una serie de secuencias, cada una con
+ *   token: 4 bits de longitud de literales y 4 de longitud de copia - 4
+ *   (si alguna vale 15, siguen bytes que se suman hasta uno que no sea 255)
+ *   los literales
+ *   offset de la copia (2 bytes, little endian) y lo que quede de su longitud
+ * La última secuencia solo lleva literales: se acaba donde acaba la entrada
+ */
+
+#define MIN_MATCH 4
+#define HASH_BITS 12
+#define MAX_OFFSET 0xffff
+#define LAST_LITERALS 5 /* los últimos bytes van siempre como literales */
+
+static uint32_t read32(const unsigned char *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, 4);
+	return v;
+}
+
+static unsigned hash(uint32_t v)
+{
+	return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+/* escribe lo que pase de 15 en una longitud */
+static unsigned char *put_len(unsigned char *op, unsigned char *end, size_t n)
+{
+	for (; n >= 255; n -= 255) {
+		if (op >= end)
+			return NULL;
+		*op++ = 255;
+	}
+	if (op >= end)
+		return NULL;
+	*op++ = n;
+	return op;
+}
+
+/* escribe una secuencia (si offset es 0 es la última, solo literales) */
+static unsigned char *put_seq(unsigned char *op, unsigned char *end,
+			      const unsigned char *lit, size_t nlit,
+			      size_t offset, size_t match)
+{
+	size_t m = (offset == 0)? 0: match - MIN_MATCH;
+
+	if (op >= end)
+		return NULL;
+	*op++ = ((nlit < 15)? nlit: 15) << 4 | ((m < 15)? m: 15);
+	if ((nlit >= 15) && ((op = put_len(op, end, nlit - 15)) == NULL))
+		return NULL;
+	if (nlit > (size_t) (end - op))
+		return NULL;
+	memcpy(op, lit, nlit);
+	op += nlit;
+	if (offset == 0)
+		return op;
+	if (end - op < 2)
+		return NULL;
+	*op++ = offset & 0xff;
+	*op++ = offset >> 8;
+	if ((m >= 15) && ((op = put_len(op, end, m - 15)) == NULL))
+		return NULL;
+	return op;
+}
+
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap)
+{
+	const unsigned char *in = src, *anchor = in, *ip = in, *ref;
+	const unsigned char *limit = in + ((len > LAST_LITERALS)? len - LAST_LITERALS: 0);
+	unsigned char *op = dst, *end = op + cap;
+	int table[1 << HASH_BITS];
+	size_t match, miss = 0;
+	unsigned h;
+
+	memset(table, 0xff, sizeof(table)); /* todo a -1 */
+	while (ip + MIN_MATCH <= limit) {
+		h = hash(read32(ip));
+		ref = (table[h] < 0)? NULL: in + table[h];
+		table[h] = ip - in;
+		if ((ref == NULL) || (ip - ref > MAX_OFFSET) ||
+		    (read32(ref) != read32(ip))) {
+			/* cuantas más veces falla más grandes los saltos: así los
+			 * datos que no se comprimen se pasan rápido */
+			ip += 1 + (miss++ >> 6);
+			continue;
+		}
+		miss = 0;
+		for (match = MIN_MATCH; (ip + match < limit) &&
+			     (ref[match] == ip[match]); match++)
+			;
+		op = put_seq(op, end, anchor, ip - anchor, ip - ref, match);
+		if (op == NULL)
+			return 0;
+		ip += match;
+		anchor = ip;
+	}
+	op = put_seq(op, end, anchor, in + len - anchor, 0, 0);
+
+	return (op == NULL)? 0: op - (unsigned char *) dst;
+}
+
+/* lee lo que pase de 15 en una longitud */
+static const unsigned char *get_len(const unsigned char *ip,
+				    const unsigned char *end, size_t *n)
+{
+	unsigned char c;
+
+	do {
+		if (ip >= end)
+			return NULL;
+		c = *ip++;
+		*n += c;
+	} while (c == 255);
+	return ip;
+}
+
+long lz_decompress(const void *src, size_t len, void *dst, size_t cap)
+{
+	const unsigned char *ip = src, *end = ip + len;
+	unsigned char *out = dst, *op = out, *oend = out + cap;
+	size_t nlit, match, offset;
+	unsigned char token;
+
+	while (ip < end) {
+		token = *ip++;
+		nlit = token >> 4;
+		if ((nlit == 15) && ((ip = get_len(ip, end, &nlit)) == NULL))
+			return -1;
+		if ((nlit > (size_t) (end - ip)) || (nlit > (size_t) (oend - op)))
+			return -1;
+		memcpy(op, ip, nlit);
+		ip += nlit;
+		op += nlit;
+		if (ip == end) /* la última secuencia */
+			break;
+
+		if (end - ip < 2)
+			return -1;
+		offset = ip[0] | ip[1] << 8;
+		ip += 2;
+		match = token & 15;
+		if ((match == 15) && ((ip = get_len(ip, end, &match)) == NULL))
+			return -1;
+		match += MIN_MATCH;
+		if ((offset == 0) || (offset > (size_t) (op - out)) ||
+		    (match > (size_t) (oend - op)))
+			return -1;
+		/* byte a byte: la copia puede pisarse consigo misma */
+		for (; match > 0; match--, op++)
+			*op = op[-offset];
+	}
+
+	return op - out;
+}
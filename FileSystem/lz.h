@@ -0,0 +1,23 @@
+#ifndef __lz_h
+#define __lz_h
+
+#include <stddef.h>
+
+/* Compresor LZ sencillo (del estilo de LZ4): secuencias de literales
+ * seguidas de una copia de hasta 64K hacia atrás. Rápido al comprimir y
+ * sobre todo al descomprimir; no hace falta ninguna biblioteca
+ */
+
+/* Comprime len bytes de src en dst (que tiene cap bytes)
+ *
+ * Devuelve los bytes comprimidos o 0 si no caben en cap
+ */
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap);
+
+/* Descomprime len bytes de src en dst (que tiene cap bytes)
+ *
+ * Devuelve los bytes descomprimidos o -1 si los datos están mal
+ */
+long lz_decompress(const void *src, size_t len, void *dst, size_t cap);
+
+#endif /* __lz_h */
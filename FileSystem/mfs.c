@@ -1,5 +1,8 @@
 
 #include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,9 +13,20 @@
 
 #include <stdbool.h>
 #include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#if defined(__x86_64__)
+#include <emmintrin.h>
+#endif
 
 #include "block.h"
+#include "crc32c.h"
+#include "lz.h"
+#include "murmur3.h"
 #include "mfs.h"
+#include "mfs_rpc.h"
 
 char default_name[] = "my_mfs.img";
 
@@ -23,8 +37,43 @@ struct super_block {
 	int num_data_blocks; /* numero de bloques de datos */ /* numero de bloques de datos */
 	int root_inode; /* inodo del directorio raiz */ 
 	bool dirty; /* indica si el sistema de ficheros esta sucio o no */
+	/* Hasta aquí es el superbloque del formato original. Las imágenes de
+	 * ese formato tienen a cero lo que sigue: sin MFS_MAGIC no se cargan
+	 * (ver sb_read). Lo nuevo se añade siempre al final y si cambia como
+	 * se guarda algo en disco se sube MFS_VERSION */
+	int magic;
+	int version;
+	int num_refcount; /* numero de bloques de la tabla de referencias */
+	int frag_block; /* bloque de fragmentos donde se meten las colas (o -1) */
+	/* lo que añadió mfs_resize: un trozo de bloques de datos reservado con
+	 * lo que ya no cabe en las zonas del principio del disco */
+	int ext_start; /* bloque de datos donde empieza la extensión */
+	int ext_bitmap; /* bloques de bitmap que hay en ella */
+	int ext_refcount; /* bloques de la tabla de referencias */
+	int ext_inodes; /* bloques de la tabla de inodos */
+	/* registro de cambios para mfs_debug -l (-1: no hay; solo vale si el
+	 * bloque empieza por LOG_MAGIC) */
+	int log_block;
+	/* bloques por cluster de los ficheros comprimidos (0: no se comprime) */
+	int zip_cluster;
+	/* tabla de huellas para la deduplicación (0 bloques: no hay) */
+	int dedup_start;
+	int dedup_blocks;
 };
 
+/* El formato de la imagen: superbloque, tabla de referencias, inodos de
+ * INODE_SIZE bytes y entradas de directorio con el inodo en un int.
+ * Cada versión cambió como se guarda algo en disco:
+ * 1: tabla de referencias de los bloques de datos
+ * 2: inodos de INODE_SIZE bytes con flags y datos dentro del inodo
+ * 3: colas de los ficheros en bloques de fragmentos
+ * 4: tipo del inodo en las entradas de directorio
+ * 5: inodo de las entradas de directorio en un int
+ * 6: las entradas de directorio lineales ya no llevan el tipo
+ */
+#define MFS_MAGIC 0x7373666d /* "mfss" */
+#define MFS_VERSION 6
+
 struct extent {
 	int start; /* bloque donde empieza el extent */
 	int size; /* numero de bloques del extent */ /* numero de bloques de los que 'se disponen' */
@@ -32,6 +81,12 @@ struct extent {
 
 #define NUM_EXTENTS 3
 
+/* Extent sin bloques (fichero con huecos): esa parte del fichero no se
+ * escribió nunca y se lee como ceros
+ */
+#define EXTENT_HOLE -2
+#define is_hole(e) ((e).start == EXTENT_HOLE)
+
 /* Macro para decir si en el campo inode te dice si es un directorio o no */
 #define is_dir(d_inode) (d_inode == 1)
 
@@ -40,33 +95,125 @@ struct extent {
 #endif
 
 
+#define INODE_SIZE 128 /* tamaño que ocupa un inodo en disco */
+#define INLINE_SIZE (INODE_SIZE - 6 * sizeof(int) - \
+		     NUM_EXTENTS * sizeof(struct extent))
+
+#define INODE_INLINE 0x1 /* los datos del fichero están dentro del inodo */
+#define INODE_TAIL   0x2 /* el último trozo de bloque está en un bloque de fragmentos */
+#define INODE_BTREE  0x4 /* directorio guardado como árbol B+ ordenado por nombre */
+#define INODE_ZIP    0x8 /* datos comprimidos por clusters (ver zip_pack) */
+
 struct disk_inode {
 	int size; /* tamaño del inodo ( del fichero ) */
 	int is_dir; /* flag para decir si es un directorio(1) o no(0) */
 	int nlink; /* para saber cuantos links simbólicos tiene */
+	int flags; /* INODE_INLINE, ... */
 	struct extent e[NUM_EXTENTS]; /* extents que tiene el archivo */
+	int tail_block; /* bloque de fragmentos con la cola del fichero */
+	int tail_offset; /* donde empieza la cola dentro de ese bloque */
+	char data[INLINE_SIZE]; /* datos de los ficheros pequeños */
+};
+
+/* Cabecera de un bloque de fragmentos: las colas de varios ficheros se
+ * van metiendo una detrás de otra y el bloque se libera cuando ya no queda
+ * ninguna
+ */
+struct frag_header {
+	int used; /* bytes ocupados del bloque (con la cabecera) */
+	int count; /* numero de colas que hay en el bloque */
+};
+
+#define tail_max(fs) ((fs)->sb.block_size / 2) /* cola más grande que se empaqueta */
+
+/* Fichero comprimido: en sus primeros bloques va esta cabecera con el mapa
+ * de los clusters detrás y luego los clusters, cada uno en los bloques que
+ * le hagan falta. Los que no se dejan comprimir van tal cual. Los bloques
+ * del mapa son relativos al fichero, así se pueden mover los extents. Al
+ * reescribir un cluster se guarda en su sitio si cabe y si no detrás del
+ * último
+ */
+struct zip_header {
+	int cluster; /* bloques de datos por cluster */
+	int count; /* numero de clusters */
+};
+
+struct zip_map {
+	int block; /* bloque del fichero donde empieza el cluster */
+	int len; /* bytes comprimidos (0: va sin comprimir) */
 };
 
+#define ZIP_MAX_CLUSTER 64
+#define zip_map(h) ((struct zip_map *) ((h) + 1))
+#define zip_map_blocks(fs, count) ((sizeof(struct zip_header) + \
+	(count) * sizeof(struct zip_map) + (fs)->sb.block_size - 1) / (fs)->sb.block_size)
+
 #define ENTRY_SIZE 255
 
 struct entry {
 	int next; /* indica donde está la siguiente entrada de directorio */
 	int busy; /* indica cuanto hay ocupado en esta entrada */
-	short int inode; /* indica el inodo que esta referenciando */
+	int inode; /* indica el inodo que esta referenciando */
 	char name[ENTRY_SIZE];	 /* nombre de la entrada de directorio */
 };
 
+#define ENTRY_HEADER offsetof(struct entry, name) /* lo que ocupa una entrada sin nombre */
+
+struct dir_item {
+	int inode; /* (en los nodos internos del árbol, el hijo) */
+	char type;
+	char name[ENTRY_SIZE];
+};
+
 struct file {
 	int num; /* fd del fichero */
 	int pos; /* posición donde te encuentras dentro de el (leeyendo/escribiendo) */
 	struct disk_inode ino; /* inodo del archivo */
+	char *wbuf; /* buffer donde se acumulan las escrituras pequeñas */
+	int wbuf_pos; /* posición del fichero donde empieza wbuf */
+	int wbuf_len; /* bytes que hay acumulados en wbuf */
+	bool written; /* se escribió */
+	int dfirst, dlast; /* bloques escritos desde que se abrió (-1: ninguno),
+			    * los que se deduplican al cerrarlo */
+	bool empty; /* estaba vacío al abrirlo: al cerrarlo se intenta comprimir */
+	struct zip_header *zip; /* cabecera y mapa si está comprimido (o NULL) */
+	char *zbuf; /* cluster que se está leyendo o escribiendo */
+	int zcluster; /* cual es (-1: ninguno) */
+	bool zdirty; /* se escribió en zbuf y no está guardado */
+	int zend; /* primer bloque del fichero detrás del último cluster */
 };
 
-#define NUM_FILES 4 /* Numero máximo de ficheros que pueden estar abiertos */
+/* Numero máximo de ficheros que pueden estar abiertos (entre todos los
+ * clientes si la imagen la sirve mfsd) */
+#define NUM_FILES 32
+
+/* Grupo de asignación: los bloques de datos que lleva un bloque del bitmap
+ * y el trozo de la tabla de inodos que le toca. Los inodos nuevos se buscan
+ * en el grupo del directorio padre y sus bloques en el grupo del inodo.
+ * Los contadores se sacan del bitmap al cargarlo (los de inodos la primera
+ * vez que hacen falta). No hay cerrojos: las reservas las hace un solo
+ * hilo (mfsd atiende una petición detrás de otra) y el registro de cambios,
+ * el índice de huellas y la tabla de inodos son de todo el sistema
+ */
+struct group {
+	int free_blocks; /* bloques de datos libres del grupo */
+	int free_inodes; /* inodos libres de su trozo de tabla (-1: sin contar) */
+	bool dirty; /* su bloque del bitmap cambió y hay que escribirlo */
+};
 
 struct file_system { /* El sistema de ficheros */
 	struct device *dev; /* dispositivo que es */
 	char *bitmap; /* el bitmap del sistema de ficheros */
+	unsigned char *refcount; /* referencias extra de cada bloque de datos */
+	struct group *group; /* grupos de asignación */
+	int num_groups;
+	char *log; /* el registro de cambios (NULL si la imagen no tiene) */
+	bool log_active; /* se está apuntando: el sistema está sucio */
+	bool log_dirty; /* hay cambios del registro sin escribir */
+	struct dedup *dedup; /* índice de huellas (NULL si no hay tabla) */
+	bool batch; /* entre mfs_begin y mfs_commit */
+	bool batch_clean; /* estaba limpio al empezar el lote */
+	int frag_freed; /* bytes de colas quitadas del bloque de fragmentos abierto */
 	struct super_block sb; /* superbloque del sistema de ficheros */
 	struct disk_inode root; /* dnd se encuentra el inodo del raiz */
 	struct file file[NUM_FILES]; /* tabla del sistema de ficheros */
@@ -74,6 +221,57 @@ struct file_system { /* El sistema de ficheros */
 
 #define BLOCK_E 2/* numero de bloques mínimo que intentará tener cada extent */
 #define BLOCK_GROW 2 /* cada vez que se intente ampliar un extent como mínimo se intentará que sea de esto */
+#define MAX_REFCOUNT 255 /* máximo de referencias extra que admite un bloque */
+
+/* Disposición del disco:
+ * superbloque | bitmap | referencias | inodos | datos
+ *
+ * Si se hizo mfs_resize, lo que no cabe de bitmap, referencias e inodos está
+ * en un trozo de la zona de datos (desde el bloque de datos ext_start):
+ * bitmap | referencias | inodos
+ */
+#define inode_offset(fs) (1 + (fs)->sb.num_bitmap + (fs)->sb.num_refcount)
+#define data_offset(fs) (inode_offset(fs) + (fs)->sb.num_inodes)
+#define ext_offset(fs) (data_offset(fs) + (fs)->sb.ext_start)
+#define ext_blocks(fs) ((fs)->sb.ext_bitmap + (fs)->sb.ext_refcount + \
+			(fs)->sb.ext_inodes)
+
+/* numero de bloques de cada tabla, contando la extensión */
+#define bitmap_blocks(fs) ((fs)->sb.num_bitmap + (fs)->sb.ext_bitmap)
+#define refcount_blocks(fs) ((fs)->sb.num_refcount + (fs)->sb.ext_refcount)
+#define inode_blocks(fs) ((fs)->sb.num_inodes + (fs)->sb.ext_inodes)
+
+/* numero de inodos que caben en la tabla de inodos */
+#define inode_count(fs) (inode_blocks(fs) * \
+			 ((fs)->sb.block_size / (int) sizeof(struct disk_inode)))
+
+/* bloques de datos de cada grupo (los de un bloque del bitmap), grupo de un
+ * bloque de datos e inodos de cada grupo */
+#define group_blocks(fs) (8 * (fs)->sb.block_size)
+#define block_group(fs, b) ((b) / group_blocks(fs))
+#define group_inodes(fs) ((inode_count(fs) + (fs)->num_groups - 1) / \
+			  (fs)->num_groups)
+#define inode_group(fs, i) ((i) / group_inodes(fs))
+
+/* Bloques del disco donde está el bloque i de cada tabla */
+static int bitmap_block(struct file_system *fs, int i)
+{
+	return (i < fs->sb.num_bitmap)? 1 + i:
+		ext_offset(fs) + i - fs->sb.num_bitmap;
+}
+
+static int refcount_block(struct file_system *fs, int i)
+{
+	return (i < fs->sb.num_refcount)? 1 + fs->sb.num_bitmap + i:
+		ext_offset(fs) + fs->sb.ext_bitmap + i - fs->sb.num_refcount;
+}
+
+static int inode_block(struct file_system *fs, int i)
+{
+	return (i < fs->sb.num_inodes)? inode_offset(fs) + i:
+		ext_offset(fs) + fs->sb.ext_bitmap + fs->sb.ext_refcount +
+		i - fs->sb.num_inodes;
+}
 
 /* Dado un dispositivo dev pone en el puntero sb la información
  * referente a su superbloque.
@@ -84,11 +282,29 @@ static int sb_read(struct device *dev, struct super_block *sb)
 	int size = block_get_block_size(dev);
 	char *block = malloc(size);
 
+	int ret = 1;
+
 	if (block == NULL)
 		return -ENOMEM;
 	if (block_read(dev, block, 0) < size)
-		return -EIO;
-	memcpy(sb, block, sizeof(struct super_block));
+		ret = -EIO;
+	else
+		memcpy(sb, block, sizeof(struct super_block));
+	free(block);
+	if (ret < 0)
+		return ret;
+
+	if (sb->magic != MFS_MAGIC) {
+		printf("La imagen es del formato antiguo de mfs (sin versión) y "
+		       "no se puede usar: hay que sacar los ficheros con las "
+		       "herramientas viejas y crearla otra vez con mfs_mkfs\n");
+		return -EINVAL;
+	}
+	if (sb->version != MFS_VERSION) {
+		printf("La imagen tiene la versión %d del formato y estas "
+		       "herramientas son de la %d\n", sb->version, MFS_VERSION);
+		return -EINVAL;
+	}
 	return 1;
 }
 
@@ -104,7 +320,54 @@ static int sb_write(struct device *dev, struct super_block *sb)
 		return -ENOMEM;
 	memset(block, '\0', size);
 	memcpy(block, sb, sizeof(struct super_block));
-	return (block_write(dev, block, 0) == size);
+	int ret = (block_write(dev, block, 0) == size);
+	free(block);
+	return ret;
+}
+
+/* obtienes el estado de algún número del bitmap */
+/* lo hace sobre el que esta en memoria */
+static int bitmap_get(struct file_system *fs, int num)
+{
+	int byte = num / 8;
+	int bit = num % 8;
+
+	return ((fs->bitmap[byte])>>bit) & 1;
+}
+
+/* Cuenta los bloques libres de cada grupo a partir del bitmap (de 64 en 64
+ * bits), creando los grupos si aún no están o si cambió cuantos hay
+ */
+static int groups_init(struct file_system *fs)
+{
+	int n = (fs->sb.num_data_blocks + group_blocks(fs) - 1) / group_blocks(fs);
+	int i, b, end;
+	uint64_t word;
+
+	if (n != fs->num_groups) {
+		free(fs->group);
+		fs->group = malloc(n * sizeof(struct group));
+		if (fs->group == NULL)
+			return -ENOMEM;
+		fs->num_groups = n;
+	}
+	for (i = 0; i < n; i++) {
+		b = i * group_blocks(fs);
+		end = b + group_blocks(fs);
+		if (end > fs->sb.num_data_blocks)
+			end = fs->sb.num_data_blocks;
+		fs->group[i].free_blocks = end - b;
+		fs->group[i].free_inodes = -1;
+		fs->group[i].dirty = false;
+		for (; b + 64 <= end; b += 64) {
+			memcpy(&word, fs->bitmap + b / 8, sizeof(word));
+			fs->group[i].free_blocks -= __builtin_popcountll(word);
+		}
+		for (; b < end; b++)
+			fs->group[i].free_blocks -= bitmap_get(fs, b);
+	}
+
+	return 1;
 }
 
 /* lee el bitmap del disco */
@@ -113,17 +376,331 @@ static int bitmap_read(struct file_system *fs)
 	char *p;
 	int i;
 
-	fs->bitmap = malloc(fs->sb.block_size * fs->sb.num_bitmap);
+	free(fs->bitmap);
+	fs->bitmap = malloc(fs->sb.block_size * bitmap_blocks(fs));
 
 	if (fs->bitmap == NULL)
 		return -ENOMEM;
 	p = fs->bitmap;
-	for (i = 0; i < fs->sb.num_bitmap; i++) {
-		block_read(fs->dev, p, 1 + i);
+	for (i = 0; i < bitmap_blocks(fs); i++) {
+		block_read(fs->dev, p, bitmap_block(fs, i));
 		p += fs->sb.block_size;
 	}
 
-	return 1;
+	return groups_init(fs);
+}
+
+/* Registro de cambios
+ *
+ * Mientras el sistema de ficheros está sucio se apunta en un bloque de datos
+ * (sb.log_block) qué inodos y qué bloques de datos (bitmap o referencias)
+ * cambiaron desde el último punto limpio. El registro se escribe siempre
+ * antes que los metadatos que cubre, así tras una caída a mfs_debug -l le
+ * basta con mirar eso. Si no cabe se marca como desbordado y toca
+ * comprobarlo todo
+ */
+
+#define LOG_MAGIC 0x6c73666d /* "mfsl" */
+
+#define LOG_NEW 1 /* inodo cogido en esta sesión */
+#define LOG_UNLINK 2 /* se quitó una entrada que lo apuntaba */
+#define LOG_DIR 4 /* directorio al que se le cambiaron entradas */
+
+struct log_header {
+	int magic;
+	int count; /* entradas usadas */
+	int overflow; /* no cupo algo: no vale para comprobar */
+};
+
+struct log_entry {
+	int first;
+	int count; /* > 0: bloques de datos [first, first + count)
+		    * <= 0: el inodo first, con -count de flags */
+};
+
+#define log_head(fs) ((struct log_header *) (fs)->log)
+#define log_entries(fs) ((struct log_entry *) ((fs)->log + \
+						sizeof(struct log_header)))
+#define log_capacity(fs) ((int) (((fs)->sb.block_size - \
+				  sizeof(struct log_header)) / sizeof(struct log_entry)))
+
+/* Carga el registro si la imagen tiene uno */
+static int log_read(struct file_system *fs)
+{
+	free(fs->log);
+	fs->log = NULL;
+	if ((fs->sb.log_block < 0) || (fs->sb.log_block >= fs->sb.num_data_blocks))
+		return 0;
+	fs->log = malloc(fs->sb.block_size);
+	if (fs->log == NULL)
+		return -ENOMEM;
+	if ((block_read(fs->dev, fs->log, data_offset(fs) + fs->sb.log_block)
+	     != fs->sb.block_size) || (log_head(fs)->magic != LOG_MAGIC)) {
+		free(fs->log);
+		fs->log = NULL;
+	}
+
+	return 0;
+}
+
+/* Escribe el registro si cambió (antes que lo que describe) */
+static int log_flush(struct file_system *fs)
+{
+	if (!fs->log_active || !fs->log_dirty)
+		return 0;
+	fs->log_dirty = false;
+	return (block_write(fs->dev, fs->log, data_offset(fs) + fs->sb.log_block)
+		== fs->sb.block_size)? 0: -EIO;
+}
+
+/* Deja una entrada libre al final (o marca el registro como desbordado) */
+static struct log_entry *log_append(struct file_system *fs)
+{
+	struct log_header *h = log_head(fs);
+
+	fs->log_dirty = true;
+	if (h->count == log_capacity(fs)) {
+		h->overflow = 1;
+		return NULL;
+	}
+	return &log_entries(fs)[h->count++];
+}
+
+static void log_overflow(struct file_system *fs)
+{
+	if (!fs->log_active || log_head(fs)->overflow)
+		return;
+	log_head(fs)->overflow = 1;
+	fs->log_dirty = true;
+	log_flush(fs);
+}
+
+/* Apunta el inodo num (con flags) y lo escribe ya */
+static void log_inode(struct file_system *fs, int num, int flags)
+{
+	struct log_entry *e;
+	int i;
+
+	if (!fs->log_active || log_head(fs)->overflow || (num < 0))
+		return;
+	for (i = 0; i < log_head(fs)->count; i++) {
+		e = &log_entries(fs)[i];
+		if ((e->count > 0) || (e->first != num))
+			continue;
+		if ((-e->count & flags) != flags) {
+			e->count = -(-e->count | flags);
+			fs->log_dirty = true;
+		}
+		log_flush(fs);
+		return;
+	}
+	if ((e = log_append(fs)) != NULL) {
+		e->first = num;
+		e->count = -flags;
+	}
+	log_flush(fs);
+}
+
+/* Apunta el bloque de datos num; se escribe con el bitmap (o las
+ * referencias), así una reserva de muchos bloques es una sola escritura
+ */
+static void log_block(struct file_system *fs, int num)
+{
+	struct log_entry *e;
+	int i;
+
+	if (!fs->log_active || log_head(fs)->overflow)
+		return;
+	for (i = log_head(fs)->count - 1; i >= 0; i--) {
+		e = &log_entries(fs)[i];
+		if (e->count <= 0)
+			continue;
+		if ((num >= e->first) && (num < e->first + e->count))
+			return;
+		if (num == e->first + e->count) {
+			e->count++;
+			fs->log_dirty = true;
+			return;
+		}
+		if (num == e->first - 1) {
+			e->first--;
+			e->count++;
+			fs->log_dirty = true;
+			return;
+		}
+	}
+	if ((e = log_append(fs)) != NULL) {
+		e->first = num;
+		e->count = 1;
+	}
+}
+
+/* Índice de huellas para la deduplicación
+ *
+ * La tabla de disco (sb.dedup_blocks bloques desde el bloque de datos
+ * sb.dedup_start) tiene la huella de cada bloque de datos de fichero, o
+ * ceros si no se sabe. En memoria está entera y además una tabla hash
+ * abierta huella -> bloque para buscar. Las huellas pueden estar viejas (el
+ * bloque se reescribió en su sitio): antes de compartir un bloque siempre
+ * se comparan los datos. Al soltar un bloque su huella se borra, así nunca
+ * se comparte un bloque que ahora sea de un directorio
+ */
+
+struct fingerprint {
+	uint64_t h[2];
+};
+
+struct dedup {
+	struct fingerprint *fp; /* huella de cada bloque de datos */
+	int blocks; /* bloques de datos que cubre */
+	int entries; /* huellas que caben en la tabla de disco */
+	char *dirty; /* bloques de la tabla que hay que escribir */
+	int *slot; /* tabla hash: bloque o -1 */
+	int size; /* huecos de slot (potencia de 2) */
+	int used; /* huecos ocupados */
+};
+
+#define fp_per_block(fs) ((fs)->sb.block_size / (int) sizeof(struct fingerprint))
+#define fp_empty(f) (((f)->h[0] | (f)->h[1]) == 0)
+#define fp_equal(a, b) (((a)->h[0] == (b)->h[0]) && ((a)->h[1] == (b)->h[1]))
+
+static void dedup_rehash(struct dedup *d);
+
+static void dedup_insert(struct dedup *d, int block)
+{
+	int i = d->fp[block].h[0] & (d->size - 1);
+
+	for (; d->slot[i] != -1; i = (i + 1) & (d->size - 1))
+		if (d->slot[i] == block)
+			return;
+	d->slot[i] = block;
+	if (++d->used * 2 > d->size) /* con huecos viejos: se rehace */
+		dedup_rehash(d);
+}
+
+/* Vuelve a meter en slot solo las huellas que valen */
+static void dedup_rehash(struct dedup *d)
+{
+	int i;
+
+	memset(d->slot, 0xff, d->size * sizeof(int));
+	d->used = 0;
+	for (i = 0; i < d->blocks; i++)
+		if (!fp_empty(&d->fp[i]))
+			dedup_insert(d, i);
+}
+
+/* Bloque con esa huella (o -1) */
+static int dedup_lookup(struct dedup *d, struct fingerprint *f)
+{
+	int i = f->h[0] & (d->size - 1);
+
+	for (; d->slot[i] != -1; i = (i + 1) & (d->size - 1))
+		if (fp_equal(&d->fp[d->slot[i]], f))
+			return d->slot[i];
+	return -1;
+}
+
+/* Cambia la huella del bloque num (ceros para borrarla) */
+static void dedup_set(struct file_system *fs, int num, struct fingerprint *f)
+{
+	struct dedup *d = fs->dedup;
+
+	if ((num >= d->blocks) || fp_equal(&d->fp[num], f))
+		return;
+	d->fp[num] = *f;
+	if (num < d->entries)
+		d->dirty[num / fp_per_block(fs)] = 1;
+	if (!fp_empty(f))
+		dedup_insert(d, num);
+}
+
+/* Escribe los bloques de la tabla que cambiaron */
+static int dedup_flush(struct file_system *fs)
+{
+	struct dedup *d = fs->dedup;
+	int i, per = fp_per_block(fs);
+	char block[fs->sb.block_size];
+
+	if (d == NULL)
+		return 0;
+	for (i = 0; i < fs->sb.dedup_blocks; i++) {
+		if (!d->dirty[i])
+			continue;
+		memset(block, '\0', fs->sb.block_size);
+		memcpy(block, d->fp + i * per, ((i + 1) * per <= d->entries)?
+		       per * sizeof(struct fingerprint):
+		       (d->entries - i * per) * sizeof(struct fingerprint));
+		if (block_write(fs->dev, block, data_offset(fs) + fs->sb.dedup_start + i)
+		    != fs->sb.block_size)
+			return -EIO;
+		d->dirty[i] = 0;
+	}
+	return 0;
+}
+
+static void dedup_free(struct file_system *fs)
+{
+	if (fs->dedup == NULL)
+		return;
+	free(fs->dedup->fp);
+	free(fs->dedup->dirty);
+	free(fs->dedup->slot);
+	free(fs->dedup);
+	fs->dedup = NULL;
+}
+
+/* Carga el índice si la imagen tiene tabla. Si no se desmontó bien (trust
+ * a false) no se sabe qué bloques se soltaron después de escribirla: se
+ * empieza de cero
+ */
+static int dedup_load(struct file_system *fs, bool trust)
+{
+	struct dedup *d;
+	int i, per = fp_per_block(fs);
+	char block[fs->sb.block_size];
+
+	dedup_free(fs);
+	if (fs->sb.dedup_blocks <= 0)
+		return 0;
+	d = calloc(1, sizeof(struct dedup));
+	if (d == NULL)
+		return -ENOMEM;
+	fs->dedup = d;
+	d->blocks = fs->sb.num_data_blocks;
+	for (d->size = 16; d->size < 4 * fs->sb.num_data_blocks; d->size *= 2)
+		;
+	d->fp = calloc(fs->sb.num_data_blocks, sizeof(struct fingerprint));
+	d->dirty = calloc(fs->sb.dedup_blocks, 1);
+	d->slot = malloc(d->size * sizeof(int));
+	if ((d->fp == NULL) || (d->dirty == NULL) || (d->slot == NULL)) {
+		dedup_free(fs);
+		return -ENOMEM;
+	}
+	d->entries = fs->sb.dedup_blocks * per;
+	if (d->entries > d->blocks) /* mfs_resize la deja corta */
+		d->entries = d->blocks;
+
+	for (i = 0; i < fs->sb.dedup_blocks; i++) {
+		if (!trust) {
+			d->dirty[i] = 1;
+			continue;
+		}
+		if (block_read(fs->dev, block, data_offset(fs) + fs->sb.dedup_start + i)
+		    != fs->sb.block_size) {
+			dedup_free(fs);
+			return -EIO;
+		}
+		memcpy(d->fp + i * per, block, ((i + 1) * per <= d->entries)?
+		       per * sizeof(struct fingerprint):
+		       (d->entries - i * per) * sizeof(struct fingerprint));
+	}
+	for (i = 0; i < d->blocks; i++)
+		if (!bitmap_get(fs, i))
+			memset(&d->fp[i], '\0', sizeof(struct fingerprint));
+	dedup_rehash(d);
+
+	return dedup_flush(fs);
 }
 
 /* escribe el bitmap en disco */
@@ -134,25 +711,19 @@ static int bitmap_write(struct file_system *fs)
 
 	if (fs->bitmap == NULL)
 		return -EINVAL;
-	p = fs->bitmap;
-	for (i = 0; i < fs->sb.num_bitmap; i++) {
-		block_write(fs->dev, p, 1 + i);
-		p += fs->sb.block_size;
+	log_flush(fs);
+	dedup_flush(fs); /* que no quede la huella de un bloque ya libre */
+	for (i = 0; i < fs->num_groups; i++) {/* solo los trozos que cambiaron */
+		if (!fs->group[i].dirty)
+			continue;
+		p = fs->bitmap + i * fs->sb.block_size;
+		block_write(fs->dev, p, bitmap_block(fs, i));
+		fs->group[i].dirty = false;
 	}
 
 	return 1;
 }
 
-/* obtienes el estado de algún número del bitmap */
-/* lo hace sobre el que esta en memoria */
-static int bitmap_get(struct file_system *fs, int num)
-{
-	int byte = num / 8;
-	int bit = num % 8;
-
-	return ((fs->bitmap[byte])>>bit) & 1;
-}
-
 /* pone a uno un número de bitmap a uno */
 /* lo hace de la copia en memoria */
 static void bitmap_set(struct file_system *fs, int num)
@@ -160,6 +731,11 @@ static void bitmap_set(struct file_system *fs, int num)
 	int byte = num / 8;
 	int bit = num % 8;
 
+	if (!(fs->bitmap[byte] & (1 << bit)) && (fs->group != NULL)) {
+		fs->group[block_group(fs, num)].free_blocks--;
+		fs->group[block_group(fs, num)].dirty = true;
+		log_block(fs, num);
+	}
 	fs->bitmap[byte] |= (1 << bit);
 }
 
@@ -170,7 +746,73 @@ static void bitmap_clear(struct file_system *fs, int num)
 	int byte = num / 8;
 	int bit = num % 8;
 
+	if ((fs->bitmap[byte] & (1 << bit)) && (fs->group != NULL)) {
+		fs->group[block_group(fs, num)].free_blocks++;
+		fs->group[block_group(fs, num)].dirty = true;
+		log_block(fs, num);
+	}
 	fs->bitmap[byte] &= ~(1 << bit);
+	if (fs->dedup != NULL) { /* ya no es de ningún fichero */
+		struct fingerprint none = {{0, 0}};
+		dedup_set(fs, num, &none);
+	}
+}
+
+/* lee la tabla de referencias del disco */
+static int refcount_read(struct file_system *fs)
+{
+	unsigned char *p;
+	int i;
+
+	free(fs->refcount);
+	fs->refcount = malloc(fs->sb.block_size * refcount_blocks(fs));
+
+	if (fs->refcount == NULL)
+		return -ENOMEM;
+	p = fs->refcount;
+	for (i = 0; i < refcount_blocks(fs); i++) {
+		block_read(fs->dev, p, refcount_block(fs, i));
+		p += fs->sb.block_size;
+	}
+
+	return 1;
+}
+
+/* escribe en disco el bloque de la tabla de referencias donde esta num */
+static int refcount_write(struct file_system *fs, int num)
+{
+	int i = num / fs->sb.block_size;
+
+	if (fs->refcount == NULL)
+		return -EINVAL;
+	log_block(fs, num);
+	log_flush(fs);
+	return block_write(fs->dev, fs->refcount + i * fs->sb.block_size,
+			   refcount_block(fs, i)) == fs->sb.block_size;
+}
+
+/* Suelta una referencia al bloque de datos num: si era la única lo marca
+ * como libre en el bitmap (en memoria)
+ */
+static void data_block_put(struct file_system *fs, int num)
+{
+	if (fs->refcount[num] == 0)
+		bitmap_clear(fs, num);
+	else {
+		fs->refcount[num]--;
+		refcount_write(fs, num);
+	}
+}
+
+/* Añade una referencia al bloque de datos num */
+static int data_block_get(struct file_system *fs, int num)
+{
+	if (fs->refcount[num] == MAX_REFCOUNT) {
+		errno = EMLINK;
+		return -1;
+	}
+	fs->refcount[num]++;
+	return refcount_write(fs, num);
 }
 
 /* Dado un sistema de ficheros lee el inodo inode_num y lo devuelve en el
@@ -188,16 +830,20 @@ static int inode_read(struct file_system *fs, struct disk_inode *ino,
 	int inode_per_block = size/inode_size;
 	int pos_block = inode_num/inode_per_block;
 	
+	int ret = 1;
+
 	if (block == NULL)
 		return -ENOMEM;
-	if (inode_num > fs->sb.num_inodes)
-		return -EINVAL;
-	n = 1 + fs->sb.num_bitmap + pos_block;
-
-	if (block_read(fs->dev, block, n) < size)
-		return -EIO;
-	memcpy(ino, block+(inode_num%inode_per_block)*inode_size, sizeof(struct disk_inode));
-	return 1;
+	n = inode_block(fs, pos_block);
+
+	if (inode_num >= inode_count(fs))
+		ret = -EINVAL;
+	else if (block_read(fs->dev, block, n) < size)
+		ret = -EIO;
+	else
+		memcpy(ino, block+(inode_num%inode_per_block)*inode_size, sizeof(struct disk_inode));
+	free(block);
+	return ret;
 }
 
 /* Dado un sistema de ficheros escribe en el inodo inode_num y lo que hay en el
@@ -215,19 +861,30 @@ static int inode_write(struct file_system *fs, struct disk_inode *ino,
 	int inode_per_block = size/inode_size;
 	int pos_block = inode_num/inode_per_block;
 	
+	int ret;
+
 	if (block == NULL)
 		return -ENOMEM;
-	if (inode_num > fs->sb.num_inodes)
+	if (inode_num >= inode_count(fs)) {
+		free(block);
 		return -EINVAL;
+	}
+	log_inode(fs, inode_num, 0);
 	/* para el número de bloque en el que hay que escribir */
-	n = 1 + fs->sb.num_bitmap + pos_block;
+	n = inode_block(fs, pos_block);
 	
-	if (block_read(fs->dev, block, n) != size) /* leo el blocque que contiene el inodo */
+	if (block_read(fs->dev, block, n) != size) {/* leo el blocque que contiene el inodo */
+		free(block);
 		return -EIO;
+	}
 	
 	//memset(block, '\0', size);
 	memcpy(block+(inode_num%inode_per_block)*inode_size, ino, sizeof(struct disk_inode));
-	return (block_write(fs->dev, block, n) == size);
+	if (inode_num == fs->sb.root_inode) /* que la copia del raiz no se quede vieja */
+		fs->root = *ino;
+	ret = (block_write(fs->dev, block, n) == size);
+	free(block);
+	return ret;
 }
 
 /* Dado un sistema de ficheros lee del bloque de datos que está en la posición 
@@ -243,7 +900,7 @@ static int data_read(struct file_system *fs, void *buffer,
 
 	if (block_num > fs->sb.num_data_blocks)
 		return -EINVAL;
-	n = 1 + fs->sb.num_bitmap + fs->sb.num_inodes + block_num;
+	n = data_offset(fs) + block_num;
 
 	if (block_read(fs->dev, buffer, n) < size)
 		return -EIO;
@@ -263,65 +920,271 @@ static int data_write(struct file_system *fs, void *buffer,
 
 	if (block_num > fs->sb.num_data_blocks)
 		return -EINVAL;
-	n = 1 + fs->sb.num_bitmap + fs->sb.num_inodes + block_num;
+	n = data_offset(fs) + block_num;
 
 	return (block_write(fs->dev, buffer, n) == size);
 }
 
-/* num bloque lo haremos de forma que sea el bloque relativo al fichero */
-static int file_read(struct file_system *fs, struct disk_inode *ino,
-		     void *buffer, int block_num)
+/* Lecturas y escrituras de bloques de datos sin esperar a cada una: los
+ * bloques seguidos en disco y en memoria se juntan en una petición (hasta
+ * AIO_RUN) y se mandan al motor asíncrono de block.c, que tiene hasta
+ * BLOCK_DEPTH en vuelo. data_wait espera a todas; hasta entonces los
+ * buffers no se pueden tocar. Solo desde el hilo principal
+ */
+#define AIO_RUN 64
+
+static struct block_req aio_req[BLOCK_DEPTH]; /* data != NULL: ocupada */
+static struct block_req *aio_cur = NULL; /* la que se está juntando */
+static bool aio_error = false; /* alguna no se pudo mandar o no se pudo
+				* poner en cola: data_wait da el error */
+
+static void aio_done(struct block_req *req)
 {
-	/* no funciona con más de un extent */
-	/* no comprueba tamaños */
-	return data_read(fs, buffer, ino->e[0].start + block_num);
+	req->data = NULL;
 }
 
-static int file_write(struct file_system *fs, struct disk_inode *ino,
-		      void *buffer, int block_num)
+static int aio_flush(struct file_system *fs)
 {
-	/* no funciona con más de un extent */
-	return data_write(fs, buffer, ino->e[0].start + block_num);
+	struct block_req *r = aio_cur;
+
+	if (r == NULL)
+		return 0;
+	aio_cur = NULL;
+	if (block_submit(fs->dev, r) == -1) {
+		r->data = NULL;
+		aio_error = true;
+		return -1;
+	}
+	return 0;
 }
 
-/* Carga la informacion del sistema de ficheros en ese puntero fs */
-static int fs_init(void)
+static int data_queue(struct file_system *fs, void *buffer, int block_num,
+		      bool write)
 {
+	struct block_req *r = aio_cur;
+	int bs = fs->sb.block_size;
+	int n = data_offset(fs) + block_num;
 	int i;
 
-	if (fs != NULL)
+	if (block_num > fs->sb.num_data_blocks) {
+		aio_error = true;
+		return -EINVAL;
+	}
+	if ((r != NULL) && (r->write == write) && (r->count < AIO_RUN) &&
+	    (r->num_block + r->count == n) &&
+	    ((char *) r->buffer + r->count * bs == buffer)) {
+		r->count++;
 		return 1;
+	}
+	if (aio_flush(fs) == -1)
+		return -EIO;
+	while (1) {
+		for (i = 0; i < BLOCK_DEPTH; i++)
+			if (aio_req[i].data == NULL)
+				break;
+		if (i < BLOCK_DEPTH)
+			break;
+		if (block_complete(fs->dev, 1) <= 0) {
+			aio_error = true;
+			return -EIO;
+		}
+	}
+	r = &aio_req[i];
+	r->write = write;
+	r->buffer = buffer;
+	r->num_block = n;
+	r->count = 1;
+	r->done = aio_done;
+	r->data = r;
+	aio_cur = r;
+	return 1;
+}
 
-	fs = malloc(sizeof(struct file_system));
-
-	if (fs == NULL)
-		return -ENOMEM;
-	memset(fs, '\0', sizeof(struct file_system));
+/* Espera a todo lo que mandó data_queue. Devuelve -1 si algo falló */
+static int data_wait(struct file_system *fs)
+{
+	bool failed;
 
-	/* a coger el nombre!!!! */
-	char *filesystem_name = getenv("MFS_NAME");
-	if (filesystem_name == NULL) {
-		printf("MFS_NAME not set\n");
-		filesystem_name = default_name;
-		printf("used '%s' like file system\n", default_name);
+	aio_flush(fs);
+	failed = (block_drain(fs->dev) != 0) || aio_error;
+	aio_error = false;
+	if (failed) {
+		errno = EIO;
+		return -1;
 	}
-	
-	fs->dev = block_open(filesystem_name);
-	if (fs->dev == NULL) {
+	return 0;
+}
+
+/* Dado un bloque relativo al fichero te devuelve el bloque de datos donde
+ * está (recorriendo los extents)
+ *
+ * Devuelve -1 si el fichero no tiene tantos bloques y EXTENT_HOLE si el
+ * bloque está en un hueco
+ */
+static int file_block(struct disk_inode *ino, int block_num)
+{
+	int i;
+	for (i = 0; i < NUM_EXTENTS; i++) {
+		if (ino->e[i].start == -1)
+			break;
+		if (block_num < ino->e[i].size)
+			return (is_hole(ino->e[i]))? EXTENT_HOLE:
+				ino->e[i].start + block_num;
+		block_num -= ino->e[i].size;
+	}
+
+	return -1;
+}
+
+/* numero de bloques del fichero que cubren los extents (huecos incluidos) */
+static int file_blocks(struct disk_inode *ino)
+{
+	int i, blocks = 0;
+	for (i = 0; i < NUM_EXTENTS; i++)
+		if (ino->e[i].start != -1)
+			blocks += ino->e[i].size;
+
+	return blocks;
+}
+
+/* cuantos de esos bloques son huecos (sin bloque de datos) */
+static int file_holes(struct disk_inode *ino)
+{
+	int i, holes = 0;
+	for (i = 0; (i < NUM_EXTENTS) && (ino->e[i].start != -1); i++)
+		if (is_hole(ino->e[i]))
+			holes += ino->e[i].size;
+
+	return holes;
+}
+
+/* numero de extents usados (huecos incluidos) */
+static int extent_count(struct disk_inode *ino)
+{
+	int i;
+	for (i = 0; (i < NUM_EXTENTS) && (ino->e[i].start != -1); i++)
+		;
+
+	return i;
+}
+
+/* Suelta todos los bloques del inodo a partir del bloque keep (relativo al
+ * fichero) y recorta los extents. No escribe ni el bitmap ni el inodo.
+ *
+ * Devuelve el número de bloques que se soltaron
+ */
+static int file_truncate_blocks(struct disk_inode *ino, int keep_blocks)
+{
+	int i, j, block = 0, freed = 0;
+
+	for (i = 0; i < NUM_EXTENTS; i++) {
+		if (ino->e[i].start == -1)
+			break;
+		int keep = (keep_blocks > block)? keep_blocks - block: 0;
+		if (keep > ino->e[i].size)
+			keep = ino->e[i].size;
+		for (j = keep; !is_hole(ino->e[i]) && (j < ino->e[i].size); j++, freed++)
+			data_block_put(fs, ino->e[i].start + j);
+		block += ino->e[i].size;
+		ino->e[i].size = keep;
+		if (keep == 0)
+			ino->e[i].start = ino->e[i].size = -1;
+	}
+
+	return freed;
+}
+
+/* num bloque lo haremos de forma que sea el bloque relativo al fichero */
+static int file_read(struct file_system *fs, struct disk_inode *ino,
+		     void *buffer, int block_num)
+{
+	int block = file_block(ino, block_num);
+
+	if (block == EXTENT_HOLE) {
+		memset(buffer, '\0', fs->sb.block_size);
+		return 1;
+	}
+	return (block == -1)? -EINVAL: data_read(fs, buffer, block);
+}
+
+static int file_write(struct file_system *fs, struct disk_inode *ino,
+		      void *buffer, int block_num)
+{
+	int block = file_block(ino, block_num);
+
+	return (block < 0)? -EINVAL: data_write(fs, buffer, block);
+}
+
+/* Carga la informacion del sistema de ficheros en ese puntero fs */
+static int fs_init(void)
+{
+	int i;
+
+	if (fs != NULL)
+		return 1;
+
+	fs = malloc(sizeof(struct file_system));
+
+	if (fs == NULL)
+		return -ENOMEM;
+	memset(fs, '\0', sizeof(struct file_system));
+
+	/* a coger el nombre!!!! */
+	char *filesystem_name = getenv("MFS_NAME");
+	if (filesystem_name == NULL) {
+		printf("MFS_NAME not set\n");
+		filesystem_name = default_name;
+		printf("used '%s' like file system\n", default_name);
+	}
+	
+	fs->dev = block_open(filesystem_name);
+	if (fs->dev == NULL) {
 		printf("Error creando el sistama de ficheros %s\n",
 		       filesystem_name);
 		perror("creando");;
 		return -1;
 	}
-	if (sb_read(fs->dev, &fs->sb) <0)
-		return -EIO;
+	if ((i = sb_read(fs->dev, &fs->sb)) < 0)
+		goto error;
+	i = -EIO;
 	if (bitmap_read(fs) < 0)
-		return -EIO;
+		goto error;
+	if (refcount_read(fs) < 0)
+		goto error;
+	if (log_read(fs) < 0) {
+		i = -ENOMEM;
+		goto error;
+	}
+	if ((i = dedup_load(fs, !fs->sb.dirty)) < 0)
+		goto error;
+	i = -EIO;
 	if (inode_read(fs, &fs->root, fs->sb.root_inode) < 0)
-		return -EIO;
+		goto error;
 	for (i = 0; i < NUM_FILES; i ++)
 		fs->file[i].num = -1;
 	return 1;
+error:
+	/* con checksums un bloque de metadatos puede no leerse: que la
+	 * siguiente llamada no se crea que ya está todo cargado */
+	block_close(fs->dev);
+	free(fs);
+	fs = NULL;
+	if (i < -1)
+		errno = -i;
+	return i;
+}
+
+/* Lo que cambia la imagen por debajo (crearla, agrandarla, repararla) no se
+ * puede hacer mientras la tiene cargada mfsd: sus cachés dejarían de valer
+ */
+static bool daemon_busy(void)
+{
+	if (!rpc_client())
+		return false;
+	printf("mfsd está sirviendo la imagen en %s: hay que pararlo antes\n",
+	       getenv("MFS_SOCKET"));
+	errno = EBUSY;
+	return true;
 }
 
 static char *catch_name(char *pathname)
@@ -331,6 +1194,11 @@ static char *catch_name(char *pathname)
 	return (name == NULL)? pathname: name + 1;	
 }
 
+static int bt_lookup(struct disk_inode *d, const char *name);
+static int bt_insert(struct disk_inode *ino, int inode_num, const char *name,
+		     int inode, char type);
+static int bt_delete(struct disk_inode *ino, const char *name);
+
 static int sub_namei(struct file_system *fs, struct disk_inode *d,
 		const char *pathname)
 {
@@ -339,6 +1207,9 @@ static int sub_namei(struct file_system *fs, struct disk_inode *d,
 	
 	int i, j;
 	
+	if (d->flags & INODE_BTREE)
+		return bt_lookup(d, pathname);
+
 	for (i = 0; i < NUM_EXTENTS; i++) {/* recorrer los extents */
 		if (d->e[i].start == -1)
 			break;
@@ -402,57 +1273,184 @@ static int namei(struct file_system *fs, struct disk_inode *d,
 	
 }
 
-/* devuelve el indice del primer inodo libre y a mayores lo ocupa con algunos
- * bloques
+/* Devuelve el primer bloque que tendrá numblock bloques libres (o el trozo más
+ * grande que se le parezca), buscando desde goal hasta el final y después
+ * desde el principio. Los grupos sin bloques libres se saltan enteros
+ *
+ * Devuelve -1 si no hay ningún bloque libre
  */
-static int get_free_inode(struct file_system *fs)
+static int catch_block_together(struct file_system *fs, const int num_block,
+				int goal)
 {
-	int i;
-	int j;
-	int k;
-
-	for (i = 0; i < fs->sb.num_inodes; i++) {
-		struct disk_inode ino;
-		inode_read(fs, &ino, i);
-		if (ino.size != -1)
-			continue;
-		ino.is_dir = 0;
-		ino.size=0;
-		ino.nlink = 1;
-		for (j = 0; j < NUM_EXTENTS; j++) {
-			ino.e[j].start = ino.e[j].size = -1;
-		}
-		j = 0;
-		while(j < fs->sb.num_data_blocks) {
-			if (bitmap_get(fs, j) == 0) {
-				ino.e[0].start = j;
-				ino.e[0].size = 0;
-				for (k=0; k < BLOCK_E; k++) {
-					if (j+k == fs->sb.num_data_blocks)
-						break;
-					if (bitmap_get(fs, k+j) != 0) {
-						break;
-					}
-					bitmap_set(fs, k+j);
-					ino.e[0].size++;
+	int previous_inode = 0, previous_size = 0, i, j, end, pass;
+
+	if ((goal < 0) || (goal >= fs->sb.num_data_blocks))
+		goal = 0;
+	for (pass = 0; pass < 2; pass++) {
+		i = (pass == 0)? goal: 0;
+		end = (pass == 0)? fs->sb.num_data_blocks: goal;
+		while (i < end) {
+			if ((i % group_blocks(fs) == 0) &&
+			    (fs->group[block_group(fs, i)].free_blocks == 0)) {
+				i += group_blocks(fs);
+				continue;
+			}
+			if (bitmap_get(fs, i)) {
+				i++;
+				continue;	
+			}
+			
+			for (j = 0; j < num_block; j++)
+				if ((i + j >= fs->sb.num_data_blocks) || bitmap_get(fs, i+j))
+					break;	
+			
+			if (j == num_block)
+				return i;
+			else {
+				if (j > previous_size) {
+					previous_size = j;
+					previous_inode = i;
 				}
-				break;
+				i += j;
 			}
-			j++;
-		}
-		if (ino.e[0].start == -1) {
-			errno = ENOSPC;
-			return -1;	
 		}
-		bitmap_write(fs);
-		inode_write(fs, &ino, i);
-		return i;
 	}
 	
-	errno = EDQUOT;
+	return (previous_size == 0)? -1: previous_inode;
+}
+
+/* Marca como ocupados hasta want bloques libres seguidos empezando en block
+ * (los que encontró catch_block_together)
+ *
+ * Devuelve cuantos bloques se reservaron
+ */
+static int alloc_at(struct file_system *fs, int block, int want)
+{
+	int n = 0;
+
+	while ((n < want) && (block + n < fs->sb.num_data_blocks)) {
+		if (bitmap_get(fs, block + n))
+			break;
+		bitmap_set(fs, block + n);
+		n++;
+	}
+
+	return n;
+}
+
+/* Devuelve a libres num_block bloques recién reservados con alloc_at */
+static void alloc_release(struct file_system *fs, int block, int num_block)
+{
+	int i;
+
+	for (i = 0; i < num_block; i++)
+		bitmap_clear(fs, block + i);
+}
+
+/* Como alloc_at, pero o reserva los num_block bloques o ninguno */
+static int alloc_run(struct file_system *fs, int block, int num_block)
+{
+	int n = alloc_at(fs, block, num_block);
+
+	if (n == num_block)
+		return 0;
+	alloc_release(fs, block, n);
 	return -1;
 }
 
+/* Cuenta los inodos libres del grupo g leyendo su trozo de la tabla */
+static int group_count_inodes(struct file_system *fs, int g)
+{
+	int per_block = fs->sb.block_size / sizeof(struct disk_inode);
+	int first = g * group_inodes(fs), last = first + group_inodes(fs);
+	char block[fs->sb.block_size];
+	struct disk_inode *ino;
+	int i, n = 0;
+
+	if (last > inode_count(fs))
+		last = inode_count(fs);
+	for (i = first; i < last; i++) {
+		if ((i == first) || (i % per_block == 0))
+			block_read(fs->dev, block, inode_block(fs, i / per_block));
+		ino = (struct disk_inode *) (block + (i % per_block) *
+					     sizeof(struct disk_inode));
+		if (ino->size == -1)
+			n++;
+	}
+
+	return n;
+}
+
+/* Un inodo del grupo g vuelve a estar libre */
+static void group_inode_freed(struct file_system *fs, int inode_num)
+{
+	struct group *grp = &fs->group[inode_group(fs, inode_num)];
+
+	if (grp->free_inodes != -1)
+		grp->free_inodes++;
+}
+
+/* devuelve el indice del primer inodo libre y a mayores lo ocupa con algunos
+ * bloques (si data es false el inodo empieza sin bloques, con los datos
+ * dentro del propio inodo). El inodo se busca primero en el grupo de near
+ * (el directorio donde va a estar, o -1) y los bloques en el del inodo
+ */
+static int get_free_inode(struct file_system *fs, bool data, int near)
+{
+	struct disk_inode ino;
+	int g = 0, i = -1, j, k, last;
+	int goal = (near >= 0)? inode_group(fs, near): 0;
+
+	for (k = 0; (k < fs->num_groups) && (i == -1); k++) {
+		g = (goal + k) % fs->num_groups;
+		struct group *grp = &fs->group[g];
+
+		if (grp->free_inodes == -1)
+			grp->free_inodes = group_count_inodes(fs, g);
+		last = (g + 1) * group_inodes(fs);
+		if (last > inode_count(fs))
+			last = inode_count(fs);
+		for (j = g * group_inodes(fs); (grp->free_inodes > 0) && (j < last); j++) {
+			inode_read(fs, &ino, j);
+			if (ino.size != -1)
+				continue;
+			ino.is_dir = 0;
+			ino.size=0;
+			ino.nlink = 1;
+			ino.flags = (data)? 0: INODE_INLINE;
+			ino.tail_block = ino.tail_offset = -1;
+			memset(ino.data, '\0', INLINE_SIZE);
+			memset(ino.e, -1, sizeof(ino.e));
+			log_inode(fs, j, LOG_NEW);
+			inode_write(fs, &ino, j);
+			grp->free_inodes--;
+			i = j;
+			break;
+		}
+	}
+	if (i == -1) {
+		errno = EDQUOT;
+		return -1;
+	}
+	if (!data)
+		return i;
+
+	int block = catch_block_together(fs, BLOCK_E, g * group_blocks(fs));
+	int n = (block == -1)? 0: alloc_at(fs, block, BLOCK_E);
+	if (n == 0) {
+		ino.size = -1;
+		inode_write(fs, &ino, i);
+		group_inode_freed(fs, i);
+		errno = ENOSPC;
+		return -1;
+	}
+	ino.e[0].start = block;
+	ino.e[0].size = n;
+	bitmap_write(fs);
+	inode_write(fs, &ino, i);
+	return i;
+}
+
 /* para saber si un nombre es valido para meter en un entry
  *
  * devuelve true si es un nombre valido o false en caso contrario
@@ -474,6 +1472,34 @@ static bool is_name_valid(const char *name) {
 	return true;
 }
 
+/* Junta en una sola las entradas libres que estén seguidas dentro del
+ * bloque, y si las últimas entradas están libres pasan a ser el final
+ * (así el hueco lo puede volver a usar avaliable_entry)
+ */
+static void entry_coalesce(char *block)
+{
+	struct entry *entry = (struct entry *) block;
+	struct entry *next;
+
+	while (entry->next != -1) {
+		if (entry->busy != -1) {
+			entry = ((void *) entry) + entry->next;
+			continue;
+		}
+		next = ((void *) entry) + entry->next;
+		if (next->next == -1) {/* lo que sigue es el final */
+			entry->next = entry->busy = entry->inode = -1;
+			strcpy(entry->name, "");
+			return;
+		}
+		if (next->busy == -1) {/* dos huecos seguidos: uno solo */
+			entry->next += next->next;
+			continue;
+		}
+		entry = next;
+	}
+}
+
 static int del_entry_of_inode(struct file_system *fs, struct disk_inode *ino,
 		const char *name)
 {
@@ -487,6 +1513,9 @@ static int del_entry_of_inode(struct file_system *fs, struct disk_inode *ino,
 		return -1;
 	}
 	
+	if (ino->flags & INODE_BTREE)
+		return bt_delete(ino, name);
+
 	char *block[fs->sb.block_size];
 	struct entry *entry;
 	int i, j;
@@ -503,6 +1532,7 @@ static int del_entry_of_inode(struct file_system *fs, struct disk_inode *ino,
 					if (!strcmp(entry->name, name)) {/* Encontramos la entrada */
 						entry->inode = entry->busy = -1;
 						strcpy(entry->name, "");
+						entry_coalesce((char *) block);
 						data_write(fs, block, ino->e[i].start+j);
 						return 0;
 					}
@@ -515,8 +1545,42 @@ static int del_entry_of_inode(struct file_system *fs, struct disk_inode *ino,
 	return -1;
 }
 
+/* El último extent no puede crecer donde está y no quedan extents: se copia
+ * a un trozo libre en el que quepan él y more bloques más. Si tenía bloques
+ * compartidos la copia ya es solo suya
+ *
+ * Devuelve -1 si no hay un trozo tan grande
+ */
+static int extent_move(struct disk_inode *ino, int i, int more, int inode_num)
+{
+	struct extent *e = &ino->e[i];
+	int n = e->size + more;
+	int b, k;
+
+	b = catch_block_together(fs, n, e->start + e->size);
+	if ((b == -1) || (alloc_run(fs, b, n) == -1)) {
+		errno = ENOSPC;
+		return -1;
+	}
+	if (block_copy(fs->dev, data_offset(fs) + e->start, data_offset(fs) + b,
+		       e->size) != e->size) {
+		alloc_release(fs, b, n);
+		errno = EIO;
+		return -1;
+	}
+	for (k = 0; k < e->size; k++)
+		data_block_put(fs, e->start + k);
+	e->start = b;
+	e->size = n;
+
+	bitmap_write(fs);
+	inode_write(fs, ino, inode_num);
+	return 0;
+}
+
 /* En el último extent en el que hay datos se va intentar aumentar bloques contiguos
- *  para que cojan los size bytes
+ *  para que cojan los size bytes. Si detrás no hay nada libre y ya no quedan
+ *  extents se mueve a otro sitio (extent_move)
  *
  * Devuelve -1 si no pudo asignar ningún byte
  */
@@ -532,29 +1596,22 @@ static int block_grow(struct disk_inode *ino, size_t size, int inode_num)
 		if (ino->e[i].start == -1)
 			break;
 	i--; /* No queremos el primero libre si no el último usado */
-	
-	int block = ino->e[i].start + ino->e[i].size;
-
-	if (block >= fs->sb.num_data_blocks){ /* es el final */
+	if (is_hole(ino->e[i])) { /* un hueco no crece: va en otro extent */
 		errno = ENOSPC;
 		return -1;
 	}
+	
+	int block = ino->e[i].start + ino->e[i].size;
 
-	/* miramos si por lo menos podemos asignar uno */
-	if (bitmap_get(fs, block))
+	/* cogemos los que estén libres justo detrás (si no hay ninguno, nada) */
+	int j = (block < fs->sb.num_data_blocks)? alloc_at(fs, block, num_block): 0;
+	if ((j == 0) && (i == NUM_EXTENTS - 1))
+		return extent_move(ino, i, num_block, inode_num);
+	if (j == 0) {
+		errno = ENOSPC;
 		return -1;
-	
-	int j;
-	
-	for (j = 0; j < num_block; j++) {
-		if (block+j == fs->sb.num_data_blocks)
-			break;
-		if (bitmap_get(fs, block+j)) /* Ya nos encontramos con uno ocupado */
-			break;
-		bitmap_set(fs, block+j); /* lo marcamos en el bitmap */
-		//block++; /* miraremos en el siguiente bloque */
-		ino->e[i].size++;/* marcamos más tamaño en el inodo */
 	}
+	ino->e[i].size += j; /* marcamos más tamaño en el inodo */
 	
 	bitmap_write(fs);
 	inode_write(fs, ino, inode_num);
@@ -562,37 +1619,15 @@ static int block_grow(struct disk_inode *ino, size_t size, int inode_num)
 	return 0;
 }
 
-/* Devuelve el primer bloque que tendrá numblock bloques libres (o el trozo más
- * grande que se le parezca)
- *
- * Devuelve -1 si no hay ningún bloque libre
+/* Donde conviene coger bloques para el extent i: detrás del último extent
+ * con bloques que tenga delante o, si no hay, en el grupo del inodo
  */
-static int catch_block_together(struct file_system *fs, const int num_block)
+static int extent_goal(struct disk_inode *ino, int i, int inode_num)
 {
-	int previous_inode = 0, previous_size = 0, i = 0, j;
-	
-	while (i < fs->sb.num_data_blocks) {
-		if (bitmap_get(fs, i)) {
-			i++;
-			continue;	
-		}
-		
-		for (j = 0; j < num_block; j++)
-			if (bitmap_get(fs, i+j))
-				break;	
-		
-		if (j == num_block)
-			return i;
-		else {
-			if (j > previous_size) {
-				previous_size = j;
-				previous_inode = i;
-			}
-			i += j;
-		}
-	}
-	
-	return (previous_size == 0)? -1: previous_inode;
+	while ((--i >= 0) && is_hole(ino->e[i]))
+		;
+	return (i >= 0)? ino->e[i].start + ino->e[i].size:
+		inode_group(fs, inode_num) * group_blocks(fs);
 }
 
 /* Va a tratar de poner el primer extent que este sin ocpuar como ocupado y
@@ -617,24 +1652,18 @@ static int extent_grow(struct disk_inode *ino, size_t size, int inode_num)
 	int num_block = ceil(size/fs->sb.block_size); /* redondeamos a la alza */
 	num_block = (num_block < BLOCK_GROW)? BLOCK_GROW: num_block;
 
-	/* buscamos donde empezar a coger bloques */
-	int block = catch_block_together(fs, num_block);
-	if (block == -1) {
+	/* buscamos donde empezar a coger bloques: detrás del último extent o,
+	 * si es el primero, en el grupo del inodo */
+	int goal = extent_goal(ino, i, inode_num);
+	int block = catch_block_together(fs, num_block, goal);
+	int j = (block == -1)? 0: alloc_at(fs, block, num_block);
+	if (j == 0) {
 		printf("There aren`t free blocks\n");
 		return -1;	
 	}
 	
-	/* sabemos que hay bloques libres... pues empezamos a asignarlo y a marcarlos */
 	ino->e[i].start = block;
-	ino->e[i].size = 0;
-	int j = 0;
-	while (j < num_block) {
-		if (bitmap_get(fs, block+j))
-			break;
-		bitmap_set(fs, block+j);
-		j++;
-		ino->e[i].size = j;
-	}
+	ino->e[i].size = j;
 //printf("\tj = %d, num_block = %d\n", j, num_block);
 //printf("\te(%d) = (%d,%d)\n",i,ino->e[i].start,ino->e[i].size);
 	/* actualizamos la información a disco */
@@ -692,7 +1721,7 @@ static bool avaliable_entry(char *block, char *name, int inode)
 {
 	struct entry *entry = (struct entry *) block;
 	
-	int size_entry = sizeof (short int) + sizeof(int)*2 + sizeof(char);/* tamaño que tendrá el último entry */
+	int size_entry = ENTRY_HEADER + sizeof(char);/* tamaño que tendrá el último entry */
 	int size_our_entry = size_entry + strlen(name);
 	int size = fs->sb.block_size - size_entry; /* tamaño que aún nos queda por mirar en el bloque */
 	while (size > size_our_entry) {
@@ -713,7 +1742,7 @@ static bool avaliable_entry(char *block, char *name, int inode)
 			return true;
 		}
 		/* entrada libre, pero no al final... mirar si nos coje */
-		if ((entry->next-sizeof(short int)-(sizeof(int)*2)-1) < strlen(name)) {
+		if ((entry->next - ENTRY_HEADER - 1) < strlen(name)) {
 			size = size - entry->next;
 			entry = ((void *) entry) + entry->next;
 			continue;
@@ -731,14 +1760,15 @@ static bool avaliable_entry(char *block, char *name, int inode)
 }
 
 /* En el sistema de ficheros fs, el inodo disk_inode, que es el de un directorio
- * añade una entrada de directorio con el par de valores (name, inode)
+ * añade una entrada de directorio con el par de valores (name, inode) y el
+ * tipo type (DT_REG o DT_DIR)
  *
  * devuelve un cero si pudo añadir la entrada en el directorio
  *
  * (inode_num corresponde al número que es ino)
  */
 static int add_entry_to_inode(struct file_system *fs, struct disk_inode *ino,
-	int inode, char *name, int inode_num)
+	int inode, char *name, int inode_num, char type)
 {
 	if (!is_dir(ino->is_dir)) {
 		printf("%s: Must be a directory. It's not\n", name);
@@ -750,6 +1780,11 @@ static int add_entry_to_inode(struct file_system *fs, struct disk_inode *ino,
 		return -1;
 	}
 	
+	log_inode(fs, inode_num, LOG_DIR);
+	log_inode(fs, inode, 0);
+	if (ino->flags & INODE_BTREE)
+		return bt_insert(ino, inode_num, name, inode, type);
+
 	char block[fs->sb.block_size];
 	int i, j, aux;
 	for (i = 0; i < NUM_EXTENTS; i++) {/* Nos movemos por los extents */
@@ -768,8 +1803,11 @@ static int add_entry_to_inode(struct file_system *fs, struct disk_inode *ino,
 				return 0;
 			}
 			
-			/* si llegamos aquí es que miramos todos los bloques de un extent */
-			aux = ino->e[i].size - 1;
+			/* solo se crece por detrás del último bloque del directorio */
+			if ((j < ino->e[i].size - 1) ||
+			    ((i < NUM_EXTENTS - 1) && (ino->e[i+1].start != -1)))
+				continue;
+			aux = ino->e[i].size; /* primer bloque nuevo */
 			if (block_grow(ino, sizeof(struct entry), inode_num) != -1)
 				block_clear_entry(ino, aux);
 		}
@@ -779,45 +1817,540 @@ static int add_entry_to_inode(struct file_system *fs, struct disk_inode *ino,
 	return -1;
 }
 
-/* Marca el inodo como libre y todos los bloques de datos asociados */
-static int free_inode(int inode_num)
-{
-	struct disk_inode ino;
-	if (inode_read(fs, &ino, inode_num) == -1) {
-		printf("%d: invalid inode\n", inode_num);
-		return -1;	
-	}
+/* Directorios en árbol B+ (INODE_BTREE)
+ *
+ * Cada nodo ocupa un bloque del directorio (el número de nodo es el bloque
+ * relativo al fichero) y el nodo 0 es siempre la raíz. En ino->size están
+ * los bytes de nodos que se usan, así que el siguiente nodo libre es
+ * size / block_size. Las hojas tienen las entradas ordenadas por nombre y
+ * encadenadas con next para recorrerlas en orden; los nodos internos tienen
+ * child0 y pares (clave, hijo) donde el hijo tiene los nombres >= clave.
+ * Al borrar no se reequilibra: una hoja puede quedarse medio vacía (o
+ * vacía) pero el árbol sigue siendo válido.
+ */
+struct bt_header {
+	int leaf; /* 1 si es una hoja */
+	int count; /* número de registros del nodo */
+	int next; /* hoja siguiente (o -1) */
+	int child0; /* primer hijo de un nodo interno */
+};
 
-	//int size = 0;	
-	int i;/* recorrer los extents */
-	int j;/* recorrer los bloques de datos */
-	for ( i = 0; i < NUM_EXTENTS; i++)
-		for (j = 0; j < ino.e[i].size; j++) {
-			bitmap_clear(fs, ino.e[i].start+j); /* marco los bloques de datos libres */
-		}			
-	
-	/* pongo la info a vacio */
+/* Un registro en disco es: int inode | char type | unsigned char len | name
+ * (el nombre sin '\0')
+ */
+#define BT_REC_HEADER (sizeof(int) + 2)
+#define bt_rec_len(p) (BT_REC_HEADER + (unsigned char) (p)[sizeof(int) + 1])
+#define BT_MIN_BLOCK 1024 /* para que en cada nodo quepan varios nombres largos */
+#define BT_GROW 16 /* bloques que se piden como mínimo al crecer el árbol */
 
-	ino.size = -1;
-	inode_write(fs, &ino, inode_num); /* lo marco en disco */
-	
-	/* escribo el bitmap en disco */
-	bitmap_write(fs);
+/* número máximo de registros que puede tener un nodo (más el que se mete) */
+#define bt_max_items(fs) ((fs)->sb.block_size / BT_REC_HEADER + 2)
 
+/* compara name con la clave del registro p, como strcmp */
+static int bt_cmp(const char *name, const char *p)
+{
+	int len = (unsigned char) p[sizeof(int) + 1];
+	int c = strncmp(name, p + BT_REC_HEADER, len);
 
-	
-	return 0;
+	return (c != 0)? c: (name[len] != '\0');
 }
 
-/* Esta función lo que hara será crear un fichero en el disco */
-/* Devolvera inodo creado si no hay fallos */
-static int create_file(struct file_system *fs, const char *pathname, int flags)
-{	
-
-	/* creamos la entrada de directorio */
-	int inode = get_free_inode(fs);
-	if (inode == -1)
+static void bt_decode(char *block, struct bt_header *h, struct dir_item *item)
+{
+	char *p = block + sizeof(struct bt_header);
+	int k, len;
+
+	memcpy(h, block, sizeof(struct bt_header));
+	for (k = 0; k < h->count; k++) {
+		len = (unsigned char) p[sizeof(int) + 1];
+		memcpy(&item[k].inode, p, sizeof(int));
+		item[k].type = p[sizeof(int)];
+		memcpy(item[k].name, p + BT_REC_HEADER, len);
+		item[k].name[len] = '\0';
+		p += BT_REC_HEADER + len;
+	}
+}
+
+static void bt_encode(char *block, struct bt_header *h, struct dir_item *item)
+{
+	char *p = block + sizeof(struct bt_header);
+	int k, len;
+
+	memset(block, '\0', fs->sb.block_size);
+	memcpy(block, h, sizeof(struct bt_header));
+	for (k = 0; k < h->count; k++) {
+		len = strlen(item[k].name);
+		memcpy(p, &item[k].inode, sizeof(int));
+		p[sizeof(int)] = item[k].type;
+		p[sizeof(int) + 1] = len;
+		memcpy(p + BT_REC_HEADER, item[k].name, len);
+		p += BT_REC_HEADER + len;
+	}
+}
+
+/* bytes que ocupan en disco los registros first..last-1 */
+static int bt_bytes(struct dir_item *item, int first, int last)
+{
+	int bytes = 0;
+
+	for (; first < last; first++)
+		bytes += BT_REC_HEADER + strlen(item[first].name);
+	return bytes;
+}
+
+/* Baja desde la raíz hasta la hoja donde estaría name y la deja en block
+ *
+ * Devuelve el nodo de la hoja o -1 si hubo error
+ */
+static int bt_find_leaf(struct disk_inode *d, const char *name, char *block)
+{
+	struct bt_header *h = (struct bt_header *) block;
+	int node = 0, k;
+	char *p;
+
+	while (1) {
+		if (file_read(fs, d, block, node) <= 0)
+			return -1;
+		if (h->leaf)
+			return node;
+		node = h->child0;
+		p = block + sizeof(struct bt_header);
+		for (k = 0; k < h->count; k++) {
+			if (bt_cmp(name, p) < 0)
+				break;
+			memcpy(&node, p, sizeof(int));
+			p += bt_rec_len(p);
+		}
+	}
+}
+
+/* Devuelve el inodo de la entrada name o -1 si no está */
+static int bt_lookup(struct disk_inode *d, const char *name)
+{
+	char block[fs->sb.block_size];
+	struct bt_header *h = (struct bt_header *) block;
+	char *p = block + sizeof(struct bt_header);
+	int k, inode;
+
+	if (bt_find_leaf(d, name, block) == -1)
+		return -1;
+	for (k = 0; k < h->count; k++, p += bt_rec_len(p))
+		if (bt_cmp(name, p) == 0) {
+			memcpy(&inode, p, sizeof(int));
+			return inode;
+		}
+
+	return -1;
+}
+
+/* número de niveles del árbol (1 si la raíz es una hoja) */
+static int bt_depth(struct disk_inode *ino)
+{
+	char block[fs->sb.block_size];
+	struct bt_header *h = (struct bt_header *) block;
+	int node = 0, depth = 0;
+
+	do {
+		if (file_read(fs, ino, block, node) <= 0)
+			return -1;
+		node = h->child0;
+		depth++;
+	} while (!h->leaf);
+
+	return depth;
+}
+
+/* Se asegura de que el directorio tiene por lo menos need nodos sin usar,
+ * así un alta que parta nodos hasta la raíz no se queda a medias. Cuando
+ * hace falta un extent nuevo se pide bastante más de lo que ya hay, porque
+ * solo hay NUM_EXTENTS
+ *
+ * Devuelve -1 si no hay sitio
+ */
+static int bt_reserve(struct disk_inode *ino, int inode_num, int need)
+{
+	int bs = fs->sb.block_size;
+	int blocks;
+
+	while ((blocks = file_blocks(ino)) - ino->size / bs < need) {
+		size_t grow = (size_t) ((blocks < BT_GROW)? BT_GROW: 4 * blocks) * bs;
+		if ((block_grow(ino, grow, inode_num) == -1) || (file_blocks(ino) == blocks))
+			if ((extent_grow(ino, grow, inode_num) == -1) ||
+			    (file_blocks(ino) == blocks)) {
+				errno = ENOSPC;
+				return -1;
+			}
+	}
+
+	return 0;
+}
+
+/* Da el siguiente nodo sin usar (ya reservado con bt_reserve) */
+static int bt_new_node(struct disk_inode *ino, int inode_num)
+{
+	int node = ino->size / fs->sb.block_size;
+
+	if (node >= file_blocks(ino)) {
+		errno = ENOSPC;
+		return -1;
+	}
+	ino->size += fs->sb.block_size;
+	inode_write(fs, ino, inode_num);
+
+	return node;
+}
+
+/* El nodo node (con los registros de item, que ya no caben) se parte en dos
+ * por la mitad de los bytes. Si es la raíz sus dos mitades se van a nodos
+ * nuevos y ella pasa a ser un nodo interno, así la raíz no se mueve nunca
+ *
+ * Devuelve 1 y deja en up la clave que sube al padre (con el nodo nuevo en
+ * up->inode), 0 si se partió la raíz o -1 si hubo error
+ */
+static int bt_split(struct disk_inode *ino, int inode_num, int node,
+		    struct bt_header *h, struct dir_item *item, struct dir_item *up)
+{
+	char block[fs->sb.block_size];
+	struct bt_header left = *h, right = *h;
+	int half = bt_bytes(item, 0, h->count) / 2;
+	int m, used = 0, l, r;
+
+	for (m = 0; m < h->count - 1; m++) {
+		int len = BT_REC_HEADER + strlen(item[m].name);
+		if (used + len > half)
+			break;
+		used += len;
+	}
+	if (m == 0)
+		m = 1;
+
+	*up = item[m]; /* la primera clave de la derecha es la que sube */
+	left.count = m;
+	if (h->leaf) {
+		right.count = h->count - m;
+	} else {/* en un nodo interno la clave sube y su hijo es el child0 */
+		right.child0 = item[m].inode;
+		right.count = h->count - m - 1;
+	}
+	struct dir_item *right_item = item + h->count - right.count;
+
+	if ((r = bt_new_node(ino, inode_num)) == -1)
+		return -1;
+	if (node == 0) {
+		if ((l = bt_new_node(ino, inode_num)) == -1)
+			return -1;
+	} else
+		l = node;
+
+	if (h->leaf) {
+		right.next = h->next;
+		left.next = r;
+	}
+	bt_encode(block, &left, item);
+	file_write(fs, ino, block, l);
+	bt_encode(block, &right, right_item);
+	file_write(fs, ino, block, r);
+	up->inode = r;
+	if (node != 0)
+		return 1;
+
+	struct bt_header root = {0, 1, -1, l};
+	bt_encode(block, &root, up);
+	file_write(fs, ino, block, 0);
+
+	return 0;
+}
+
+/* Mete it en el subárbol que cuelga de node
+ *
+ * Devuelve 1 si node se partió (la clave para el padre queda en up), 0 si no
+ * y -1 si hubo error (EEXIST si ya había una entrada con ese nombre)
+ */
+static int bt_insert_rec(struct disk_inode *ino, int inode_num, int node,
+			 struct dir_item *it, struct dir_item *up)
+{
+	char block[fs->sb.block_size];
+	struct bt_header h;
+	struct dir_item *item = malloc(bt_max_items(fs) * sizeof(struct dir_item));
+	struct dir_item child_up;
+	int pos, ret = -1;
+
+	if (item == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	if (file_read(fs, ino, block, node) <= 0)
+		goto out;
+	bt_decode(block, &h, item);
+
+	if (h.leaf) {
+		for (pos = 0; pos < h.count; pos++)
+			if (strcmp(item[pos].name, it->name) >= 0)
+				break;
+		if ((pos < h.count) && !strcmp(item[pos].name, it->name)) {
+			errno = EEXIST;
+			goto out;
+		}
+		child_up = *it;
+	} else {
+		for (pos = 0; pos < h.count; pos++)
+			if (strcmp(it->name, item[pos].name) < 0)
+				break;
+		int child = (pos == 0)? h.child0: item[pos-1].inode;
+		ret = bt_insert_rec(ino, inode_num, child, it, &child_up);
+		if (ret != 1)
+			goto out;
+		ret = -1;
+	}
+
+	memmove(item + pos + 1, item + pos, (h.count - pos) * sizeof(struct dir_item));
+	item[pos] = child_up;
+	h.count++;
+	if (sizeof(struct bt_header) + bt_bytes(item, 0, h.count) <= fs->sb.block_size) {
+		bt_encode(block, &h, item);
+		ret = (file_write(fs, ino, block, node) > 0)? 0: -1;
+	} else
+		ret = bt_split(ino, inode_num, node, &h, item, up);
+out:
+	free(item);
+	return ret;
+}
+
+static int bt_insert(struct disk_inode *ino, int inode_num, const char *name,
+		     int inode, char type)
+{
+	struct dir_item it, up;
+	int depth = bt_depth(ino);
+
+	/* en el peor caso se parte un nodo por nivel y la raíz usa dos */
+	if ((depth == -1) || (bt_reserve(ino, inode_num, depth + 1) == -1))
+		return -1;
+	it.inode = inode;
+	it.type = type;
+	strcpy(it.name, name);
+
+	return (bt_insert_rec(ino, inode_num, 0, &it, &up) == -1)? -1: 0;
+}
+
+/* Quita la entrada name de la hoja donde esté (sin reequilibrar) */
+static int bt_delete(struct disk_inode *ino, const char *name)
+{
+	char block[fs->sb.block_size];
+	struct bt_header *h = (struct bt_header *) block;
+	char *p = block + sizeof(struct bt_header), *end = p;
+	int k, node = bt_find_leaf(ino, name, block);
+
+	if (node == -1)
+		return -1;
+	for (k = 0; k < h->count; k++)
+		end += bt_rec_len(end);
+	for (k = 0; k < h->count; k++, p += bt_rec_len(p))
+		if (bt_cmp(name, p) == 0) {
+			int len = bt_rec_len(p);
+			memmove(p, p + len, end - (p + len));
+			memset(end - len, '\0', len);
+			h->count--;
+			return (file_write(fs, ino, block, node) > 0)? 0: -1;
+		}
+
+	return -1;
+}
+
+/* Llama a fn con cada entrada del directorio, en orden, hasta que devuelva
+ * algo distinto de 0 (y devuelve eso)
+ */
+static int bt_foreach(struct disk_inode *ino,
+		      int (*fn)(struct dir_item *, void *), void *arg)
+{
+	char block[fs->sb.block_size];
+	struct bt_header h;
+	struct dir_item *item = malloc(bt_max_items(fs) * sizeof(struct dir_item));
+	int k, ret = 0, node = bt_find_leaf(ino, "", block);
+
+	if (item == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	while ((node != -1) && (ret == 0)) {
+		if (file_read(fs, ino, block, node) <= 0) {
+			ret = -1;
+			break;
+		}
+		bt_decode(block, &h, item);
+		for (k = 0; (k < h.count) && (ret == 0); k++)
+			ret = fn(&item[k], arg);
+		node = h.next;
+	}
+	free(item);
+
+	return ret;
+}
+
+struct tail_ref {
+	int offset;
+	int inode;
+};
+
+static int cmp_tail_ref(const void *a, const void *b)
+{
+	const struct tail_ref *x = a, *y = b;
+
+	return (x->offset < y->offset)? -1: (x->offset > y->offset);
+}
+
+/* Junta al principio del bloque de fragmentos abierto (en frag) las colas
+ * que siguen vivas: se buscan en la tabla de inodos y a cada uno se le
+ * cambia tail_offset (también a su copia si está abierto)
+ */
+static int tail_compact(char *frag)
+{
+	struct frag_header *header = (struct frag_header *) frag;
+	int bs = fs->sb.block_size, block = fs->sb.frag_block;
+	struct tail_ref *ref = malloc(header->count * sizeof(struct tail_ref));
+	struct disk_inode ino;
+	int i, j, n = 0, used = sizeof(struct frag_header), len;
+
+	if (ref == NULL) {
+		errno = ENOMEM;
 		return -1;
+	}
+	for (i = 0; (i < inode_count(fs)) && (n < header->count); i++) {
+		if ((inode_read(fs, &ino, i) == -1) || (ino.size == -1))
+			continue;
+		if ((ino.flags & INODE_TAIL) && (ino.tail_block == block)) {
+			ref[n].offset = ino.tail_offset;
+			ref[n++].inode = i;
+		}
+	}
+	qsort(ref, n, sizeof(struct tail_ref), cmp_tail_ref);
+
+	for (i = 0; i < n; i++) {
+		inode_read(fs, &ino, ref[i].inode);
+		len = ino.size % bs;
+		memmove(frag + used, frag + ino.tail_offset, len);
+		ino.tail_offset = used;
+		inode_write(fs, &ino, ref[i].inode);
+		for (j = 0; j < NUM_FILES; j++)
+			if (fs->file[j].num == ref[i].inode)
+				fs->file[j].ino.tail_offset = used;
+		used += len;
+	}
+	memset(frag + used, '\0', bs - used);
+	header->used = used;
+	header->count = n;
+	fs->frag_freed = 0;
+	free(ref);
+
+	return data_write(fs, frag, block);
+}
+
+/* Busca sitio para una cola de len bytes en el bloque de fragmentos
+ * abierto (o en uno nuevo) y la escribe. Si no cabe pero sí cabría sin las
+ * colas que se quitaron de él, se juntan las que quedan antes de dejarlo
+ *
+ * Devuelve -1 si no hay bloques libres
+ */
+static int tail_alloc(void *tail, int len, int *block, int *offset)
+{
+	char frag[fs->sb.block_size];
+	struct frag_header *header = (struct frag_header *) frag;
+
+	if (fs->sb.frag_block != -1) {
+		data_read(fs, frag, fs->sb.frag_block);
+		if ((header->used + len > fs->sb.block_size) &&
+		    (header->used - fs->frag_freed + len <= fs->sb.block_size) &&
+		    (tail_compact(frag) == -1))
+			return -1;
+		if (header->used + len > fs->sb.block_size) {
+			fs->sb.frag_block = -1;
+			fs->frag_freed = 0;
+		}
+	}
+	if (fs->sb.frag_block == -1) {/* empezamos un bloque de fragmentos */
+		int b = catch_block_together(fs, 1, 0);
+		if ((b == -1) || (alloc_at(fs, b, 1) == 0)) {
+			errno = ENOSPC;
+			return -1;
+		}
+		bitmap_write(fs);
+		memset(frag, '\0', fs->sb.block_size);
+		header->used = sizeof(struct frag_header);
+		header->count = 0;
+		fs->sb.frag_block = b;
+		sb_write(fs->dev, &fs->sb);
+	}
+
+	*block = fs->sb.frag_block;
+	*offset = header->used;
+	memcpy(frag + header->used, tail, len);
+	header->used += len;
+	header->count++;
+
+	return data_write(fs, frag, *block);
+}
+
+/* Quita una cola de len bytes del bloque de fragmentos block. Si es el
+ * abierto se apunta lo que queda libre para que tail_alloc lo recupere
+ */
+static void tail_free(int block, int len)
+{
+	char frag[fs->sb.block_size];
+	struct frag_header *header = (struct frag_header *) frag;
+
+	data_read(fs, frag, block);
+	if (--header->count > 0) {
+		data_write(fs, frag, block);
+		if (fs->sb.frag_block == block)
+			fs->frag_freed += len;
+		return;
+	}
+	bitmap_clear(fs, block); /* ya no queda ninguna cola */
+	bitmap_write(fs);
+	if (fs->sb.frag_block == block) {
+		fs->sb.frag_block = -1;
+		fs->frag_freed = 0;
+		sb_write(fs->dev, &fs->sb);
+	}
+}
+
+/* Marca el inodo como libre y todos los bloques de datos asociados */
+static int free_inode(int inode_num)
+{
+	struct disk_inode ino;
+	if (inode_read(fs, &ino, inode_num) == -1) {
+		printf("%d: invalid inode\n", inode_num);
+		return -1;	
+	}
+
+	//int size = 0;	
+	int i;/* recorrer los extents */
+	int j;/* recorrer los bloques de datos */
+	for ( i = 0; i < NUM_EXTENTS; i++)
+		for (j = 0; !is_hole(ino.e[i]) && (j < ino.e[i].size); j++) {
+			data_block_put(fs, ino.e[i].start+j); /* marco los bloques de datos libres */
+		}			
+	
+	if (ino.flags & INODE_TAIL)
+		tail_free(ino.tail_block, ino.size % fs->sb.block_size);
+
+	/* pongo la info a vacio */
+
+	ino.size = -1;
+	inode_write(fs, &ino, inode_num); /* lo marco en disco */
+	group_inode_freed(fs, inode_num);
+	
+	/* escribo el bitmap en disco */
+	bitmap_write(fs);
+
+
+	
+	return 0;
+}
+
+/* Esta función lo que hara será crear un fichero en el disco */
+/* Devolvera inodo creado si no hay fallos */
+static int create_file(struct file_system *fs, const char *pathname, int flags)
+{	
 
 	/* tenemos que añadir una entrada en el directorio */
 	/* en que inodo tendremos que escribir la info */
@@ -842,8 +2375,13 @@ static int create_file(struct file_system *fs, const char *pathname, int flags)
 		
 		inode_read(fs, &ino, dir_inode);		
 	}
+
+	/* creamos la entrada de directorio, cerca del directorio padre */
+	int inode = get_free_inode(fs, false, dir_inode);
+	if (inode == -1)
+		return -1;
 	
-	if (add_entry_to_inode(fs, &ino, inode, catch_name(aux), dir_inode) != 0) {
+	if (add_entry_to_inode(fs, &ino, inode, catch_name(aux), dir_inode, DT_REG) != 0) {
 		free_inode(inode);/* TENGO QUE LIBERAR EL INODO QUE OCUPE */
 		return -1;	
 	}
@@ -851,10 +2389,41 @@ static int create_file(struct file_system *fs, const char *pathname, int flags)
 	return inode;
 }
 
+/* Empieza a apuntar cambios: si el sistema estaba limpio con un registro
+ * vacío, si no siguiendo con el que hay. Las imágenes que aún no tienen
+ * registro se reservan aquí un bloque de datos para él
+ */
+static void log_start(struct file_system *fs, bool clean)
+{
+	if (fs->log == NULL) {
+		if (!clean) /* no se sabe qué pasó antes: no vale empezar ahora */
+			return;
+		int b = catch_block_together(fs, 1, 0);
+		if ((b == -1) || (alloc_at(fs, b, 1) == 0))
+			return;
+		fs->log = malloc(fs->sb.block_size);
+		if (fs->log == NULL) {
+			alloc_release(fs, b, 1);
+			return;
+		}
+		bitmap_write(fs);
+		fs->sb.log_block = b; /* lo escribe is_clean */
+	}
+	if (clean) {
+		memset(fs->log, '\0', fs->sb.block_size);
+		log_head(fs)->magic = LOG_MAGIC;
+		fs->log_dirty = true;
+	}
+	fs->log_active = true;
+	log_flush(fs);
+}
+
 static bool is_clean(struct file_system *fs)
 {
 	bool clean = !fs->sb.dirty;
 	
+	if (!fs->log_active)
+		log_start(fs, clean);
 	if (clean) {
 		fs->sb.dirty = true;
 		sb_write(fs->dev, &fs->sb);	
@@ -868,18 +2437,56 @@ static int restore_dirty(struct file_system *fs, bool clean, int restore)
 	if (!clean)
 		return restore;
 		
+	fs->log_active = false;
 	fs->sb.dirty = false;
 	sb_write(fs->dev, &fs->sb);
 		
 	return restore; 	
 }
 
+/* Lote de operaciones: el sistema se marca sucio una vez en mfs_begin y se
+ * deja limpio en mfs_commit. Las operaciones de en medio ven que ya estaba
+ * sucio y no escriben el superbloque dos veces cada una; el registro de
+ * cambios sigue apuntando todo, así que si se corta a mitad el chequeo
+ * mira lo que tocó el lote entero. No hay vuelta atrás: lo hecho queda
+ */
+int mfs_begin(void)
+{
+	if (rpc_client()) { /* el demonio tiene a otros clientes a la vez */
+		errno = ENOTSUP;
+		return -1;
+	}
+	if (fs_init() < 0)
+		return -1;
+	if (fs->batch) {
+		errno = EBUSY;
+		return -1;
+	}
+	fs->batch_clean = is_clean(fs);
+	fs->batch = true;
+	return 0;
+}
+
+int mfs_commit(void)
+{
+	if ((fs == NULL) || !fs->batch) {
+		errno = EINVAL;
+		return -1;
+	}
+	fs->batch = false;
+	log_flush(fs);
+	return restore_dirty(fs, fs->batch_clean, 0);
+}
+
 /* Dado un archivo situado en el pathname, abre un fichero y lo situa en la
  * tabla de ficheros
  */
 int mfs_open(const char *pathname, int flags)
 {/* no funciona si hay subdirectorios */
-	fs_init();
+	if (rpc_client())
+		return rpc_path(RPC_OPEN, pathname, NULL, flags, NULL, 0);
+	if (fs_init() < 0)
+		return -1;
 
 	int inode;
 	int fd = -1;
@@ -912,6 +2519,15 @@ int mfs_open(const char *pathname, int flags)
 		inode_read(fs, &fs->file[fd].ino, inode);
 		fs->file[fd].pos = 0;
 		fs->file[fd].num = inode;
+		fs->file[fd].wbuf = NULL;
+		fs->file[fd].wbuf_len = 0;
+		fs->file[fd].written = false;
+		fs->file[fd].dfirst = fs->file[fd].dlast = -1;
+		fs->file[fd].empty = (fs->file[fd].ino.size == 0);
+		fs->file[fd].zip = NULL;
+		fs->file[fd].zbuf = NULL;
+		fs->file[fd].zcluster = -1;
+		fs->file[fd].zdirty = false;
 	}
 	if (fd == -1)
 		errno = EMFILE;
@@ -919,21 +2535,6 @@ int mfs_open(const char *pathname, int flags)
 	return restore_dirty(fs, clean, fd);
 }
 
-int mfs_close(int fd)
-{
-	if (fd < 0 || fd >= NUM_FILES)
-		return -1;
-	if (fs->file[fd].num == -1) {
-		printf("Trying to close unopened fd\n");
-		return -1;
-	}
-	
-	bool clean = is_clean(fs);
-	inode_write(fs, &fs->file[fd].ino, fs->file[fd].num);
-	fs->file[fd].num = -1;
-	return restore_dirty(fs, clean, 0);
-}
-
 /* Función donde estoy????
  * dada una posición de un fichero te dice en que extent te encuentras y...
  * dentro de el en que bloque estás
@@ -969,594 +2570,2872 @@ static int where_is_it(int fd, int *block, int *pos_extent)
 
 
 
-/* Dado un fd lee count bytes y los almacena en buf */
-/* Función creo que acabada
- * Lee trocitos de bloque
- * Se mueve por los extents
- * No se pasa leyendo si mandas leer más de lo que tiene el fichero
+static int wbuf_flush(int fd);
+
+/* Si algún bloque del extent está compartido con otro inodo se copia el
+ * extent entero a bloques nuevos (copy-on-write) y se sueltan los viejos
+ *
+ * Devuelve -1 si no hay sitio para la copia
  */
-static int read_data_block(int fd, void *buf, size_t count)
+static int extent_unshare(struct disk_inode *ino, int extent, int inode_num)
 {
-	int pos_block;
-	int extent;
-	switch (where_is_it(fd, &pos_block, &extent)) {
-		case 0:  return 0;
-		case -1: return -1;
+	struct extent *e = &ino->e[extent];
+	int j;
 
-	};
+	if (is_hole(*e))
+		return 0;
+	for (j = 0; j < e->size; j++)
+		if (fs->refcount[e->start + j] != 0)
+			break;
+	if (j == e->size) /* no hay nada compartido */
+		return 0;
 
-	/* Lo actualizamos para no leer mas de lo que debemos */
-	count = (count > (fs->file[fd].ino.size-fs->file[fd].pos) )? fs->file[fd].ino.size - fs->file[fd].pos: count;
-	
-	/* nos ponemos a leer */
-	int read = 0;
-	void *buffer = buf;
-	char block[fs->sb.block_size];
-	int delay = fs->file[fd].pos % fs->sb.block_size; /* desfase */
+	int block = catch_block_together(fs, e->size, e->start);
+	if ((block == -1) || (alloc_run(fs, block, e->size) == -1)) {
+		errno = ENOSPC;
+		return -1;
+	}
 
-	/* tenemos tres casos */
-	/* 1.- Empezar a leer por el medio del bloque */
-	if ( delay != 0) {
-		data_read(fs, (void *) block, fs->file[fd].ino.e[extent].start+pos_block);
-		memcpy(buffer, block, (count > fs->sb.block_size - delay)? fs->sb.block_size - delay: count);
-		read = (count > fs->sb.block_size - delay)? fs->sb.block_size - delay: count;
-		fs->file[fd].pos += read;
-		pos_block++;
-		buffer += read;
+	if (block_copy(fs->dev, data_offset(fs) + e->start,
+		       data_offset(fs) + block, e->size) != e->size) {
+		alloc_release(fs, block, e->size);
+		return -1;
 	}
+	for (j = 0; j < e->size; j++)
+		data_block_put(fs, e->start + j);
+	e->start = block;
 
-	/* 2.- Leer bloques de datos completos */
-	int num_block = (count-read) / fs->sb.block_size;
-	int i;	
-	for (i = 0; i < num_block; i++) {
-		if (pos_block == fs->file[fd].ino.e[extent].size) { /* Es que tenemos que cambiar de extent */
-			extent++;
-			pos_block = 0;
-		}
-		data_read(fs, buffer, fs->file[fd].ino.e[extent].start+pos_block);
-		buffer += fs->sb.block_size;/* para no escribir siempre lo mismo */
-		pos_block++;
-		read += fs->sb.block_size;
-		fs->file[fd].pos += fs->sb.block_size;
+	bitmap_write(fs);
+	inode_write(fs, ino, inode_num);
+	return 0;
+}
+
+/* Hace copy-on-write de los extents de fd que tengan algún bloque entre
+ * first y last (bloques relativos al fichero)
+ */
+static int file_unshare(int fd, int first, int last)
+{
+	struct disk_inode *ino = &fs->file[fd].ino;
+	int i, block = 0;
+
+	for (i = 0; i < NUM_EXTENTS; i++) {
+		if (ino->e[i].start == -1)
+			break;
+		if ((block <= last) && (block + ino->e[i].size > first))
+			if (extent_unshare(ino, i, fs->file[fd].num) == -1)
+				return -1;
+		block += ino->e[i].size;
 	}
-	
-	/* 3.- Leer un trocito del final */
-	if (read < count) {
-		if (pos_block == fs->file[fd].ino.e[extent].size) { /* Es que tenemos que cambiar de extent */
-			extent++;
-			pos_block = 0;
-		}
-		data_read(fs, (void *) block, fs->file[fd].ino.e[extent].start+pos_block);
-		memcpy(buffer, (void *) block, count-read);
-		fs->file[fd].pos += (count-read);
-		read += (count-read);
+
+	return 0;
+}
+
+/* Apunta que se escribieron los bloques first a last de fd: al cerrarlo
+ * solo se deduplican los que se escribieron
+ */
+static void file_written(int fd, int first, int last)
+{
+	struct file *f = &fs->file[fd];
+
+	if ((f->dfirst == -1) || (first < f->dfirst))
+		f->dfirst = first;
+	if (last > f->dlast)
+		f->dlast = last;
+}
+
+/* El inodo está abierto: su copia en fs->file manda sobre la del disco y
+ * lo que cambie sus bloques por debajo (mfs_defrag, mfs_dedup) lo deja mal
+ */
+static bool inode_open(int inode_num)
+{
+	int i;
+
+	for (i = 0; i < NUM_FILES; i++)
+		if (fs->file[i].num == inode_num)
+			return true;
+	return false;
+}
+
+/* Lectura de un fichero que tiene los datos dentro del inodo */
+static int inline_read(int fd, void *buf, size_t count)
+{
+	struct file *f = &fs->file[fd];
+
+	if (f->pos >= f->ino.size)
+		return 0;
+	if (count > f->ino.size - f->pos)
+		count = f->ino.size - f->pos;
+	memcpy(buf, f->ino.data + f->pos, count);
+	f->pos += count;
+
+	return count;
+}
+
+/* Escritura en un fichero que tiene los datos dentro del inodo (tiene que
+ * caber en el)
+ */
+static int inline_write(int fd, void *buf, size_t count)
+{
+	struct file *f = &fs->file[fd];
+
+	memcpy(f->ino.data + f->pos, buf, count);
+	f->pos += count;
+	if (f->pos > f->ino.size)
+		f->ino.size = f->pos;
+
+	return count;
+}
+
+/* El fichero ya no cabe en el inodo: le damos un extent de por lo menos
+ * size bytes y pasamos al primer bloque lo que tenía dentro
+ */
+static int inline_promote(int fd, size_t size)
+{
+	struct disk_inode *ino = &fs->file[fd].ino;
+	char block[fs->sb.block_size];
+
+	memset(block, '\0', fs->sb.block_size);
+	memcpy(block, ino->data, ino->size);
+
+	ino->flags &= ~INODE_INLINE;
+	if (extent_grow(ino, size, fs->file[fd].num) == -1) {
+		ino->flags |= INODE_INLINE;
+		return -1;
 	}
+	memset(ino->data, '\0', INLINE_SIZE);
+	data_write(fs, block, ino->e[0].start);
+	file_written(fd, 0, 0);
+	inode_write(fs, ino, fs->file[fd].num);
 
-	return read;	
+	return 0;
 }
 
-/* Escribe en un fichero fd, count bytes de lo que hay en buf despues de pos */
-int mfs_read(int fd, void *buf, size_t count)
+/* Asigna bloques al fichero fd hasta que tenga por lo menos num_block
+ *
+ * Devuelve el número de bloques que tiene asignados al final
+ */
+static int file_alloc(int fd, int num_block)
 {
-	if (fd < 0 || fd >= NUM_FILES)
+	struct disk_inode *ino = &fs->file[fd].ino;
+	int blocks;
+
+	while ((blocks = file_blocks(ino)) < num_block) {
+		size_t size = (size_t) (num_block - blocks) * fs->sb.block_size;
+		if ((ino->e[0].start == -1) ||
+		    (block_grow(ino, size, fs->file[fd].num) == -1))
+			if (extent_grow(ino, size, fs->file[fd].num) == -1)
+				break;
+	}
+
+	return blocks;
+}
+
+/* Si el último bloque del fichero está a medias se mueve ese trozo a un
+ * bloque de fragmentos y se sueltan el bloque y los que sobren de los extents
+ */
+static int tail_pack(int fd)
+{
+	struct disk_inode *ino = &fs->file[fd].ino;
+	int bs = fs->sb.block_size;
+	int last = ino->size / bs; /* bloque donde está la cola */
+	int len = ino->size % bs;
+
+	if ((ino->flags & (INODE_INLINE | INODE_TAIL | INODE_ZIP)) || is_dir(ino->is_dir))
+		return 0;
+	if ((len == 0) || (len > tail_max(fs)))
+		return 0;
+	int b = file_block(ino, last);
+	if ((b < 0) || (fs->refcount[b] != 0))
+		return 0;
+
+	char buffer[bs];
+	data_read(fs, buffer, b);
+	if (tail_alloc(buffer, len, &ino->tail_block, &ino->tail_offset) == -1)
 		return -1;
-	if (fs->file[fd].num == -1) {
-		printf("Trying to read unopened fd\n");
+	ino->flags |= INODE_TAIL;
+
+	/* soltamos el bloque de la cola y los que sobran por detrás */
+	file_truncate_blocks(ino, last);
+
+	bitmap_write(fs);
+	return inode_write(fs, ino, fs->file[fd].num);
+}
+
+/* Vuelve a poner la cola del fichero en un bloque propio (antes de escribir) */
+static int tail_unpack(int fd)
+{
+	struct disk_inode *ino = &fs->file[fd].ino;
+	int bs = fs->sb.block_size;
+	int last = ino->size / bs;
+	char frag[bs];
+	char block[bs];
+
+	if (!(ino->flags & INODE_TAIL))
+		return 0;
+	if (file_alloc(fd, last + 1) < last + 1) {
+		errno = ENOSPC;
 		return -1;
 	}
-	
-	return read_data_block(fd, buf, count);
+
+	data_read(fs, frag, ino->tail_block);
+	memset(block, '\0', bs);
+	memcpy(block, frag + ino->tail_offset, ino->size % bs);
+	file_write(fs, ino, block, last);
+	file_written(fd, last, last);
+
+	tail_free(ino->tail_block, ino->size % bs);
+	ino->flags &= ~INODE_TAIL;
+	ino->tail_block = ino->tail_offset = -1;
+
+	return inode_write(fs, ino, fs->file[fd].num);
 }
 
-/* Dado un fd escribe count bytes de buf */
-/* Falta asignación de bloques
- * Lee trocitos de bloque
- * Se mueve por los extents
+/* Lee de la cola del fichero (pos tiene que estar dentro de ella) */
+static int tail_read(int fd, void *buf, size_t count)
+{
+	struct file *f = &fs->file[fd];
+	int bs = fs->sb.block_size;
+	char frag[bs];
+
+	if (f->pos >= f->ino.size)
+		return 0;
+	if (count > f->ino.size - f->pos)
+		count = f->ino.size - f->pos;
+
+	data_read(fs, frag, f->ino.tail_block);
+	memcpy(buf, frag + f->ino.tail_offset + f->pos % bs, count);
+	f->pos += count;
+
+	return count;
+}
+
+/* Alarga z con blocks bloques libres: primero seguidos detrás de su último
+ * extent y si no en extents nuevos (hasta NUM_EXTENTS), empezando a buscar
+ * en goal. Solo se marcan en el bitmap, no se escribe nada
+ *
+ * Devuelve -1 si no hay sitio (z se queda como estaba)
  */
-static int write_data_block(int fd, void *buf, size_t count)
+static int zip_extend(struct disk_inode *z, int blocks, int goal)
 {
-	int pos_block;
-	int extent;
-	if (where_is_it(fd, &pos_block, &extent) == -1) {
-		return -1;
+	int i = extent_count(z), first = i, size = 0, block, n;
+
+	if (i > 0) {
+		size = z->e[i-1].size;
+		goal = z->e[i-1].start + size;
+		n = (goal < fs->sb.num_data_blocks)? alloc_at(fs, goal, blocks): 0;
+		z->e[i-1].size += n;
+		blocks -= n;
+		goal += n;
 	}
-	
-	/* Escritura que no asigna bloques */
-	/*tres casos*/
-	int write = 0;
-	void *buffer = buf;
-	char block[fs->sb.block_size];
-	int delay = fs->file[fd].pos % fs->sb.block_size; /* desfase */
-	/* 1.- Empezar a escribir por el medio del bloque */ /* lo bueno es que este bloque siempre está asignado */
-	if (delay != 0) {
-		/* Leemos el bloque que tenemos que escribir */
-		data_read(fs, (void *) block, fs->file[fd].ino.e[extent].start+pos_block);
-		/* modificamos el trozo en el bloque */
-		memcpy(((void *) block)+delay, buffer, (count > fs->sb.block_size - delay)? fs->sb.block_size - delay: count);
-		/* escribirmos en bloque en disco */
-		data_write(fs, (void *) block, fs->file[fd].ino.e[extent].start+pos_block);
-		write = (count > fs->sb.block_size - delay)? fs->sb.block_size - delay: count;
-		fs->file[fd].pos += write;
-		pos_block++;
-		buffer += write;
+	for (; (i < NUM_EXTENTS) && (blocks > 0); i++) {
+		block = catch_block_together(fs, blocks, goal);
+		n = (block == -1)? 0: alloc_at(fs, block, blocks);
+		if (n == 0)
+			break;
+		z->e[i].start = block;
+		z->e[i].size = n;
+		blocks -= n;
+		goal = block + n;
 	}
-	
-	/* 2.- Escribir bloques de datos completos */
-	int num_block = (count-write) / fs->sb.block_size;
+	if (blocks == 0)
+		return 0;
+	for (i--; i >= first; i--) {
+		alloc_release(fs, z->e[i].start, z->e[i].size);
+		z->e[i].start = z->e[i].size = -1;
+	}
+	if (first > 0) {
+		alloc_release(fs, z->e[first-1].start + size, z->e[first-1].size - size);
+		z->e[first-1].size = size;
+	}
+	errno = ENOSPC;
+	return -1;
+}
+
+/* Pone los extents de z (ya escritos) en el inodo de fd, lo marca como
+ * comprimido y suelta los bloques viejos. Como en defrag_inode, el cambio
+ * está en la escritura del inodo
+ */
+static void zip_switch(int fd, struct disk_inode *z)
+{
+	struct disk_inode *ino = &fs->file[fd].ino;
+	struct disk_inode old = *ino;
 	int i;
-	for (i = 0; i < num_block; i++) {
-		if (pos_block == fs->file[fd].ino.e[extent].size) {
-			/* intentamos alargar el extent */
-			if (block_grow(&fs->file[fd].ino, count-write, fs->file[fd].num) == -1) {
-				/* no se pudo alargar el extent... pues a por uno nuevo */
-				if (extent_grow(&fs->file[fd].ino, count-write, fs->file[fd].num) == -1)
-					return (write == 0)? -1: write;
 
-				extent++;/* empezamos en el siguiente extent */
-				pos_block = 0; /* y en el primer bloque del siguiente */
-			}
-		}
-		data_write(fs, buffer, fs->file[fd].ino.e[extent].start+pos_block);
-		buffer += fs->sb.block_size;/* para no escribir siempre lo mismo */
-		pos_block++;
-		write += fs->sb.block_size;
-		fs->file[fd].pos += fs->sb.block_size;
-	}
+	bitmap_write(fs);
+	for (i = 0; i < NUM_EXTENTS; i++)
+		ino->e[i] = z->e[i];
+	ino->flags |= INODE_ZIP;
+	inode_write(fs, ino, fs->file[fd].num);
 
-	/* 3.- Escribir un trocito del final */
-	if (write < count) {
-		if (pos_block == fs->file[fd].ino.e[extent].size) {
-			/* intentamos alargar el extent */
-			if (block_grow(&fs->file[fd].ino, count-write, fs->file[fd].num) == -1) {
-				/* no se pudo alargar el extent... pues a por uno nuevo */
-				if (extent_grow(&fs->file[fd].ino, count-write, fs->file[fd].num) == -1)
-					return (write == 0)? -1: write;
+	file_truncate_blocks(&old, 0);
+	bitmap_write(fs);
+}
 
-				extent++;/* empezamos en el siguiente extent */
-				pos_block = 0; /* y en el primer bloque del siguiente */
-			}
+/* Bloques que ocupa en el fichero el cluster c (con el mapa cargado). Los
+ * que van sin comprimir ocupan lo que tengan de fichero: todos están
+ * enteros menos el último
+ */
+static int zip_stored(struct file *f, int c)
+{
+	struct zip_map *m = &zip_map(f->zip)[c];
+	int bs = fs->sb.block_size;
+	int len = f->zip->cluster * bs;
+	int bytes = (f->ino.size - c * len < len)? f->ino.size - c * len: len;
+
+	return (((m->len == 0)? bytes: m->len) + bs - 1) / bs;
+}
+
+/* Lee la cabecera y el mapa de clusters del fichero fd y mira donde acaba
+ * el último cluster (zend)
+ */
+static int zip_load(int fd)
+{
+	struct file *f = &fs->file[fd];
+	int bs = fs->sb.block_size;
+	struct zip_header h;
+	char block[bs];
+	int i, n, end;
+
+	if (f->zip != NULL)
+		return 0;
+	if (file_read(fs, &f->ino, block, 0) != 1)
+		return -1;
+	memcpy(&h, block, sizeof(struct zip_header));
+	if ((h.cluster <= 0) || (h.cluster > ZIP_MAX_CLUSTER) ||
+	    ((long) h.count * h.cluster * bs < f->ino.size)) {
+		errno = EIO;
+		return -1;
+	}
+	n = zip_map_blocks(fs, h.count);
+	f->zip = malloc((size_t) n * bs);
+	if (f->zip == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	memcpy(f->zip, block, bs);
+	for (i = 1; i < n; i++)
+		if (file_read(fs, &f->ino, (char *) f->zip + i * bs, i) != 1)
+			goto error;
+
+	f->zend = n;
+	for (i = 0; i < h.count; i++) {
+		end = zip_map(f->zip)[i].block + zip_stored(f, i);
+		if ((zip_map(f->zip)[i].block < n) || (end > file_blocks(&f->ino))) {
+			printf("inode %d: cluster %d out of the file\n", f->num, i);
+			errno = EIO;
+			goto error;
 		}
-		/* Leemos el bloque */
-		data_read(fs, (void *) block, fs->file[fd].ino.e[extent].start+pos_block);
-		/* metemos solo el trozo que nos interesa */
-		memcpy((void *)block, buffer, count-write);
-		/* lo escribimos en disco */
-		data_write(fs, (void *) block, fs->file[fd].ino.e[extent].start+pos_block);
-		fs->file[fd].pos += (count-write);
-		write += (count-write);
+		if (end > f->zend)
+			f->zend = end;
 	}
-	
-	fs->file[fd].ino.size += write; /* habrá que cambiarlo */
-	return write;
+
+	return 0;
+error:
+	free(f->zip);
+	f->zip = NULL;
+	return -1;
 }
 
-/* Escribe en un fichero fd, count bytes de lo que hay en buf despues de pos */
-int mfs_write(int fd, void *buf, size_t count)
+/* Carga el mapa de fd y le da el buffer para un cluster */
+static int zip_buffer(int fd)
 {
-	if (fd < 0 || fd >= NUM_FILES)
+	struct file *f = &fs->file[fd];
+
+	if (zip_load(fd) == -1)
 		return -1;
-	if (fs->file[fd].num == -1) {
-		printf("Trying to write unopened fd\n");
+	if ((f->zbuf == NULL) &&
+	    ((f->zbuf = malloc(f->zip->cluster * fs->sb.block_size)) == NULL)) {
+		errno = ENOMEM;
 		return -1;
 	}
 
-	bool clean = is_clean(fs);
-	return restore_dirty(fs, clean, write_data_block(fd, buf, count));
-	
+	return 0;
 }
 
-off_t mfs_lseek(int fd, off_t offset, int whence)
+/* Suelta lo que se guardó en memoria de un fichero comprimido */
+static void zip_release(int fd)
+{
+	struct file *f = &fs->file[fd];
+
+	free(f->zip);
+	free(f->zbuf);
+	f->zip = NULL;
+	f->zbuf = NULL;
+	f->zcluster = -1;
+	f->zdirty = false;
+}
+
+/* Lee el cluster c del fichero fd (ya con el mapa cargado) en out y pone a
+ * ceros lo que quede del cluster detrás del final del fichero
+ *
+ * Devuelve los bytes del fichero que hay en el cluster
+ */
+static int zip_cluster(int fd, int c, char *out)
 {
-	fs_init();
+	struct file *f = &fs->file[fd];
+	struct zip_map *m = &zip_map(f->zip)[c];
+	int bs = fs->sb.block_size;
+	int len = f->zip->cluster * bs;
+	int bytes = (f->ino.size - c * len < len)? f->ino.size - c * len: len;
+	int blocks = zip_stored(f, c);
+	char *in = out;
+	int i;
 
-	if (fd < 0 || fd >= NUM_FILES)
-		return -1;
-	if (fs->file[fd].num == -1) {
-		errno = EBADF;
+	if ((m->len != 0) && ((in = malloc((size_t) blocks * bs)) == NULL)) {
+		errno = ENOMEM;
 		return -1;
 	}
-	
-	if ((whence != SEEK_SET) && (whence != SEEK_CUR) && (whence != SEEK_END)){
-		errno = 	EINVAL;
+	for (i = 0; i < blocks; i++)
+		if (file_read(fs, &f->ino, in + i * bs, m->block + i) != 1)
+			break;
+	if ((i == blocks) && (m->len != 0) &&
+	    (lz_decompress(in, m->len, out, len) != bytes))
+		i = -1;
+	if (in != out)
+		free(in);
+	if (i != blocks) {
+		printf("inode %d: cluster %d damaged\n", f->num, c);
+		errno = EIO;
 		return -1;
 	}
-	
-	bool clean = is_clean(fs);
-	
-	off_t aux = -1;
-	if (whence == SEEK_SET) /* The offset is set to offset bytes. */
-		aux = offset;
-	
-	if (whence == SEEK_CUR)/* The offset is set to its current location plus offset bytes. */
-		aux = fs->file[fd].pos + offset;
-		
-	if (whence == SEEK_END)/* The offset is set to the size of the file plus offset bytes. */
-		aux = fs->file[fd].pos +offset;
-/*
-	if (aux < 0)
-		return restore_dirty(fs, clean, -1);
-	
-	if (aux > fs->file[fd].ino.size )
-		return restore_dirty(fs, clean, -1);
-*/	
-	fs->file[fd].pos = aux;
-	return restore_dirty(fs, clean, aux);
-	
-}
+	memset(out + bytes, '\0', len - bytes);
 
+	return bytes;
+}
 
-/* Normalmente esta en la segunda entrada pero....*/
-static int whos_father(const struct disk_inode ino)
+/* Escribe el bloque b del mapa de fd (el 0 lleva la cabecera) */
+static int zip_map_write(int fd, int b)
 {
-	if (!is_dir(ino.is_dir))
+	struct file *f = &fs->file[fd];
+	int bs = fs->sb.block_size;
+
+	if (file_unshare(fd, b, b) == -1)
 		return -1;
-		
-	int i, j;
+	if (file_write(fs, &f->ino, (char *) f->zip + (size_t) b * bs, b) != 1) {
+		errno = EIO;
+		return -1;
+	}
+	file_written(fd, b, b);
+
+	return 0;
+}
+
+/* Lleva los bloques del cluster c detrás del último (a zend) */
+static int zip_move(int fd, int c)
+{
+	struct file *f = &fs->file[fd];
+	struct zip_map *m = &zip_map(f->zip)[c];
+	int n = zip_stored(f, c);
 	char block[fs->sb.block_size];
-	struct entry *entry;
-	
-	for (i = 0; i < NUM_EXTENTS; i++) {
-		if (ino.e[i].size == -1)
-			continue;
-			
-		for (j = 0; j < ino.e[i].size; j++) {
-			data_read(fs, block, ino.e[i].start+j);
-			entry = (struct entry *) block;
+	int i;
 
-			while (entry->next != -1) {
-				if ((entry->inode != -1) && (entry->busy != -1) && 
-					(!strcmp(entry->name, "..")))
-					return entry->inode;
-					
-				entry = ((void *) entry) + entry->next;
+	if (file_alloc(fd, f->zend + n) < f->zend + n) {
+		errno = ENOSPC;
+		return -1;
+	}
+	if (file_unshare(fd, f->zend, f->zend + n - 1) == -1)
+		return -1;
+	for (i = 0; i < n; i++)
+		if ((file_read(fs, &f->ino, block, m->block + i) != 1) ||
+		    (file_write(fs, &f->ino, block, f->zend + i) != 1)) {
+			errno = EIO;
+			return -1;
+		}
+	file_written(fd, f->zend, f->zend + n - 1);
+	m->block = f->zend;
+	f->zend += n;
+
+	return 0;
+}
+
+/* Añade un cluster al final del mapa (sin escribir la cabecera). Si el
+ * mapa necesita un bloque más, los clusters que estaban en él se llevan
+ * detrás de todo
+ */
+static int zip_map_grow(int fd)
+{
+	struct file *f = &fs->file[fd];
+	int bs = fs->sb.block_size;
+	int count = f->zip->count;
+	int mb = zip_map_blocks(fs, count), nb = zip_map_blocks(fs, count + 1);
+	int c, b;
+
+	if (nb > mb) {
+		struct zip_header *h = realloc(f->zip, (size_t) nb * bs);
+		if (h == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+		memset((char *) h + (size_t) mb * bs, '\0', (size_t) (nb - mb) * bs);
+		f->zip = h;
+		if (f->zend < nb)
+			f->zend = nb;
+		for (c = 0; c < count; c++)
+			if ((zip_map(h)[c].block < nb) && (zip_move(fd, c) == -1))
+				return -1;
+		for (b = 0; b < nb; b++)
+			if (zip_map_write(fd, b) == -1)
+				return -1;
+	}
+	zip_map(f->zip)[count].block = f->zend;
+	zip_map(f->zip)[count].len = 0;
+	f->zip->count++;
+
+	return 0;
+}
+
+/* Bloques libres que tiene el cluster c en su sitio hasta el siguiente
+ * (INT_MAX si es el último del fichero)
+ */
+static int zip_room(struct file *f, int c)
+{
+	struct zip_map *map = zip_map(f->zip);
+	int j, room = INT_MAX;
+
+	for (j = 0; j < f->zip->count; j++)
+		if ((map[j].block > map[c].block) && (map[j].block - map[c].block < room))
+			room = map[j].block - map[c].block;
+
+	return room;
+}
+
+/* Primer bloque detrás del mapa donde caben need bloques sin pisar ningún
+ * cluster que no sea c (el sitio de c vale, se va a escribir encima). Si no
+ * hay hueco entre los clusters es el final del último
+ */
+static int zip_gap(struct file *f, int c, int need)
+{
+	struct zip_map *map = zip_map(f->zip);
+	int start = zip_map_blocks(fs, f->zip->count), j, end;
+	bool moved = true;
+
+	/* lo que pisa se salta: entre medias no cabe */
+	while (moved) {
+		moved = false;
+		for (j = 0; j < f->zip->count; j++) {
+			end = map[j].block + zip_stored(f, j);
+			if ((j != c) && (map[j].block < start + need) && (end > start)) {
+				start = end;
+				moved = true;
 			}
-		}	
+		}
 	}
-	
-	return -1;
+
+	return start;
 }
 
-int mfs_link(const char *oldpath, const char *newpath)
+/* Donde acaba el último cluster (el mapa si no hay ninguno) */
+static int zip_end(struct file *f)
 {
-	fs_init();
-//printf("oldpath = %s\n", oldpath);
-//printf("newpath = %s\n", newpath);
+	struct zip_map *map = zip_map(f->zip);
+	int end = zip_map_blocks(fs, f->zip->count), j;
 
-	int old_inode = namei(fs, &fs->root, oldpath);
-	if (old_inode == -1) {
-		errno = ENOENT;
-		return -1;	
+	for (j = 0; j < f->zip->count; j++)
+		if (map[j].block + zip_stored(f, j) > end)
+			end = map[j].block + zip_stored(f, j);
+
+	return end;
+}
+
+/* Guarda el cluster de zbuf si se escribió en él: comprimido si ahorra algún
+ * bloque y si no tal cual. Va en su sitio si cabe y si no en el primer hueco
+ * que dejen los demás, así los sitios que se quedan libres se vuelven a usar
+ * y el fichero no crece con cada cluster que cambia de tamaño. Solo se
+ * escriben sus bloques y el bloque del mapa donde está
+ */
+static int zip_flush(int fd)
+{
+	struct file *f = &fs->file[fd];
+	int bs = fs->sb.block_size;
+	int c = f->zcluster, len, bytes, blocks, n, need, start, i;
+	bool added;
+	char *out;
+
+	if (!f->zdirty)
+		return 0;
+	len = f->zip->cluster * bs;
+	bytes = (f->ino.size - c * len < len)? f->ino.size - c * len: len;
+	blocks = (bytes + bs - 1) / bs;
+	out = malloc((size_t) blocks * bs);
+	if (out == NULL) {
+		errno = ENOMEM;
+		return -1;
 	}
-	struct disk_inode ino;
-	inode_read(fs, &ino, old_inode);
-	if (is_dir(ino.is_dir)) {
-		errno = EPERM;
-		return -1;	
+	/* tiene que ahorrar por lo menos un bloque */
+	n = lz_compress(f->zbuf, bytes, out, (size_t) (blocks - 1) * bs);
+	if (n == 0)
+		memcpy(out, f->zbuf, (size_t) blocks * bs);
+	else
+		memset(out + n, '\0', (size_t) blocks * bs - n);
+	need = (n == 0)? blocks: (n + bs - 1) / bs;
+
+	added = (c == f->zip->count);
+	if (added && (zip_map_grow(fd) == -1))
+		goto error;
+	struct zip_map *m = &zip_map(f->zip)[c];
+	struct zip_map old = *m;
+	if (added)
+		start = f->zend;
+	else
+		start = (need <= zip_room(f, c))? m->block: zip_gap(f, c, need);
+
+	if (file_alloc(fd, start + need) < start + need) {
+		errno = ENOSPC;
+		goto error;
 	}
-	
-	int new_inode = namei(fs, &fs->root, newpath);
-	if (new_inode != -1) {
-		errno = EEXIST;
-		return -1;	
+	if (file_unshare(fd, start, start + need - 1) == -1)
+		goto error;
+	for (i = 0; i < need; i++)
+		if (file_write(fs, &f->ino, out + (size_t) i * bs, start + i) != 1) {
+			errno = EIO;
+			goto error;
+		}
+
+	file_written(fd, start, start + need - 1);
+	m->block = start;
+	m->len = n;
+	i = (sizeof(struct zip_header) + c * sizeof(struct zip_map)) / bs;
+	if ((zip_map_write(fd, i) == -1) || (added && (i != 0) && (zip_map_write(fd, 0) == -1))) {
+		*m = old;
+		goto error;
 	}
-//printf("old_inode = %d\n", old_inode);
-//printf("new_inode = %d\n", new_inode);
+	f->zend = zip_end(f);
+	f->zdirty = false;
+	free(out);
 
-	bool clean = is_clean(fs); /* dirty */
-	/* comprobados estos valores empezamos a trabajar para la función */
-	char path[strlen(newpath)+1];
-	strcpy(path, newpath);
-	struct disk_inode aux_ino;
-	char *aux = rindex(path, '/');
+	bitmap_write(fs);
+	inode_write(fs, &f->ino, f->num);
+	return 0;
+error:
+	if (added)
+		f->zip->count = c;
+	free(out);
+	bitmap_write(fs);
+	return -1;
+}
 
-	if ((aux == path)||(aux == NULL)) {/* caso raiz */
-		aux = (aux != NULL)? aux +1: path;
-		new_inode = fs->sb.root_inode;
-	} else {
-	/*
-		aux++;
-		if ((new_inode = namei(fs, &fs->root, path))==-1)
-			return restore_dirty(fs, clean, -1);
-		inode_read(fs, &aux_ino, new_inode);
-		if ((new_inode = whos_father(aux_ino))== -1)
-			return restore_dirty(fs, clean, -1);// ????????????????????????????????????????????
-	*/
-		*aux = '\0';
-		aux++;
-		if ((new_inode = namei(fs, &fs->root, path)) == -1)
-			return restore_dirty(fs, clean, -1);
-	}
-printf("new_inode = %d\n", new_inode);
-printf("aux = %s\n", aux);
-//exit(0);
-	inode_read(fs, &aux_ino, new_inode);
-	if (add_entry_to_inode(fs, &aux_ino, old_inode, aux, new_inode) != -1) { /* POR EL WARNING */
-		ino.nlink++;
-		inode_write(fs, &ino, old_inode);
-		return restore_dirty(fs, clean, 0);
-	}
-	
-	return restore_dirty(fs, clean, -1);
+/* Guarda zbuf como el cluster c entero: el fichero crece hasta donde acaba
+ * (size es el tamaño de antes, para dejarlo como estaba si falla)
+ */
+static int zip_fill(int fd, int c, int size)
+{
+	struct file *f = &fs->file[fd];
+	int len = f->zip->cluster * fs->sb.block_size;
+
+	f->zcluster = c;
+	f->ino.size = (c + 1) * len;
+	f->zdirty = true;
+	if (zip_flush(fd) == 0)
+		return 0;
+	f->ino.size = (size > c * len)? size: c * len;
+	f->zcluster = -1;
+	f->zdirty = false;
+	return -1;
 }
 
-/* Para poder borrar un archivo */
-int mfs_unlink(const char *pathname)
+/* Deja en zbuf el cluster c guardando antes el que hubiera. Detrás del
+ * último solo se pueden poner clusters si está entero: se guarda entero y
+ * los que queden en medio se guardan a ceros
+ */
+static int zip_seek(int fd, int c)
 {
-	fs_init();
+	struct file *f = &fs->file[fd];
+	int len = f->zip->cluster * fs->sb.block_size;
+	int size = f->ino.size;
+	int k, last;
 
-	/* buscamos el archivo */
-	int inode = namei(fs, &fs->root, pathname);
-	if (inode == -1) {
-		printf("%s: file or directory does not exist\n", pathname);
-		errno = ENOENT;
-		return -1;	
+	if (zip_flush(fd) == -1)
+		return -1;
+	f->zcluster = -1;
+	last = f->zip->count - 1;
+	if ((c > last) && (size < (last + 1) * len))
+		if ((zip_cluster(fd, last, f->zbuf) == -1) ||
+		    (zip_fill(fd, last, size) == -1))
+			return -1;
+	for (k = last + 1; k < c; k++) {
+		memset(f->zbuf, '\0', len);
+		if (zip_fill(fd, k, size) == -1)
+			return -1;
 	}
 
-	struct disk_inode ino;
-	inode_read(fs, &ino, inode);
-	if (is_dir(ino.is_dir)) {
-		printf("%s: is a directory\n", pathname);
-		return -1;	
+	if (c < f->zip->count) {
+		if (zip_cluster(fd, c, f->zbuf) == -1)
+			return -1;
+	} else
+		memset(f->zbuf, '\0', len);
+	f->zcluster = c;
+
+	return 0;
+}
+
+/* Lectura de un fichero comprimido: se descomprime el cluster entero y se
+ * queda en zbuf para las lecturas que sigan dentro de él
+ */
+static int zip_read(int fd, void *buf, size_t count)
+{
+	struct file *f = &fs->file[fd];
+	size_t done = 0;
+	int len, off, n, c;
+
+	if (zip_buffer(fd) == -1)
+		return -1;
+	len = f->zip->cluster * fs->sb.block_size;
+	while ((done < count) && (f->pos < f->ino.size)) {
+		c = f->pos / len;
+		if (c != f->zcluster) {
+			/* lo escrito en zbuf se guarda antes de cambiar */
+			bool clean = is_clean(fs);
+			n = restore_dirty(fs, clean, zip_seek(fd, c));
+			if (n == -1)
+				return (done == 0)? -1: done;
+		}
+		off = f->pos % len;
+		n = (f->ino.size - f->pos < len - off)? f->ino.size - f->pos: len - off;
+		if (n > count - done)
+			n = count - done;
+		memcpy(buf + done, f->zbuf + off, n);
+		done += n;
+		f->pos += n;
 	}
 
-	bool clean = is_clean(fs);
-	ino.nlink--;
-	bool rm = (ino.nlink == 0)? true: false;
-	inode_write(fs, &ino, inode);
+	return done;
+}
 
-	char *aux, path[strlen(pathname)+1];
-	strcpy(path, pathname);
-	
-	if ((aux = rindex(path+1, '/')) == NULL) { /* está en el raiz */
-		ino = fs->root;
-		aux = (path[0] == '/')?path+1:path;
-	} else {/* está en un subdirectorio */
-		*aux = '\0';
-		inode = namei(fs, &fs->root, path);
-		inode_read(fs, &ino, inode);
-		aux++;
+/* Escritura en un fichero comprimido: se cambia el cluster que hay en zbuf
+ * y se guarda al pasar a otro, en mfs_fsync o al cerrar. Así cada escritura
+ * cuesta lo que los clusters que toca y no lo que el fichero
+ */
+static int zip_write(int fd, void *buf, size_t count)
+{
+	struct file *f = &fs->file[fd];
+	size_t done = 0;
+	int len, off, n, c;
+
+	if (zip_buffer(fd) == -1)
+		return -1;
+	len = f->zip->cluster * fs->sb.block_size;
+	while (done < count) {
+		c = f->pos / len;
+		if ((c != f->zcluster) && (zip_seek(fd, c) == -1))
+			return (done == 0)? -1: done;
+		off = f->pos % len;
+		n = (count - done < len - off)? count - done: len - off;
+		memcpy(f->zbuf + off, buf + done, n);
+		f->zdirty = true;
+		done += n;
+		f->pos += n;
+		if (f->pos > f->ino.size)
+			f->ino.size = f->pos;
 	}
 
-	/* en el caso de que exista lo buscamos en el directorio donde está */
-	char buffer[(fs->sb).block_size];
-	struct entry *entry;
-	int i; /* para movernos por los extends */
-	int j; /* para movernos por los bloques de un extend */
+	return done;
+}
 
-	for (i = 0; i < NUM_EXTENTS; i++) {
-		if (ino.e[i].start == -1)
-			break;
-			
-		for (j = 0; j < ino.e[i].size; j++) {
-			data_read(fs, buffer, ino.e[i].start+j);
-			entry = (struct entry *) buffer;
-			
-			while (entry->next != -1) {/* recorremos las entradas de directorio */
-				if ((entry->busy != -1) && (entry->inode != -1) && (strcmp(entry->name, aux) == 0)) {
-					if (rm)
-						free_inode(entry->inode);
-					entry->busy = entry->inode = -1;
-					strcmp(entry->name, "");
-					data_write(fs, buffer, ino.e[i].start+j);
-					return restore_dirty(fs, clean, 0);
+struct zip_slot {
+	int block;
+	int c;
+};
+
+static int cmp_zip_slot(const void *a, const void *b)
+{
+	const struct zip_slot *x = a, *y = b;
+
+	return (x->block < y->block)? -1: (x->block > y->block);
+}
+
+/* Junta los clusters detrás del mapa (en el orden en el que están) si más
+ * de 1/8 de lo que hay hasta zend son sitios que no usa nadie: los huecos
+ * que zip_flush no pudo volver a usar porque no cabía nada en ellos
+ */
+static int zip_repack(int fd)
+{
+	struct file *f = &fs->file[fd];
+	struct zip_map *map = zip_map(f->zip);
+	int count = f->zip->count, mb = zip_map_blocks(fs, count);
+	char block[fs->sb.block_size];
+	int live = mb, pos = mb, c, i, k, n;
+
+	for (c = 0; c < count; c++)
+		live += zip_stored(f, c);
+	if ((f->zend - live) * 8 <= f->zend)
+		return 0;
+
+	struct zip_slot *slot = malloc(count * sizeof(struct zip_slot));
+	if (slot == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	for (c = 0; c < count; c++) {
+		slot[c].block = map[c].block;
+		slot[c].c = c;
+	}
+	qsort(slot, count, sizeof(struct zip_slot), cmp_zip_slot);
+
+	for (k = 0; k < count; k++) {
+		c = slot[k].c;
+		n = zip_stored(f, c);
+		if (map[c].block > pos) { /* hacia atrás: se copia de delante a detrás */
+			if (file_unshare(fd, pos, pos + n - 1) == -1)
+				goto error;
+			for (i = 0; i < n; i++)
+				if ((file_read(fs, &f->ino, block, map[c].block + i) != 1) ||
+				    (file_write(fs, &f->ino, block, pos + i) != 1)) {
+					errno = EIO;
+					goto error;
 				}
-				entry = ((void *) entry) + entry->next;
-			}
+			file_written(fd, pos, pos + n - 1);
+			map[c].block = pos;
 		}
+		pos += n;
 	}
+	free(slot);
+	for (i = 0; i < mb; i++)
+		if (zip_map_write(fd, i) == -1)
+			return -1;
+	f->zend = pos;
 
-	return restore_dirty(fs, clean, -1);
+	return 0;
+error:
+	free(slot);
+	return -1;
 }
 
-static bool rename_valid(const char *oldpath, const char *newpath)
+/* Al cerrar: se guarda lo que quede en zbuf, se juntan los clusters si han
+ * dejado demasiados huecos y se sueltan los bloques que sobren detrás del
+ * último
+ */
+static int zip_close(int fd)
 {
-	char old[strlen(oldpath)+1];
-	char new[strlen(newpath)+1];
-	
-	strcpy(old, oldpath);
-	strcpy(new, newpath);
-	
-	char *aux_old = rindex(old, '/');
-	if (aux_old == NULL)
+	struct file *f = &fs->file[fd];
+
+	if (f->zip == NULL)
+		return 0;
+	if ((zip_flush(fd) == -1) || (zip_repack(fd) == -1))
 		return -1;
-	*aux_old = '\0';
-	
-	char *aux_new = rindex(new, '/');
-	if (aux_new == NULL)
-		return -1;
-	*aux_new = '\0';
-	
-	/* Si es el mismo directorio si que se permite */
-	if (!strcmp(aux_new, aux_old))
-		return true;
-	
-	const char cut [] = {"/"};
-	aux_new = strtok(new, cut);
-	aux_old = strtok(old, cut);
-	
-	while ((aux_new != NULL) && (aux_old != NULL)) { /* para no hacer ciclos */
-		if (!strcmp(aux_new, aux_old))
-			return false;
-		aux_new++;
-		aux_old++;
-		aux_new = strtok(aux_new, cut);
-		aux_old = strtok(aux_old, cut);
+	if (file_blocks(&f->ino) > f->zend) {
+		file_truncate_blocks(&f->ino, f->zend);
+		bitmap_write(fs);
 	}
-	
-	return true;
+
+	return 0;
 }
 
-/* Función que dado un archivo viejo renueva a uno nuevo */
-int mfs_rename(const char *oldpath, const char *newpath)
+/* Al cerrar un fichero que estaba vacío al abrirlo se comprime por clusters
+ * de sb.zip_cluster bloques. Cada cluster se comprime y se escribe en
+ * bloques nuevos según se lee (en memoria solo hay un cluster y el mapa) y
+ * solo se queda si ahorra algún bloque; los clusters que no ahorran nada
+ * van sin comprimir. Los que ya tenían datos se quedan como estaban, así
+ * cerrar no cuesta más que lo que se escribió
+ *
+ * Devuelve 1 si lo comprimió
+ */
+static int zip_pack(int fd)
 {
-	
-	fs_init();
-	/* Primero miramos que exista el archivo */
-	int inode = namei(fs, &fs->root, oldpath);
-	if (inode == -1) {
-		printf("%s: No such file or directory\n", oldpath);
-		return -1;
-	}
-	
-	if (-1 != namei(fs, &fs->root, newpath)) {
-		printf("%s: Such file or directory\n", newpath);
-		return -1;	
+	struct file *f = &fs->file[fd];
+	struct disk_inode *ino = &f->ino;
+	int bs = fs->sb.block_size;
+	int cluster = fs->sb.zip_cluster;
+
+	if ((cluster == 0) || !f->written || !f->empty || (ino->size == 0) ||
+	    (ino->flags & (INODE_INLINE | INODE_TAIL | INODE_ZIP)) ||
+	    is_dir(ino->is_dir) || (file_holes(ino) > 0)) /* los huecos ya no ocupan */
+		return 0;
+
+	int len = cluster * bs;
+	int count = (ino->size + len - 1) / len;
+	int raw = (ino->size + bs - 1) / bs; /* lo que ocupa sin comprimir */
+	int used = zip_map_blocks(fs, count);
+	int c, i, n, bytes, blocks, need;
+	struct disk_inode z;
+
+	if (used >= raw)
+		return 0;
+	memset(&z, '\0', sizeof(z));
+	for (i = 0; i < NUM_EXTENTS; i++)
+		z.e[i].start = z.e[i].size = -1;
+	struct zip_header *h = calloc(used, bs);
+	char *in = malloc(len);
+	char *out = malloc(len);
+	if ((h == NULL) || (in == NULL) || (out == NULL) ||
+	    (zip_extend(&z, used, ino->e[0].start) == -1))
+		goto out;
+
+	h->cluster = cluster;
+	h->count = count;
+	for (c = 0; c < count; c++) {
+		bytes = (ino->size - c * len < len)? ino->size - c * len: len;
+		blocks = (bytes + bs - 1) / bs;
+		for (i = 0; i < blocks; i++)
+			if (file_read(fs, ino, in + i * bs, c * cluster + i) != 1)
+				goto out;
+		/* tiene que ahorrar por lo menos un bloque */
+		n = lz_compress(in, bytes, out, (size_t) (blocks - 1) * bs);
+		if (n == 0)
+			memcpy(out, in, (size_t) blocks * bs);
+		else
+			memset(out + n, '\0', (size_t) blocks * bs - n);
+		need = (n == 0)? blocks: (n + bs - 1) / bs;
+		if ((used + need >= raw) || /* ya no ahorra nada */
+		    (zip_extend(&z, need, 0) == -1))
+			goto out;
+		for (i = 0; i < need; i++)
+			if (file_write(fs, &z, out + i * bs, used + i) != 1)
+				goto out;
+		zip_map(h)[c].block = used;
+		zip_map(h)[c].len = n;
+		used += need;
 	}
-	
-	
-	if (!rename_valid(oldpath, newpath)) {
-		printf("%s to %s: Permision denied\n", oldpath, newpath);
-		return -1;	
+	for (i = 0; i < zip_map_blocks(fs, count); i++)
+		if (file_write(fs, &z, (char *) h + i * bs, i) != 1)
+			goto out;
+
+	zip_switch(fd, &z);
+	file_written(fd, 0, used - 1);
+	free(h);
+	free(in);
+	free(out);
+	return 1;
+out:
+	for (i = 0; (i < NUM_EXTENTS) && (z.e[i].start != -1); i++)
+		alloc_release(fs, z.e[i].start, z.e[i].size);
+	free(h);
+	free(in);
+	free(out);
+	return 0;
+}
+
+/* Cuantos bloques seguidos desde block (de datos) son iguales que los del
+ * fichero desde pos (hasta end): misma huella, ocupados, con sitio para
+ * otra referencia y, comparándolos, con los mismos datos. fp y data
+ * empiezan en el bloque first del fichero
+ */
+static int dedup_match(struct disk_inode *ino, struct fingerprint *fp,
+		       char *data, int first, int end, int pos, int block)
+{
+	int bs = fs->sb.block_size;
+	char buffer[bs];
+	int len;
+
+	for (len = 0; pos + len < end; len++) {
+		int b = block + len;
+		if ((b >= fs->dedup->blocks) || !bitmap_get(fs, b) ||
+		    (fs->refcount[b] == MAX_REFCOUNT) ||
+		    (b == file_block(ino, pos + len)) ||
+		    !fp_equal(&fs->dedup->fp[b], &fp[pos + len - first]))
+			break;
+		if ((data_read(fs, buffer, b) != 1) ||
+		    memcmp(buffer, data + (size_t) (pos + len - first) * bs, bs))
+			break;
 	}
-	/* ahora ya podemos proceder a mover el archivo */
 
-	char old[strlen(oldpath)+1];
-	char new[strlen(newpath)+1];
-	
-	strcpy(old, oldpath);
-	strcpy(new, newpath);
-	
-	/* para mirar los padres */
-	struct disk_inode ino_father;
-	int inode_father;
-	char *aux = rindex(new+1, '/');
-	if (aux == NULL) {
-		inode_father = fs->sb.root_inode;
-		ino_father = fs->root; 
-	} else {
-		*aux = '\0';
-		if ((inode_father = namei(fs, &fs->root, new)) == -1) {
-			printf("%s: No such directory\n",new);
-			return -1;
+	return len;
+}
+
+/* Comparte los bloques first a last del inodo con bloques iguales que ya
+ * estén en el índice: solo se leen y se calculan las huellas de esos. Los
+ * extents nuevos se sacan por trozos: los bloques que coinciden seguidos
+ * con un trozo del índice se cambian por él y los demás se quedan donde
+ * estaban. Con NUM_EXTENTS extents no se puede compartir bloque a bloque:
+ * si no sale en NUM_EXTENTS trozos se deja como estaba
+ *
+ * Devuelve cuantos bloques dejó de usar el fichero (o -1 si hubo error)
+ */
+static int dedup_inode(struct disk_inode *ino, int inode_num, int first,
+		       int last, struct mfs_dedup_stats *st)
+{
+	int bs = fs->sb.block_size;
+	int n = file_blocks(ino);
+	struct extent piece[NUM_EXTENTS];
+	bool shared[NUM_EXTENTS];
+	int i, j, k, p, len, off, pieces = 0, saved = 0;
+	struct timespec t0, t1;
+
+	if (last >= n)
+		last = n - 1;
+	if ((fs->dedup == NULL) || (first < 0) || (first > last) ||
+	    is_dir(ino->is_dir) ||
+	    (file_holes(ino) > 0)) /* los trozos solo salen sin huecos */
+		return 0;
+
+	int count = last - first + 1;
+	char *data = malloc((size_t) count * bs);
+	struct fingerprint *fp = malloc(count * sizeof(struct fingerprint));
+	if ((data == NULL) || (fp == NULL)) {
+		free(data);
+		free(fp);
+		errno = ENOMEM;
+		return -1;
+	}
+	struct iovec iov = {data, 0};
+	for (i = 0, off = 0; (i < NUM_EXTENTS) && (ino->e[i].start != -1);
+	     off += ino->e[i++].size) {
+		int from = (first > off)? first: off;
+		int to = (last + 1 < off + ino->e[i].size)? last + 1: off + ino->e[i].size;
+		if (from >= to)
+			continue;
+		iov.iov_len = (size_t) (to - from) * bs;
+		if (block_readv(fs->dev, &iov, 1,
+				data_offset(fs) + ino->e[i].start + from - off)
+		    != iov.iov_len) {
+			saved = -1;
+			goto out;
 		}
-		inode_read(fs, &ino_father, inode_father);
+		iov.iov_base += iov.iov_len;
 	}
-	
-	if (add_entry_to_inode(fs, &ino_father, inode, catch_name((char *) newpath), inode_father) != 0) {/* POR EL WARNING */
-		return -1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (k = 0; k < count; k++)
+		murmur3_128(data + (size_t) k * bs, bs, 0, fp[k].h);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	if (st != NULL) {
+		st->blocks += count;
+		st->hash_time += (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
 	}
-	
-	aux = rindex(old+1, '/');
-	if (aux == NULL) {
-		ino_father = fs->root; 
-	} else {
-		*aux = '\0';
-		if ((inode_father = namei(fs, &fs->root, old)) == -1) {
-			printf("%s: No such directory\n",old);
-			return -1;
+
+	/* los trozos: compartidos o de bloques propios seguidos (fuera de
+	 * first..last solo puede haber de los propios) */
+	for (p = 0; p < n; p += len) {
+		if (pieces == NUM_EXTENTS)
+			goto index;
+		int own = file_block(ino, p);
+		int b = -1;
+		len = 0;
+		if ((p >= first) && (p <= last) &&
+		    ((b = dedup_lookup(fs->dedup, &fp[p - first])) != -1))
+			len = dedup_match(ino, fp, data, first, last + 1, p, b);
+		shared[pieces] = (len > 0);
+		if (len == 0) {
+			b = own;
+			for (len = 1; (p + len < n) &&
+				     (file_block(ino, p + len) == own + len); len++) {
+				if ((p + len < first) || (p + len > last))
+					continue;
+				j = dedup_lookup(fs->dedup, &fp[p + len - first]);
+				if ((j != -1) &&
+				    (dedup_match(ino, fp, data, first, last + 1,
+						 p + len, j) > 0))
+					break; /* empieza un trozo compartido */
+			}
 		}
-		inode_read(fs, &ino_father, inode_father);
+		piece[pieces].start = b;
+		piece[pieces++].size = len;
 	}
-	/* borramos una entrada */
-	int value = del_entry_of_inode(fs, &ino_father, catch_name((char *) oldpath)); /* POR EL WARNING */
-		
-	return value;
+	for (i = 0; i < pieces; i++)
+		if (shared[i])
+			break;
+	if (i == pieces) /* nada que compartir */
+		goto index;
+
+	/* primero las referencias nuevas, luego se sueltan los bloques que
+	 * ya no usa (si un trozo compartido es suyo, así no se pierde). Si un
+	 * bloque ya no admite más referencias (otro trozo lo llevó a
+	 * MAX_REFCOUNT) ese trozo se queda con sus bloques, si están seguidos */
+	struct disk_inode old = *ino;
+	for (i = 0, p = 0; i < pieces; p += piece[i++].size)
+		for (j = 0; shared[i] && (j < piece[i].size); j++) {
+			if (data_block_get(fs, piece[i].start + j) != -1)
+				continue;
+			while (j-- > 0)
+				data_block_put(fs, piece[i].start + j);
+			shared[i] = false;
+			for (k = 1; (k < piece[i].size) &&
+				     (file_block(ino, p + k) == file_block(ino, p) + k); k++)
+				;
+			if (k == piece[i].size) {
+				piece[i].start = file_block(ino, p);
+				continue;
+			}
+			/* no: se deja todo como estaba */
+			while (i-- > 0)
+				for (j = 0; shared[i] && (j < piece[i].size); j++)
+					data_block_put(fs, piece[i].start + j);
+			goto index;
+		}
+	for (i = 0; i < NUM_EXTENTS; i++)
+		ino->e[i].start = ino->e[i].size = -1;
+	for (i = 0; i < pieces; i++)
+		ino->e[i] = piece[i];
+	inode_write(fs, ino, inode_num);
+	for (i = 0, p = 0; i < pieces; p += piece[i++].size)
+		for (j = 0; shared[i] && (j < piece[i].size); j++, saved++)
+			data_block_put(fs, file_block(&old, p + j));
+	if (st != NULL)
+		st->shared += saved;
+
+index:
+	for (k = first; k <= last; k++)
+		dedup_set(fs, file_block(ino, k), &fp[k - first]);
+	bitmap_write(fs);
+out:
+	free(data);
+	free(fp);
+	return saved;
 }
 
+/* Reserva la tabla de huellas, o una más grande si mfs_resize dejó corta
+ * la que había. Con tabla los ficheros se deduplican al cerrarlos
+ */
+static int dedup_table(struct file_system *fs)
+{
+	int per = fp_per_block(fs);
+	int need = (fs->sb.num_data_blocks + per - 1) / per;
+	int old = fs->sb.dedup_blocks, old_start = fs->sb.dedup_start;
+	int i, start;
 
-struct mfs_dir {
-        int next;
-        int num_block;
-        int num_extent;
-	struct dirent dirent;
-	struct disk_inode d;
-};
+	if (old >= need)
+		return 0;
+	start = catch_block_together(fs, need, 0);
+	if ((start == -1) || (alloc_run(fs, start, need) == -1)) {
+		errno = ENOSPC;
+		return -1;
+	}
+	fs->sb.dedup_start = start;
+	fs->sb.dedup_blocks = need;
+	sb_write(fs->dev, &fs->sb);
+	for (i = 0; i < old; i++)
+		bitmap_clear(fs, old_start + i);
+	bitmap_write(fs);
 
-MFS_DIR *mfs_opendir(const char *name)
+	if (fs->dedup == NULL) /* nueva: se escribe entera a ceros */
+		return dedup_load(fs, false);
+	/* lo que hay en memoria vale: se escribe entero en la nueva */
+	char *dirty = realloc(fs->dedup->dirty, need);
+	if (dirty == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	memset(dirty, 1, need);
+	fs->dedup->dirty = dirty;
+	fs->dedup->entries = fs->dedup->blocks;
+	return dedup_flush(fs);
+}
+
+/* true si los len bytes de buf son cero. Con SSE2 se miran 64 bytes por
+ * vuelta (OR de cuatro registros y una comparación) y se sale en cuanto
+ * aparece algo, así un bloque con datos cuesta poco más que su principio
+ */
+static bool is_zero(const void *buf, size_t len)
 {
-	fs_init();
-	int inodo = namei(fs, &fs->root, name);
-	if (inodo == -1) {
-		errno = ENOENT;
-		return NULL;
+	const unsigned char *p = buf;
+	size_t i = 0;
+	uint64_t w;
+
+#if defined(__x86_64__)
+	const __m128i zero = _mm_setzero_si128();
+	for (; i + 64 <= len; i += 64) {
+		__m128i v = _mm_or_si128(
+			_mm_or_si128(_mm_loadu_si128((const __m128i *) (p + i)),
+				     _mm_loadu_si128((const __m128i *) (p + i + 16))),
+			_mm_or_si128(_mm_loadu_si128((const __m128i *) (p + i + 32)),
+				     _mm_loadu_si128((const __m128i *) (p + i + 48))));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xffff)
+			return false;
 	}
-	
-	MFS_DIR *dir = malloc(sizeof(MFS_DIR));
-	if (dir == NULL)
-		return NULL;
-		
-	inode_read(fs, &dir->d, inodo);
-	if (!is_dir(dir->d.is_dir)) {
-		free(dir);
-		errno = ENOTDIR;
-		return NULL;
+#endif
+	for (; i + sizeof(w) <= len; i += sizeof(w)) {
+		memcpy(&w, p + i, sizeof(w));
+		if (w != 0)
+			return false;
 	}
-		
-	printf("inodo %d\n", inodo);
-	dir->next       = 0;
-	dir->num_block  = 0;
-	dir->num_extent = 0;
+	for (; i < len; i++)
+		if (p[i] != 0)
+			return false;
 
-	return dir;
+	return true;
 }
 
-struct dirent *mfs_readdir(MFS_DIR *dir)
+/* Escribe ceros en n bloques de datos seguidos desde start */
+static int zero_blocks(int start, int n)
 {
-	char block[fs->sb.block_size];
-	struct entry *entry;
-	/* Empezamos desde el principio */
-	for (; dir->num_extent < NUM_EXTENTS; dir->num_extent++) {
-		if (dir->d.e[dir->num_extent].start == -1)
-			break;
-
-		for (; dir->num_block < dir->d.e[dir->num_extent].size; dir->num_block++) {
-			data_read(fs, block, dir->d.e[dir->num_extent].start+dir->num_block);
-			entry = ((void *) block) + dir->next;
-			while (entry->next != -1) {
-				if ((entry->busy != -1) && (entry->inode != -1)) {/* tenemos entrada valida */
-//dir->dirent.d_ino = entry->inode != -1;
-					strcpy(dir->dirent.d_name, entry->name);
-					dir->next += entry->next;
-					entry = ((void *) block) + dir->next;
+	int bs = fs->sb.block_size;
+	int chunk = (n < 64)? n: 64;
+	char *zero = calloc(chunk, bs);
+	struct iovec iov;
+	int done;
+
+	if (zero == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	iov.iov_base = zero;
+	for (done = 0; done < n; done += chunk) {
+		if (chunk > n - done)
+			chunk = n - done;
+		iov.iov_len = (size_t) chunk * bs;
+		if (block_writev(fs->dev, &iov, 1, data_offset(fs) + start + done)
+		    != iov.iov_len) {
+			free(zero);
+			errno = EIO;
+			return -1;
+		}
+	}
+	free(zero);
+	return 0;
+}
 
-					return &dir->dirent;
-				}
-				dir->next += entry->next;
-				entry = ((void *) entry) + entry->next; /* avanzamos el trozo necesario */	
+/* Da bloques a los n bloques del hueco e[i] que empiezan en a (relativo al
+ * hueco). Si son los primeros y los que siguen al extent anterior en disco
+ * están libres se alarga ese extent; si no, el hueco se parte en tres
+ * (hueco, bloques, hueco). Si no quedan extents para partirlo se le dan
+ * bloques al hueco entero y se llenan de ceros
+ *
+ * En block deja el bloque de datos que le tocó al primero de los n
+ */
+static int hole_split(struct disk_inode *ino, int inode_num, int i, int a,
+		      int n, int *block)
+{
+	struct extent *h = &ino->e[i];
+	int left = a, right = h->size - a - n;
+	int used = extent_count(ino);
+	int extra = (left > 0) + (right > 0);
+	int goal = extent_goal(ino, i, inode_num);
+	int b, got, k;
+
+	if ((a == 0) && (i > 0) && !is_hole(ino->e[i-1])) {
+		b = ino->e[i-1].start + ino->e[i-1].size;
+		got = (b < fs->sb.num_data_blocks)? alloc_at(fs, b, n): 0;
+		if (got == n) {
+			ino->e[i-1].size += n;
+			if ((h->size -= n) == 0) { /* el hueco desaparece */
+				for (k = i; k < NUM_EXTENTS - 1; k++)
+					ino->e[k] = ino->e[k+1];
+				ino->e[NUM_EXTENTS-1].start = ino->e[NUM_EXTENTS-1].size = -1;
 			}
-			dir->next = 0;
+			*block = b;
+			return 0;
 		}
-		dir->num_block = 0;
+		alloc_release(fs, b, got);
 	}
-	
-	return NULL;
+
+	if (used + extra <= NUM_EXTENTS) {
+		b = catch_block_together(fs, n, goal);
+		if ((b == -1) || (alloc_run(fs, b, n) == -1)) {
+			errno = ENOSPC;
+			return -1;
+		}
+		for (k = NUM_EXTENTS - 1; k > i + extra; k--)
+			ino->e[k] = ino->e[k - extra];
+		if (left > 0) {
+			h->size = left;
+			h++;
+		}
+		h->start = b;
+		h->size = n;
+		if (right > 0) {
+			h[1].start = EXTENT_HOLE;
+			h[1].size = right;
+		}
+		*block = b;
+		return 0;
+	}
+
+	/* no quedan extents: el hueco entero pasa a tener bloques */
+	b = catch_block_together(fs, h->size, goal);
+	if ((b == -1) || (alloc_run(fs, b, h->size) == -1)) {
+		errno = ENOSPC;
+		return -1;
+	}
+	if (zero_blocks(b, h->size) == -1) {
+		alloc_release(fs, b, h->size);
+		return -1;
+	}
+	h->start = b;
+	*block = b + a;
+	return 0;
 }
 
-int mfs_closedir(MFS_DIR *dir)
+/* El fichero va a llegar hasta el bloque first sin que se escriba lo que
+ * hay entre su final y first. Lo que se cogió de más por detrás del final
+ * no está a ceros y se suelta, y lo de en medio se deja como un hueco (o,
+ * si no quedan extents, se llena de bloques a ceros)
+ *
+ * Devuelve 1 si cambió los extents del inodo
+ */
+static int hole_gap(int fd, int first)
 {
-	free(dir);
+	struct disk_inode *ino = &fs->file[fd].ino;
+	int bs = fs->sb.block_size;
+	char block[bs];
+	int i, n, k, b, len, changed = 0;
 
-	return 0;
+	if (file_truncate_blocks(ino, (ino->size + bs - 1) / bs) > 0) {
+		bitmap_write(fs);
+		changed = 1;
+	}
+	if ((ino->size % bs != 0) &&
+	    ((b = file_block(ino, ino->size / bs)) >= 0)) {
+		data_read(fs, block, b);
+		memset(block + ino->size % bs, '\0', bs - ino->size % bs);
+		data_write(fs, block, b);
+	}
+	n = file_blocks(ino);
+	i = extent_count(ino);
+	if (first <= n)
+		return changed;
+	if ((i > 0) && is_hole(ino->e[i-1]) && (i < NUM_EXTENTS))
+		ino->e[i-1].size += first - n;
+	else if (i + 2 <= NUM_EXTENTS) {
+		ino->e[i].start = EXTENT_HOLE;
+		ino->e[i].size = first - n;
+	} else { /* sin extents para el hueco: bloques a ceros */
+		if (file_alloc(fd, first) < first) {
+			errno = ENOSPC;
+			return -1;
+		}
+		for (k = n; k < first; k += len) {
+			b = file_block(ino, k);
+			for (len = 1; (k + len < first) &&
+				     (file_block(ino, k + len) == b + len); len++)
+				;
+			if (zero_blocks(b, len) == -1)
+				return -1;
+		}
+	}
+
+	return 1;
 }
 
-static int sb_init(struct file_system *fs, int num_blocks,
-		   int percent_inodes)
+/* Antes de escribir count bytes en la posición de fd. Si se escribe más
+ * allá del final lo de en medio será un hueco (hole_gap) y los huecos que
+ * pisa la escritura pasan a tener bloques. Así write_blocks solo ve bloques
+ */
+static int hole_prepare(int fd, size_t count)
 {
-	fs->sb.block_size = block_get_block_size(fs->dev);
-	fs->sb.num_inodes = num_blocks * percent_inodes/100;
+	struct file *f = &fs->file[fd];
+	struct disk_inode *ino = &f->ino;
+	int bs = fs->sb.block_size;
+	int first = f->pos / bs, last = (f->pos + count - 1) / bs;
+	int i, b, a, len, start, changed = 0;
 
-	fs->sb.num_bitmap = num_blocks
-		- 1 /* super_block */
-		- fs->sb.num_inodes; /* blocks used by inodes */
-	fs->sb.num_bitmap = fs->sb.num_bitmap + fs->sb.block_size - 1;
-	fs->sb.num_bitmap = fs->sb.num_bitmap / fs->sb.block_size;
+	if (count == 0)
+		return 0;
+	if ((f->pos > ino->size) && ((changed = hole_gap(fd, first)) == -1))
+		return -1;
 
-	fs->sb.num_data_blocks = num_blocks - fs->sb.num_inodes
-		- fs->sb.num_bitmap - 1;
+	/* escribir por la mitad de un bloque que no existe: se coge a ceros */
+	if ((f->pos % bs != 0) && (file_blocks(ino) <= first)) {
+		if (file_alloc(fd, first + 1) < first + 1) {
+			errno = ENOSPC;
+			return -1;
+		}
+		if (zero_blocks(file_block(ino, first), 1) == -1)
+			return -1;
+	}
 
-	fs->sb.root_inode = 0;
-	fs->sb.dirty = false;
-	return sb_write(fs->dev, &(fs->sb));
+	/* los huecos que pisa la escritura */
+again:
+	for (i = 0, start = 0; (i < NUM_EXTENTS) && (ino->e[i].start != -1);
+	     start += ino->e[i++].size) {
+		if (!is_hole(ino->e[i]) || (start + ino->e[i].size <= first) ||
+		    (start > last))
+			continue;
+		a = (first > start)? first: start;
+		len = ((last < start + ino->e[i].size)? last + 1:
+		       start + ino->e[i].size) - a;
+		if (hole_split(ino, f->num, i, a - start, len, &b) == -1)
+			return -1;
+		/* los bloques de los bordes que no se escriben enteros, a ceros */
+		if ((a * bs < f->pos) && (zero_blocks(b, 1) == -1))
+			return -1;
+		if (((a + len) * bs > f->pos + count) &&
+		    (zero_blocks(b + len - 1, 1) == -1))
+			return -1;
+		bitmap_write(fs);
+		changed = 1;
+		goto again;
+	}
+
+	if (changed)
+		inode_write(fs, ino, f->num);
+	return 0;
 }
 
-static int bitmap_init(struct file_system *fs)
+/* SEEK_DATA y SEEK_HOLE: la primera posición desde offset que tiene datos
+ * (data) o que está en un hueco. El final del fichero cuenta como hueco
+ *
+ * Devuelve -1 (ENXIO) si offset está más allá del final o no hay más datos
+ */
+static off_t hole_seek(int fd, off_t offset, bool data)
 {
-	int size = block_get_block_size(fs->dev);
-	char *block = malloc(size);
+	struct disk_inode *ino = &fs->file[fd].ino;
+	off_t pos = 0, end;
 	int i;
 
-	if (block == NULL)
-		return -ENOMEM;
+	if ((offset < 0) || (offset >= ino->size)) {
+		errno = ENXIO;
+		return -1;
+	}
+	if (ino->flags & (INODE_INLINE | INODE_ZIP)) /* no tienen huecos */
+		return (data)? offset: ino->size;
+
+	for (i = 0; (i < NUM_EXTENTS) && (ino->e[i].start != -1); i++) {
+		end = pos + (off_t) ino->e[i].size * fs->sb.block_size;
+		if ((end > offset) && (is_hole(ino->e[i]) != data))
+			break;
+		pos = end;
+	}
+	/* detrás de los extents solo puede estar la cola */
+	if ((i == NUM_EXTENTS) || (ino->e[i].start == -1))
+		if (!data || !(ino->flags & INODE_TAIL))
+			pos = ino->size;
+	if (pos < offset)
+		pos = offset;
+	if (data && (pos >= ino->size)) {
+		errno = ENXIO;
+		return -1;
+	}
+
+	return (pos > ino->size)? ino->size: pos;
+}
+
+/* Lee el bloque n del extent e: si es un hueco no hay nada que leer */
+static int extent_read(struct file_system *fs, void *buffer,
+		       struct extent *e, int n)
+{
+	if (is_hole(*e)) {
+		memset(buffer, '\0', fs->sb.block_size);
+		return 1;
+	}
+	return data_read(fs, buffer, e->start + n);
+}
+
+/* Dado un fd lee count bytes y los almacena en buf */
+/* Función creo que acabada
+ * Lee trocitos de bloque
+ * Se mueve por los extents
+ * No se pasa leyendo si mandas leer más de lo que tiene el fichero
+ */
+static int read_data_block(int fd, void *buf, size_t count)
+{
+	int pos_block;
+	int extent;
+	if (fs->file[fd].ino.flags & INODE_INLINE)
+		return inline_read(fd, buf, count);
+	if (fs->file[fd].ino.flags & INODE_ZIP)
+		return zip_read(fd, buf, count);
+	if (fs->file[fd].ino.flags & INODE_TAIL) {
+		/* lo que haya antes de la cola se lee normal */
+		int tail = fs->file[fd].ino.size / fs->sb.block_size * fs->sb.block_size;
+		if (fs->file[fd].pos >= tail)
+			return tail_read(fd, buf, count);
+		if (fs->file[fd].pos + count > tail) {
+			int n = read_data_block(fd, buf, tail - fs->file[fd].pos);
+			if (n <= 0)
+				return n;
+			return n + tail_read(fd, buf + n, count - n);
+		}
+	}
+
+	if (fs->file[fd].pos >= fs->file[fd].ino.size)
+		return 0;
+	switch (where_is_it(fd, &pos_block, &extent)) {
+		case 0:  return 0;
+		case -1: return -1;
+
+	};
+
+	/* Lo actualizamos para no leer mas de lo que debemos */
+	count = (count > (fs->file[fd].ino.size-fs->file[fd].pos) )? fs->file[fd].ino.size - fs->file[fd].pos: count;
+	
+	/* nos ponemos a leer */
+	int start = fs->file[fd].pos; /* si algo falla se vuelve aquí */
+	int read = 0;
+	void *buffer = buf;
+	char block[fs->sb.block_size];
+	int delay = fs->file[fd].pos % fs->sb.block_size; /* desfase */
+
+	/* tenemos tres casos */
+	/* 1.- Empezar a leer por el medio del bloque */
+	if ( delay != 0) {
+		if (pos_block == fs->file[fd].ino.e[extent].size) { /* where_is_it nos deja al final del extent anterior */
+			extent++;
+			pos_block = 0;
+		}
+		extent_read(fs, block, &fs->file[fd].ino.e[extent], pos_block);
+		memcpy(buffer, block + delay, (count > fs->sb.block_size - delay)? fs->sb.block_size - delay: count);
+		read = (count > fs->sb.block_size - delay)? fs->sb.block_size - delay: count;
+		fs->file[fd].pos += read;
+		pos_block++;
+		buffer += read;
+	}
+
+	/* 2.- Leer bloques de datos completos */
+	int num_block = (count-read) / fs->sb.block_size;
+	int i;	
+	for (i = 0; i < num_block; i++) {
+		if (pos_block == fs->file[fd].ino.e[extent].size) { /* Es que tenemos que cambiar de extent */
+			extent++;
+			pos_block = 0;
+		}
+		if (is_hole(fs->file[fd].ino.e[extent]))
+			memset(buffer, '\0', fs->sb.block_size);
+		else if (data_queue(fs, buffer, fs->file[fd].ino.e[extent].start + pos_block,
+				    false) < 0) /* se piden todos sin esperar */
+			break; /* data_wait da el error */
+		buffer += fs->sb.block_size;/* para no escribir siempre lo mismo */
+		pos_block++;
+		read += fs->sb.block_size;
+		fs->file[fd].pos += fs->sb.block_size;
+	}
+	if (data_wait(fs) == -1) {
+		fs->file[fd].pos = start;
+		return -1;
+	}
+	
+	/* 3.- Leer un trocito del final */
+	if (read < count) {
+		if (pos_block == fs->file[fd].ino.e[extent].size) { /* Es que tenemos que cambiar de extent */
+			extent++;
+			pos_block = 0;
+		}
+		extent_read(fs, block, &fs->file[fd].ino.e[extent], pos_block);
+		memcpy(buffer, (void *) block, count-read);
+		fs->file[fd].pos += (count-read);
+		read += (count-read);
+	}
+
+	return read;	
+}
+
+/* Escribe en un fichero fd, count bytes de lo que hay en buf despues de pos */
+int mfs_read(int fd, void *buf, size_t count)
+{
+	if (rpc_client())
+		return rpc_read(fd, buf, count);
+	if (fd < 0 || fd >= NUM_FILES)
+		return -1;
+	if (fs->file[fd].num == -1) {
+		printf("Trying to read unopened fd\n");
+		return -1;
+	}
+	if (wbuf_flush(fd) == -1) /* lo que haya en el buffer tiene que verse */
+		return -1;
+	
+	return read_data_block(fd, buf, count);
+}
+
+/* Dado un fd escribe count bytes de buf */
+/* Falta asignación de bloques
+ * Lee trocitos de bloque
+ * Se mueve por los extents
+ */
+static int write_blocks(int fd, void *buf, size_t count)
+{
+	int pos_block;
+	int extent;
+	if (hole_prepare(fd, count) == -1)
+		return -1;
+
+	if (where_is_it(fd, &pos_block, &extent) == -1) {
+		return -1;
+	}
+	if (count == 0)
+		return 0;
+	if (file_unshare(fd, fs->file[fd].pos / fs->sb.block_size,
+			 (fs->file[fd].pos + count - 1) / fs->sb.block_size) == -1)
+		return -1;
+	file_written(fd, fs->file[fd].pos / fs->sb.block_size,
+		     (fs->file[fd].pos + count - 1) / fs->sb.block_size);
+	
+	/* Escritura que no asigna bloques */
+	/*tres casos*/
+	int start = fs->file[fd].pos; /* si algo falla se vuelve aquí */
+	int write = 0;
+	void *buffer = buf;
+	char block[fs->sb.block_size];
+	int delay = fs->file[fd].pos % fs->sb.block_size; /* desfase */
+	/* 1.- Empezar a escribir por el medio del bloque */ /* lo bueno es que este bloque siempre está asignado */
+	if (delay != 0) {
+		if (pos_block == fs->file[fd].ino.e[extent].size) { /* where_is_it nos deja al final del extent anterior */
+			extent++;
+			pos_block = 0;
+		}
+		/* Leemos el bloque que tenemos que escribir */
+		data_read(fs, (void *) block, fs->file[fd].ino.e[extent].start+pos_block);
+		/* modificamos el trozo en el bloque */
+		memcpy(((void *) block)+delay, buffer, (count > fs->sb.block_size - delay)? fs->sb.block_size - delay: count);
+		/* escribirmos en bloque en disco */
+		data_write(fs, (void *) block, fs->file[fd].ino.e[extent].start+pos_block);
+		write = (count > fs->sb.block_size - delay)? fs->sb.block_size - delay: count;
+		fs->file[fd].pos += write;
+		pos_block++;
+		buffer += write;
+	}
+	
+	/* 2.- Escribir bloques de datos completos */
+	int num_block = (count-write) / fs->sb.block_size;
+	int i;
+	for (i = 0; i < num_block; i++) {
+		if ((pos_block == fs->file[fd].ino.e[extent].size) &&
+		    (extent + 1 < NUM_EXTENTS) &&
+		    (fs->file[fd].ino.e[extent + 1].start != -1)) {
+			/* sobrescribiendo: seguimos en el extent siguiente */
+			extent++;
+			pos_block = 0;
+		} else if (pos_block == fs->file[fd].ino.e[extent].size) {
+			/* al crecer se puede mover el extent: lo que va a él
+			 * tiene que estar ya escrito */
+			if (data_wait(fs) == -1) {
+				fs->file[fd].pos = start;
+				return -1;
+			}
+			/* intentamos alargar el extent */
+			if (block_grow(&fs->file[fd].ino, count-write, fs->file[fd].num) == -1) {
+				/* no se pudo alargar el extent... pues a por uno nuevo */
+				if (extent_grow(&fs->file[fd].ino, count-write, fs->file[fd].num) == -1)
+					return (write == 0)? -1: write;
+
+				extent++;/* empezamos en el siguiente extent */
+				pos_block = 0; /* y en el primer bloque del siguiente */
+			}
+		}
+		/* se mandan todos sin esperar */
+		if (data_queue(fs, buffer, fs->file[fd].ino.e[extent].start+pos_block, true) < 0)
+			break; /* data_wait da el error */
+		buffer += fs->sb.block_size;/* para no escribir siempre lo mismo */
+		pos_block++;
+		write += fs->sb.block_size;
+		fs->file[fd].pos += fs->sb.block_size;
+	}
+	if (data_wait(fs) == -1) {
+		fs->file[fd].pos = start;
+		return -1;
+	}
+
+	/* 3.- Escribir un trocito del final */
+	if (write < count) {
+		if ((pos_block == fs->file[fd].ino.e[extent].size) &&
+		    (extent + 1 < NUM_EXTENTS) &&
+		    (fs->file[fd].ino.e[extent + 1].start != -1)) {
+			/* sobrescribiendo: seguimos en el extent siguiente */
+			extent++;
+			pos_block = 0;
+		} else if (pos_block == fs->file[fd].ino.e[extent].size) {
+			/* intentamos alargar el extent */
+			if (block_grow(&fs->file[fd].ino, count-write, fs->file[fd].num) == -1) {
+				/* no se pudo alargar el extent... pues a por uno nuevo */
+				if (extent_grow(&fs->file[fd].ino, count-write, fs->file[fd].num) == -1)
+					return (write == 0)? -1: write;
+
+				extent++;/* empezamos en el siguiente extent */
+				pos_block = 0; /* y en el primer bloque del siguiente */
+			}
+		}
+		/* Leemos el bloque */
+		data_read(fs, (void *) block, fs->file[fd].ino.e[extent].start+pos_block);
+		/* metemos solo el trozo que nos interesa */
+		memcpy((void *)block, buffer, count-write);
+		/* lo escribimos en disco */
+		data_write(fs, (void *) block, fs->file[fd].ino.e[extent].start+pos_block);
+		fs->file[fd].pos += (count-write);
+		write += (count-write);
+	}
+	
+	if (fs->file[fd].pos > fs->file[fd].ino.size) /* sobrescribir no lo alarga */
+		fs->file[fd].ino.size = fs->file[fd].pos;
+	return write;
+}
+
+/* Cuantos bytes desde buf van juntos en la escritura de fd: o bloques
+ * enteros a ceros que caen donde el fichero no tiene bloque de datos (un
+ * hueco o detrás del final), que no hace falta escribir (zero = true), o
+ * todo lo demás hasta el siguiente de esos. Detrás del final solo si queda
+ * sitio para el hueco y para otro extent detrás: con NUM_EXTENTS extents
+ * un hueco de más puede dejar al fichero sin poder crecer
+ */
+static size_t zero_run(int fd, char *buf, size_t count, bool *zero)
+{
+	struct file *f = &fs->file[fd];
+	int bs = fs->sb.block_size;
+	int i = extent_count(&f->ino), b;
+	bool room = (i + 2 <= NUM_EXTENTS) || ((i > 0) && is_hole(f->ino.e[i-1]));
+	size_t n = 0, len;
+	bool z;
+
+	/* el trozo hasta el primer límite de bloque se escribe siempre */
+	if (f->pos % bs != 0)
+		n = (count < bs - f->pos % bs)? count: bs - f->pos % bs;
+	*zero = false;
+	while (n < count) {
+		len = (count - n < bs)? count - n: bs;
+		z = (len == bs) && is_zero(buf + n, bs) &&
+			(((b = file_block(&f->ino, (f->pos + n) / bs)) == EXTENT_HOLE) ||
+			 ((b == -1) && room));
+		if ((n == 0) && z)
+			*zero = true;
+		if (z != *zero)
+			break;
+		n += len;
+	}
+
+	return n;
+}
+
+/* Dado un fd escribe count bytes de buf. Los bloques enteros a ceros que no
+ * tienen bloque de datos no se escriben: se quedan como huecos
+ */
+static int write_data_block(int fd, void *buf, size_t count)
+{
+	struct file *f = &fs->file[fd];
+	size_t done = 0, n;
+	int write;
+	bool zero;
+
+	if (f->ino.flags & INODE_INLINE) {
+		if (f->pos + count <= INLINE_SIZE)
+			return inline_write(fd, buf, count);
+		/* si se escribe más allá del final lo de en medio será hueco */
+		if (inline_promote(fd, (f->pos > f->ino.size)? f->ino.size + 1:
+				   f->pos + count) == -1)
+			return -1;
+	}
+	if (tail_unpack(fd) == -1)
+		return -1;
+	f->written = true;
+	if (f->ino.flags & INODE_ZIP)
+		return zip_write(fd, buf, count);
+	if (count == 0)
+		return 0;
+
+	while (done < count) {
+		n = zero_run(fd, buf + done, count - done, &zero);
+		if (zero) {
+			f->pos += n;
+			done += n;
+			continue;
+		}
+		write = write_blocks(fd, buf + done, n);
+		if (write > 0)
+			done += write;
+		if (write != n)
+			return (done == 0)? -1: done;
+	}
+
+	/* si acaba en ceros el fichero crece con un hueco */
+	if (f->pos > f->ino.size) {
+		if (hole_gap(fd, f->pos / fs->sb.block_size) == -1) {
+			done -= f->pos - f->ino.size; /* los ceros no se quedan */
+			f->pos = f->ino.size;
+			return (done == 0)? -1: done;
+		}
+		f->ino.size = f->pos;
+	}
+
+	return done;
+}
+
+/* Escribe en un fichero fd, count bytes de lo que hay en buf despues de pos */
+int mfs_write(int fd, void *buf, size_t count)
+{
+	if (rpc_client())
+		return rpc_write(fd, buf, count);
+	if (fd < 0 || fd >= NUM_FILES)
+		return -1;
+	if (fs->file[fd].num == -1) {
+		printf("Trying to write unopened fd\n");
+		return -1;
+	}
+
+	struct file *f = &fs->file[fd];
+	if (count >= fs->sb.block_size) {/* escritura grande: va directa */
+		if (wbuf_flush(fd) == -1)
+			return -1;
+		bool clean = is_clean(fs);
+		return restore_dirty(fs, clean, write_data_block(fd, buf, count));
+	}
+
+	/* escritura pequeña: la acumulamos hasta tener el bloque completo */
+	if ((f->wbuf_len != 0) && (f->pos != f->wbuf_pos + f->wbuf_len))
+		if (wbuf_flush(fd) == -1)
+			return -1;
+	if (f->wbuf == NULL) {
+		f->wbuf = malloc(fs->sb.block_size);
+		if (f->wbuf == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+	}
+
+	/* lo que se copia al buffer ya cuenta como escrito: si luego no se
+	 * puede volcar se queda ahí y el error lo da la siguiente escritura
+	 * (o mfs_close) al intentarlo otra vez */
+	size_t done = 0;
+	while (done < count) {
+		if (f->wbuf_len == 0)
+			f->wbuf_pos = f->pos;
+		/* el buffer acaba siempre en un límite de bloque */
+		int room = fs->sb.block_size - (f->wbuf_pos % fs->sb.block_size) - f->wbuf_len;
+		if (room == 0) {
+			if (wbuf_flush(fd) == -1)
+				return (done == 0)? -1: done;
+			continue;
+		}
+		int n = (count - done > room)? room: count - done;
+		memcpy(f->wbuf + f->wbuf_len, buf + done, n);
+		f->wbuf_len += n;
+		f->pos += n;
+		done += n;
+		if (n == room)
+			wbuf_flush(fd);
+	}
+
+	return done;
+}
+
+/* Escribe en disco lo que haya acumulado en el buffer de escritura de fd
+ *
+ * Devuelve -1 si no se pudo escribir todo. Lo que no se escribió se queda
+ * en el buffer (ya se dijo que estaba escrito) para volver a intentarlo
+ */
+static int wbuf_flush(int fd)
+{
+	struct file *f = &fs->file[fd];
+	if (f->wbuf_len == 0)
+		return 0;
+
+	int pos = f->pos;
+	int len = f->wbuf_len;
+	f->pos = f->wbuf_pos;
+
+	bool clean = is_clean(fs);
+	int write = write_data_block(fd, f->wbuf, len);
+	f->pos = pos;
+
+	if (write == len) {
+		f->wbuf_len = 0;
+		return restore_dirty(fs, clean, 0);
+	}
+	if (write > 0) { /* se queda lo que falta */
+		memmove(f->wbuf, f->wbuf + write, len - write);
+		f->wbuf_pos += write;
+		f->wbuf_len -= write;
+	}
+	return restore_dirty(fs, clean, -1);
+}
+
+int mfs_fsync(int fd)
+{
+	if (rpc_client())
+		return rpc_call(RPC_FSYNC, fd, 0, 0, NULL, 0, NULL, 0);
+	if (fd < 0 || fd >= NUM_FILES)
+		return -1;
+	if (fs->file[fd].num == -1) {
+		errno = EBADF;
+		return -1;
+	}
+	if (wbuf_flush(fd) == -1)
+		return -1;
+
+	bool clean = is_clean(fs);
+	if (zip_flush(fd) == -1) /* el cluster que se está escribiendo */
+		return restore_dirty(fs, clean, -1);
+	inode_write(fs, &fs->file[fd].ino, fs->file[fd].num);
+	return restore_dirty(fs, clean, 0);
+}
+
+int mfs_close(int fd)
+{
+	if (rpc_client())
+		return rpc_call(RPC_CLOSE, fd, 0, 0, NULL, 0, NULL, 0);
+	if (fd < 0 || fd >= NUM_FILES)
+		return -1;
+	if (fs->file[fd].num == -1) {
+		printf("Trying to close unopened fd\n");
+		return -1;
+	}
+	
+	int flushed = wbuf_flush(fd);
+	free(fs->file[fd].wbuf);
+	fs->file[fd].wbuf = NULL;
+
+	bool clean = is_clean(fs);
+	if (zip_close(fd) == -1)
+		flushed = -1;
+	if (zip_pack(fd) == 0)
+		tail_pack(fd);
+	zip_release(fd);
+	if (fs->file[fd].dfirst != -1) /* deduplicación en línea */
+		dedup_inode(&fs->file[fd].ino, fs->file[fd].num,
+			    fs->file[fd].dfirst, fs->file[fd].dlast, NULL);
+	inode_write(fs, &fs->file[fd].ino, fs->file[fd].num);
+	fs->file[fd].num = -1;
+	return restore_dirty(fs, clean, flushed);
+}
+
+off_t mfs_lseek(int fd, off_t offset, int whence)
+{
+	if (rpc_client())
+		return rpc_call(RPC_LSEEK, fd, offset, whence, NULL, 0, NULL, 0);
+	if (fs_init() < 0)
+		return -1;
+
+	if (fd < 0 || fd >= NUM_FILES)
+		return -1;
+	if (fs->file[fd].num == -1) {
+		errno = EBADF;
+		return -1;
+	}
+	
+	if ((whence != SEEK_SET) && (whence != SEEK_CUR) && (whence != SEEK_END) &&
+	    (whence != SEEK_DATA) && (whence != SEEK_HOLE)){
+		errno = 	EINVAL;
+		return -1;
+	}
+	
+	bool clean = is_clean(fs);
+
+	/* el tamaño y los huecos tienen que contar lo que hay en el buffer */
+	if ((whence != SEEK_SET) && (whence != SEEK_CUR))
+		if (wbuf_flush(fd) == -1)
+			return restore_dirty(fs, clean, -1);
+	
+	off_t aux = -1;
+	if (whence == SEEK_SET) /* The offset is set to offset bytes. */
+		aux = offset;
+	
+	if (whence == SEEK_CUR)/* The offset is set to its current location plus offset bytes. */
+		aux = fs->file[fd].pos + offset;
+		
+	if (whence == SEEK_END)/* The offset is set to the size of the file plus offset bytes. */
+		aux = fs->file[fd].ino.size + offset;
+
+	if ((whence == SEEK_DATA) || (whence == SEEK_HOLE)) {
+		aux = hole_seek(fd, offset, whence == SEEK_DATA);
+		if (aux == -1)
+			return restore_dirty(fs, clean, -1);
+	}
+
+	/* se puede ir más allá del final (lo de en medio será un hueco) pero
+	 * la posición es un int */
+	if ((aux < 0) || (aux > INT_MAX)) {
+		errno = EINVAL;
+		return restore_dirty(fs, clean, -1);
+	}
+
+	/* si nos vamos de donde acaba el buffer lo volcamos */
+	if ((fs->file[fd].wbuf_len != 0) &&
+	    (aux != fs->file[fd].wbuf_pos + fs->file[fd].wbuf_len))
+		if (wbuf_flush(fd) == -1)
+			return restore_dirty(fs, clean, -1);
+
+	fs->file[fd].pos = aux;
+	return restore_dirty(fs, clean, aux);
+	
+}
+
+
+/* Copia count bytes de fd_in (desde su posición) a fd_out (desde la suya)
+ * sin pasarlos por un buffer: se asignan los bloques del destino y se
+ * copian los trozos contiguos de bloque a bloque en el dispositivo.
+ *
+ * Si las posiciones no están alineadas a bloque se copia por el camino
+ * normal de lectura/escritura.
+ *
+ * Devuelve el número de bytes copiados, 0 al final del fichero de entrada
+ */
+int mfs_copy_file_range(int fd_in, int fd_out, size_t count)
+{
+	if (rpc_client())
+		return rpc_call(RPC_COPY_RANGE, fd_in, fd_out, count, NULL, 0, NULL, 0);
+	if (fd_in < 0 || fd_in >= NUM_FILES || fd_out < 0 || fd_out >= NUM_FILES)
+		return -1;
+	if (fs->file[fd_in].num == -1 || fs->file[fd_out].num == -1) {
+		errno = EBADF;
+		return -1;
+	}
+	if (wbuf_flush(fd_in) == -1 || wbuf_flush(fd_out) == -1)
+		return -1;
+
+	struct file *in = &fs->file[fd_in];
+	struct file *out = &fs->file[fd_out];
+	int bs = fs->sb.block_size;
+
+	if (in->pos >= in->ino.size)
+		return 0;
+	if (count > in->ino.size - in->pos)
+		count = in->ino.size - in->pos;
+
+	/* la cola del origen se copia aparte */
+	int tail = in->ino.size / bs * bs;
+	if ((in->ino.flags & INODE_TAIL) && (in->pos < tail) &&
+	    (in->pos + count > tail))
+		count = tail - in->pos;
+
+	bool clean = is_clean(fs);
+	if (tail_unpack(fd_out) == -1)
+		return restore_dirty(fs, clean, -1);
+	out->written = true;
+
+	/* los huecos del origen no se copian de bloque a bloque: se para en
+	 * el primero y si se empieza en uno se lee a ceros */
+	int first_in = in->pos / bs;
+	int i, num_block = (count + bs - 1) / bs;
+	for (i = 0; i < num_block; i++)
+		if (file_block(&in->ino, first_in + i) == EXTENT_HOLE)
+			break;
+	if ((i < num_block) && (i > 0)) {
+		num_block = i;
+		count = (size_t) num_block * bs;
+	}
+
+	if ((in->ino.flags & (INODE_INLINE | INODE_ZIP)) || (i == 0) ||
+	    (out->ino.flags & (INODE_INLINE | INODE_ZIP)) ||
+	    ((in->ino.flags & INODE_TAIL) && (in->pos >= tail)) ||
+	    (in->pos % bs != 0) || (out->pos % bs != 0) ||
+	    ((out->pos + count < out->ino.size) && (count % bs != 0))) {
+		/* no alineado: copia normal a través de un bloque */
+		char block[bs];
+		int rsize = read_data_block(fd_in, block, (count > bs)? bs: count);
+		if (rsize <= 0)
+			return restore_dirty(fs, clean, rsize);
+		return restore_dirty(fs, clean, write_data_block(fd_out, block, rsize));
+	}
+
+	int first_out = out->pos / bs;
+
+	/* asignamos los extents del destino antes de copiar nada */
+	if (hole_prepare(fd_out, count) == -1)
+		return restore_dirty(fs, clean, -1);
+	int blocks = file_alloc(fd_out, first_out + num_block);
+	if (blocks <= first_out) {
+		errno = ENOSPC;
+		return restore_dirty(fs, clean, -1);
+	}
+	if (blocks < first_out + num_block) {
+		num_block = blocks - first_out;
+		count = (size_t) num_block * bs;
+	}
+
+	if (file_unshare(fd_out, first_out, first_out + num_block - 1) == -1)
+		return restore_dirty(fs, clean, -1);
+	file_written(fd_out, first_out, first_out + num_block - 1);
+
+	/* copiamos los trozos que sean contiguos en origen y en destino */
+	int done = 0;
+	while (done < num_block) {
+		int src = file_block(&in->ino, first_in + done);
+		int dst = file_block(&out->ino, first_out + done);
+		int run = 1;
+		while ((done + run < num_block) &&
+		       (file_block(&in->ino, first_in + done + run) == src + run) &&
+		       (file_block(&out->ino, first_out + done + run) == dst + run))
+			run++;
+
+		if (block_copy(fs->dev, data_offset(fs) + src,
+			       data_offset(fs) + dst, run) != run)
+			break;
+		done += run;
+	}
+	if (done < num_block)
+		count = (size_t) done * bs;
+
+	in->pos += count;
+	out->pos += count;
+	if (out->pos > out->ino.size)
+		out->ino.size = out->pos;
+	inode_write(fs, &out->ino, out->num);
+
+	return restore_dirty(fs, clean, (done == 0)? -1: count);
+}
+
+/* Crea dst como un clon de src: el nuevo inodo comparte los extents del
+ * original (se suma una referencia a cada bloque) y los datos solo se
+ * copian cuando uno de los dos los modifica
+ */
+int mfs_clone(const char *src, const char *dst)
+{
+	if (rpc_client())
+		return rpc_path(RPC_CLONE, src, dst, 0, NULL, 0);
+	if (fs_init() < 0)
+		return -1;
+
+	int inode = namei(fs, &fs->root, src);
+	if (inode == -1) {
+		errno = ENOENT;
+		return -1;
+	}
+	if (namei(fs, &fs->root, dst) != -1) {
+		errno = EEXIST;
+		return -1;
+	}
+
+	/* si está abierto lo que haya en memoria tiene que estar en disco:
+	 * el buffer de escritura y el cluster comprimido que se está escribiendo */
+	int i, j;
+	for (i = 0; i < NUM_FILES; i++) {
+		if (fs->file[i].num != inode)
+			continue;
+		bool clean = is_clean(fs);
+		if ((wbuf_flush(i) == -1) || (zip_flush(i) == -1))
+			return restore_dirty(fs, clean, -1);
+		inode_write(fs, &fs->file[i].ino, inode);
+		restore_dirty(fs, clean, 0);
+	}
+
+	struct disk_inode ino, new_ino;
+	inode_read(fs, &ino, inode);
+	if (is_dir(ino.is_dir)) {
+		errno = EISDIR;
+		return -1;
+	}
+	for (i = 0; i < NUM_EXTENTS; i++)
+		for (j = 0; (ino.e[i].start >= 0) && (j < ino.e[i].size); j++)
+			if (fs->refcount[ino.e[i].start + j] == MAX_REFCOUNT) {
+				errno = EMLINK;
+				return -1;
+			}
+
+	bool clean = is_clean(fs);
+	int new_inode = create_file(fs, dst, 0);
+	if (new_inode == -1)
+		return restore_dirty(fs, clean, -1);
+
+	/* soltamos los bloques que le dio create_file y compartimos los otros */
+	inode_read(fs, &new_ino, new_inode);
+	for (i = 0; i < NUM_EXTENTS; i++)
+		for (j = 0; (new_ino.e[i].start != -1) && (j < new_ino.e[i].size); j++)
+			data_block_put(fs, new_ino.e[i].start + j);
+
+	new_ino.size = ino.size;
+	new_ino.flags = ino.flags;
+	memcpy(new_ino.data, ino.data, INLINE_SIZE);
+	if (ino.flags & INODE_TAIL) {/* la cola no se comparte: se copia */
+		char frag[fs->sb.block_size];
+		data_read(fs, frag, ino.tail_block);
+		if (tail_alloc(frag + ino.tail_offset, ino.size % fs->sb.block_size,
+			       &new_ino.tail_block, &new_ino.tail_offset) == -1) {
+			new_ino.flags &= ~INODE_TAIL;
+			new_ino.size = -1;
+			inode_write(fs, &new_ino, new_inode);
+			group_inode_freed(fs, new_inode);
+			return restore_dirty(fs, clean, -1);
+		}
+	}
+	for (i = 0; i < NUM_EXTENTS; i++) {
+		new_ino.e[i] = ino.e[i]; /* los huecos se copian tal cual */
+		for (j = 0; (ino.e[i].start >= 0) && (j < ino.e[i].size); j++)
+			data_block_get(fs, ino.e[i].start + j);
+	}
+
+	bitmap_write(fs);
+	inode_write(fs, &new_ino, new_inode);
+	return restore_dirty(fs, clean, 0);
+}
+
+/* Normalmente esta en la segunda entrada pero....*/
+static int whos_father(const struct disk_inode ino)
+{
+	if (!is_dir(ino.is_dir))
+		return -1;
+	if (ino.flags & INODE_BTREE) {
+		struct disk_inode d = ino;
+		return bt_lookup(&d, "..");
+	}
+		
+	int i, j;
+	char block[fs->sb.block_size];
+	struct entry *entry;
+	
+	for (i = 0; i < NUM_EXTENTS; i++) {
+		if (ino.e[i].size == -1)
+			continue;
+			
+		for (j = 0; j < ino.e[i].size; j++) {
+			data_read(fs, block, ino.e[i].start+j);
+			entry = (struct entry *) block;
+
+			while (entry->next != -1) {
+				if ((entry->inode != -1) && (entry->busy != -1) && 
+					(!strcmp(entry->name, "..")))
+					return entry->inode;
+					
+				entry = ((void *) entry) + entry->next;
+			}
+		}	
+	}
+	
+	return -1;
+}
+
+int mfs_link(const char *oldpath, const char *newpath)
+{
+	if (rpc_client())
+		return rpc_path(RPC_LINK, oldpath, newpath, 0, NULL, 0);
+	if (fs_init() < 0)
+		return -1;
+//printf("oldpath = %s\n", oldpath);
+//printf("newpath = %s\n", newpath);
+
+	int old_inode = namei(fs, &fs->root, oldpath);
+	if (old_inode == -1) {
+		errno = ENOENT;
+		return -1;	
+	}
+	struct disk_inode ino;
+	inode_read(fs, &ino, old_inode);
+	if (is_dir(ino.is_dir)) {
+		errno = EPERM;
+		return -1;	
+	}
+	
+	int new_inode = namei(fs, &fs->root, newpath);
+	if (new_inode != -1) {
+		errno = EEXIST;
+		return -1;	
+	}
+//printf("old_inode = %d\n", old_inode);
+//printf("new_inode = %d\n", new_inode);
+
+	bool clean = is_clean(fs); /* dirty */
+	/* comprobados estos valores empezamos a trabajar para la función */
+	char path[strlen(newpath)+1];
+	strcpy(path, newpath);
+	struct disk_inode aux_ino;
+	char *aux = rindex(path, '/');
+
+	if ((aux == path)||(aux == NULL)) {/* caso raiz */
+		aux = (aux != NULL)? aux +1: path;
+		new_inode = fs->sb.root_inode;
+	} else {
+	/*
+		aux++;
+		if ((new_inode = namei(fs, &fs->root, path))==-1)
+			return restore_dirty(fs, clean, -1);
+		inode_read(fs, &aux_ino, new_inode);
+		if ((new_inode = whos_father(aux_ino))== -1)
+			return restore_dirty(fs, clean, -1);// ????????????????????????????????????????????
+	*/
+		*aux = '\0';
+		aux++;
+		if ((new_inode = namei(fs, &fs->root, path)) == -1)
+			return restore_dirty(fs, clean, -1);
+	}
+printf("new_inode = %d\n", new_inode);
+printf("aux = %s\n", aux);
+//exit(0);
+	inode_read(fs, &aux_ino, new_inode);
+	if (add_entry_to_inode(fs, &aux_ino, old_inode, aux, new_inode, DT_REG) != -1) { /* POR EL WARNING */
+		ino.nlink++;
+		inode_write(fs, &ino, old_inode);
+		return restore_dirty(fs, clean, 0);
+	}
+	
+	return restore_dirty(fs, clean, -1);
+}
+
+/* Para poder borrar un archivo */
+int mfs_unlink(const char *pathname)
+{
+	if (rpc_client())
+		return rpc_path(RPC_UNLINK, pathname, NULL, 0, NULL, 0);
+	if (fs_init() < 0)
+		return -1;
+
+	/* buscamos el archivo */
+	int inode = namei(fs, &fs->root, pathname);
+	if (inode == -1) {
+		printf("%s: file or directory does not exist\n", pathname);
+		errno = ENOENT;
+		return -1;	
+	}
+
+	struct disk_inode ino;
+	inode_read(fs, &ino, inode);
+	if (is_dir(ino.is_dir)) {
+		printf("%s: is a directory\n", pathname);
+		return -1;	
+	}
+
+	bool clean = is_clean(fs);
+	log_inode(fs, inode, LOG_UNLINK);
+	ino.nlink--;
+	bool rm = (ino.nlink == 0)? true: false;
+	inode_write(fs, &ino, inode);
+
+	char *aux, path[strlen(pathname)+1];
+	strcpy(path, pathname);
+	
+	if ((aux = rindex(path+1, '/')) == NULL) { /* está en el raiz */
+		ino = fs->root;
+		inode = fs->sb.root_inode;
+		aux = (path[0] == '/')?path+1:path;
+	} else {/* está en un subdirectorio */
+		*aux = '\0';
+		inode = namei(fs, &fs->root, path);
+		inode_read(fs, &ino, inode);
+		aux++;
+	}
+	log_inode(fs, inode, LOG_DIR);
+
+	if (ino.flags & INODE_BTREE) {
+		inode = bt_lookup(&ino, aux);
+		if ((inode == -1) || (bt_delete(&ino, aux) == -1))
+			return restore_dirty(fs, clean, -1);
+		if (rm)
+			free_inode(inode);
+		return restore_dirty(fs, clean, 0);
+	}
+
+	/* en el caso de que exista lo buscamos en el directorio donde está */
+	char buffer[(fs->sb).block_size];
+	struct entry *entry;
+	int i; /* para movernos por los extends */
+	int j; /* para movernos por los bloques de un extend */
+
+	for (i = 0; i < NUM_EXTENTS; i++) {
+		if (ino.e[i].start == -1)
+			break;
+			
+		for (j = 0; j < ino.e[i].size; j++) {
+			data_read(fs, buffer, ino.e[i].start+j);
+			entry = (struct entry *) buffer;
+			
+			while (entry->next != -1) {/* recorremos las entradas de directorio */
+				if ((entry->busy != -1) && (entry->inode != -1) && (strcmp(entry->name, aux) == 0)) {
+					if (rm)
+						free_inode(entry->inode);
+					entry->busy = entry->inode = -1;
+					strcpy(entry->name, "");
+					entry_coalesce(buffer);
+					data_write(fs, buffer, ino.e[i].start+j);
+					return restore_dirty(fs, clean, 0);
+				}
+				entry = ((void *) entry) + entry->next;
+			}
+		}
+	}
+
+	return restore_dirty(fs, clean, -1);
+}
+
+static bool rename_valid(const char *oldpath, const char *newpath)
+{
+	char old[strlen(oldpath)+1];
+	char new[strlen(newpath)+1];
+	
+	strcpy(old, oldpath);
+	strcpy(new, newpath);
+	
+	char *aux_old = rindex(old, '/');
+	if (aux_old == NULL)
+		return -1;
+	*aux_old = '\0';
+	
+	char *aux_new = rindex(new, '/');
+	if (aux_new == NULL)
+		return -1;
+	*aux_new = '\0';
+	
+	/* Si es el mismo directorio si que se permite */
+	if (!strcmp(aux_new, aux_old))
+		return true;
+	
+	const char cut [] = {"/"};
+	aux_new = strtok(new, cut);
+	aux_old = strtok(old, cut);
+	
+	while ((aux_new != NULL) && (aux_old != NULL)) { /* para no hacer ciclos */
+		if (!strcmp(aux_new, aux_old))
+			return false;
+		aux_new++;
+		aux_old++;
+		aux_new = strtok(aux_new, cut);
+		aux_old = strtok(aux_old, cut);
+	}
+	
+	return true;
+}
+
+/* Función que dado un archivo viejo renueva a uno nuevo */
+int mfs_rename(const char *oldpath, const char *newpath)
+{
+	if (rpc_client())
+		return rpc_path(RPC_RENAME, oldpath, newpath, 0, NULL, 0);
+	
+	if (fs_init() < 0)
+		return -1;
+	/* Primero miramos que exista el archivo */
+	int inode = namei(fs, &fs->root, oldpath);
+	if (inode == -1) {
+		printf("%s: No such file or directory\n", oldpath);
+		return -1;
+	}
+	
+	if (-1 != namei(fs, &fs->root, newpath)) {
+		printf("%s: Such file or directory\n", newpath);
+		return -1;	
+	}
+	
+	
+	if (!rename_valid(oldpath, newpath)) {
+		printf("%s to %s: Permision denied\n", oldpath, newpath);
+		return -1;	
+	}
+	/* ahora ya podemos proceder a mover el archivo */
+
+	char old[strlen(oldpath)+1];
+	char new[strlen(newpath)+1];
+	
+	strcpy(old, oldpath);
+	strcpy(new, newpath);
+	
+	/* para mirar los padres */
+	struct disk_inode ino_father;
+	int inode_father;
+	char *aux = rindex(new+1, '/');
+	if (aux == NULL) {
+		inode_father = fs->sb.root_inode;
+		ino_father = fs->root; 
+	} else {
+		*aux = '\0';
+		if ((inode_father = namei(fs, &fs->root, new)) == -1) {
+			printf("%s: No such directory\n",new);
+			return -1;
+		}
+		inode_read(fs, &ino_father, inode_father);
+	}
+	
+	struct disk_inode ino;
+	inode_read(fs, &ino, inode);
+	bool clean = is_clean(fs);
+	if (add_entry_to_inode(fs, &ino_father, inode, catch_name((char *) newpath), inode_father,
+			       is_dir(ino.is_dir)? DT_DIR: DT_REG) != 0) {/* POR EL WARNING */
+		return restore_dirty(fs, clean, -1);
+	}
+	
+	aux = rindex(old+1, '/');
+	if (aux == NULL) {
+		inode_father = fs->sb.root_inode;
+		ino_father = fs->root; 
+	} else {
+		*aux = '\0';
+		if ((inode_father = namei(fs, &fs->root, old)) == -1) {
+			printf("%s: No such directory\n",old);
+			return restore_dirty(fs, clean, -1);
+		}
+		inode_read(fs, &ino_father, inode_father);
+	}
+	/* borramos una entrada */
+	log_inode(fs, inode_father, LOG_DIR);
+	log_inode(fs, inode, LOG_UNLINK);
+	int value = del_entry_of_inode(fs, &ino_father, catch_name((char *) oldpath)); /* POR EL WARNING */
+		
+	return restore_dirty(fs, clean, value);
+}
+
+
+/* Tamaño del inodo inode si está abierto: el de la tabla de ficheros (aún
+ * no se escribió en disco) contando lo que haya en el buffer de escritura
+ */
+static int open_size(int inode, int size)
+{
+	int i, end;
+
+	for (i = 0; i < NUM_FILES; i++) {
+		if (fs->file[i].num != inode)
+			continue;
+		size = fs->file[i].ino.size;
+		end = fs->file[i].wbuf_pos + fs->file[i].wbuf_len;
+		if ((fs->file[i].wbuf_len != 0) && (end > size))
+			size = end;
+		break;
+	}
+	return size;
+}
+
+/* Rellena buf con la información del inodo inode */
+static void inode_stat(int inode, struct disk_inode *ino, struct stat *buf)
+{
+	buf->st_ino = inode;
+	buf->st_size = open_size(inode, ino->size);
+	buf->st_nlink = ino->nlink;
+	buf->st_mode = 0;
+	if (is_dir(ino->is_dir))
+		buf->st_mode |= S_IFDIR;
+	buf->st_blocks = file_blocks(ino) - file_holes(ino);
+}
+
+/* En los directorios en árbol num_block es la hoja que se está recorriendo,
+ * next el byte del siguiente registro dentro de ella y num_extent cuantos
+ * registros de la hoja ya se devolvieron
+ */
+struct mfs_dir {
+        int next;
+        int num_block;
+        int num_extent;
+	char *prefix; /* solo se devuelven los nombres que empiezan así (o NULL) */
+	struct dirent dirent;
+	struct disk_inode d;
+	struct mfs_direntplus plus;
+	int ino_block; /* bloque de la tabla de inodos que hay en ino_cache */
+	char *ino_cache; /* para no leer el mismo bloque de inodos una y otra vez */
+	int cached; /* bloque de datos del directorio que hay en block */
+	char *block; /* el bloque de entradas que se está recorriendo */
+	int remote; /* manejador del directorio en mfsd (-1: se lee aquí) */
+	struct mfs_direntplus *batch; /* entradas que mandó mfsd */
+	int batch_len; /* cuantas hay en batch */
+	int batch_pos; /* la siguiente que se devuelve */
+};
+
+/* El directorio lo abre mfsd y aquí solo se guarda su manejador. Las
+ * entradas llegan de RPC_DIRENTS en RPC_DIRENTS ya con su stat
+ */
+static MFS_DIR *remote_opendir(const char *name, const char *prefix)
+{
+	struct {
+		int handle;
+		int inode;
+	} r;
+	MFS_DIR *dir = calloc(1, sizeof(MFS_DIR));
+
+	if (dir == NULL)
+		return NULL;
+	dir->batch = malloc(RPC_DIRENTS * sizeof(struct mfs_direntplus));
+	if (dir->batch == NULL) {
+		free(dir);
+		errno = ENOMEM;
+		return NULL;
+	}
+	if (rpc_path(RPC_OPENDIR, name, prefix, 0, &r, sizeof(r)) == -1) {
+		int e = errno;
+		free(dir->batch);
+		free(dir);
+		errno = e;
+		return NULL;
+	}
+	printf("inodo %d\n", r.inode);
+	dir->remote = r.handle;
+	return dir;
+}
+
+static struct mfs_direntplus *remote_readdir(MFS_DIR *dir)
+{
+	if (dir->batch_pos == dir->batch_len) {
+		int n = rpc_call(RPC_READDIR, dir->remote, RPC_DIRENTS, 0, NULL, 0,
+				 dir->batch, RPC_DIRENTS * sizeof(struct mfs_direntplus));
+		if (n <= 0)
+			return NULL;
+		dir->batch_len = n;
+		dir->batch_pos = 0;
+	}
+	return &dir->batch[dir->batch_pos++];
+}
+
+MFS_DIR *mfs_opendir(const char *name)
+{
+	if (rpc_client())
+		return remote_opendir(name, NULL);
+	if (fs_init() < 0)
+		return NULL;
+	int inodo = namei(fs, &fs->root, name);
+	if (inodo == -1) {
+		errno = ENOENT;
+		return NULL;
+	}
+	
+	MFS_DIR *dir = malloc(sizeof(MFS_DIR));
+	if (dir == NULL)
+		return NULL;
+		
+	inode_read(fs, &dir->d, inodo);
+	if (!is_dir(dir->d.is_dir)) {
+		free(dir);
+		errno = ENOTDIR;
+		return NULL;
+	}
+		
+	printf("inodo %d\n", inodo);
+	dir->next       = 0;
+	dir->num_block  = 0;
+	dir->num_extent = 0;
+	dir->ino_block  = -1;
+	dir->ino_cache  = NULL;
+	dir->cached     = -1;
+	dir->prefix     = NULL;
+	dir->remote     = -1;
+	dir->batch      = NULL;
+	dir->block      = malloc(fs->sb.block_size);
+	if (dir->block == NULL) {
+		free(dir);
+		errno = ENOMEM;
+		return NULL;
+	}
+	if (dir->d.flags & INODE_BTREE) {/* se empieza por la hoja de más a la izquierda */
+		dir->num_block = bt_find_leaf(&dir->d, "", dir->block);
+		dir->cached = dir->num_block;
+		dir->next = sizeof(struct bt_header);
+	}
+
+	return dir;
+}
+
+/* Como mfs_opendir, pero al leer solo salen los nombres que empiezan por
+ * prefix. En los directorios en árbol se va directamente a la primera hoja
+ * que los puede tener y se para en cuanto se pasan, en los lineales se
+ * recorre todo el directorio
+ */
+MFS_DIR *mfs_opendir_prefix(const char *name, const char *prefix)
+{
+	if (rpc_client())
+		return remote_opendir(name, prefix);
+
+	MFS_DIR *dir = mfs_opendir(name);
+
+	if (dir == NULL)
+		return NULL;
+	dir->prefix = strdup(prefix);
+	if (dir->prefix == NULL) {
+		mfs_closedir(dir);
+		errno = ENOMEM;
+		return NULL;
+	}
+	if (dir->d.flags & INODE_BTREE) {
+		dir->num_block = bt_find_leaf(&dir->d, prefix, dir->block);
+		dir->cached = dir->num_block;
+	}
+
+	return dir;
+}
+
+static int dir_inode_read(MFS_DIR *dir, struct disk_inode *ino, int inode_num);
+
+/* Avanza hasta la siguiente entrada ocupada del directorio y deja su nombre,
+ * inodo y tipo en dir->dirent. El bloque de entradas se queda en el MFS_DIR
+ * así que solo se lee de disco una vez.
+ *
+ * Las entradas lineales son las de siempre y no guardan el tipo: se saca
+ * del inodo con dir_inode_read, que también se queda con su bloque
+ *
+ * Devuelve el inodo de la entrada o -1 si ya no quedan
+ */
+static int linear_read_entry(MFS_DIR *dir)
+{
+	char *block = dir->block;
+	struct entry *entry;
+	struct disk_inode ino;
+	/* Empezamos desde el principio */
+	for (; dir->num_extent < NUM_EXTENTS; dir->num_extent++) {
+		if (dir->d.e[dir->num_extent].start == -1)
+			break;
+
+		for (; dir->num_block < dir->d.e[dir->num_extent].size; dir->num_block++) {
+			int n = dir->d.e[dir->num_extent].start+dir->num_block;
+			if (dir->cached != n) {
+				data_read(fs, block, n);
+				dir->cached = n;
+			}
+			entry = ((void *) block) + dir->next;
+			while (entry->next != -1) {
+				if ((entry->busy != -1) && (entry->inode != -1)) {/* tenemos entrada valida */
+					dir->dirent.d_ino = entry->inode;
+					if (dir_inode_read(dir, &ino, entry->inode) <= 0)
+						dir->dirent.d_type = DT_UNKNOWN;
+					else
+						dir->dirent.d_type = is_dir(ino.is_dir)? DT_DIR: DT_REG;
+					strcpy(dir->dirent.d_name, entry->name);
+					dir->next += entry->next;
+
+					return entry->inode;
+				}
+				dir->next += entry->next;
+				entry = ((void *) entry) + entry->next; /* avanzamos el trozo necesario */	
+			}
+			dir->next = 0;
+		}
+		dir->num_block = 0;
+	}
+	
+	return -1;
+}
+
+/* Lo mismo que linear_read_entry pero recorriendo las hojas del árbol (aquí
+ * dir->cached es el nodo que hay en dir->block)
+ */
+static int bt_read_entry(MFS_DIR *dir)
+{
+	char *block = dir->block;
+	struct bt_header *h = (struct bt_header *) block;
+	int inode, len;
+
+	while (dir->num_block != -1) {
+		if (dir->cached != dir->num_block) {
+			if (file_read(fs, &dir->d, block, dir->num_block) <= 0)
+				return -1;
+			dir->cached = dir->num_block;
+		}
+		if (dir->num_extent < h->count) {
+			char *p = block + dir->next;
+			len = (unsigned char) p[sizeof(int) + 1];
+			memcpy(&inode, p, sizeof(int));
+			dir->dirent.d_ino = inode;
+			dir->dirent.d_type = p[sizeof(int)];
+			memcpy(dir->dirent.d_name, p + BT_REC_HEADER, len);
+			dir->dirent.d_name[len] = '\0';
+			dir->next += BT_REC_HEADER + len;
+			dir->num_extent++;
+			return inode;
+		}
+		dir->num_block = h->next;
+		dir->next = sizeof(struct bt_header);
+		dir->num_extent = 0;
+	}
+
+	return -1;
+}
+
+static int dir_read_entry(MFS_DIR *dir)
+{
+	bool btree = dir->d.flags & INODE_BTREE;
+	int inode;
+
+	while (1) {
+		inode = (btree)? bt_read_entry(dir): linear_read_entry(dir);
+		if ((inode == -1) || (dir->prefix == NULL))
+			return inode;
+		if (!strncmp(dir->dirent.d_name, dir->prefix, strlen(dir->prefix)))
+			return inode;
+		if (btree && (strcmp(dir->dirent.d_name, dir->prefix) > 0)) {
+			dir->num_block = -1; /* ya nos pasamos: no hay más */
+			return -1;
+		}
+	}
+}
+
+struct dirent *mfs_readdir(MFS_DIR *dir)
+{
+	if (dir->remote != -1) {
+		struct mfs_direntplus *plus = remote_readdir(dir);
+		return (plus == NULL)? NULL: &plus->d;
+	}
+	return (dir_read_entry(dir) == -1)? NULL: &dir->dirent;
+}
+
+/* Llena buf con hasta count entradas del directorio de una vez
+ *
+ * Devuelve cuantas entradas se pusieron (0 si ya no quedan)
+ */
+int mfs_getdents(MFS_DIR *dir, struct dirent *buf, int count)
+{
+	int n = 0;
+
+	if (dir->remote != -1) {
+		struct mfs_direntplus *plus;
+		while ((n < count) && ((plus = remote_readdir(dir)) != NULL))
+			buf[n++] = plus->d;
+		return n;
+	}
+	while ((n < count) && (dir_read_entry(dir) != -1))
+		buf[n++] = dir->dirent;
+
+	return n;
+}
+
+/* Como inode_read pero guardando en el MFS_DIR el último bloque de la tabla
+ * de inodos que se leyó: las entradas de un directorio suelen tener inodos
+ * seguidos, así que se lee cada bloque de inodos una vez
+ */
+static int dir_inode_read(MFS_DIR *dir, struct disk_inode *ino, int inode_num)
+{
+	int inode_per_block = fs->sb.block_size / sizeof(struct disk_inode);
+	int pos_block = inode_num / inode_per_block;
+
+	if (inode_num >= inode_count(fs))
+		return -EINVAL;
+	if (dir->ino_cache == NULL) {
+		dir->ino_cache = malloc(fs->sb.block_size);
+		if (dir->ino_cache == NULL)
+			return -ENOMEM;
+	}
+	if (dir->ino_block != pos_block) {
+		if (block_read(fs->dev, dir->ino_cache, inode_block(fs, pos_block))
+		    < fs->sb.block_size)
+			return -EIO;
+		dir->ino_block = pos_block;
+	}
+	memcpy(ino, dir->ino_cache + (inode_num % inode_per_block) *
+	       sizeof(struct disk_inode), sizeof(struct disk_inode));
+	return 1;
+}
+
+/* Como mfs_readdir pero devolviendo a la vez la información del inodo de
+ * cada entrada (lo que daría mfs_stat) sin tener que resolver el path
+ */
+struct mfs_direntplus *mfs_readdirplus(MFS_DIR *dir)
+{
+	struct disk_inode ino;
+
+	if (dir->remote != -1)
+		return remote_readdir(dir);
+
+	int inode = dir_read_entry(dir);
+	if (inode == -1)
+		return NULL;
+	if (dir_inode_read(dir, &ino, inode) <= 0)
+		return NULL;
+
+	dir->plus.d = dir->dirent;
+	memset(&dir->plus.st, '\0', sizeof(struct stat));
+	inode_stat(inode, &ino, &dir->plus.st);
+
+	return &dir->plus;
+}
+
+int mfs_closedir(MFS_DIR *dir)
+{
+	int ret = 0;
+
+	if (dir->remote != -1)
+		ret = rpc_call(RPC_CLOSEDIR, dir->remote, 0, 0, NULL, 0, NULL, 0);
+	free(dir->batch);
+	free(dir->ino_cache);
+	free(dir->prefix);
+	free(dir->block);
+	free(dir);
+
+	return ret;
+}
+
+static int sb_init(struct file_system *fs, int num_blocks,
+		   int percent_inodes)
+{
+	fs->sb.block_size = block_get_block_size(fs->dev);
+	if (fs->sb.block_size < sizeof(struct disk_inode)) {
+		printf("block size must be at least %d\n",
+		       (int) sizeof(struct disk_inode));
+		return -EINVAL;
+	}
+	fs->sb.num_inodes = num_blocks * percent_inodes/100;
+
+	fs->sb.num_bitmap = num_blocks
+		- 1 /* super_block */
+		- fs->sb.num_inodes; /* blocks used by inodes */
+	fs->sb.num_bitmap = fs->sb.num_bitmap + fs->sb.block_size - 1;
+	fs->sb.num_bitmap = fs->sb.num_bitmap / fs->sb.block_size;
+
+	/* un byte de referencias por bloque, igual que el bitmap */
+	fs->sb.num_refcount = fs->sb.num_bitmap;
+
+	fs->sb.num_data_blocks = num_blocks - fs->sb.num_inodes
+		- fs->sb.num_bitmap - fs->sb.num_refcount - 1;
+
+	fs->sb.root_inode = 0;
+	fs->sb.magic = MFS_MAGIC;
+	fs->sb.version = MFS_VERSION;
+	fs->sb.frag_block = -1;
+	fs->sb.log_block = -1;
+	fs->sb.zip_cluster = 0;
+	fs->sb.dedup_start = fs->sb.dedup_blocks = 0;
+	fs->sb.dirty = false;
+	return sb_write(fs->dev, &(fs->sb));
+}
+
+static int bitmap_init(struct file_system *fs)
+{
+	int size = block_get_block_size(fs->dev);
+	char *block = malloc(size);
+	int i;
+
+	if (block == NULL)
+		return -ENOMEM;
 	memset(block, '\0', size);
 	for (i = 0; i < fs->sb.num_bitmap; i++)
 		block_write(fs->dev, block, 1 + i);
@@ -1564,868 +5443,2693 @@ static int bitmap_init(struct file_system *fs)
 	return 1;
 }
 
-static int inodes_init(struct file_system *fs)
+static int refcount_init(struct file_system *fs)
+{
+	int size = block_get_block_size(fs->dev);
+	char *block = malloc(size);
+	int i;
+
+	if (block == NULL)
+		return -ENOMEM;
+	memset(block, '\0', size);
+	for (i = 0; i < fs->sb.num_refcount; i++)
+		block_write(fs->dev, block, 1 + fs->sb.num_bitmap + i);
+	free(block);
+	refcount_read(fs);
+	return 1;
+}
+
+static int inodes_init(struct file_system *fs)
+{
+	struct disk_inode ino;
+	int i;
+
+	memset(&ino, '\0', sizeof(struct disk_inode));
+	ino.size = -1; /* empty */
+	ino.e[0].start = -1;
+	ino.e[0].size = -1;
+
+	int inode_size = sizeof(struct disk_inode);
+	int inode_per_block = fs->sb.block_size/inode_size;
+	int num_inodes = fs->sb.num_inodes *inode_per_block;
+
+	for (i = 0; i < num_inodes; i++)
+		inode_write(fs, &ino, i);
+
+	return 1;
+
+}
+
+static int data_init(struct file_system *fs)
+{
+	int size = block_get_block_size(fs->dev);
+	char *block = malloc(size);
+	int i;
+
+	if (block == NULL)
+		return -ENOMEM;
+	memset(block, '@', size);
+	for (i = 0; i < fs->sb.num_data_blocks; i++)
+		data_write(fs, block, i);
+	return 1;
+}
+ 
+static int dir_create(struct file_system *fs)
+{/* para crear el directorio raiz */
+	struct disk_inode ino;
+	int inode = get_free_inode(fs, true, -1);
+	if (inode == -1)
+		return -1;	
+	
+	/* leer todos los bloques para ponerlos como sin ocupar */
+	if (inode_read(fs, &ino, inode)!=1)
+		printf("Error al leer el inodo.\n");
+	ino.is_dir = 1;
+	ino.nlink  = 1;
+	
+	int i, j;
+	char block[fs->sb.block_size];
+	struct entry *entry;
+	entry = (struct entry*) block;
+	entry->next = entry->busy = entry->inode = -1;
+	for (i = 0; i < NUM_EXTENTS; i++) {/* Pongo todo como libre */
+		if (ino.e[i].start == -1)
+			break;
+		for (j = 0; j < ino.e[i].size; j++)	
+			data_write(fs, block, ino.e[i].start+j);
+	}
+	
+	/* Ahora me toca poner las entradas . y .. */
+	strncpy(entry->name, ".", 2);
+	entry->inode = inode;
+	entry->busy = strlen(".")+1;
+	entry->next = ENTRY_HEADER + entry->busy;
+/*
+printf("entry->inode = %d\n", entry->inode);
+printf("entry->busy  = %d\n", entry->busy);
+printf("entry->name  = '%s'\n", entry->name);
+printf("entry->next  = %d\n", entry->next);
+*/
+	entry = ((void *) block) + entry->next;
+	strncpy(entry->name, "..", 3);
+	entry->inode = inode;
+	entry->busy = strlen("..")+1;
+	entry->next = ENTRY_HEADER + entry->busy;
+
+	entry = ((void *) entry) + entry->next;
+	entry->next = entry->busy = entry->inode = -1;
+	
+	if (data_write(fs, block, ino.e[0].start)!=1)
+		printf("Error al escribir el bloque.\n");
+	if (inode_write(fs, &ino, inode)!=1)
+		printf("Error a escribir el inodo.\n");
+
+	return inode;
+}
+
+int mfs_mkfs(char *name, int num_blocks, int size_block,
+	     int percent_inodes)
+{
+	printf("Creando sistema de ficheros %s con %d bloques de "
+	       "tamaño %d y porcentaje de inodos %d\n",
+	       name, num_blocks, size_block, percent_inodes);
+
+	fs = malloc(sizeof(struct file_system));
+
+	if (fs == NULL)
+		return -ENOMEM;
+	memset(fs, '\0', sizeof(struct file_system));
+
+	fs->dev = block_create(name, num_blocks, size_block);
+	if (fs->dev == NULL) {
+		printf("Error creando el sistama de ficheros %s\n",
+		       name);
+		perror("creando");;
+		return -1;
+	}
+	if (sb_init(fs, num_blocks, percent_inodes) <= 0)
+		return -1;
+	if (bitmap_init(fs) <= 0)
+		return -1;
+	if (refcount_init(fs) <= 0)
+		return -1;
+	if (inodes_init(fs) <= 0)
+		return -1;
+	if (data_init(fs) <= 0)
+		return -1;
+	fs->sb.root_inode = dir_create(fs);
+	if (fs->sb.root_inode < 0)
+		return -1;
+	sb_write(fs->dev, &(fs->sb));
+
+	return 0;
+}
+
+int my_mkfs(int num_blocks, int size_block, int percent_inodes, bool checksum,
+	    int zip_cluster, bool dedup)
+{
+	if (daemon_busy())
+		return -1;
+
+	char *name = getenv("MFS_NAME");
+	if (name == NULL) {
+		printf("MFS_NAME not set\n");
+		name = default_name;
+		printf("used '%s' like file system\n", name);
+	}
+	printf("Creando sistema de ficheros %s con %d bloques de "
+	       "tamaño %d y porcentaje de inodos %d\n",
+	       name, num_blocks, size_block, percent_inodes);
+
+	fs = malloc(sizeof(struct file_system));
+
+	if (fs == NULL)
+		return -ENOMEM;
+	memset(fs, '\0', sizeof(struct file_system));
+
+	fs->dev = block_create(name, num_blocks, size_block);
+	if (fs->dev == NULL) {
+		printf("Error creando el sistama de ficheros %s\n",
+		       name);
+		perror("creando");;
+		return -1;
+	}
+	if (sb_init(fs, num_blocks, percent_inodes) <= 0)
+		return -1;
+	if (bitmap_init(fs) <= 0)
+		return -1;
+	if (refcount_init(fs) <= 0)
+		return -1;
+	if (inodes_init(fs) <= 0)
+		return -1;
+	if (data_init(fs) <= 0)
+		return -1;
+	fs->sb.root_inode = dir_create(fs);
+	if (fs->sb.root_inode < 0)
+		return -1;
+	if ((zip_cluster < 0) || (zip_cluster > ZIP_MAX_CLUSTER)) {
+		printf("cluster de %d bloques: tiene que ser de 1 a %d\n",
+		       zip_cluster, ZIP_MAX_CLUSTER);
+		return -1;
+	}
+	fs->sb.zip_cluster = zip_cluster;
+	sb_write(fs->dev, &(fs->sb));
+	if (dedup && (dedup_table(fs) == -1)) {
+		perror("dedup");
+		return -1;
+	}
+
+	/* se calculan al final: así no hay que ir actualizándolos mientras
+	 * se inicializa todo */
+	if (checksum && (block_set_checksums(fs->dev) == -1)) {
+		perror("checksums");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int sb_print(struct file_system *fs)
+{
+	printf("Printing Superblock info:\n");
+	printf("block_size = %d\n", fs->sb.block_size);
+	printf("num_inodes = %d\n", fs->sb.num_inodes);
+	printf("num_bitmap = %d\n", fs->sb.num_bitmap);
+	printf("num_data_blocks = %d\n", fs->sb.num_data_blocks);
+
+	return 1;
+}
+
+static int bitmap_print(struct file_system *fs)
+{
+	int i;
+	for (i = 0; i < fs->sb.num_data_blocks; i++)
+		if (bitmap_get(fs, i))
+			printf("data block %i used\n", i);
+	return 1;
+}
+
+static int inodes_print(struct file_system *fs)
+{
+	int i;
+	for (i = 0; i < inode_count(fs); i++) {
+		struct disk_inode ino;
+		inode_read(fs, &ino, i);
+		if (ino.size == -1)
+			continue;
+		printf("Inode %d used\n", i);
+		printf("\tsize = %d\n", ino.size);
+		printf("\tstart = %d\n", ino.e[0].start);
+		printf("\tnum = %d\n", ino.e[0].size);
+	}
+
+	return 1;
+}
+
+static int data_print(struct file_system *fs)
+{
+	int i;
+	char unitialized[fs->sb.block_size];
+
+	memset(unitialized, '@', fs->sb.block_size);
+	for (i = 0; i < fs->sb.num_data_blocks; i++) {
+		char block[fs->sb.block_size];
+		data_read(fs, block, i);
+		if (memcmp(block, unitialized,
+			    fs->sb.block_size) == 0)
+			continue;
+		printf("Data block %d used\n", i);
+		printf("*****\n\n");
+		printf("%s", block);
+		printf("\n\n*****\n");
+	}
+
+	return 1;
+}
+
+static int root_dir_print(struct file_system *fs)
+{
+	struct disk_inode root;
+	int i, j;
+	char block[fs->sb.block_size];
+	struct entry *dir = (struct entry *)block;
+
+	printf("Printing root directory:\n");
+	inode_read(fs, &root, fs->sb.root_inode);
+
+	for (i = 0; i < root.e[0].size; i++) {
+		file_read(fs, &root, block, i);
+		for (j = 0; j < fs->sb.block_size / sizeof(struct entry); j++)
+			if (dir[j].inode != -1) {
+				printf("\t%s : inode %d\n", dir[j].name,
+				       dir[j].inode);
+			}
+	}
+	return 1;
+}
+
+int mfs_debug(char *name)
+{
+	printf("Depurando sistema de ficheros %s\n", name);
+
+	if (fs_init() < 0)
+		return -1;
+
+	if (sb_print(fs) <= 0)
+		return -1;
+	if (bitmap_print(fs) <= 0)
+		return -1;
+	if (inodes_print(fs) <= 0)
+		return -1;
+	if (data_print(fs) <= 0)
+		return -1;
+	if (root_dir_print(fs) <= 0)
+		return -1;
+
+	return 0;
+}
+
+int mfs_stat(const char *path, struct stat *buf)
+{
+	if (rpc_client())
+		return rpc_path(RPC_STAT, path, NULL, 0, buf, sizeof(struct stat));
+	if (fs_init() < 0)
+		return -1;
+
+	int inode = namei(fs, &fs->root, path);
+	if (inode == -1) {
+		errno = ENOENT;
+		return -1;	
+	}
+	struct disk_inode ino;
+	inode_read(fs, &ino, inode);
+	inode_stat(inode, &ino, buf);
+	
+	return 0;
+}
+
+static int create_directory(int previous_inode)
+{
+	int inode = get_free_inode(fs, true, previous_inode);
+	if (inode == -1)
+		return -1;
+		
+	char block[fs->sb.block_size];
+	struct entry *entry = (struct entry*) block;
+
+	entry->next = entry->busy = entry->inode = -1;
+	strcmp(entry->name, "");
+
+	struct disk_inode ino;
+	inode_read(fs, &ino, inode);
+	ino.is_dir = 1;
+
+	int i;
+	for (i = 0; i < ino.e[0].size; i++)
+		data_write(fs, (void *) block, ino.e[0].start+i);
+
+	/* Ahora me toca poner las entradas . y .. */
+	strncpy(entry->name, ".", 2);
+	entry->inode = inode;
+	entry->busy = strlen(".")+1;
+	entry->next = ENTRY_HEADER + entry->busy;
+
+	entry = ((void *) block) + entry->next;
+	strncpy(entry->name, "..", 3);
+	entry->inode = previous_inode;
+	entry->busy = strlen("..")+1;
+	entry->next = ENTRY_HEADER + entry->busy;
+
+	entry = ((void *) entry) + entry->next;
+	entry->next = entry->busy = entry->inode = -1;
+
+	data_write(fs, block, ino.e[0].start);
+	inode_write(fs, &ino, inode);
+	
+	return inode;
+}
+
+/* Como create_directory pero el directorio nuevo es un árbol B+ con solo
+ * la raíz (una hoja con . y ..)
+ */
+static int create_btree_directory(int previous_inode)
+{
+	if (fs->sb.block_size < BT_MIN_BLOCK) {
+		errno = EINVAL;
+		return -1;
+	}
+	int inode = get_free_inode(fs, true, previous_inode);
+	if (inode == -1)
+		return -1;
+
+	char block[fs->sb.block_size];
+	struct bt_header root = {1, 0, -1, -1};
+	struct disk_inode ino;
+	inode_read(fs, &ino, inode);
+	ino.is_dir = 1;
+	ino.flags |= INODE_BTREE;
+	ino.size = fs->sb.block_size; /* el nodo 0 */
+
+	bt_encode(block, &root, NULL);
+	file_write(fs, &ino, block, 0);
+	inode_write(fs, &ino, inode);
+	if ((bt_insert(&ino, inode, ".", inode, DT_DIR) == -1) ||
+	    (bt_insert(&ino, inode, "..", previous_inode, DT_DIR) == -1)) {
+		free_inode(inode);
+		return -1;
+	}
+
+	return inode;
+}
+
+static int add_directory(int num_inode, char *name, bool btree)
+{
+	if (!is_name_valid(name))
+		return -1;
+
+	int new_inode = (btree)? create_btree_directory(num_inode):
+				 create_directory(num_inode);
+	if (new_inode == -1)
+		return -1;
+
+	struct disk_inode ino;
+	inode_read(fs, &ino, num_inode);
+
+	if (add_entry_to_inode(fs, &ino, new_inode, name, num_inode, DT_DIR) == -1) {
+		free_inode(new_inode);
+		return -1;	
+	}
+	
+	return new_inode;
+}
+
+static int make_directory(const char *pathname, bool btree)
+{
+	if (fs_init() < 0)
+		return -1;
+
+	if (!strcmp("/", pathname)) {
+		errno = EEXIST;	
+		return -1;
+	}
+
+	if (namei(fs, &fs->root, pathname) != -1) {
+		errno = EEXIST;
+		return -1;
+	}
+
+	pathname = (*pathname == '/')? pathname+1: pathname;
+	
+	bool clean = is_clean(fs);
+	int inode, num_inode = fs->sb.root_inode;
+	struct disk_inode ino;
+	pathname = strtok((char *) pathname, "/");
+	while (pathname != NULL) {
+		inode_read(fs, &ino, num_inode);
+		inode = sub_namei(fs, &ino, pathname);
+
+		if (inode == -1) {
+//printf("num_inode: %d\npath: %s\n",num_inode, pathname);
+			if ((num_inode = add_directory(num_inode, (char *) pathname, btree)) == -1) {
+				printf("%s: cannot create directory\n", pathname);
+				return restore_dirty(fs, clean, -1);
+			}	
+			inode = num_inode;	
+		} else
+			num_inode = inode;
+//printf("inode = %d\n",num_inode);
+		pathname = strtok(NULL, "/");	
+	}
+	
+	return restore_dirty(fs, clean, 1);
+}
+
+int mfs_mkdir(const char *pathname, mode_t mode)
 {
-	struct disk_inode ino;
-	int i;
+	if (rpc_client())
+		return rpc_path(RPC_MKDIR, pathname, NULL, mode, NULL, 0);
+	return make_directory(pathname, false);
+}
 
-	ino.size = -1; /* empty */
-	ino.e[0].start = -1;
-	ino.e[0].size = -1;
+/* Como mfs_mkdir pero los directorios que se crean son árboles B+ (búsqueda,
+ * alta y baja en O(log n) y readdir en orden). Necesita bloques de al menos
+ * BT_MIN_BLOCK bytes
+ */
+int mfs_mkdir_btree(const char *pathname)
+{
+	if (rpc_client())
+		return rpc_path(RPC_MKDIR_BTREE, pathname, NULL, 0, NULL, 0);
+	return make_directory(pathname, true);
+}
+/*
+static int my_rmdir(struct disk_inode *ino)
+{
+	// voy recorrer una a una todas las entradas del directorio
+	int i, j;
+	char block[fs->sb.block_size];
+	struct entry *entry;
+	struct disk_inode  aux_ino;
+	
+	for (i = 0; i < NUM_EXTENTS; i++) {// Me muevo por los extents
+		if (ino->e[i].start == -1)
+			continue;
 
-	int inode_size = sizeof(struct disk_inode);
-	int inode_per_block = fs->sb.block_size/inode_size;
-	int num_inodes = fs->sb.num_inodes *inode_per_block;
+		for (j = 0; j < ino->e[i].size; j++) {
+			data_read(fs, block, ino->e[i].start+j);
+			entry = (struct entry *) block;
+			
+			while (entry->next != -1) {
+				if ((entry->inode == -1) || (entry->busy == -1) || (!strcmp(entry->name,".")) ||
+					(!strcmp(entry->name, ".."))) {
+					entry = ((void *) entry) + entry->next;
+					continue;
+				}
+				
+				inode_read(fs, &aux_ino, entry->inode);
+				if (is_dir(aux_ino.is_dir))
+					if (my_rmdir(&aux_ino) == -1)
+						return -1;
+						
+				if (free_inode(entry->inode) == -1) {
+					printf("%s: cannot delete\n", entry->name);
+					return -1;
+				}
+				
+				// quitamos la entrada
+				entry->busy = entry->inode = -1;
+				strcmp(entry->name, "");
+				data_write(fs, block, ino->e[i].start + j);
+				
+				entry = ((void *) entry) + entry->next;
+			}
+		}
+	}
+	
+	return 0;
+}
+*/
 
-	for (i = 0; i < num_inodes; i++)
-		inode_write(fs, &ino, i);
+static int delete_directory(struct disk_inode *ino, const int inode);
 
-	return 1;
+/* para delete_directory con los directorios en árbol */
+static int delete_item(struct dir_item *it, void *arg)
+{
+	struct disk_inode aux_ino;
+
+	if (!strcmp(it->name, ".") || !strcmp(it->name, ".."))
+		return 0;
+	inode_read(fs, &aux_ino, it->inode);
+	if (is_dir(aux_ino.is_dir))
+		delete_directory(&aux_ino, it->inode);
+	free_inode(it->inode);
 
+	return 0;
 }
 
-static int data_init(struct file_system *fs)
+/* Esta función mira la tabla de entry's que tiene un directorio y borra todo
+ * lo que tenga dentro
+ */
+static int delete_directory(struct disk_inode *ino, const int inode)
 {
-	int size = block_get_block_size(fs->dev);
-	char *block = malloc(size);
-	int i;
+	int i, j;
+	struct disk_inode aux_ino;
+	char block[fs->sb.block_size];
+	struct entry *entry;
+	
+	log_inode(fs, inode, LOG_DIR);
+	if (ino->flags & INODE_BTREE) /* el directorio se libera entero después */
+		return bt_foreach(ino, delete_item, NULL);
 
-	if (block == NULL)
-		return -ENOMEM;
-	memset(block, '@', size);
-	for (i = 0; i < fs->sb.num_data_blocks; i++)
-		data_write(fs, block, i);
-	return 1;
+	for (i = 0; i < NUM_EXTENTS; i++) {
+		if (ino->e[i].start == -1) /* extent sin usar */
+			continue;
+		
+		for (j = 0; j < ino->e[i].size; j++) {
+			data_read(fs, block, ino->e[i].start+j);
+			entry = (struct entry *) block;
+			while (entry->next != -1) {
+				if ((entry->inode == -1) || (entry->busy == -1) ||
+					(!strcmp(entry->name, ".")) || ((!strcmp(entry->name, "..")))) {
+					entry = ((void *) entry) + entry->next;
+					continue;
+				}
+				
+				inode_read(fs, &aux_ino, entry->inode);
+				if (is_dir(aux_ino.is_dir))
+					delete_directory(&aux_ino, entry->inode);
+					
+				free_inode(entry->inode);
+				entry->inode = entry->busy = -1;
+				strcmp(entry->name, "");
+				entry = ((void *) entry) + entry->next;
+			}
+			data_write(fs, block, ino->e[i].start+j);
+		}
+	}
+	
+	return 0;
 }
- 
-static int dir_create(struct file_system *fs)
-{/* para crear el directorio raiz */
-	struct disk_inode ino;
-	int inode = get_free_inode(fs);
-	if (inode == -1)
-		return -1;	
+
+int mfs_rmdir(const char *pathname)
+{	
+	if (rpc_client())
+		return rpc_path(RPC_RMDIR, pathname, NULL, 0, NULL, 0);
+	if (!strcmp(pathname, "/")) { /* no se va a dejar borra el directorio raiz */
+		errno = EACCES;
+		return -1;
+	}
+
+	if (fs_init() < 0)
+		return -1;
 	
-	/* leer todos los bloques para ponerlos como sin ocupar */
-	if (inode_read(fs, &ino, inode)!=1)
-		printf("Error al leer el inodo.\n");
-	ino.is_dir = 1;
-	ino.nlink  = 1;
+	int inode = namei(fs, &fs->root, pathname);
+	if (inode == -1) { /* El archivo a borrar no existe */
+		errno = ENOENT;
+		return -1;
+	}
 	
-	int i, j;
-	char block[fs->sb.block_size];
-	struct entry *entry;
-	entry = (struct entry*) block;
-	entry->next = entry->busy = entry->inode = -1;
-	for (i = 0; i < NUM_EXTENTS; i++) {/* Pongo todo como libre */
-		if (ino.e[i].start == -1)
-			break;
-		for (j = 0; j < ino.e[i].size; j++)	
-			data_write(fs, block, ino.e[i].start+j);
+	struct disk_inode ino;
+	inode_read(fs, &ino, inode);
+	if (!is_dir(ino.is_dir)){ /* Lo que te piden borrar no es un directorio */
+		errno = ENOTDIR;
+		return -1;
 	}
+	bool clean = is_clean(fs);
+	delete_directory(&ino, inode);
 	
-	/* Ahora me toca poner las entradas . y .. */
-	strncpy(entry->name, ".", 2);
-	entry->inode = inode;
-	entry->busy = strlen(".")+1;
-	entry->next = sizeof(short int) + (sizeof(int)*2 + entry->busy);
-/*
-printf("entry->inode = %d\n", entry->inode);
-printf("entry->busy  = %d\n", entry->busy);
-printf("entry->name  = '%s'\n", entry->name);
-printf("entry->next  = %d\n", entry->next);
-*/
-	entry = ((void *) block) + entry->next;
-	strncpy(entry->name, "..", 3);
-	entry->inode = inode;
-	entry->busy = strlen("..")+1;
-	entry->next = sizeof(short int) + sizeof(int)*2 + entry->busy;
+	/* ahora tengo que borrar la entra del directorio del padre */
 
-	entry = ((void *) entry) + entry->next;
-	entry->next = entry->busy = entry->inode = -1;
+	int inode_father = whos_father(ino);
+	if (inode_father == -1) {
+		printf("%s: No se pudo encontrar el direcotorio anterior\n", pathname);
+		return restore_dirty(fs, clean, -1);
+	}
+	log_inode(fs, inode_father, LOG_DIR);
+	log_inode(fs, inode, LOG_UNLINK);
+	free_inode(inode); /* pongo como libre el inodo y sus bloques asociados */
 	
-	if (data_write(fs, block, ino.e[0].start)!=1)
-		printf("Error al escribir el bloque.\n");
-	if (inode_write(fs, &ino, inode)!=1)
-		printf("Error a escribir el inodo.\n");
+	char *aux = rindex(pathname, '/');
+	aux = (aux == NULL)? (char *) pathname: aux+1;
+	
+	struct disk_inode ino_father;
+	inode_read(fs, &ino_father, inode_father);
+	del_entry_of_inode(fs, &ino_father, aux);
+	
+	return restore_dirty(fs, clean, 0);
+}
 
-	return inode;
+/* Reescribe el directorio pathname con las entradas ocupadas seguidas (sin
+ * huecos) y suelta los bloques del final que ya no hagan falta
+ *
+ * Devuelve el número de bloques liberados o -1 si hubo error
+ */
+int mfs_compactdir(const char *pathname)
+{
+	if (rpc_client())
+		return rpc_path(RPC_COMPACTDIR, pathname, NULL, 0, NULL, 0);
+	if (fs_init() < 0)
+		return -1;
+
+	int inode = namei(fs, &fs->root, pathname);
+	if (inode == -1) {
+		errno = ENOENT;
+		return -1;
+	}
+	struct disk_inode ino;
+	inode_read(fs, &ino, inode);
+	if (!is_dir(ino.is_dir)) {
+		errno = ENOTDIR;
+		return -1;
+	}
+
+	int bs = fs->sb.block_size;
+	int last = bs - (ENTRY_HEADER + 1); /* sitio para la entrada final */
+	int num_block = file_blocks(&ino);
+	char block[bs];
+	struct entry *entry;
+	struct dir_item *item = NULL;
+	int i, k, count = 0, max = 0;
+
+	if (ino.flags & INODE_BTREE) /* las hojas del árbol ya están empaquetadas */
+		return 0;
+
+	/* sacamos todas las entradas ocupadas */
+	for (i = 0; i < num_block; i++) {
+		file_read(fs, &ino, block, i);
+		entry = (struct entry *) block;
+		while (entry->next != -1) {
+			if ((entry->busy != -1) && (entry->inode != -1)) {
+				if (count == max) {
+					max = (max == 0)? 32: max * 2;
+					struct dir_item *aux = realloc(item, max * sizeof(struct dir_item));
+					if (aux == NULL) {
+						free(item);
+						errno = ENOMEM;
+						return -1;
+					}
+					item = aux;
+				}
+				item[count].inode = entry->inode;
+				strcpy(item[count].name, entry->name);
+				count++;
+			}
+			entry = ((void *) entry) + entry->next;
+		}
+	}
+
+	/* cuantos bloques hacen falta con las entradas seguidas */
+	int used = 0, needed = 1;
+	for (k = 0; k < count; k++) {
+		int len = ENTRY_HEADER + strlen(item[k].name) + 1;
+		if (used + len >= last) {
+			needed++;
+			used = 0;
+		}
+		used += len;
+	}
+	if (needed > num_block) { /* no debería pasar, pero no perdemos nada */
+		free(item);
+		errno = ENOSPC;
+		return -1;
+	}
+
+	bool clean = is_clean(fs);
+	for (i = k = 0; i < needed; i++) {
+		used = 0;
+		while (k < count) {
+			int len = ENTRY_HEADER + strlen(item[k].name) + 1;
+			if (used + len >= last)
+				break;
+			entry = (struct entry *) (block + used);
+			entry->next = len;
+			entry->busy = strlen(item[k].name) + 1;
+			entry->inode = item[k].inode;
+			strcpy(entry->name, item[k].name);
+			used += len;
+			k++;
+		}
+		entry = (struct entry *) (block + used);
+		entry->next = entry->busy = entry->inode = -1;
+		strcpy(entry->name, "");
+		file_write(fs, &ino, block, i);
+	}
+	free(item);
+
+	int freed = file_truncate_blocks(&ino, needed);
+	bitmap_write(fs);
+	inode_write(fs, &ino, inode);
+
+	return restore_dirty(fs, clean, freed);
 }
 
-int mfs_mkfs(char *name, int num_blocks, int size_block,
-	     int percent_inodes)
+/* número de trozos separados del disco en los que están los bloques del
+ * inodo (dos extents seguidos en disco cuentan como uno)
+ */
+static int extent_pieces(struct disk_inode *ino)
 {
-	printf("Creando sistema de ficheros %s con %d bloques de "
-	       "tamaño %d y porcentaje de inodos %d\n",
-	       name, num_blocks, size_block, percent_inodes);
+	int i, pieces = 0, next = -1;
 
-	fs = malloc(sizeof(struct file_system));
+	for (i = 0; (i < NUM_EXTENTS) && (ino->e[i].start != -1); i++) {
+		if (is_hole(ino->e[i]))
+			continue;
+		if (ino->e[i].start != next)
+			pieces++;
+		next = ino->e[i].start + ino->e[i].size;
+	}
 
-	if (fs == NULL)
-		return -ENOMEM;
-	memset(fs, '\0', sizeof(struct file_system));
+	return pieces;
+}
+
+/* Rellena st con cómo están repartidos por el disco los bloques de los
+ * ficheros y directorios
+ */
+int mfs_fragstats(struct mfs_frag_stats *st)
+{
+	struct disk_inode ino;
+	int i, j;
+
+	if (rpc_client())
+		return rpc_call(RPC_FRAGSTATS, 0, 0, 0, NULL, 0, st, sizeof(*st));
 
-	fs->dev = block_create(name, num_blocks, size_block);
-	if (fs->dev == NULL) {
-		printf("Error creando el sistama de ficheros %s\n",
-		       name);
-		perror("creando");;
+	if (fs_init() < 0)
 		return -1;
+	memset(st, '\0', sizeof(struct mfs_frag_stats));
+	for (i = 0; i < inode_count(fs); i++) {
+		inode_read(fs, &ino, i);
+		if ((ino.size == -1) || (ino.e[0].start == -1))
+			continue;
+		st->files++;
+		st->blocks += file_blocks(&ino) - file_holes(&ino);
+		for (j = 0; (j < NUM_EXTENTS) && (ino.e[j].start != -1); j++)
+			st->extents++;
+		if (extent_pieces(&ino) > 1)
+			st->fragmented++;
 	}
-	if (sb_init(fs, num_blocks, percent_inodes) <= 0)
-		return -1;
-	if (bitmap_init(fs) <= 0)
-		return -1;
-	if (inodes_init(fs) <= 0)
-		return -1;
-	if (data_init(fs) <= 0)
-		return -1;
-	fs->sb.root_inode = dir_create(fs);
-	if (fs->sb.root_inode < 0)
-		return -1;
-	sb_write(fs->dev, &(fs->sb));
 
 	return 0;
 }
 
-int my_mkfs(int num_blocks, int size_block, int percent_inodes)
+/* Mueve todos los bloques del inodo a un solo trozo de bloques libres. Los
+ * extents se leen cada uno con su readv (están separados en disco) y se
+ * escriben todos juntos con un solo writev en el sitio nuevo. El cambio
+ * está en la escritura del inodo: antes de ella el fichero sigue en los
+ * bloques viejos y los nuevos solo están marcados en el bitmap
+ *
+ * Devuelve 1 si lo movió, 0 si no hacía falta o no se puede (bloques
+ * compartidos o no hay un hueco tan grande) y -1 si hubo error
+ */
+static int defrag_inode(struct disk_inode *ino, int inode_num)
 {
-	char *name = getenv("MFS_NAME");
-	if (name == NULL) {
-		printf("MFS_NAME not set\n");
-		name = default_name;
-		printf("used '%s' like file system\n", name);
+	int bs = fs->sb.block_size;
+	int n = file_blocks(ino);
+	int i, j, target;
+
+	if (file_holes(ino) > 0) /* los huecos necesitan sus extents */
+		return 0;
+	if (extent_pieces(ino) == 1) {
+		if (ino->e[1].start == -1)
+			return 0;
+		/* ya están seguidos en disco: basta con juntar los extents */
+		ino->e[0].size = n;
+		for (i = 1; i < NUM_EXTENTS; i++)
+			ino->e[i].start = ino->e[i].size = -1;
+		inode_write(fs, ino, inode_num);
+		return 1;
 	}
-	printf("Creando sistema de ficheros %s con %d bloques de "
-	       "tamaño %d y porcentaje de inodos %d\n",
-	       name, num_blocks, size_block, percent_inodes);
 
-	fs = malloc(sizeof(struct file_system));
+	for (i = 0; (i < NUM_EXTENTS) && (ino->e[i].start != -1); i++)
+		for (j = 0; j < ino->e[i].size; j++)
+			if (fs->refcount[ino->e[i].start + j]) /* compartido con otro fichero */
+				return 0;
 
-	if (fs == NULL)
-		return -ENOMEM;
-	memset(fs, '\0', sizeof(struct file_system));
+	target = catch_block_together(fs, n, ino->e[0].start);
+	if ((target == -1) || (alloc_run(fs, target, n) == -1))
+		return 0;
 
-	fs->dev = block_create(name, num_blocks, size_block);
-	if (fs->dev == NULL) {
-		printf("Error creando el sistama de ficheros %s\n",
-		       name);
-		perror("creando");;
+	char *buffer = malloc((size_t) n * bs);
+	struct iovec iov[NUM_EXTENTS];
+	size_t len = 0;
+	int num_extents;
+
+	if (buffer == NULL) {
+		alloc_release(fs, target, n);
+		errno = ENOMEM;
 		return -1;
 	}
-	if (sb_init(fs, num_blocks, percent_inodes) <= 0)
-		return -1;
-	if (bitmap_init(fs) <= 0)
-		return -1;
-	if (inodes_init(fs) <= 0)
-		return -1;
-	if (data_init(fs) <= 0)
-		return -1;
-	fs->sb.root_inode = dir_create(fs);
-	if (fs->sb.root_inode < 0)
-		return -1;
-	sb_write(fs->dev, &(fs->sb));
+	/* los extents se leen a la vez */
+	for (i = 0; (i < NUM_EXTENTS) && (ino->e[i].start != -1); i++) {
+		iov[i].iov_base = buffer + len;
+		iov[i].iov_len = (size_t) ino->e[i].size * bs;
+		for (j = 0; j < ino->e[i].size; j++)
+			if (data_queue(fs, buffer + len + (size_t) j * bs,
+				       ino->e[i].start + j, false) < 0)
+				break;
+		len += iov[i].iov_len;
+		if (j < ino->e[i].size) /* data_wait da el error */
+			break;
+	}
+	num_extents = i;
+	if (data_wait(fs) == -1)
+		goto error;
+	if (block_writev(fs->dev, iov, num_extents, data_offset(fs) + target) != len)
+		goto error;
 
-	return 0;
+	bitmap_write(fs);
+
+	struct disk_inode old = *ino;
+	ino->e[0].start = target;
+	ino->e[0].size = n;
+	for (i = 1; i < NUM_EXTENTS; i++)
+		ino->e[i].start = ino->e[i].size = -1;
+	inode_write(fs, ino, inode_num);
+
+	file_truncate_blocks(&old, 0); /* los bloques viejos ya no son de nadie */
+	bitmap_write(fs);
+	free(buffer);
+
+	return 1;
+error:
+	alloc_release(fs, target, n);
+	free(buffer);
+	errno = EIO;
+	return -1;
 }
 
-static int sb_print(struct file_system *fs)
+/* Junta en un solo trozo de disco los bloques de cada fichero o directorio
+ * que esté repartido (menos los que están abiertos). En before y after (si
+ * no son NULL) deja las estadísticas de antes y de después
+ *
+ * Devuelve cuantos inodos se cambiaron o -1 si hubo error
+ */
+int mfs_defrag(struct mfs_frag_stats *before, struct mfs_frag_stats *after)
 {
-	printf("Printing Superblock info:\n");
-	printf("block_size = %d\n", fs->sb.block_size);
-	printf("num_inodes = %d\n", fs->sb.num_inodes);
-	printf("num_bitmap = %d\n", fs->sb.num_bitmap);
-	printf("num_data_blocks = %d\n", fs->sb.num_data_blocks);
+	struct disk_inode ino;
+	int i, ret, moved = 0;
 
-	return 1;
+	if (rpc_client()) {
+		struct mfs_frag_stats st[2];
+		ret = rpc_call(RPC_DEFRAG, 0, 0, 0, NULL, 0, st, sizeof(st));
+		if (ret == -1)
+			return -1;
+		if (before != NULL)
+			*before = st[0];
+		if (after != NULL)
+			*after = st[1];
+		return ret;
+	}
+	if (fs_init() < 0)
+		return -1;
+	if (before != NULL)
+		mfs_fragstats(before);
+
+	bool clean = is_clean(fs);
+	for (i = 0; i < inode_count(fs); i++) {
+		inode_read(fs, &ino, i);
+		if ((ino.size == -1) || (ino.e[0].start == -1) || inode_open(i))
+			continue;
+		if ((ret = defrag_inode(&ino, i)) == -1)
+			return restore_dirty(fs, clean, -1);
+		moved += ret;
+	}
+
+	if (after != NULL)
+		mfs_fragstats(after);
+
+	return restore_dirty(fs, clean, moved);
 }
 
-static int bitmap_print(struct file_system *fs)
+/* bloques de datos libres (de los contadores de los grupos) */
+static int free_blocks(struct file_system *fs)
 {
-	int i;
-	for (i = 0; i < fs->sb.num_data_blocks; i++)
-		if (bitmap_get(fs, i))
-			printf("data block %i used\n", i);
-	return 1;
+	int i, n = 0;
+
+	for (i = 0; i < fs->num_groups; i++)
+		n += fs->group[i].free_blocks;
+	return n;
 }
 
-static int inodes_print(struct file_system *fs)
+/* Deduplicación de todo el sistema de ficheros: se calcula la huella de
+ * cada bloque de cada fichero y se comparten los que ya estén en el índice
+ * (si no hay tabla de huellas se crea). Los ficheros abiertos no se tocan.
+ * En st se dejan las estadísticas
+ *
+ * Devuelve cuantos bloques quedaron libres o -1 si hubo error
+ */
+int mfs_dedup(struct mfs_dedup_stats *st)
 {
-	int i;
-	for (i = 0; i < fs->sb.num_inodes; i++) {
-		struct disk_inode ino;
+	struct disk_inode ino;
+	struct timespec t0, t1;
+	int i, before;
+
+	if (rpc_client())
+		return rpc_call(RPC_DEDUP, 0, 0, 0, NULL, 0, st, sizeof(*st));
+
+	if (fs_init() < 0)
+		return -1;
+	memset(st, '\0', sizeof(struct mfs_dedup_stats));
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	bool clean = is_clean(fs);
+	if (dedup_table(fs) == -1)
+		return restore_dirty(fs, clean, -1);
+	before = free_blocks(fs);
+	for (i = 0; i < inode_count(fs); i++) {
 		inode_read(fs, &ino, i);
-		if (ino.size == -1)
+		if ((ino.size == -1) || is_dir(ino.is_dir) || (ino.e[0].start == -1) ||
+		    inode_open(i)) /* su fd tiene los extents de antes */
 			continue;
-		printf("Inode %d used\n", i);
-		printf("\tsize = %d\n", ino.size);
-		printf("\tstart = %d\n", ino.e[0].start);
-		printf("\tnum = %d\n", ino.e[0].size);
+		st->files++;
+		if (dedup_inode(&ino, i, 0, file_blocks(&ino) - 1, st) == -1)
+			return restore_dirty(fs, clean, -1);
 	}
+	st->freed = free_blocks(fs) - before;
+	st->block_size = fs->sb.block_size;
 
-	return 1;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	st->time = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	return restore_dirty(fs, clean, st->freed);
 }
 
-static int data_print(struct file_system *fs)
+/* Hace más grande el sistema de ficheros, hasta num_blocks bloques (como
+ * en mfs_mkfs), y añade inode_blocks bloques a la tabla de inodos.
+ *
+ * No se mueve ningún dato: los bloques nuevos van al final de la zona de
+ * datos y lo que ya no cabe de bitmap, referencias e inodos en las zonas
+ * del principio se guarda en un trozo reservado de la zona de datos (la
+ * extensión). Si la extensión tiene que crecer se copia a un trozo nuevo y
+ * se suelta la vieja, así que solo se copian bloques de la tabla de inodos
+ *
+ * Devuelve 0 o -1 si hubo error
+ */
+int mfs_resize(int num_blocks, int inode_blocks)
 {
-	int i;
-	char unitialized[fs->sb.block_size];
+	if (daemon_busy() || (fs_init() < 0))
+		return -1;
 
-	memset(unitialized, '@', fs->sb.block_size);
-	for (i = 0; i < fs->sb.num_data_blocks; i++) {
-		char block[fs->sb.block_size];
-		data_read(fs, block, i);
-		if (memcmp(block, unitialized,
-			    fs->sb.block_size) == 0)
-			continue;
-		printf("Data block %d used\n", i);
-		printf("*****\n\n");
-		printf("%s", block);
-		printf("\n\n*****\n");
+	int bs = fs->sb.block_size;
+	int old_blocks = block_get_num_blocks(fs->dev);
+	int i, need;
+
+	if ((num_blocks < old_blocks) || (inode_blocks < 0)) {
+		errno = EINVAL;
+		return -1;
 	}
 
-	return 1;
+	/* antes de copiar nada: is_clean puede reservar el bloque del registro */
+	bool clean = is_clean(fs);
+	log_overflow(fs); /* cambia toda la geometría: mfs_debug -l no sirve */
+	struct super_block sb = fs->sb;
+
+	sb.num_data_blocks += num_blocks - old_blocks;
+	need = (sb.num_data_blocks + 8 * bs - 1) / (8 * bs) - sb.num_bitmap;
+	if (need > sb.ext_bitmap)
+		sb.ext_bitmap = need;
+	need = (sb.num_data_blocks + bs - 1) / bs - sb.num_refcount;
+	if (need > sb.ext_refcount)
+		sb.ext_refcount = need;
+	sb.ext_inodes += inode_blocks;
+
+	/* bitmap y referencias en memoria con el tamaño nuevo */
+	char *bitmap = calloc(sb.num_bitmap + sb.ext_bitmap, bs);
+	unsigned char *refcount = calloc(sb.num_refcount + sb.ext_refcount, bs);
+	if ((bitmap == NULL) || (refcount == NULL)) {
+		free(bitmap);
+		free(refcount);
+		errno = ENOMEM;
+		return restore_dirty(fs, clean, -1);
+	}
+	memcpy(bitmap, fs->bitmap, bitmap_blocks(fs) * bs);
+	memcpy(refcount, fs->refcount, refcount_blocks(fs) * bs);
+
+	if (block_resize(fs->dev, num_blocks) == -1) {
+		free(bitmap);
+		free(refcount);
+		return restore_dirty(fs, clean, -1);
+	}
+	free(fs->bitmap);
+	free(fs->refcount);
+	fs->bitmap = bitmap;
+	fs->refcount = refcount;
+	fs->sb.num_data_blocks = sb.num_data_blocks;
+	groups_init(fs); /* hay más bloques (y puede que más grupos) */
+
+	int old_total = ext_blocks(fs);
+	int total = sb.ext_bitmap + sb.ext_refcount + sb.ext_inodes;
+	if (total != old_total) {
+		int start = catch_block_together(fs, total, 0);
+		if ((start == -1) || (alloc_run(fs, start, total) == -1)) {
+			errno = ENOSPC;
+			return restore_dirty(fs, clean, -1);
+		}
+
+		/* los inodos que ya había en la extensión se copian y los
+		 * bloques nuevos se llenan de inodos libres */
+		int old_inodes = ext_offset(fs) + fs->sb.ext_bitmap + fs->sb.ext_refcount;
+		int new_inodes = data_offset(fs) + start + sb.ext_bitmap + sb.ext_refcount;
+		if ((fs->sb.ext_inodes > 0) &&
+		    (block_copy(fs->dev, old_inodes, new_inodes, fs->sb.ext_inodes) == -1))
+			return restore_dirty(fs, clean, -1);
+
+		char block[bs];
+		struct disk_inode ino;
+		memset(&ino, '\0', sizeof(struct disk_inode));
+		ino.size = -1;
+		ino.e[0].start = ino.e[0].size = -1;
+		for (i = 0; i < bs / (int) sizeof(struct disk_inode); i++)
+			memcpy(block + i * sizeof(struct disk_inode), &ino,
+			       sizeof(struct disk_inode));
+		for (i = fs->sb.ext_inodes; i < sb.ext_inodes; i++)
+			block_write(fs->dev, block, new_inodes + i);
+
+		for (i = 0; i < old_total; i++) /* la extensión vieja ya no hace falta */
+			bitmap_clear(fs, fs->sb.ext_start + i);
+		sb.ext_start = start;
+	}
+
+	sb.dirty = fs->sb.dirty;
+	fs->sb = sb;
+	for (i = 0; i < bitmap_blocks(fs); i++) /* todo: puede haber bloques nuevos */
+		block_write(fs->dev, fs->bitmap + i * bs, bitmap_block(fs, i));
+	for (i = 0; i < refcount_blocks(fs); i++)
+		refcount_write(fs, i * bs);
+	sb_write(fs->dev, &fs->sb);
+	groups_init(fs); /* los inodos de cada grupo han cambiado */
+	if ((fs->dedup != NULL) && (dedup_flush(fs) == 0)) /* hay más bloques */
+		dedup_load(fs, true);
+
+	return restore_dirty(fs, clean, 0);
 }
 
-static int root_dir_print(struct file_system *fs)
+/* Mis debug */
+static int sb_info(struct file_system *fs)
 {
-	struct disk_inode root;
-	int i, j;
-	char block[fs->sb.block_size];
-	struct entry *dir = (struct entry *)block;
 
-	printf("Printing root directory:\n");
-	inode_read(fs, &root, fs->sb.root_inode);
+	printf("*******************************\n");
+	printf("**            SB             **\n");
+	printf("*******************************\n");
+	printf("** version : %15d **\n", fs->sb.version);
+	printf("** block_size : %12d **\n", fs->sb.block_size);
+	printf("** num_inodes : %12d **\n", fs->sb.num_inodes);
+	printf("** num_bitmap : %12d **\n", fs->sb.num_bitmap);
+	printf("** num_refcount : %10d **\n", fs->sb.num_refcount);
+	printf("** num_data_blocks : %7d **\n", fs->sb.num_data_blocks);
+	if (ext_blocks(fs) > 0) {
+		printf("** ext_start : %13d **\n", fs->sb.ext_start);
+		printf("** ext_bitmap : %12d **\n", fs->sb.ext_bitmap);
+		printf("** ext_refcount : %10d **\n", fs->sb.ext_refcount);
+		printf("** ext_inodes : %12d **\n", fs->sb.ext_inodes);
+	}
+	if (fs->log != NULL)
+		printf("** log_block : %13d **\n", fs->sb.log_block);
+	if (fs->sb.zip_cluster > 0)
+		printf("** zip_cluster : %11d **\n", fs->sb.zip_cluster);
+	if (fs->sb.dedup_blocks > 0) {
+		printf("** dedup_start : %11d **\n", fs->sb.dedup_start);
+		printf("** dedup_blocks : %10d **\n", fs->sb.dedup_blocks);
+	}
+	if (block_get_checksums(fs->dev) == 1)
+		printf("** checksums : crc32c %6s **\n", crc32c_name());
+	printf("** dirty :             %s **\n", (fs->sb.dirty)? " True":"False");
+	printf("*******************************\n\n");
+	
+	return 0;
+}
 
-	for (i = 0; i < root.e[0].size; i++) {
-		file_read(fs, &root, block, i);
-		for (j = 0; j < fs->sb.block_size / sizeof(struct entry); j++)
-			if (dir[j].inode != -1) {
-				printf("\t%s : inode %d\n", dir[j].name,
-				       dir[j].inode);
-			}
+static int inode_info(struct file_system *fs, bool all)
+{/* all=true  -> muestra todos los inodos
+  * all=flase -> muestra solo los ocupados
+  */
+	printf("********************************\n");
+	printf("**           INODE            **\n");
+	printf("********************************\n");
+	
+	int i, j;
+	struct disk_inode ino;
+
+	int num_inodes = inode_count(fs);
+	
+	for (i = 0; i < num_inodes; i++) {
+		inode_read(fs, &ino, i);
+		if ((ino.size == -1) && (!all))
+			continue;
+		
+		printf("inode: %3d\n", i);
+		printf("\tsize: %5d\n", ino.size);
+		printf("\tnlink: %4d\n", ino.nlink);
+		printf("\tdir:     %s\n", (is_dir(ino.is_dir))? "Si": "No");
+		if (ino.flags & INODE_INLINE)
+			printf("\tinline:  Si\n");
+		if (ino.flags & INODE_TAIL)
+			printf("\ttail:    (block: %d, offset: %d)\n",
+			       ino.tail_block, ino.tail_offset);
+		if (ino.flags & INODE_BTREE)
+			printf("\tbtree:   Si (%d nodos)\n",
+			       ino.size / fs->sb.block_size);
+		if (ino.flags & INODE_ZIP)
+			printf("\tzip:     Si (%d bloques de %d)\n", file_blocks(&ino),
+			       (ino.size + fs->sb.block_size - 1) / fs->sb.block_size);
+		if (file_holes(&ino) > 0)
+			printf("\thuecos:  %d bloques\n", file_holes(&ino));
+		printf("\textents:\n");
+		for (j = 0; j < NUM_EXTENTS; j++) {
+			printf("\t\textent(%d)= (start: %d, size: %d)\n", j, ino.e[j].start, ino.e[j].size);
+		}
+		printf("\n");
 	}
-	return 1;
+	
+	printf("*******************************\n\n");
+	return 0;
 }
 
-int mfs_debug(char *name)
+static int bitmap_info(struct file_system *fs, bool all)
 {
-	printf("Depurando sistema de ficheros %s\n", name);
+	bitmap_read(fs);
+	
+	printf("*******************************\n");
+	printf("**          BITMAP           **\n");
+	printf("*******************************\n");
+	
+	int i;
+	for (i = 0; i < fs->sb.num_data_blocks; i++)
+		if (!bitmap_get(fs, i) && !all)
+			continue;
+		else
+			printf("** block: %8d used: %s **\n", i, (bitmap_get(fs,i))?"Yes":"No ");
+	
+	printf("*******************************\n\n");
+	return 0;
+}
+
+static int data_block_info(struct file_system *fs, bool all)
+{
+	int i;
+	char block[fs->sb.block_size];
+	bitmap_read(fs);
+	
+	printf("*******************************\n");
+	printf("**        DATA BLOCK         **\n");
+	printf("*******************************\n");
+
+	for (i = 0; i < fs->sb.num_data_blocks; i++) {
+		if (!bitmap_get(fs, i) && !all)
+			continue;
+		data_read(fs, (void *) block, i);
+		printf("------ block: %3d -%s--\n",i,bitmap_get(fs, i)?"Yes":"No-");
+		printf("%s\n", block);
+		printf("-------------------------\n\n");
+		
+	}		
+	
+	printf("*******************************\n\n");
+	
+	return 0;
+}
 
-	fs_init();
+#define RUN_BUCKETS 32 /* trozos libres de 1, 2-3, 4-7, 8-15, ... bloques */
 
-	if (sb_print(fs) <= 0)
-		return -1;
-	if (bitmap_print(fs) <= 0)
-		return -1;
-	if (inodes_print(fs) <= 0)
-		return -1;
-	if (data_print(fs) <= 0)
-		return -1;
-	if (root_dir_print(fs) <= 0)
-		return -1;
+struct free_space {
+	int free; /* bloques libres */
+	int runs; /* trozos de bloques libres seguidos */
+	int largest; /* el trozo más grande */
+	int hist[RUN_BUCKETS];
+};
 
-	return 0;
+static void free_run_add(struct free_space *f, int len)
+{
+	int b = 0;
+
+	if (len == 0)
+		return;
+	f->runs++;
+	f->free += len;
+	if (len > f->largest)
+		f->largest = len;
+	while ((len >>= 1) != 0)
+		b++;
+	f->hist[b]++;
 }
 
-int mfs_stat(const char *path, struct stat *buf)
+/* Recorre el bitmap de 64 en 64 bits: las palabras del todo libres o del
+ * todo ocupadas se pasan de una vez y solo se miran bit a bit las mezcladas
+ */
+static void free_space_scan(struct free_space *f)
 {
-	fs_init();
-
-	int inode = namei(fs, &fs->root, path);
-	if (inode == -1) {
-		errno = ENOENT;
-		return -1;	
+	int n = fs->sb.num_data_blocks, i = 0, run = 0;
+	uint64_t word;
+
+	memset(f, '\0', sizeof(struct free_space));
+	while (i < n) {
+		if ((i % 64 == 0) && (i + 64 <= n)) {
+			memcpy(&word, fs->bitmap + i / 8, sizeof(word));
+			if (word == 0) {
+				run += 64;
+				i += 64;
+				continue;
+			}
+			if (word == ~(uint64_t) 0) {
+				free_run_add(f, run);
+				run = 0;
+				i += 64;
+				continue;
+			}
+		}
+		if (bitmap_get(fs, i)) {
+			free_run_add(f, run);
+			run = 0;
+		} else
+			run++;
+		i++;
 	}
-	struct disk_inode ino;
-	inode_read(fs, &ino, inode);
-	
-	buf->st_ino = inode;
-	buf->st_size = ino.size;
-	buf->st_nlink = ino.nlink;
-	buf->st_mode = 0;
-	if (is_dir(ino.is_dir))
-		buf->st_mode |= S_IFDIR;
-	
-	int i, blocks = 0;
-	for (i = 0; i < NUM_EXTENTS; i++)
-		if (ino.e[i].start != -1)
-			blocks += ino.e[i].size;
-			
-	buf->st_blocks = blocks;
-	
-	return 0;
+	free_run_add(f, run);
 }
 
-static int create_directory(int previous_inode)
+struct usage_stats {
+	int used; /* inodos ocupados */
+	int files; /* ficheros normales */
+	int inline_files; /* con los datos dentro del inodo */
+	int tail_files; /* con la cola en un bloque de fragmentos */
+	int zip_files; /* comprimidos */
+	int zip_blocks; /* bloques que ocupan */
+	int zip_raw; /* los que ocuparían sin comprimir */
+	int sparse_files; /* con huecos */
+	int hole_blocks; /* bloques de esos huecos */
+	int extents[NUM_EXTENTS + 1]; /* ficheros con 0, 1, ... extents */
+	int with_blocks; /* ficheros con algún bloque de datos */
+	double contiguity; /* suma de la contigüidad de esos ficheros */
+	int dirs; /* directorios */
+	int btree; /* de ellos, en árbol */
+	int entries; /* entradas de todos los directorios */
+	int dir_blocks; /* bloques que tienen asignados */
+	long dir_bytes; /* bytes de esos bloques que se usan */
+};
+
+/* Suma a st las entradas de un directorio y lo que ocupan */
+static void dir_usage(struct disk_inode *ino, struct usage_stats *st)
 {
-	int inode = get_free_inode(fs);
-	if (inode == -1)
-		return -1;
-		
 	char block[fs->sb.block_size];
-	struct entry *entry = (struct entry*) block;
+	struct bt_header *h = (struct bt_header *) block;
+	struct entry *entry;
+	int i, k, blocks = file_blocks(ino);
+
+	st->dir_blocks += blocks;
+	if (ino->flags & INODE_BTREE) {
+		for (i = 0; i < ino->size / fs->sb.block_size; i++) {
+			file_read(fs, ino, block, i);
+			char *p = block + sizeof(struct bt_header);
+			for (k = 0; k < h->count; k++)
+				p += bt_rec_len(p);
+			st->dir_bytes += p - block;
+			if (h->leaf)
+				st->entries += h->count;
+		}
+		return;
+	}
+	for (i = 0; i < blocks; i++) {
+		file_read(fs, ino, block, i);
+		entry = (struct entry *) block;
+		while (entry->next != -1) {
+			if ((entry->busy != -1) && (entry->inode != -1)) {
+				st->entries++;
+				st->dir_bytes += ENTRY_HEADER + entry->busy;
+			}
+			entry = ((void *) entry) + entry->next;
+		}
+	}
+}
 
-	entry->next = entry->busy = entry->inode = -1;
-	strcmp(entry->name, "");
+/* Suma a st un inodo ocupado */
+static void inode_usage(struct disk_inode *ino, struct usage_stats *st)
+{
+	int n, pieces;
+
+	st->used++;
+	if (is_dir(ino->is_dir)) {
+		st->dirs++;
+		if (ino->flags & INODE_BTREE)
+			st->btree++;
+		dir_usage(ino, st);
+		return;
+	}
+	st->files++;
+	if (ino->flags & INODE_INLINE)
+		st->inline_files++;
+	if (ino->flags & INODE_TAIL)
+		st->tail_files++;
+	if (ino->flags & INODE_ZIP) {
+		st->zip_files++;
+		st->zip_raw += (ino->size + fs->sb.block_size - 1) / fs->sb.block_size;
+		st->zip_blocks += file_blocks(ino);
+	}
+	if ((n = file_holes(ino)) > 0) {
+		st->sparse_files++;
+		st->hole_blocks += n;
+	}
+	st->extents[extent_count(ino)]++;
+	if ((n = file_blocks(ino) - n) == 0)
+		return;
+	/* bloques que van seguidos del anterior en disco de los que podrían */
+	pieces = extent_pieces(ino);
+	st->with_blocks++;
+	st->contiguity += (n == 1)? 1.0: (double) (n - pieces) / (n - 1);
+}
 
+/* Análisis del sistema de ficheros en JSON: trozos libres, extents por
+ * fichero, contigüidad y ocupación de inodos y directorios. Se hace con
+ * una sola pasada por el bitmap y otra por la tabla de inodos
+ */
+int my_analysis(void)
+{
+	struct free_space f;
+	struct usage_stats st;
 	struct disk_inode ino;
-	inode_read(fs, &ino, inode);
-	ino.is_dir = 1;
+	int i, k, last;
 
-	int i;
-	for (i = 0; i < ino.e[0].size; i++)
-		data_write(fs, (void *) block, ino.e[0].start+i);
+	if (fs_init() < 0)
+		return -1;
+	int inode_per_block = fs->sb.block_size / sizeof(struct disk_inode);
+	char block[fs->sb.block_size];
 
-	/* Ahora me toca poner las entradas . y .. */
-	strncpy(entry->name, ".", 2);
-	entry->inode = inode;
-	entry->busy = strlen(".")+1;
-	entry->next = sizeof(short int) + (sizeof(int)*2 + entry->busy);
+	free_space_scan(&f);
 
-	entry = ((void *) block) + entry->next;
-	strncpy(entry->name, "..", 3);
-	entry->inode = previous_inode;
-	entry->busy = strlen("..")+1;
-	entry->next = sizeof(short int) + sizeof(int)*2 + entry->busy;
+	memset(&st, '\0', sizeof(struct usage_stats));
+	for (i = 0; i < inode_blocks(fs); i++) {
+		block_read(fs->dev, block, inode_block(fs, i));
+		for (k = 0; k < inode_per_block; k++) {
+			memcpy(&ino, block + k * sizeof(struct disk_inode),
+			       sizeof(struct disk_inode));
+			if (ino.size != -1)
+				inode_usage(&ino, &st);
+		}
+	}
 
-	entry = ((void *) entry) + entry->next;
-	entry->next = entry->busy = entry->inode = -1;
+	printf("{\n");
+	printf("  \"block_size\": %d,\n", fs->sb.block_size);
+	printf("  \"data_blocks\": {\"total\": %d, \"used\": %d, \"free\": %d},\n",
+	       fs->sb.num_data_blocks, fs->sb.num_data_blocks - f.free, f.free);
+	printf("  \"free_space\": {\n");
+	printf("    \"runs\": %d,\n", f.runs);
+	printf("    \"largest_run\": %d,\n", f.largest);
+	printf("    \"histogram\": {");
+	for (last = RUN_BUCKETS - 1; (last > 0) && (f.hist[last] == 0); last--)
+		;
+	for (i = 0; i <= last; i++) {
+		if (i == 0)
+			printf("\"1\": %d", f.hist[0]);
+		else
+			printf(", \"%d-%d\": %d", 1 << i, (1 << (i + 1)) - 1, f.hist[i]);
+	}
+	printf("}\n  },\n");
+	printf("  \"files\": {\n");
+	printf("    \"count\": %d,\n", st.files);
+	printf("    \"inline\": %d,\n", st.inline_files);
+	printf("    \"tail\": %d,\n", st.tail_files);
+	printf("    \"compressed\": {\"count\": %d, \"blocks\": %d, \"raw_blocks\": %d},\n",
+	       st.zip_files, st.zip_blocks, st.zip_raw);
+	printf("    \"sparse\": {\"count\": %d, \"hole_blocks\": %d},\n",
+	       st.sparse_files, st.hole_blocks);
+	printf("    \"extents_per_file\": {");
+	for (i = 0; i <= NUM_EXTENTS; i++)
+		printf("%s\"%d\": %d", (i == 0)? "": ", ", i, st.extents[i]);
+	printf("},\n");
+	printf("    \"contiguity\": %.4f\n", (st.with_blocks == 0)? 1.0:
+	       st.contiguity / st.with_blocks);
+	printf("  },\n");
+	printf("  \"inodes\": {\"total\": %d, \"used\": %d, \"occupancy\": %.4f},\n",
+	       inode_count(fs), st.used, (double) st.used / inode_count(fs));
+	printf("  \"directories\": {\"count\": %d, \"btree\": %d, \"entries\": %d, "
+	       "\"blocks\": %d, \"occupancy\": %.4f}\n", st.dirs, st.btree,
+	       st.entries, st.dir_blocks, (st.dir_blocks == 0)? 0.0:
+	       (double) st.dir_bytes / ((double) st.dir_blocks * fs->sb.block_size));
+	printf("}\n");
 
-	data_write(fs, block, ino.e[0].start);
-	inode_write(fs, &ino, inode);
-	
-	return inode;
+	return 0;
 }
 
-static int add_directory(int num_inode, char *name)
+int my_info(bool h_i, bool i, bool h_b, bool b, bool h_d, bool d)
 {
-	if (!is_name_valid(name))
-		return -1;
-
-	int new_inode = create_directory(num_inode);
-	if (new_inode == -1)
+	if (fs_init() < 0)
 		return -1;
+/*
+printf("superblock = %d\n", sizeof(struct super_block));
+printf("extent = %d\n", sizeof(struct extent));
+printf("disk_inode = %d\n", sizeof(struct disk_inode));
+printf("entry = %d\n", sizeof(struct entry));
+printf("file = %d\n", sizeof(struct file));
+*/
 
-	struct disk_inode ino;
-	inode_read(fs, &ino, num_inode);
-
-	if (add_entry_to_inode(fs, &ino, new_inode, name, num_inode) == -1) {
-		free_inode(new_inode);
-		return -1;	
-	}
+	sb_info(fs);
+	if (!h_i)
+		inode_info(fs, i);
+	if (!h_b)
+		bitmap_info(fs, b);
+	if (!h_d)
+		data_block_info(fs, d);
 	
-	return new_inode;
+	return 0;
 }
 
-int mfs_mkdir(const char *pathname, mode_t mode)
+static int init_check_data(int *data)
 {
-	fs_init();
+	int i;
+	for (i = 0; i < fs->sb.num_data_blocks; i++)
+		data[i] = 0;
+	
+	return 0;
+}
 
-	if (!strcmp("/", pathname)) {
-		errno = EEXIST;	
-		return -1;
-	}
+struct inode_info {
+	bool busy;
+	int dir; /* inode del directorio donde está */	
+};
 
-	if (namei(fs, &fs->root, pathname) != -1) {
-		errno = EEXIST;
-		return -1;
+/* cuenta cuantos inodos referencian cada bloque de datos */
+static int check_data(int *data, struct inode_info *inode_info)
+{
+	int i;
+	struct disk_inode ino;
+	int e, j;
+	for (i = 0; i < inode_count(fs); i++) {
+		if (!inode_info[i].busy)/* inodo libre miramos el siguiente */
+			continue;
+		inode_read(fs, &ino, i);
+		for (e = 0; e < NUM_EXTENTS; e++) {/* Para empezar a marcar los bloques ocupados */
+			if (ino.e[e].start == -1)
+				break;
+			for (j = 0; !is_hole(ino.e[e]) && (j < ino.e[e].size); j++)
+				data[ino.e[e].start+j]++;
+		}
+		if (ino.flags & INODE_TAIL) /* bloque de fragmentos: sin refcount */
+			data[ino.tail_block] = -1;
+		
 	}
-
-	pathname = (*pathname == '/')? pathname+1: pathname;
+	for (i = 0; i < ext_blocks(fs); i++) /* la extensión de mfs_resize */
+		data[fs->sb.ext_start + i] = 1;
+	if (fs->log != NULL) /* y el registro de cambios */
+		data[fs->sb.log_block] = 1;
+	for (i = 0; i < fs->sb.dedup_blocks; i++) /* y la tabla de huellas */
+		data[fs->sb.dedup_start + i] = 1;
 	
-	bool clean = is_clean(fs);
-	int inode, num_inode = fs->sb.root_inode;
-	struct disk_inode ino;
-	pathname = strtok((char *) pathname, "/");
-	while (pathname != NULL) {
-		inode_read(fs, &ino, num_inode);
-		inode = sub_namei(fs, &ino, pathname);
+	return 0;
+}
 
-		if (inode == -1) {
-//printf("num_inode: %d\npath: %s\n",num_inode, pathname);
-			if ((num_inode = add_directory(num_inode, (char *) pathname)) == -1) {
-				printf("%s: cannot create directory\n", pathname);
-				return restore_dirty(fs, clean, -1);
-			}	
-			inode = num_inode;	
-		} else
-			num_inode = inode;
-//printf("inode = %d\n",num_inode);
-		pathname = strtok(NULL, "/");	
+static int init_check_inode(struct inode_info *inode_info)
+{
+	int i = 0;
+	for (; i < inode_count(fs); i++) {
+		inode_info[i].busy = false;
+		inode_info[i].dir = -1;
 	}
 	
-	return restore_dirty(fs, clean, 1);
+	return 0;	
 }
-/*
-static int my_rmdir(struct disk_inode *ino)
+
+/* para del_entry: se queda con el nombre de la primera entrada del inodo */
+static int find_item(struct dir_item *it, void *arg)
 {
-	// voy recorrer una a una todas las entradas del directorio
+	struct dir_item *want = arg;
+
+	if (it->inode != want->inode)
+		return 0;
+	strcpy(want->name, it->name);
+	return 1;
+}
+
+static int del_entry(struct disk_inode ino, int num_inode)
+{
+	if (!is_dir(ino.is_dir))
+		return -1;
+	if (ino.flags & INODE_BTREE) {
+		struct dir_item want;
+		want.inode = num_inode;
+		while (bt_foreach(&ino, find_item, &want) == 1)
+			if (bt_delete(&ino, want.name) == -1)
+				return -1;
+		return 0;
+	}
+		
 	int i, j;
 	char block[fs->sb.block_size];
 	struct entry *entry;
-	struct disk_inode  aux_ino;
-	
-	for (i = 0; i < NUM_EXTENTS; i++) {// Me muevo por los extents
-		if (ino->e[i].start == -1)
-			continue;
-
-		for (j = 0; j < ino->e[i].size; j++) {
-			data_read(fs, block, ino->e[i].start+j);
+	for (i = 0; i < NUM_EXTENTS; i++) {
+		if (ino.e[i].start == -1)
+			break;
+		for (j = 0; j < ino.e[i].size; j++) {
+			data_read(fs, block, ino.e[i].start +j);
 			entry = (struct entry *) block;
-			
+			bool changed = false;
 			while (entry->next != -1) {
-				if ((entry->inode == -1) || (entry->busy == -1) || (!strcmp(entry->name,".")) ||
-					(!strcmp(entry->name, ".."))) {
-					entry = ((void *) entry) + entry->next;
-					continue;
-				}
-				
-				inode_read(fs, &aux_ino, entry->inode);
-				if (is_dir(aux_ino.is_dir))
-					if (my_rmdir(&aux_ino) == -1)
-						return -1;
-						
-				if (free_inode(entry->inode) == -1) {
-					printf("%s: cannot delete\n", entry->name);
-					return -1;
+				if (entry->inode == num_inode) {
+					entry->busy = entry->inode = -1;
+					strcpy(entry->name, "");
+					changed = true;
 				}
-				
-				// quitamos la entrada
-				entry->busy = entry->inode = -1;
-				strcmp(entry->name, "");
-				data_write(fs, block, ino->e[i].start + j);
-				
 				entry = ((void *) entry) + entry->next;
 			}
+			if (changed) {
+				entry_coalesce(block);
+				data_write(fs, block, ino.e[i].start + j);
+			}
 		}
 	}
-	
+	return 0;	
+}
+
+/* Comprobación en serie
+ *
+ * No hay recursión ni arrays en la pila: el árbol se recorre con una pila
+ * explícita en memoria dinámica, de cada inodo solo se guardan dos bits
+ * (referenciado y directorio ya recorrido) y los bloques de datos se cuentan
+ * por ventanas de CHECK_WINDOW bloques, releyendo la tabla de inodos en cada
+ * una. Así la memoria no depende del tamaño de la imagen
+ */
+
+#define CHECK_WINDOW (1 << 24) /* bloques de datos por ventana (~20MB) */
+
+#define bits_get(bits, i) (((bits)[(i) / 8] >> ((i) % 8)) & 1)
+#define bits_set(bits, i) ((bits)[(i) / 8] |= 1 << ((i) % 8))
+#define bits_clear(bits, i) ((bits)[(i) / 8] &= ~(1 << ((i) % 8)))
+
+struct check_ref {
+	int inode;
+	int dir; /* directorio de la entrada que lo referencia */
+	int seq; /* orden en el que se encontró */
+};
+
+struct check_list {
+	struct check_ref *ref;
+	int count, cap;
+};
+
+struct check_state {
+	unsigned char *busy; /* un bit por inodo: alguien lo referencia */
+	unsigned char *expanded; /* un bit por inodo: directorio ya recorrido */
+	struct check_list stack; /* lo que falta por visitar */
+	struct check_list lost; /* entradas que apuntan a inodos libres */
+	bool failed;
+};
+
+static int check_push(struct check_list *l, int inode, int dir)
+{
+	if (l->count == l->cap) {
+		int cap = (l->cap == 0)? 256: 2 * l->cap;
+		struct check_ref *ref = realloc(l->ref, cap * sizeof(struct check_ref));
+		if (ref == NULL)
+			return -1;
+		l->ref = ref;
+		l->cap = cap;
+	}
+	l->ref[l->count].inode = inode;
+	l->ref[l->count].dir = dir;
+	l->ref[l->count].seq = l->count;
+	l->count++;
+
 	return 0;
 }
-*/
 
-/* Esta función mira la tabla de entry's que tiene un directorio y borra todo
- * lo que tenga dentro
- */
-static int delete_directory(struct disk_inode *ino, const int inode)
+struct check_arg {
+	struct check_state *st;
+	int dir;
+};
+
+/* para check_tree con los directorios en árbol */
+static int check_item(struct dir_item *it, void *arg)
+{
+	struct check_arg *c = arg;
+
+	if (!strcmp(it->name, ".") || !strcmp(it->name, ".."))
+		return 0;
+	if ((it->inode < 0) || (it->inode >= inode_count(fs)))
+		return 0;
+	return check_push(&c->st->stack, it->inode, c->dir);
+}
+
+/* Mete en la pila las entradas del directorio ino */
+static int check_entries(struct check_state *st, struct disk_inode *ino,
+			 int num_inode)
 {
-	int i, j;
-	struct disk_inode aux_ino;
+	int i, j, dir = -1;
+
+	if (ino->flags & INODE_BTREE) {
+		struct check_arg arg = {st, num_inode};
+		return bt_foreach(ino, check_item, &arg);
+	}
+
 	char block[fs->sb.block_size];
 	struct entry *entry;
-	
-	for (i = 0; i < NUM_EXTENTS; i++) {
-		if (ino->e[i].start == -1) /* extent sin usar */
-			continue;
-		
+	for (i = 0; (i < NUM_EXTENTS) && (ino->e[i].start != -1); i++)
 		for (j = 0; j < ino->e[i].size; j++) {
 			data_read(fs, block, ino->e[i].start+j);
-			entry = (struct entry *) block;
-			while (entry->next != -1) {
+			for (entry = (struct entry *) block; entry->next != -1;
+			     entry = ((void *) entry) + entry->next) {
 				if ((entry->inode == -1) || (entry->busy == -1) ||
-					(!strcmp(entry->name, ".")) || ((!strcmp(entry->name, "..")))) {
-					entry = ((void *) entry) + entry->next;
+				    (!strcmp(entry->name, "..")))
+					continue;
+				if (!strcmp(entry->name, ".")) {
+					dir = entry->inode;
 					continue;
 				}
-				
-				inode_read(fs, &aux_ino, entry->inode);
-				if (is_dir(aux_ino.is_dir))
-					delete_directory(&aux_ino, entry->inode);
-					
-				free_inode(entry->inode);
-				entry->inode = entry->busy = -1;
-				strcmp(entry->name, "");
-				entry = ((void *) entry) + entry->next;
+				if ((entry->inode < 0) || (entry->inode >= inode_count(fs)))
+					continue;
+				if (check_push(&st->stack, entry->inode, dir) == -1)
+					return -1;
 			}
-			data_write(fs, block, ino->e[i].start+j);
 		}
-	}
-	
+
 	return 0;
 }
 
-int mfs_rmdir(const char *pathname)
-{	
-	if (!strcmp(pathname, "/")) { /* no se va a dejar borra el directorio raiz */
-		errno = EACCES;
+/* Recorre el árbol en profundidad desde el raiz. Los hijos de cada directorio
+ * se meten al revés en la pila, así salen en el mismo orden en el que los
+ * visitaría una función recursiva
+ */
+static int check_tree(struct check_state *st)
+{
+	struct disk_inode ino;
+	struct check_ref r;
+	int first, k;
+
+	if (check_push(&st->stack, fs->sb.root_inode, -1) == -1)
 		return -1;
+	while (st->stack.count > 0) {
+		r = st->stack.ref[--st->stack.count];
+		bits_set(st->busy, r.inode);
+		if (inode_read(fs, &ino, r.inode) <= 0) {
+			printf("Failed to read inode: %3d\n", r.inode);
+			continue;
+		}
+		if ((ino.size == -1) && (check_push(&st->lost, r.inode, r.dir) == -1))
+			return -1;
+		/* un directorio enlazado dos veces (o un ciclo) se recorre una vez */
+		if (!is_dir(ino.is_dir) || bits_get(st->expanded, r.inode))
+			continue;
+		bits_set(st->expanded, r.inode);
+
+		first = st->stack.count;
+		if (check_entries(st, &ino, r.inode) == -1)
+			return -1;
+		for (k = 0; k < (st->stack.count - first) / 2; k++) {
+			struct check_ref aux = st->stack.ref[first + k];
+			st->stack.ref[first + k] = st->stack.ref[st->stack.count - 1 - k];
+			st->stack.ref[st->stack.count - 1 - k] = aux;
+		}
 	}
 
-	fs_init();
-	
-	int inode = namei(fs, &fs->root, pathname);
-	if (inode == -1) { /* El archivo a borrar no existe */
-		errno = ENOENT;
-		return -1;
+	return 0;
+}
+
+static int cmp_check_ref(const void *a, const void *b)
+{
+	const struct check_ref *x = a, *y = b;
+
+	if (x->inode != y->inode)
+		return (x->inode < y->inode)? -1: 1;
+	return (x->seq < y->seq)? -1: (x->seq > y->seq);
+}
+
+/* Compara la tabla de inodos con lo que se vio al recorrer el árbol */
+static bool repair_inode(struct check_state *st, bool repair)
+{
+	int per_block = fs->sb.block_size / sizeof(struct disk_inode);
+	char block[fs->sb.block_size];
+	struct disk_inode *ino, dir;
+	bool polluted = false, reload = true;
+	int i, k = 0;
+
+	qsort(st->lost.ref, st->lost.count, sizeof(struct check_ref), cmp_check_ref);
+	for (i = 0; i < inode_count(fs); i++) {
+		if (reload || (i % per_block == 0))
+			block_read(fs->dev, block, inode_block(fs, i / per_block));
+		reload = false;
+		ino = (struct disk_inode *) (block + (i % per_block) * sizeof(struct disk_inode));
+		if (bits_get(st->busy, i) && (ino->size == -1)) {/* inode free when it must be bussy */
+			polluted = true;
+			printf("inode[%3d] free mark, (but referenced!!!)",i);
+			if (repair) {/* prepair to delete form... */
+				/* la última entrada que se encontró es la que se borra */
+				int d = -1;
+				for (; (k < st->lost.count) && (st->lost.ref[k].inode <= i); k++)
+					if (st->lost.ref[k].inode == i)
+						d = st->lost.ref[k].dir;
+				if (d == -1)
+					printf(". Cannot find entry\n");
+				else {
+					inode_read(fs, &dir, d);
+					printf(" %s", (del_entry(dir, i)== 0)? "repair": "cannot repair");
+					reload = true;
+				}	
+			}
+			printf("\n");
+		}
+		if ((!bits_get(st->busy, i)) && (ino->size != -1)){/* inode busy when it must be free */
+			polluted = true;
+			printf("inode[%3d] busy mark, (but not referenced!!!)",i);
+			if (repair) {
+				ino->size = -1;
+				fs->group[inode_group(fs, i)].free_inodes = -1; /* se vuelve a contar */
+				printf(" %s", (inode_write(fs, ino, i)<=0)?"cannot repair": "repair" );
+				reload = true;
+			}
+			printf("\n");
+		}
 	}
 	
-	struct disk_inode ino;
-	inode_read(fs, &ino, inode);
-	if (!is_dir(ino.is_dir)){ /* Lo que te piden borrar no es un directorio */
-		errno = ENOTDIR;
+	return polluted;
+}
+
+/* Referencias de una ventana de bloques de datos, como las contaría un
+ * entero: tail (-1, bloque de fragmentos), seen (1) y extra (las demás,
+ * hasta MAX_REFCOUNT)
+ */
+struct check_window {
+	int first, count;
+	unsigned char *seen, *tail;
+	unsigned char *extra;
+};
+
+static void window_ref(struct check_window *w, int block)
+{
+	int b = block - w->first;
+
+	if ((b < 0) || (b >= w->count))
+		return;
+	if (bits_get(w->tail, b))
+		bits_clear(w->tail, b); /* de -1 a 0 */
+	else if (!bits_get(w->seen, b))
+		bits_set(w->seen, b);
+	else if (w->extra[b] < MAX_REFCOUNT)
+		w->extra[b]++;
+}
+
+static int window_get(struct check_window *w, int b)
+{
+	if (bits_get(w->tail, b))
 		return -1;
+	return (bits_get(w->seen, b))? w->extra[b] + 1: 0;
+}
+
+/* Suma a la ventana las referencias del inodo ino */
+static void window_inode(struct check_window *w, struct disk_inode *ino)
+{
+	int e, j, b;
+
+	for (e = 0; e < NUM_EXTENTS; e++) {
+		if (ino->e[e].start == -1)
+			break;
+		for (j = 0; !is_hole(ino->e[e]) && (j < ino->e[e].size); j++)
+			window_ref(w, ino->e[e].start + j);
 	}
-	bool clean = is_clean(fs);
-	delete_directory(&ino, inode);
-	
-	/* ahora tengo que borrar la entra del directorio del padre */
+	b = ino->tail_block - w->first;
+	if ((ino->flags & INODE_TAIL) && (b >= 0) && (b < w->count)) {
+		bits_clear(w->seen, b); /* bloque de fragmentos: sin refcount */
+		w->extra[b] = 0;
+		bits_set(w->tail, b);
+	}
+}
 
-	int inode_father = whos_father(ino);
-	if (inode_father == -1) {
-		printf("%s: No se pudo encontrar el direcotorio anterior\n", pathname);
-		return restore_dirty(fs, clean, -1);
+static void window_busy(struct check_window *w, int block)
+{
+	int b = block - w->first;
+
+	if ((b >= 0) && (b < w->count)) {
+		bits_clear(w->tail, b);
+		bits_set(w->seen, b);
+		w->extra[b] = 0;
 	}
-	free_inode(inode); /* pongo como libre el inodo y sus bloques asociados */
-	
-	char *aux = rindex(pathname, '/');
-	aux = (aux == NULL)? (char *) pathname: aux+1;
-	
-	struct disk_inode ino_father;
-	inode_read(fs, &ino_father, inode_father);
-	del_entry_of_inode(fs, &ino_father, aux);
-	
-	return restore_dirty(fs, clean, 0);
 }
 
-/* Mis debug */
-static int sb_info(struct file_system *fs)
+/* La extensión de mfs_resize, el registro de cambios y la tabla de huellas
+ * no son de ningún inodo, pero están ocupados */
+static void window_reserved(struct check_window *w)
 {
+	int i;
 
-	printf("*******************************\n");
-	printf("**            SB             **\n");
-	printf("*******************************\n");
-	printf("** block_size : %12d **\n", fs->sb.block_size);
-	printf("** num_inodes : %12d **\n", fs->sb.num_inodes);
-	printf("** num_bitmap : %12d **\n", fs->sb.num_bitmap);
-	printf("** num_data_blocks : %7d **\n", fs->sb.num_data_blocks);
-	printf("** dirty :             %s **\n", (fs->sb.dirty)? " True":"False");
-	printf("*******************************\n\n");
-	
-	return 0;
+	for (i = 0; i < ext_blocks(fs); i++)
+		window_busy(w, fs->sb.ext_start + i);
+	if (fs->log != NULL)
+		window_busy(w, fs->sb.log_block);
+	for (i = 0; i < fs->sb.dedup_blocks; i++)
+		window_busy(w, fs->sb.dedup_start + i);
 }
 
-static int inode_info(struct file_system *fs, bool all)
-{/* all=true  -> muestra todos los inodos
-  * all=flase -> muestra solo los ocupados
-  */
-	printf("********************************\n");
-	printf("**           INODE            **\n");
-	printf("********************************\n");
+/* cuenta cuantos inodos referencian cada bloque de datos de la ventana */
+static void check_data_window(struct check_state *st, struct check_window *w)
+{
+	int per_block = fs->sb.block_size / sizeof(struct disk_inode);
+	char block[fs->sb.block_size];
+	int i;
+
+	for (i = 0; i < inode_count(fs); i++) {
+		if (i % per_block == 0)
+			block_read(fs->dev, block, inode_block(fs, i / per_block));
+		if (!bits_get(st->busy, i))/* inodo libre miramos el siguiente */
+			continue;
+		window_inode(w, (struct disk_inode *) (block + (i % per_block) *
+						       sizeof(struct disk_inode)));
+	}
+	window_reserved(w);
+}
+
+/* shared = false: los bloques compartidos (refcount) no se miran, pueden
+ * tener dueños que no se contaron */
+static bool repair_data(struct check_window *w, bool repair, bool shared)
+{
+	int i, b;
+	bool polluted = false;
+	for (b = 0; b < w->count; b++) {
+		i = w->first + b;
+		if (!shared && (fs->refcount[i] > 0))
+			continue;
+		int data = window_get(w, b);
+		int refs = (data > 0)? data - 1: 0; /* -1: fragmentos */
+		if (fs->refcount[i] != refs) {
+			polluted = true;
+			printf("data [%3d] refcount %d, (but %d references!!!)\n",
+			       i, fs->refcount[i] + 1, data);
+			if (repair) {
+				fs->refcount[i] = refs;
+				refcount_write(fs, i);
+			}
+		}
+		if (!bitmap_get(fs, i) && data) {
+			polluted = true;
+			printf("data [%3d] free mark, (but referenced!!!)\n",i);
+			if (repair)
+				bitmap_set(fs, i);
+		}
+		if (bitmap_get(fs, i) && !data) {
+			polluted = true;
+			printf("data [%3d] busy mark, (but not referenced!!!)\n",i);
+			if (repair)
+				bitmap_clear(fs, i);
+		}
+		
+	}
 	
-	int i, j;
-	struct disk_inode ino;
+	return polluted;
+}
 
-	int inode_size = sizeof(struct disk_inode);
-	int inode_per_block = fs->sb.block_size/inode_size;
-	int num_inodes = fs->sb.num_inodes *inode_per_block;
+static int check(bool repair)
+{/* Start with inodes */
+	struct check_state st;
+	struct check_window w;
+	int window = (fs->sb.num_data_blocks < CHECK_WINDOW)?
+		fs->sb.num_data_blocks: CHECK_WINDOW;
+	int ret = -1;
+
+	memset(&st, '\0', sizeof(struct check_state));
+	st.busy = calloc((inode_count(fs) + 7) / 8, 1);
+	st.expanded = calloc((inode_count(fs) + 7) / 8, 1);
+	w.seen = malloc((window + 7) / 8);
+	w.tail = malloc((window + 7) / 8);
+	w.extra = malloc(window);
+	if ((st.busy == NULL) || (st.expanded == NULL) || (w.seen == NULL) ||
+	    (w.tail == NULL) || (w.extra == NULL) || (check_tree(&st) == -1)) {
+		printf("check: %s\n", strerror(ENOMEM));
+		goto out;
+	}
+	free(st.stack.ref);
+	st.stack.ref = NULL;
 	
-	for (i = 0; i < num_inodes; i++) {
-		inode_read(fs, &ino, i);
-		if ((ino.size == -1) && (!all))
+	bool polluted = repair_inode(&st, repair);
+	if (!polluted)
+		printf("Inodes right\n");
+
+	bitmap_read(fs);
+	refcount_read(fs);
+	polluted = false;
+	for (w.first = 0; w.first < fs->sb.num_data_blocks; w.first += window) {
+		w.count = fs->sb.num_data_blocks - w.first;
+		if (w.count > window)
+			w.count = window;
+		memset(w.seen, '\0', (w.count + 7) / 8);
+		memset(w.tail, '\0', (w.count + 7) / 8);
+		memset(w.extra, '\0', w.count);
+		check_data_window(&st, &w);
+		polluted |= repair_data(&w, repair, true);
+	}
+	if (polluted)
+		bitmap_write(fs);
+	else
+		printf("Data right\n");
+	ret = 0;
+out:
+	free(st.busy);
+	free(st.expanded);
+	free(st.stack.ref);
+	free(st.lost.ref);
+	free(w.seen);
+	free(w.tail);
+	free(w.extra);
+	
+	return ret;
+}
+
+static int cmp_check_window(const void *a, const void *b)
+{
+	const struct check_window *x = a, *y = b;
+
+	return (x->first < y->first)? -1: (x->first > y->first);
+}
+
+/* fsck incremental (mfs_debug -l)
+ *
+ * Con el registro de cambios solo se mira lo que se tocó desde el último
+ * punto limpio:
+ *  - los directorios apuntados y sus padres: sus entradas no pueden apuntar
+ *    a inodos apuntados que estén libres
+ *  - los inodos apuntados que están ocupados tienen que estar en alguno de
+ *    esos directorios; si no están y son de esta sesión se quedaron
+ *    huérfanos. Si se les quitó una entrada no se sabe sin mirarlo todo
+ *  - los bloques apuntados, frente a lo que dicen los inodos apuntados. Los
+ *    compartidos pueden tener dueños fuera del registro: si no cuadran
+ *    tampoco se sabe
+ * Lo que no se puede decidir así (o un registro desbordado) acaba en la
+ * comprobación completa
+ *
+ * Devuelve 1 si hace falta la completa
+ */
+static int check_log(bool repair)
+{
+	struct log_entry *le = log_entries(fs);
+	struct check_state st;
+	struct check_list logged, dirs;
+	struct check_window *w = NULL;
+	struct disk_inode ino, dir;
+	int i, k, b, num_w = 0, blocks = 0, ret = -1;
+	bool polluted = false;
+
+	if (log_head(fs)->overflow)
+		return 1;
+	memset(&st, '\0', sizeof(struct check_state));
+	memset(&logged, '\0', sizeof(struct check_list));
+	memset(&dirs, '\0', sizeof(struct check_list));
+	w = calloc(log_head(fs)->count + 1, sizeof(struct check_window));
+	if (w == NULL)
+		goto out;
+
+	/* inodos y trozos de bloques (juntando los que se pisan) */
+	for (i = 0; i < log_head(fs)->count; i++)
+		if ((le[i].count <= 0) && (check_push(&logged, le[i].first, -le[i].count) == -1))
+			goto out;
+	qsort(logged.ref, logged.count, sizeof(struct check_ref), cmp_check_ref);
+	for (i = 0; i < log_head(fs)->count; i++)
+		if (le[i].count > 0) {
+			w[num_w].first = le[i].first;
+			w[num_w++].count = le[i].count;
+		}
+	qsort(w, num_w, sizeof(struct check_window), cmp_check_window);
+	for (i = 1, k = 0; i < num_w; i++) {
+		if (w[i].first > w[k].first + w[k].count) {
+			w[++k] = w[i];
 			continue;
-		
-		printf("inode: %3d\n", i);
-		printf("\tsize: %5d\n", ino.size);
-		printf("\tnlink: %4d\n", ino.nlink);
-		printf("\tdir:     %s\n", (is_dir(ino.is_dir))? "Si": "No");
-		printf("\textents:\n");
-		for (j = 0; j < NUM_EXTENTS; j++) {
-			printf("\t\textent(%d)= (start: %d, size: %d)\n", j, ino.e[j].start, ino.e[j].size);
 		}
-		printf("\n");
+		if (w[i].first + w[i].count > w[k].first + w[k].count)
+			w[k].count = w[i].first + w[i].count - w[k].first;
+	}
+	num_w = (num_w == 0)? 0: k + 1;
+
+	/* los directorios: los apuntados que lo sean y sus padres */
+	for (i = 0; i < logged.count; i++) {
+		if ((inode_read(fs, &ino, logged.ref[i].inode) <= 0) ||
+		    (ino.size == -1) || !is_dir(ino.is_dir))
+			continue;
+		if ((check_push(&dirs, logged.ref[i].inode, 0) == -1) ||
+		    (check_push(&dirs, sub_namei(fs, &ino, ".."), 0) == -1))
+			goto out;
+	}
+	qsort(dirs.ref, dirs.count, sizeof(struct check_ref), cmp_check_ref);
+	for (i = 0; i < dirs.count; i++) {
+		if ((dirs.ref[i].inode < 0) ||
+		    ((i > 0) && (dirs.ref[i].inode == dirs.ref[i-1].inode)))
+			continue;
+		inode_read(fs, &ino, dirs.ref[i].inode);
+		if (check_entries(&st, &ino, dirs.ref[i].inode) == -1)
+			goto out;
+	}
+	qsort(st.stack.ref, st.stack.count, sizeof(struct check_ref), cmp_check_ref);
+
+	/* qué le pasa a cada inodo apuntado: dir = directorio que lo apunta,
+	 * seq = 0 bien, 1 libre y apuntado, 2 huérfano, 3 no se cuenta */
+	for (i = k = 0; i < logged.count; i++) {
+		struct check_ref *r = &logged.ref[i];
+		int flags = r->dir;
+		r->dir = -1;
+		for (; (k < st.stack.count) && (st.stack.ref[k].inode <= r->inode); k++)
+			if (st.stack.ref[k].inode == r->inode)
+				r->dir = st.stack.ref[k].dir;
+		inode_read(fs, &ino, r->inode);
+		if (r->inode == fs->sb.root_inode)
+			r->seq = 0;
+		else if (ino.size == -1)
+			r->seq = (r->dir != -1)? 1: 3;
+		else if ((r->dir != -1) || !(flags & (LOG_NEW | LOG_UNLINK)))
+			r->seq = 0;
+		else if (flags & LOG_NEW)
+			r->seq = 2;
+		else {
+			ret = 1; /* se le quitó una entrada: puede que haya más */
+			goto out;
+		}
+	}
+
+	/* los bloques apuntados, con lo que referencian esos inodos */
+	for (i = 0; i < num_w; i++) {
+		w[i].seen = calloc((w[i].count + 7) / 8, 1);
+		w[i].tail = calloc((w[i].count + 7) / 8, 1);
+		w[i].extra = calloc(w[i].count, 1);
+		if ((w[i].seen == NULL) || (w[i].tail == NULL) || (w[i].extra == NULL))
+			goto out;
+		for (k = 0; k < logged.count; k++)
+			if ((logged.ref[k].seq != 2) && (logged.ref[k].seq != 3) &&
+			    (inode_read(fs, &ino, logged.ref[k].inode) > 0))
+				window_inode(&w[i], &ino);
+		window_reserved(&w[i]);
+		blocks += w[i].count;
+	}
+	bitmap_read(fs);
+	refcount_read(fs);
+	for (i = 0; i < num_w; i++)
+		for (b = 0; b < w[i].count; b++) {
+			int n = w[i].first + b, data = window_get(&w[i], b);
+			if ((fs->refcount[n] > 0) &&
+			    (!bitmap_get(fs, n) || (data > fs->refcount[n] + 1))) {
+				ret = 1;
+				goto out;
+			}
+		}
+
+	printf("Incremental check: %d inodes, %d blocks\n", logged.count, blocks);
+	for (i = 0; i < logged.count; i++) {
+		struct check_ref *r = &logged.ref[i];
+		if (r->seq == 1) {
+			polluted = true;
+			printf("inode[%3d] free mark, (but referenced!!!)", r->inode);
+			if (repair) {
+				inode_read(fs, &dir, r->dir);
+				printf(" %s", (del_entry(dir, r->inode)== 0)? "repair": "cannot repair");
+			}
+			printf("\n");
+		}
+		if (r->seq == 2) {
+			polluted = true;
+			printf("inode[%3d] busy mark, (but not referenced!!!)", r->inode);
+			if (repair) {
+				inode_read(fs, &ino, r->inode);
+				ino.size = -1;
+				fs->group[inode_group(fs, r->inode)].free_inodes = -1;
+				printf(" %s", (inode_write(fs, &ino, r->inode)<=0)?"cannot repair": "repair" );
+			}
+			printf("\n");
+		}
+	}
+	if (!polluted)
+		printf("Inodes right\n");
+	polluted = false;
+	for (i = 0; i < num_w; i++)
+		polluted |= repair_data(&w[i], repair, false);
+	if (polluted)
+		bitmap_write(fs);
+	else
+		printf("Data right\n");
+	ret = 0;
+out:
+	for (i = 0; (w != NULL) && (i < num_w); i++) {
+		free(w[i].seen);
+		free(w[i].tail);
+		free(w[i].extra);
+	}
+	free(w);
+	free(logged.ref);
+	free(dirs.ref);
+	free(st.stack.ref);
+	if (ret == -1)
+		printf("check: %s\n", strerror(ENOMEM));
+
+	return ret;
+}
+
+/* fsck en paralelo (mfs_debug -j)
+ *
+ * Hace lo mismo que check() y saca exactamente lo mismo, pero en tres fases
+ * con varios hilos:
+ *  1. el árbol de directorios se recorre con una cola por hilo; cada hilo
+ *     saca de la suya por el final y, si se queda sin trabajo, roba por el
+ *     principio de la de otro. Cada hilo apunta las referencias que
+ *     encuentra (inodo, directorio) en su propia lista, sin cerrojos
+ *  2. las listas se juntan repitiendo en memoria el recorrido en profundidad
+ *     del modo serie, así el directorio que queda para cada inodo es el mismo
+ *  3. la tabla de inodos y después los bloques de datos se comprueban por
+ *     trozos; los fallos se apuntan por índice y se sacan (y reparan) en
+ *     orden con un solo hilo
+ */
+
+#define PCHECK_CHUNK 64 /* bloques de inodos (o bytes del bitmap) por trozo */
+
+struct pcheck_ref {
+	int inode;
+	int dir; /* el directorio que habría apuntado check_tree */
+};
+
+struct pcheck_deque {
+	pthread_mutex_t lock;
+	int *item;
+	int head, tail, cap;
+};
+
+struct pcheck;
+
+struct pcheck_thread {
+	struct pcheck *pc;
+	int id;
+	struct pcheck_deque q;
+	struct pcheck_ref *ref;
+	int num_ref, cap_ref;
+	bool failed;
+};
+
+struct pcheck_span { /* las entradas de un directorio ya recorrido */
+	int thread; /* -1: no es un directorio (o no se recorrió) */
+	int first, count;
+};
+
+struct pcheck {
+	int jobs;
+	struct pcheck_thread *th;
+	struct pcheck_span *span; /* uno por inodo */
+	char *visited;
+	int pending; /* directorios en cola o a medias */
+	int next_chunk;
+	struct inode_info *inode_info;
+	char *bad_inode; /* 1: libre y referenciado, 2: ocupado y sin referencias */
+	int *data;
+	int *tail; /* mayor inodo con su cola en ese bloque */
+	char *bad_data;
+};
+
+static int deque_push(struct pcheck_deque *q, int n)
+{
+	pthread_mutex_lock(&q->lock);
+	if (q->tail == q->cap) {
+		int len = q->tail - q->head;
+		if (len * 2 > q->cap) {
+			int *item = realloc(q->item, 2 * q->cap * sizeof(int));
+			if (item == NULL) {
+				pthread_mutex_unlock(&q->lock);
+				return -1;
+			}
+			q->item = item;
+			q->cap *= 2;
+		}
+		memmove(q->item, q->item + q->head, len * sizeof(int));
+		q->head = 0;
+		q->tail = len;
 	}
-	
-	printf("*******************************\n\n");
+	q->item[q->tail++] = n;
+	pthread_mutex_unlock(&q->lock);
+
 	return 0;
 }
 
-static int bitmap_info(struct file_system *fs, bool all)
+/* el dueño saca por el final; los demás roban por el principio */
+static int deque_pop(struct pcheck_deque *q, bool steal)
 {
-	bitmap_read(fs);
-	
-	printf("*******************************\n");
-	printf("**          BITMAP           **\n");
-	printf("*******************************\n");
-	
-	int i;
-	for (i = 0; i < fs->sb.num_data_blocks; i++)
-		if (!bitmap_get(fs, i) && !all)
-			continue;
-		else
-			printf("** block: %8d used: %s **\n", i, (bitmap_get(fs,i))?"Yes":"No ");
-	
-	printf("*******************************\n\n");
-	return 0;
+	int n = -1;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->head < q->tail)
+		n = (steal)? q->item[q->head++]: q->item[--q->tail];
+	pthread_mutex_unlock(&q->lock);
+
+	return n;
 }
 
-static int data_block_info(struct file_system *fs, bool all)
+static int pcheck_add_ref(struct pcheck_thread *t, int inode, int dir)
 {
-	int i;
-	char block[fs->sb.block_size];
-	bitmap_read(fs);
-	
-	printf("*******************************\n");
-	printf("**        DATA BLOCK         **\n");
-	printf("*******************************\n");
+	if (t->num_ref == t->cap_ref) {
+		int cap = (t->cap_ref == 0)? 256: 2 * t->cap_ref;
+		struct pcheck_ref *ref = realloc(t->ref, cap * sizeof(struct pcheck_ref));
+		if (ref == NULL)
+			return -1;
+		t->ref = ref;
+		t->cap_ref = cap;
+	}
+	t->ref[t->num_ref].inode = inode;
+	t->ref[t->num_ref].dir = dir;
+	t->num_ref++;
+
+	/* cada inodo se mete en la cola una sola vez */
+	if (__atomic_exchange_n(&t->pc->visited[inode], 1, __ATOMIC_ACQ_REL))
+		return 0;
+	__atomic_add_fetch(&t->pc->pending, 1, __ATOMIC_ACQ_REL);
+	if (deque_push(&t->q, inode) == -1) {
+		__atomic_sub_fetch(&t->pc->pending, 1, __ATOMIC_ACQ_REL);
+		return -1;
+	}
 
-	for (i = 0; i < fs->sb.num_data_blocks; i++) {
-		if (!bitmap_get(fs, i) && !all)
-			continue;
-		data_read(fs, (void *) block, i);
-		printf("------ block: %3d -%s--\n",i,bitmap_get(fs, i)?"Yes":"No-");
-		printf("%s\n", block);
-		printf("-------------------------\n\n");
-		
-	}		
-	
-	printf("*******************************\n\n");
-	
 	return 0;
 }
 
-int my_info(bool h_i, bool i, bool h_b, bool b, bool h_d, bool d)
+struct pcheck_arg {
+	struct pcheck_thread *t;
+	int dir;
+};
+
+static int pcheck_item(struct dir_item *it, void *arg)
 {
-	fs_init();
-/*
-printf("superblock = %d\n", sizeof(struct super_block));
-printf("extent = %d\n", sizeof(struct extent));
-printf("disk_inode = %d\n", sizeof(struct disk_inode));
-printf("entry = %d\n", sizeof(struct entry));
-printf("file = %d\n", sizeof(struct file));
-*/
+	struct pcheck_arg *c = arg;
 
-	sb_info(fs);
-	if (!h_i)
-		inode_info(fs, i);
-	if (!h_b)
-		bitmap_info(fs, b);
-	if (!h_d)
-		data_block_info(fs, d);
-	
-	return 0;
+	if (!strcmp(it->name, ".") || !strcmp(it->name, ".."))
+		return 0;
+	if ((it->inode < 0) || (it->inode >= inode_count(fs)))
+		return 0;
+	return pcheck_add_ref(c->t, it->inode, c->dir);
 }
 
-static int init_check_data(bool *data)
+/* Lo mismo que check_entries, pero los hijos van a la cola del hilo */
+static void pcheck_dir(struct pcheck_thread *t, int num_inode)
 {
-	int i;
-	for (i = 0; i < fs->sb.num_data_blocks; i++)
-		data[i] = false;
-	
-	return 0;
+	struct disk_inode ino;
+	int i, j, dir = -1, first = t->num_ref;
+
+	if (inode_read(fs, &ino, num_inode) <= 0) {
+		printf("Failed to read inode: %3d\n", num_inode);
+		return;
+	}
+	if (!is_dir(ino.is_dir))
+		return;
+	if (ino.flags & INODE_BTREE) {
+		struct pcheck_arg arg = {t, num_inode};
+		if (bt_foreach(&ino, pcheck_item, &arg) == -1)
+			t->failed = true;
+	} else {
+		char block[fs->sb.block_size];
+		struct entry *entry;
+		for (i = 0; (i < NUM_EXTENTS) && (ino.e[i].start != -1); i++)
+			for (j = 0; j < ino.e[i].size; j++) {
+				data_read(fs, block, ino.e[i].start+j);
+				for (entry = (struct entry *) block; entry->next != -1;
+				     entry = ((void *) entry) + entry->next) {
+					if ((entry->inode == -1) || (entry->busy == -1) ||
+					    (!strcmp(entry->name, "..")))
+						continue;
+					if (!strcmp(entry->name, ".")) {
+						dir = entry->inode;
+						continue;
+					}
+					if ((entry->inode < 0) || (entry->inode >= inode_count(fs)))
+						continue;
+					if (pcheck_add_ref(t, entry->inode, dir) == -1)
+						t->failed = true;
+				}
+			}
+	}
+
+	t->pc->span[num_inode].thread = t->id;
+	t->pc->span[num_inode].first = first;
+	t->pc->span[num_inode].count = t->num_ref - first;
 }
 
-struct inode_info {
-	bool busy;
-	int dir; /* inode del directorio donde está */	
-};
+static void *pcheck_walk(void *arg)
+{
+	struct pcheck_thread *t = arg;
+	struct pcheck *pc = t->pc;
+	int n, k;
+
+	while (__atomic_load_n(&pc->pending, __ATOMIC_ACQUIRE) > 0) {
+		n = deque_pop(&t->q, false);
+		for (k = 1; (n == -1) && (k < pc->jobs); k++)
+			n = deque_pop(&pc->th[(t->id + k) % pc->jobs].q, true);
+		if (n == -1) {
+			sched_yield();
+			continue;
+		}
+		pcheck_dir(t, n);
+		__atomic_sub_fetch(&pc->pending, 1, __ATOMIC_ACQ_REL);
+	}
 
-static int check_data(bool *data, struct inode_info *inode_info)
+	return NULL;
+}
+
+/* Repite el recorrido en profundidad de check_tree con las listas de los
+ * hilos: el último directorio que referencia a cada inodo es el que se queda
+ */
+static int pcheck_merge(struct pcheck *pc)
 {
-	int i;
-	struct disk_inode ino;
-	int e, j;
-	for (i = 0; i < fs->sb.num_inodes; i++) {
-		if (!inode_info[i].busy)/* inodo libre miramos el siguiente */
+	struct frame {
+		int dir;
+		int next;
+	} *stack = malloc(inode_count(fs) * sizeof(struct frame));
+	char *expanded = calloc(inode_count(fs), 1);
+	int top = 0;
+
+	if ((stack == NULL) || (expanded == NULL)) {
+		free(stack);
+		free(expanded);
+		return -1;
+	}
+	pc->inode_info[fs->sb.root_inode].busy = true;
+	if (pc->span[fs->sb.root_inode].thread != -1) {
+		stack[top].dir = fs->sb.root_inode;
+		stack[top++].next = 0;
+		expanded[fs->sb.root_inode] = 1;
+	}
+	while (top > 0) {
+		struct frame *f = &stack[top-1];
+		struct pcheck_span *s = &pc->span[f->dir];
+		if (f->next == s->count) {
+			top--;
 			continue;
-		inode_read(fs, &ino, i);
-		for (e = 0; e < NUM_EXTENTS; e++) {/* Para empezar a marcar los bloques ocupados */
-			if (ino.e[e].start == -1)
-				break;
-			for (j = 0; j < ino.e[e].size; j++)
-				data[ino.e[e].start+j] = true;
 		}
-		
+		struct pcheck_ref *r = &pc->th[s->thread].ref[s->first + f->next++];
+		pc->inode_info[r->inode].busy = true;
+		pc->inode_info[r->inode].dir = r->dir;
+		/* como check_tree: cada directorio se recorre una vez */
+		if ((pc->span[r->inode].thread != -1) && !expanded[r->inode]) {
+			expanded[r->inode] = 1;
+			stack[top].dir = r->inode;
+			stack[top++].next = 0;
+		}
 	}
-	
+	free(stack);
+	free(expanded);
+
 	return 0;
 }
 
-static int init_check_inode(struct inode_info *inode_info)
+/* Un trozo de la tabla de inodos: qué inodos están mal y a quién
+ * referencian los ocupados (lo que luego haría check_data)
+ */
+static void pcheck_inodes(struct pcheck *pc, int chunk)
 {
-	int i = 0;
-	for (; i < fs->sb.num_inodes; i++) {
-		inode_info[i].busy = false;
-		inode_info[i].dir = -1;
+	int per_block = fs->sb.block_size / sizeof(struct disk_inode);
+	int b, i, e, j, k, last = (chunk + 1) * PCHECK_CHUNK;
+	char block[fs->sb.block_size];
+	struct disk_inode *ino;
+
+	if (last > inode_blocks(fs))
+		last = inode_blocks(fs);
+	for (b = chunk * PCHECK_CHUNK; b < last; b++) {
+		block_read(fs->dev, block, inode_block(fs, b));
+		for (k = 0; k < per_block; k++) {
+			i = b * per_block + k;
+			ino = (struct disk_inode *) (block + k * sizeof(struct disk_inode));
+			if (pc->inode_info[i].busy && (ino->size == -1))
+				pc->bad_inode[i] = 1;
+			if (!pc->inode_info[i].busy && (ino->size != -1))
+				pc->bad_inode[i] = 2;
+			if (!pc->inode_info[i].busy)
+				continue;
+			for (e = 0; (e < NUM_EXTENTS) && (ino->e[e].start != -1); e++)
+				for (j = 0; !is_hole(ino->e[e]) && (j < ino->e[e].size); j++)
+					if ((unsigned) (ino->e[e].start + j) < (unsigned) fs->sb.num_data_blocks)
+						__atomic_add_fetch(&pc->data[ino->e[e].start+j], 1,
+								   __ATOMIC_RELAXED);
+			if ((ino->flags & INODE_TAIL) &&
+			    ((unsigned) ino->tail_block < (unsigned) fs->sb.num_data_blocks)) {
+				int old = __atomic_load_n(&pc->tail[ino->tail_block], __ATOMIC_RELAXED);
+				while ((old < i) &&
+				       !__atomic_compare_exchange_n(&pc->tail[ino->tail_block], &old, i,
+								    false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+					;
+			}
+		}
 	}
-	
-	return 0;	
 }
 
-static int check_inode(struct inode_info *inode_info, int num_inode)
+/* Un trozo del área de datos: lo que miraría repair_data */
+static void pcheck_blocks(struct pcheck *pc, int chunk)
 {
-	int i, j;
-    int dir = -1;
-	    
-    struct disk_inode ino;
-    if (inode_read(fs, &ino, num_inode) <= 0) {
-    	printf("Failed to read inode: %3d\n", num_inode);
-    	return -1;	
-    }
-    
-    if (!is_dir(ino.is_dir)) /* solo recorreremos las entradas de lo que son dir */
-    	return -1;
-	    
-    char block[fs->sb.block_size];
-    struct entry *entry;
-    for (i = 0; i < NUM_EXTENTS; i++) {
-    	if (ino.e[i].start == -1) /* ya no hay más extents que se usen */
-    		return 0;
-
-   		for (j = 0; j < ino.e[i].size; j++) {
-   			data_read(fs, block, ino.e[i].start+j);
-   			entry = (struct entry *) block;
-   			
-   			while (entry->next != -1) {
-   				if ((entry->inode == -1) || (entry->busy == -1) ||
-   					(!strcmp(entry->name, ".."))) {
-   					entry = ((void *) entry) + entry->next;
-   					continue;	
-				}
-				if ((entry->busy != -1) && (!strcmp(entry->name, "."))) {
-					dir = entry->inode;
-					entry = ((void *) entry) + entry->next;
-					continue;
-				}
-				inode_info[entry->inode].busy = true;
-				inode_info[entry->inode].dir = dir;
-				check_inode(inode_info, entry->inode);
-				
-				entry = ((void *) entry) + entry->next;
-   			}
-   		}
-    	
-    }
+	int i, first = chunk * PCHECK_CHUNK * 8, last = first + PCHECK_CHUNK * 8;
+
+	if (last > fs->sb.num_data_blocks)
+		last = fs->sb.num_data_blocks;
+	for (i = first; i < last; i++) {
+		int refs = (pc->data[i] > 0)? pc->data[i] - 1: 0;
+		if (refs > MAX_REFCOUNT)
+			refs = MAX_REFCOUNT;
+		if (fs->refcount[i] != refs)
+			pc->bad_data[i] |= 1;
+		if (!bitmap_get(fs, i) && pc->data[i])
+			pc->bad_data[i] |= 2;
+		if (bitmap_get(fs, i) && !pc->data[i])
+			pc->bad_data[i] |= 4;
+	}
+}
 
-	return 0;	
+struct pcheck_job {
+	struct pcheck *pc;
+	int chunks;
+	void (*fn)(struct pcheck *, int);
+};
+
+static void *pcheck_chunks(void *arg)
+{
+	struct pcheck_job *job = arg;
+	int c;
+
+	while ((c = __atomic_fetch_add(&job->pc->next_chunk, 1, __ATOMIC_RELAXED)) < job->chunks)
+		job->fn(job->pc, c);
+
+	return NULL;
 }
 
-static int del_entry(struct disk_inode ino, int num_inode)
+/* Lanza pc->jobs hilos con start (el primero hace de hilo 0) */
+static int pcheck_spawn(struct pcheck *pc, void *(*start)(void *),
+			void *arg, size_t arg_size)
 {
-	if (!is_dir(ino.is_dir))
-		return -1;
-		
-	int i, j;
-	char block[fs->sb.block_size];
-	struct entry *entry;
-	for (i = 0; i < NUM_EXTENTS; i++) {
-		if (ino.e[i].start == -1)
+	pthread_t tid[pc->jobs];
+	int k;
+
+	for (k = 1; k < pc->jobs; k++)
+		if (pthread_create(&tid[k], NULL, start, (char *) arg + k * arg_size) != 0)
 			break;
-		for (j = 0; j < ino.e[i].size; j++) {
-			data_read(fs, block, ino.e[i].start +j);
-			entry = (struct entry *) block;
-			while (entry->next != -1) {
-				if (entry->inode == num_inode) {
-					entry->busy = entry->inode = -1;
-					strcmp(entry->name, "");
-					data_write(fs, block, ino.e[i].start + j);
-				}
-				entry = ((void *) entry) + entry->next;
-			}
-		}
+	start(arg);
+	while (--k > 0)
+		pthread_join(tid[k], NULL);
+
+	return 0;
+}
+
+static int pcheck_run(struct pcheck *pc, int chunks,
+		      void (*fn)(struct pcheck *, int))
+{
+	struct pcheck_job job = {pc, chunks, fn};
+
+	pc->next_chunk = 0;
+	return pcheck_spawn(pc, pcheck_chunks, &job, 0);
+}
+
+static void pcheck_free(struct pcheck *pc)
+{
+	int k;
+
+	for (k = 0; (pc->th != NULL) && (k < pc->jobs); k++) {
+		pthread_mutex_destroy(&pc->th[k].q.lock);
+		free(pc->th[k].q.item);
+		free(pc->th[k].ref);
 	}
-	return 0;	
+	free(pc->th);
+	free(pc->span);
+	free(pc->visited);
+	free(pc->inode_info);
+	free(pc->bad_inode);
+	free(pc->data);
+	free(pc->tail);
+	free(pc->bad_data);
 }
 
-static bool repair_inode(struct inode_info *inode_info, bool repair)
+static int check_parallel(bool repair, int jobs)
 {
+	struct pcheck pc;
 	struct disk_inode ino, dir;
+	int i, k, ni = inode_count(fs), nd = fs->sb.num_data_blocks;
 	bool polluted = false;
-	int i;
-	for (i = 0; i < fs->sb.num_inodes; i++){
-		inode_read(fs, &ino, i);
-		if ((inode_info[i].busy) && (ino.size == -1)) {/* inode free when it must be bussy */
-			polluted = true;
+
+	memset(&pc, '\0', sizeof(struct pcheck));
+	pc.jobs = jobs;
+	pc.th = calloc(jobs, sizeof(struct pcheck_thread));
+	pc.span = malloc(ni * sizeof(struct pcheck_span));
+	pc.visited = calloc(ni, 1);
+	pc.inode_info = malloc(ni * sizeof(struct inode_info));
+	pc.bad_inode = calloc(ni, 1);
+	pc.data = calloc(nd, sizeof(int));
+	pc.tail = malloc(nd * sizeof(int));
+	pc.bad_data = calloc(nd, 1);
+	if ((pc.th == NULL) || (pc.span == NULL) || (pc.visited == NULL) ||
+	    (pc.inode_info == NULL) || (pc.bad_inode == NULL) ||
+	    (pc.data == NULL) || (pc.tail == NULL) || (pc.bad_data == NULL)) {
+		pcheck_free(&pc);
+		errno = ENOMEM;
+		return -1;
+	}
+	init_check_inode(pc.inode_info);
+	for (i = 0; i < ni; i++)
+		pc.span[i].thread = -1;
+	for (i = 0; i < nd; i++)
+		pc.tail[i] = -1;
+	for (k = 0; k < jobs; k++) {
+		pc.th[k].pc = &pc;
+		pc.th[k].id = k;
+		pthread_mutex_init(&pc.th[k].q.lock, NULL);
+		pc.th[k].q.cap = 64;
+		pc.th[k].q.item = malloc(64 * sizeof(int));
+		if (pc.th[k].q.item == NULL) {
+			pcheck_free(&pc);
+			errno = ENOMEM;
+			return -1;
+		}
+	}
+
+	/* 1 y 2: el árbol */
+	pc.visited[fs->sb.root_inode] = 1;
+	pc.pending = 1;
+	deque_push(&pc.th[0].q, fs->sb.root_inode);
+	pcheck_spawn(&pc, pcheck_walk, pc.th, sizeof(struct pcheck_thread));
+	for (k = 0; k < jobs; k++)
+		if (pc.th[k].failed) {
+			pcheck_free(&pc);
+			errno = ENOMEM;
+			return -1;
+		}
+	if (pcheck_merge(&pc) == -1) {
+		pcheck_free(&pc);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	/* 3: la tabla de inodos */
+	pcheck_run(&pc, (inode_blocks(fs) + PCHECK_CHUNK - 1) / PCHECK_CHUNK,
+		   pcheck_inodes);
+	for (i = 0; i < ni; i++) {
+		if (pc.bad_inode[i] == 0)
+			continue;
+		polluted = true;
+		if (pc.bad_inode[i] == 1) {
 			printf("inode[%3d] free mark, (but referenced!!!)",i);
-			if (repair) {/* prepair to delete form... */
-				if (inode_info[i].dir == -1)
+			if (repair) {
+				if (pc.inode_info[i].dir == -1)
 					printf(". Cannot find entry\n");
 				else {
-					inode_read(fs, &dir, inode_info[i].dir);
+					inode_read(fs, &dir, pc.inode_info[i].dir);
 					printf(" %s", (del_entry(dir, i)== 0)? "repair": "cannot repair");
-				}	
+				}
 			}
-			printf("\n");
-		}
-		if ((!inode_info[i].busy) && (ino.size != -1)){/* inode busy when it must be free */
-			polluted = true;
+		} else {
 			printf("inode[%3d] busy mark, (but not referenced!!!)",i);
 			if (repair) {
+				inode_read(fs, &ino, i);
 				ino.size = -1;
+				fs->group[inode_group(fs, i)].free_inodes = -1;
 				printf(" %s", (inode_write(fs, &ino, i)<=0)?"cannot repair": "repair" );
 			}
-			printf("\n");
 		}
+		printf("\n");
 	}
-	
-	return polluted;
-}
+	if (!polluted)
+		printf("Inodes right\n");
 
-static bool repair_data(bool *data, bool repair)
-{
+	/* un bloque de fragmentos que también está en un extent depende del
+	 * orden en que check_data pasa por los inodos: entonces se cuenta igual */
+	for (i = 0; i < nd; i++)
+		if ((pc.tail[i] != -1) && (pc.data[i] != 0))
+			break;
+	if (i < nd) {
+		init_check_data(pc.data);
+		check_data(pc.data, pc.inode_info);
+	} else {
+		for (i = 0; i < nd; i++)
+			if (pc.tail[i] != -1)
+				pc.data[i] = -1;
+		for (i = 0; i < ext_blocks(fs); i++)
+			pc.data[fs->sb.ext_start + i] = 1;
+		if (fs->log != NULL)
+			pc.data[fs->sb.log_block] = 1;
+		for (i = 0; i < fs->sb.dedup_blocks; i++)
+			pc.data[fs->sb.dedup_start + i] = 1;
+	}
+
+	/* 4: los bloques de datos */
 	bitmap_read(fs);
-	int i;
-	bool polluted = false;
-	for (i = 0; i <fs->sb.num_data_blocks; i++) {
-		if (!bitmap_get(fs, i) && data[i]) {
-			polluted = true;
+	refcount_read(fs);
+	pcheck_run(&pc, (nd + PCHECK_CHUNK * 8 - 1) / (PCHECK_CHUNK * 8),
+		   pcheck_blocks);
+	polluted = false;
+	for (i = 0; i < nd; i++) {
+		if (pc.bad_data[i] == 0)
+			continue;
+		polluted = true;
+		if (pc.bad_data[i] & 1) {
+			int refs = (pc.data[i] > 0)? pc.data[i] - 1: 0;
+			printf("data [%3d] refcount %d, (but %d references!!!)\n",
+			       i, fs->refcount[i] + 1, pc.data[i]);
+			if (repair) {
+				fs->refcount[i] = (refs > MAX_REFCOUNT)? MAX_REFCOUNT: refs;
+				refcount_write(fs, i);
+			}
+		}
+		if (pc.bad_data[i] & 2) {
 			printf("data [%3d] free mark, (but referenced!!!)\n",i);
 			if (repair)
 				bitmap_set(fs, i);
 		}
-		if (bitmap_get(fs, i) && !data[i]) {
-			polluted = true;
+		if (pc.bad_data[i] & 4) {
 			printf("data [%3d] busy mark, (but not referenced!!!)\n",i);
 			if (repair)
 				bitmap_clear(fs, i);
 		}
-		
 	}
 	if (polluted)
 		bitmap_write(fs);
-	
-	return polluted;
-}
-
-static int check(bool repair)
-{/* Start with inodes */
-	struct inode_info inode_info[fs->sb.num_inodes];
-	
-	init_check_inode(inode_info);
-
-	inode_info[fs->sb.root_inode].busy = true;
-	check_inode(inode_info, fs->sb.root_inode);
-	
-	bool polluted = repair_inode(inode_info, repair);
-	if (!polluted)
-		printf("Inodes right\n");
-		
-	bool data[fs->sb.num_data_blocks];
-	init_check_data(data);
-	
-	check_data(data, inode_info);
-	
-	polluted = repair_data(data, repair);
-	if (!polluted)
+	else
 		printf("Data right\n");
-	
+
+	pcheck_free(&pc);
 	return 0;
 }
 
 /* repair = true  -> reparar el sistema de ficheros */
 /* reapir = false -> mostrar que está mal */
-int my_debug(bool repair)
+/* jobs: hilos que comprueban a la vez (1: el modo de siempre, 0: uno por cpu) */
+int my_debug(bool repair, int jobs)
 {
-	fs_init();
+	if ((repair && daemon_busy()) || (fs_init() < 0))
+		return -1;
 
+	if (jobs == 0)
+		jobs = sysconf(_SC_NPROCESSORS_ONLN);
 	//bool clean = is_clean(fs);
-	check(repair);
+	if ((jobs <= 1) || (check_parallel(repair, jobs) == -1))
+		check(repair);
 	
 	return restore_dirty(fs, true, 0);
 }
 
+/* Como my_debug, pero si el sistema quedó sucio con un registro de cambios
+ * solo se comprueba lo que dice el registro. Solo queda limpio si se repara,
+ * así el registro sigue valiendo después de un -c */
+int my_debug_log(bool repair, int jobs)
+{
+	if ((repair && daemon_busy()) || (fs_init() < 0))
+		return -1;
+
+	if (!fs->sb.dirty) {
+		printf("Clean file system: nothing to check\n");
+		return 0;
+	}
+	if ((fs->log == NULL) || (check_log(repair) != 0)) {
+		printf("No usable change log: full check\n");
+		if (jobs == 0)
+			jobs = sysconf(_SC_NPROCESSORS_ONLN);
+		if ((jobs <= 1) || (check_parallel(repair, jobs) == -1))
+			check(repair);
+	}
+	
+	return restore_dirty(fs, repair, 0);
+}
+
 static int fake_inode(int num_inode)
 {
-	int fake = (num_inode >fs->sb.num_inodes)? fs->sb.num_inodes/10+1: num_inode;
+	int fake = (num_inode >inode_count(fs))? inode_count(fs)/10+1: num_inode;
 	printf("try to bug %d inodes\n", fake);
 	
 	srand(getpid()); /* inicio la semilla */
@@ -2433,7 +8137,7 @@ static int fake_inode(int num_inode)
 	
 	int i, inode;
 	for (i = 0; i < fake; i++) {
-		inode = rand() % fs->sb.num_inodes;
+		inode = rand() % inode_count(fs);
 		inode_read(fs, &ino, inode);
 		printf("inode(%3d) %s\n",inode, (ino.size == -1)?"free to bussy": "bussy to free" );
 		ino.size = (ino.size == -1)? 10: -1;
@@ -2470,7 +8174,8 @@ static int fake_data(int num_data)
 
 int my_fake(int num_inode, int num_data)
 {
-	fs_init();
+	if (daemon_busy() || (fs_init() < 0))
+		return -1;
 	
 	if (num_inode > 0)
 		fake_inode(num_inode);
@@ -9,6 +9,11 @@
 #include <fcntl.h>
 #include <unistd.h>
 
+/* para los ficheros con huecos (en glibc solo con _GNU_SOURCE) */
+#ifndef SEEK_DATA
+	#define SEEK_DATA 3
+	#define SEEK_HOLE 4
+#endif
 
 int mfs_open(const char *pathname, int flags);
 int mfs_close(int fd);
@@ -16,15 +21,26 @@ int mfs_close(int fd);
 int mfs_read(int fd, void *buf, size_t count);
 int mfs_write(int fd, void *buf, size_t count);
 off_t mfs_lseek(int fd, off_t offset, int whence);
+int mfs_fsync(int fd);
+int mfs_copy_file_range(int fd_in, int fd_out, size_t count);
 
 int mfs_link(const char *oldpath, const char *newpath);
 int mfs_unlink(const char *pathname);
 int mfs_rename(const char *oldpath, const char *newpath);
+int mfs_clone(const char *src, const char *dst);
 
 typedef struct mfs_dir MFS_DIR;
 
+struct mfs_direntplus {
+	struct dirent d; /* la entrada del directorio */
+	struct stat st; /* lo que devolvería mfs_stat */
+};
+
 MFS_DIR *mfs_opendir(const char *);
+MFS_DIR *mfs_opendir_prefix(const char *name, const char *prefix);
 struct dirent *mfs_readdir(MFS_DIR *dir);
+struct mfs_direntplus *mfs_readdirplus(MFS_DIR *dir);
+int mfs_getdents(MFS_DIR *dir, struct dirent *buf, int count);
 int mfs_closedir(MFS_DIR *dir);
 
 int mfs_mkfs(char *name, int num_blocks, int size_block,
@@ -33,12 +49,45 @@ int mfs_debug(char *name);
 
 int mfs_stat(const char *path, struct stat *buf);
 
+/* todo lo que va entre las dos se marca sucio y limpio una sola vez */
+int mfs_begin(void);
+int mfs_commit(void);
+
 int mfs_mkdir(const char *path, mode_t mode);
+int mfs_mkdir_btree(const char *path);
 int mfs_rmdir(const char *pathname);
+int mfs_compactdir(const char *pathname);
+
+struct mfs_frag_stats {
+	int files; /* ficheros y directorios con bloques de datos */
+	int fragmented; /* los que están en más de un trozo del disco */
+	int extents; /* extents usados entre todos */
+	int blocks; /* bloques de datos que ocupan */
+};
+
+int mfs_fragstats(struct mfs_frag_stats *st);
+int mfs_defrag(struct mfs_frag_stats *before, struct mfs_frag_stats *after);
+
+int mfs_resize(int num_blocks, int inode_blocks);
+
+struct mfs_dedup_stats {
+	int files; /* ficheros mirados */
+	int block_size;
+	long blocks; /* bloques a los que se les calculó la huella */
+	long shared; /* bloques que se cambiaron por uno igual */
+	long freed; /* bloques que quedaron libres */
+	double hash_time; /* segundos calculando huellas */
+	double time; /* segundos en total */
+};
+
+int mfs_dedup(struct mfs_dedup_stats *st);
 
 int my_info(bool h_i, bool i, bool h_b, bool b, bool h_d, bool d);
-int my_debug(bool repair);
+int my_analysis(void);
+int my_debug(bool repair, int jobs);
+int my_debug_log(bool repair, int jobs);
 int my_fake(int num_inode, int num_data);
-int my_mkfs(int num_blocks, int size_block, int percent_inodes);
+int my_mkfs(int num_blocks, int size_block, int percent_inodes, bool checksum,
+	    int zip_cluster, bool dedup);
 
 #endif /* MFS_H */
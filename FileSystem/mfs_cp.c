@@ -13,6 +13,7 @@
 #include "mfs.h"
 
 int transfer_size = 2048;//512;
+bool reflink = false;
 
 static bool usage(char *arg)
 {
@@ -21,6 +22,7 @@ static bool usage(char *arg)
 		"Copia el fichero origen a destino\n\n"
 		"Opciones:\n"
 		"  -s, --size=<tamaño cada transferencia>: copia en trozos de este tamaño\n"
+		"  -r, --reflink: el destino comparte los bloques del origen\n"
 		"  -h, --help: muestra esta ayuda\n\n"
 	);
 	exit(0);
@@ -45,6 +47,12 @@ static bool change_size(char *arg)
 	return true;	
 }
 
+static bool set_reflink(char *arg)
+{
+	reflink = true;
+	return true;
+}
+
 struct cmd {
 	char *name;
 	bool (*function) (char *);	
@@ -53,6 +61,8 @@ struct cmd {
 struct cmd option[] = {
 	{"-s=",change_size},
 	{"--size=", change_size},
+	{"-r", set_reflink},
+	{"--reflink", set_reflink},
 	{"-h", usage},
 	{"--help", usage},
 	
@@ -88,7 +98,16 @@ static int check_options(char **arg, char **cpy)
 static int standard_copy(char *source, char *target)
 {
 	int in, out;
-	char * buffer;
+
+	if (reflink) {
+		printf("clonar '%s' en '%s'\n", source, target);
+		if (mfs_clone(source, target) == -1) {
+			printf("No puedo clonar '%s' en '%s'. Error %s\n",
+			       source, target, strerror(errno));
+			return -1;
+		}
+		return 0;
+	}
 
 	printf("copiar '%s' a '%s' en trozos de %d\n",
 	       source, target, transfer_size);
@@ -107,29 +126,36 @@ static int standard_copy(char *source, char *target)
 		return -1;
 	}
 
-	buffer = malloc(transfer_size);
- 
-	if (buffer == NULL) {
-		printf("No puedo obteren %d memoria para el buffer"
-		       " de intercambio\n", transfer_size);
-		exit(-4);
-	}
-
-	while(true) {
-		int wsize;
-		int rsize = mfs_read(in, buffer, transfer_size);
-		if (rsize == 0)
+	/* copiamos dentro de la imagen, sin pasar los datos por aqui, y solo
+	 * los trozos con datos: los huecos se quedan como huecos */
+	off_t size = mfs_lseek(in, 0, SEEK_END);
+	off_t data = 0, hole, end = 0;
+	while ((data = mfs_lseek(in, data, SEEK_DATA)) != -1) {
+		hole = mfs_lseek(in, data, SEEK_HOLE);
+		mfs_lseek(in, data, SEEK_SET);
+		mfs_lseek(out, data, SEEK_SET);
+		while (data < hole) {
+			int csize = mfs_copy_file_range(in, out,
+				(hole - data < transfer_size)? hole - data: transfer_size);
+			if (csize <= 0) {
+				if (csize < 0)
+					printf("Error %s copiando '%s' en '%s'\n",
+					       strerror(errno), source, target);
+				data = size; /* no seguimos */
+				break;
+			}
+			data += csize;
+		}
+		end = data;
+		if (data >= size)
 			break;
-		if (rsize < 0)
-			printf("Error %s leyendo fichero '%s'\n",
-			       strerror(errno), source);
-
-		wsize = mfs_write(out, buffer, rsize);
-		if (wsize <= 0)
-			printf("Error %s escribiendo fichero '%s'\n",
-			       strerror(errno), target);
 	}
-	free(buffer);
+	/* si acaba en un hueco se copia el último byte para que tenga el tamaño */
+	if (end < size) {
+		mfs_lseek(in, size - 1, SEEK_SET);
+		mfs_lseek(out, size - 1, SEEK_SET);
+		mfs_copy_file_range(in, out, 1);
+	}
 	mfs_close(in);
 	mfs_close(out);
 
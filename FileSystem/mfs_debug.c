@@ -9,15 +9,19 @@
 #include "mfs.h"
 
 	bool repair;
+	bool incremental = false;
+	int jobs = 1;
 
 static void usage(void)
 {
 	printf(
-		"Usage:  my_debug -c|-r|-h \n"
+		"Usage:  my_debug -c|-r|-h [-l] [-j hilos]\n"
 		"Un simple debug del sistema de ficheros $MFS_NAME\n"
 		"Opciones:\n"
 		"  -c, --check: comprueba el sistema de ficheros\n"
 		"  -r, --repair: repara el sistema de ficheros\n"
+		"  -l, --log: tras una caída mira solo lo que dice el registro de cambios\n"
+		"  -j, --jobs: hilos para comprobar a la vez (0: uno por cpu)\n"
 		"  -h, --help: Muestra esta ayuda\n"
 	);
 	exit(0);
@@ -33,6 +37,11 @@ static void r_false(void)
 	repair = false;	
 }
 
+static void l_true(void)
+{
+	incremental = true;
+}
+
 struct cmd {
 	char *name;
 	void (*function)(void);	
@@ -44,6 +53,8 @@ struct cmd option[] = {
 	{"--check", r_false},
 	{"-r", r_true},
 	{"--repair", r_true},
+	{"-l", l_true},
+	{"--log", l_true},
 	{"-h", usage},
 	{"--help", usage},
 	
@@ -72,12 +83,22 @@ int main (int argc, char **argv)
 	argv++;
 	argc--;
 	
-	if (argc!= 1)
+	if (argc == 0)
 		usage();
 	
-	handler(argv);
+	for (; argc > 0; argc--, argv++) {
+		if ((argc > 1) && (!strcmp(argv[0], "-j") || !strcmp(argv[0], "--jobs"))) {
+			jobs = atoi(argv[1]);
+			argc--;
+			argv++;
+		} else
+			handler(argv);
+	}
 
-	my_debug(repair);
+	if (incremental)
+		my_debug_log(repair, jobs);
+	else
+		my_debug(repair, jobs);
 
 	exit (0);
 }
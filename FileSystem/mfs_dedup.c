@@ -0,0 +1,87 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mfs.h"
+
+static struct option long_options[] = {
+	{ .name = "help", 
+	  .has_arg = no_argument, 
+	  .flag = NULL,
+	  .val = 0},
+	{0, 0, 0, 0}
+};
+
+static void usage(int i)
+{
+	printf(
+		"Usage:  mfs_dedup [OPTION]\n"
+		"Busca bloques iguales en los ficheros y los comparte. Si la\n"
+		"imagen no tenía tabla de huellas se crea y desde entonces los\n"
+		"ficheros también se deduplican al cerrarlos\n"
+		"Opciones:\n"
+		"  -h, --help: muestra esta ayuda\n\n"
+	);
+	exit(i);
+}
+
+static int handle_options(int argc, char **argv)
+{
+	while (1) {
+		int c;
+		int option_index = 0;
+
+		c = getopt_long (argc, argv, "h",
+				 long_options, &option_index);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 0:
+		case '?':
+		case 'h':
+			usage(0);
+			break;
+
+		default:
+			printf ("?? getopt returned character code 0%o ??\n", c);
+			usage(-1);
+		}
+	}
+	return 0; 
+}
+
+int main (int argc, char **argv)
+{
+	struct mfs_dedup_stats st;
+	int result = handle_options(argc, argv);
+
+	if (result != 0)
+		exit(result);
+
+	result = mfs_dedup(&st);
+	if (result == -1) {
+		printf("no puedo deduplicar. Error %s\n", strerror(errno));
+		exit(-1);
+	}
+
+	double mb = (double) st.blocks * st.block_size / (1024 * 1024);
+	printf("ficheros:          %8d\n", st.files);
+	printf("bloques mirados:   %8ld\n", st.blocks);
+	printf("bloques cambiados: %8ld\n", st.shared);
+	printf("bloques libres:    %8ld (%ld KB, %.1f%%)\n", st.freed,
+	       st.freed * st.block_size / 1024,
+	       (st.blocks == 0)? 0.0: 100.0 * st.freed / st.blocks);
+	if (st.hash_time > 0)
+		printf("huellas:           %8.1f MB/s\n", mb / st.hash_time);
+	printf("tiempo:            %8.3f s\n", st.time);
+
+	exit (0);
+}
@@ -0,0 +1,121 @@
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mfs.h"
+
+bool dry_run = false;
+
+static struct option long_options[] = {
+	{ .name = "dry-run", 
+	  .has_arg = no_argument, 
+	  .flag = NULL,
+	  .val = 0},
+	{ .name = "help", 
+	  .has_arg = no_argument, 
+	  .flag = NULL,
+	  .val = 0},
+	{0, 0, 0, 0}
+};
+
+static void usage(int i)
+{
+	printf(
+		"Usage:  mfs_defrag [OPTION]\n"
+		"Mueve los ficheros que están repartidos por el disco a un\n"
+		"solo trozo de bloques seguidos\n"
+		"Opciones:\n"
+		"  -n, --dry-run: solo muestra como está el disco\n"
+		"  -h, --help: muestra esta ayuda\n\n"
+	);
+	exit(i);
+}
+
+static void handle_long_options(struct option option, char *arg)
+{
+	if (!strcmp(option.name, "help"))
+		usage(0);
+
+	if (!strcmp(option.name, "dry-run"))
+		dry_run = true;
+}
+
+static int handle_options(int argc, char **argv)
+{
+	while (1) {
+		int c;
+		int option_index = 0;
+
+		c = getopt_long (argc, argv, "nh",
+				 long_options, &option_index);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 0:
+			handle_long_options(long_options[option_index],
+				optarg);
+			break;
+
+		case 'n':
+			dry_run = true;
+			break;
+
+		case '?':
+		case 'h':
+			usage(0);
+			break;
+
+		default:
+			printf ("?? getopt returned character code 0%o ??\n", c);
+			usage(-1);
+		}
+	}
+	return 0; 
+}
+
+static void print_stats(const char *when, struct mfs_frag_stats *st)
+{
+	printf("%s:\n", when);
+	printf("\tficheros:      %8d\n", st->files);
+	printf("\tfragmentados:  %8d\n", st->fragmented);
+	printf("\textents:       %8d\n", st->extents);
+	printf("\tbloques:       %8d\n", st->blocks);
+	if (st->files > 0)
+		printf("\textents/fich.: %8.2f\n",
+		       (double) st->extents / st->files);
+}
+
+int main (int argc, char **argv)
+{
+	struct mfs_frag_stats before, after;
+	int result = handle_options(argc, argv);
+
+	if (result != 0)
+		exit(result);
+
+	if (dry_run) {
+		mfs_fragstats(&before);
+		print_stats("estado", &before);
+		exit(0);
+	}
+
+	result = mfs_defrag(&before, &after);
+	if (result == -1) {
+		printf("no puedo desfragmentar. Error %s\n", strerror(errno));
+		exit(-1);
+	}
+	print_stats("antes", &before);
+	print_stats("después", &after);
+	printf("%d ficheros movidos\n", result);
+
+	exit (0);
+}
@@ -135,21 +135,38 @@ static int mfs_get(char *source, char *target)
 		exit(-4);
 	}
 
-	while(true) {
-		int wsize;
-		int rsize = mfs_read(in, buffer, transfer_size);
-		if (rsize == 0)
-			break;
-		if (rsize < 0)
-			printf("Error %s leyendo fichero '%s'\n",
-			       strerror(errno), source);
-
-		wsize = write(out, buffer, rsize);
-		if (wsize <= 0)
-			printf("Error %s escribiendo fichero '%s'\n",
-			       strerror(errno), target);
+	/* solo se copian los trozos con datos: los huecos se quedan como
+	 * huecos en el destino */
+	off_t size = mfs_lseek(in, 0, SEEK_END);
+	off_t data = 0, hole;
+	while ((data = mfs_lseek(in, data, SEEK_DATA)) != -1) {
+		hole = mfs_lseek(in, data, SEEK_HOLE);
+		mfs_lseek(in, data, SEEK_SET);
+		lseek(out, data, SEEK_SET);
+		while (data < hole) {
+			int wsize;
+			int rsize = mfs_read(in, buffer, (hole - data < transfer_size)?
+					     hole - data: transfer_size);
+			if (rsize <= 0) {
+				if (rsize < 0)
+					printf("Error %s leyendo fichero '%s'\n",
+					       strerror(errno), source);
+				data = size; /* no seguimos */
+				break;
+			}
 
+			wsize = write(out, buffer, rsize);
+			if (wsize <= 0)
+				printf("Error %s escribiendo fichero '%s'\n",
+				       strerror(errno), target);
+			data += rsize;
+		}
+		if (data >= size)
+			break;
 	}
+	if (ftruncate(out, size) != 0) /* por si acaba en un hueco */
+		printf("Error %s escribiendo fichero '%s'\n",
+		       strerror(errno), target);
 	free(buffer);
 	mfs_close(in);
 	close(out);
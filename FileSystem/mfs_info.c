@@ -10,6 +10,7 @@
 
 	bool inode=false, bitmap=false, data=false;
 	bool h_inode=false, h_bitmap=false, h_data=false;
+	bool analysis=false;
 
 static void usage(int i) {
 	printf(
@@ -24,6 +25,8 @@ static void usage(int i) {
 		"  -hide=i: No muestra ningún inodo\n"
 		"  -hide=b: No muestra el bitmap\n"
 		"  -hide=d: No muestra ningún inodo\n"
+		"  -a, --analysis: Solo muestra un análisis de la fragmentación\n"
+		"                  y la ocupación (en JSON)\n"
 		"  -h, --help: Muestra esta ayuda\n"
 	);
 	exit(i);
@@ -54,6 +57,8 @@ int main (int argc, char **argv)
 		if (!strcmp("-b", argv[i])) bitmap = true;
 		else if (!strcmp("-i", argv[i])) inode = true;
 		else if (!strcmp("-d", argv[i])) data = true;
+		else if (!strcmp("-a", argv[i])) analysis = true;
+		else if (!strcmp("--analysis", argv[i])) analysis = true;
 		else if (!strcmp("-h", argv[i])) usage(-1);
 		else if (!strcmp("--help", argv[i])) usage(-1);
 		else if (!strncmp("-hide=", argv[i], strlen("-hide="))) {
@@ -67,6 +72,9 @@ int main (int argc, char **argv)
 		}
 	}
 	
+	if (analysis)
+		exit(my_analysis());
+
 	my_info(h_inode, inode, h_bitmap, bitmap, h_data, data);
 
 	exit (0);
@@ -13,12 +13,17 @@
 #include "mfs.h"
 
 int list_long = 0;
+char *prefix = NULL;
 
 static struct option long_options[] = {
 	{ .name = "long", 
 	  .has_arg = no_argument, 
 	  .flag = NULL,
 	  .val = 0},
+	{ .name = "prefix", 
+	  .has_arg = required_argument, 
+	  .flag = NULL,
+	  .val = 0},
 	{ .name = "help", 
 	  .has_arg = no_argument, 
 	  .flag = NULL,
@@ -33,6 +38,7 @@ static void usage(int i)
 		"Lista el directorio que se le pasa como argumento\n"
 		"Opciones:\n"
 		"  -l, --long>: lista tambien tipo de fichero y tamaño\n"
+		"  -p, --prefix=<nombre>: solo las entradas que empiezan por nombre\n"
 		"  -h, --help: muestra esta ayuda\n\n"
 	);
 	exit(i);
@@ -45,6 +51,9 @@ static void handle_long_options(struct option option, char *arg)
 
 	if (!strcmp(option.name, "long"))
 		list_long = 1;
+
+	if (!strcmp(option.name, "prefix"))
+		prefix = arg;
 }
 
 static int handle_options(int argc, char **argv)
@@ -53,7 +62,7 @@ static int handle_options(int argc, char **argv)
 		int c;
 		int option_index = 0;
 
-		c = getopt_long (argc, argv, "lh",
+		c = getopt_long (argc, argv, "lp:h",
 				 long_options, &option_index);
 		if (c == -1)
 			break;
@@ -68,6 +77,10 @@ static int handle_options(int argc, char **argv)
 			list_long = 1;
 			break;
 
+		case 'p':
+			prefix = optarg;
+			break;
+
 		case '?':
 		case 'h':
 			usage(0);
@@ -84,35 +97,36 @@ static int handle_options(int argc, char **argv)
 static int mfs_ls(char *directory, int list_long)
 {
 	MFS_DIR *dir;
-	struct dirent *entry;
 
 	printf("listar '%s' en formato largo = %d\n",
 	       directory, list_long);
 
-	dir = mfs_opendir(directory);
+	dir = (prefix == NULL)? mfs_opendir(directory):
+				mfs_opendir_prefix(directory, prefix);
 	if (dir == NULL) {
 		printf("No puedo abrir el directorio '%s' Error %s\n",
 		       directory, strerror(errno));
 		exit(-4);
 	}
 
-	char aux[1024];
-
-	while((entry = mfs_readdir(dir)) != NULL) {
-		if (list_long) {
-			struct stat buf;
-
-			if (mfs_stat(strcat(strcat(strcpy(aux, directory),"/"), entry->d_name), &buf) == -1)
-				printf("can't stat '%s'. Error %s\n",
-				       entry->d_name, strerror(errno));
-			else
-				printf("%s %7ld %7ld %s\n",
-				       S_ISDIR(buf.st_mode)?"d":"-",
-				       buf.st_size,
-				       buf.st_ino,
-				       entry->d_name);
-		} else
-			printf("%s\n", entry->d_name);
+	if (list_long) {
+		struct mfs_direntplus *plus;
+
+		/* el stat de cada entrada viene con ella */
+		while((plus = mfs_readdirplus(dir)) != NULL)
+			printf("%s %7ld %7ld %s\n",
+			       S_ISDIR(plus->st.st_mode)?"d":"-",
+			       plus->st.st_size,
+			       plus->st.st_ino,
+			       plus->d.d_name);
+	} else {
+		struct dirent entries[32];
+		int i, n;
+
+		/* pedimos las entradas de 32 en 32 */
+		while((n = mfs_getdents(dir, entries, 32)) > 0)
+			for (i = 0; i < n; i++)
+				printf("%s\n", entries[i].d_name);
 	}
 	mfs_closedir(dir);
 
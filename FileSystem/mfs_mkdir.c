@@ -12,7 +12,13 @@
 
 #include "mfs.h"
 
+bool btree = false;
+
 static struct option long_options[] = {
+	{ .name = "btree", 
+	  .has_arg = no_argument, 
+	  .flag = NULL,
+	  .val = 0},
 	{ .name = "help", 
 	  .has_arg = no_argument, 
 	  .flag = NULL,
@@ -26,6 +32,8 @@ static void usage(int i)
 		"Usage:  mfs_mkdir DIR\n"
 		"Crea un directorio argumento\n"
 		"Opciones:\n"
+		"  -b, --btree: el directorio se guarda como un árbol B+ (para\n"
+		"               directorios muy grandes, bloques >= 1024)\n"
 		"  -h, --help: muestra esta ayuda\n\n"
 	);
 	exit(i);
@@ -36,6 +44,9 @@ static void handle_long_options(struct option option, char *arg)
 	if (!strcmp(option.name, "help"))
 		usage(0);
 
+	if (!strcmp(option.name, "btree"))
+		btree = true;
+
 }
 
 static int handle_options(int argc, char **argv)
@@ -44,7 +55,7 @@ static int handle_options(int argc, char **argv)
 		int c;
 		int option_index = 0;
 
-		c = getopt_long (argc, argv, "h",
+		c = getopt_long (argc, argv, "bh",
 				 long_options, &option_index);
 		if (c == -1)
 			break;
@@ -55,6 +66,10 @@ static int handle_options(int argc, char **argv)
 				optarg);
 			break;
 
+		case 'b':
+			btree = true;
+			break;
+
 		case '?':
 		case 'h':
 			usage(0);
@@ -72,7 +87,10 @@ static int mfs_create_dir(char *directory)
 {
 	printf("crear directorio '%s'\n", directory);
 
-	if (mfs_mkdir(directory, S_IRUSR | S_IWUSR | S_IXUSR | S_IRGRP | S_IXGRP) == -1) {
+	int ret = (btree)? mfs_mkdir_btree(directory):
+		mfs_mkdir(directory, S_IRUSR | S_IWUSR | S_IXUSR | S_IRGRP | S_IXGRP);
+
+	if (ret == -1) {
 		printf("no puedo crear '%s'. Error %s\n",
 		       directory, strerror(errno));
 		return -1;
@@ -15,6 +15,9 @@
 int inodes_percent = 10;
 int block_size = 128;
 int num_blocks = 100;
+bool checksum = false;
+int zip_cluster = 0;
+bool dedup = false;
 
 static void usage(char *s)
 {
@@ -28,6 +31,9 @@ static void usage(char *s)
 		"  -b, --block-size=<tamaño bloque>\n"
 		"  -n, --num-blocks=<numero de bloques>\n"
 		"  -i, --inodes-percent=<porcentaje de bloques destinados a inodos>\n"
+		"  -k, --checksum=<crc32c|none>: checksum de cada bloque\n"
+		"  -z, --compress=<bloques por cluster>: comprime los ficheros\n"
+		"  -d, --dedup=<on|off>: comparte los bloques iguales\n"
 		"  -h, --help: muestra esta ayuda\n\n"
 	);
 	exit(-1);
@@ -73,6 +79,39 @@ static void n_data(char *s)
 	set_var(s, &num_blocks);
 }
 
+static void k_data(char *s)
+{
+	if (s == NULL) {
+		printf("No se introdujo valor alguno\n");
+		exit(-1);
+	}
+	if (!strcmp(s, "crc32c"))
+		checksum = true;
+	else if (!strcmp(s, "none"))
+		checksum = false;
+	else
+		usage(s);
+}
+
+static void z_data(char *s)
+{
+	set_var(s, &zip_cluster);
+}
+
+static void d_data(char *s)
+{
+	if (s == NULL) {
+		printf("No se introdujo valor alguno\n");
+		exit(-1);
+	}
+	if (!strcmp(s, "on"))
+		dedup = true;
+	else if (!strcmp(s, "off"))
+		dedup = false;
+	else
+		usage(s);
+}
+
 struct cmd option[] = {
 	{"-i",p_inode},
 	{"--inodes-percent", p_inode},
@@ -80,6 +119,12 @@ struct cmd option[] = {
 	{"--block-size", b_data},
 	{"-n",n_data},
 	{"--num-blocks",n_data},
+	{"-k", k_data},
+	{"--checksum", k_data},
+	{"-z", z_data},
+	{"--compress", z_data},
+	{"-d", d_data},
+	{"--dedup", d_data},
 	{"-h", usage},
 	{"--help", usage},
 	
@@ -119,7 +164,8 @@ int main(int argc, char **argv)
 	printf("n = %d\n", num_blocks);
 */
 	
-	if (my_mkfs(num_blocks, block_size, inodes_percent) == -1) {
+	if (my_mkfs(num_blocks, block_size, inodes_percent, checksum,
+		    zip_cluster, dedup) == -1) {
 		printf("Error creando el sistema de ficheros: ");
 		char *name = getenv("MFS_NAME");
 		printf("%s\n", (name == NULL)?
@@ -63,10 +63,45 @@ static int check_options(char **arg, char **cpy)
 	return j;
 }
 
+/* Si no se puede renombrar (p.ej. entre directorios) copiamos el fichero
+ * dentro de la imagen y borramos el original
+ */
+static int copy_move(char *source, char *target)
+{
+	int in, out, result = 0;
+	struct stat buf;
+
+	if ((mfs_stat(source, &buf) == -1) || S_ISDIR(buf.st_mode))
+		return -1;
+
+	in = mfs_open(source, O_RDONLY);
+	if (in == -1)
+		return -1;
+	out = mfs_open(target, O_WRONLY | O_CREAT | O_TRUNC);
+	if (out == -1) {
+		mfs_close(in);
+		return -1;
+	}
+
+	while ((result = mfs_copy_file_range(in, out, buf.st_size)) > 0)
+		;
+	mfs_close(in);
+	mfs_close(out);
+
+	if (result == -1) {
+		mfs_unlink(target);
+		return -1;
+	}
+	return mfs_unlink(source);
+}
+
 static int standard_move(char *source, char *target)
 {
 	int result = mfs_rename(source, target);
 	
+	if (result == -1)
+		result = copy_move(source, target);
+
 	if (result == -1)
 		printf("mfs_mv %s %s ha fallado, con error %s\n",
 		       source, target, strerror(errno));
@@ -0,0 +1,130 @@
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mfs.h"
+
+int num_blocks = 0;
+int inode_blocks = 0;
+
+static struct option long_options[] = {
+	{ .name = "num-blocks", 
+	  .has_arg = required_argument, 
+	  .flag = NULL,
+	  .val = 0},
+	{ .name = "inode-blocks", 
+	  .has_arg = required_argument, 
+	  .flag = NULL,
+	  .val = 0},
+	{ .name = "help", 
+	  .has_arg = no_argument, 
+	  .flag = NULL,
+	  .val = 0},
+	{0, 0, 0, 0}
+};
+
+static void usage(int i)
+{
+	printf(
+		"Usage:  mfs_resize -n BLOQUES [-i BLOQUES]\n"
+		"Hace más grande el sistema de ficheros $MFS_NAME sin copiar\n"
+		"los datos\n"
+		"Opciones:\n"
+		"  -n, --num-blocks=<numero de bloques>: tamaño nuevo (como en mfs_mkfs)\n"
+		"  -i, --inode-blocks=<numero de bloques>: bloques que se añaden\n"
+		"                                          a la tabla de inodos\n"
+		"  -h, --help: muestra esta ayuda\n\n"
+	);
+	exit(i);
+}
+
+static void set_var(char *s, int *var)
+{
+	char *end;
+
+	*var = strtol(s, &end, 10);
+	if ((*end != '\0') || (*var < 0)) {
+		printf("%s: No es un entero válido\n", s);
+		exit(-1);
+	}
+}
+
+static void handle_long_options(struct option option, char *arg)
+{
+	if (!strcmp(option.name, "help"))
+		usage(0);
+
+	if (!strcmp(option.name, "num-blocks"))
+		set_var(arg, &num_blocks);
+
+	if (!strcmp(option.name, "inode-blocks"))
+		set_var(arg, &inode_blocks);
+}
+
+static int handle_options(int argc, char **argv)
+{
+	while (1) {
+		int c;
+		int option_index = 0;
+
+		c = getopt_long (argc, argv, "n:i:h",
+				 long_options, &option_index);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 0:
+			handle_long_options(long_options[option_index],
+				optarg);
+			break;
+
+		case 'n':
+			set_var(optarg, &num_blocks);
+			break;
+
+		case 'i':
+			set_var(optarg, &inode_blocks);
+			break;
+
+		case '?':
+		case 'h':
+			usage(0);
+			break;
+
+		default:
+			printf ("?? getopt returned character code 0%o ??\n", c);
+			usage(-1);
+		}
+	}
+	return 0; 
+}
+
+int main (int argc, char **argv)
+{
+	int result = handle_options(argc, argv);
+
+	if (result != 0)
+		exit(result);
+
+	if (num_blocks == 0) {
+		printf("Necesita el número de bloques nuevo\n");
+		usage(-1);
+	}
+	if (mfs_resize(num_blocks, inode_blocks) == -1) {
+		printf("no puedo redimensionar a %d bloques. Error %s\n",
+		       num_blocks, strerror(errno));
+		exit(-1);
+	}
+	printf("sistema de ficheros con %d bloques (%d bloques de inodos más)\n",
+	       num_blocks, inode_blocks);
+
+	exit (0);
+}
@@ -0,0 +1,399 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "mfs_rpc.h"
+
+static int sock = -1; /* conexión con mfsd */
+static int remote = -1; /* -1 sin mirar todavía, 0 acceso directo, 1 por mfsd */
+static struct rpc_ring *ring = NULL; /* NULL: todo va por el socket */
+static int ring_sq = -1; /* eventfd para avisar al demonio */
+static int ring_cq = -1; /* eventfd por el que avisa él */
+
+static void ring_setup(void);
+
+bool rpc_client(void)
+{
+	struct sockaddr_un addr;
+	char *name;
+
+	if (remote != -1)
+		return remote;
+
+	remote = 0;
+	name = getenv("MFS_SOCKET");
+	if (name == NULL)
+		return false;
+	if (strlen(name) >= sizeof(addr.sun_path)) {
+		printf("MFS_SOCKET '%s' demasiado largo\n", name);
+		return false;
+	}
+	memset(&addr, '\0', sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, name);
+
+	int s = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (s == -1)
+		return false;
+	if (connect(s, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+		printf("mfsd no contesta en %s (%s): se usa la imagen directamente\n",
+		       name, strerror(errno));
+		close(s);
+		return false;
+	}
+	sock = s;
+	remote = 1;
+	name = getenv("MFS_RING");
+	if ((name == NULL) || strcmp(name, "0"))
+		ring_setup();
+	return true;
+}
+
+int rpc_recv(int s, void *buf, size_t len)
+{
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t n = recv(s, (char *) buf + done, len - done, 0);
+		if (n == 0)
+			return 0;
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		done += n;
+	}
+	return 1;
+}
+
+int rpc_send(int s, const void *buf, size_t len)
+{
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t n = send(s, (const char *) buf + done, len - done,
+				 MSG_NOSIGNAL);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		done += n;
+	}
+	return 1;
+}
+
+/* Si el demonio desaparece a mitad no se puede seguir (los fd eran suyos):
+ * todo lo que venga después falla con EPIPE, no se pasa a acceso directo
+ */
+static int64_t rpc_broken(void)
+{
+	if (sock >= 0)
+		close(sock);
+	sock = -1;
+	if (ring != NULL) {
+		munmap(ring, RING_SIZE);
+		close(ring_sq);
+		close(ring_cq);
+		ring = NULL;
+	}
+	errno = EPIPE;
+	return -1;
+}
+
+/* Pide los anillos por el socket. La respuesta trae tres descriptores
+ * (memfd, eventfd del demonio y el nuestro); si algo falla se sigue con el
+ * socket
+ */
+static void ring_setup(void)
+{
+	struct rpc_request req = { .op = RPC_RING };
+	struct rpc_reply rep;
+	union {
+		struct cmsghdr h;
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+	} cmsg;
+	struct iovec iov = { .iov_base = &rep, .iov_len = sizeof(rep) };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cmsg.buf,
+		.msg_controllen = sizeof(cmsg.buf),
+	};
+	struct cmsghdr *c;
+	int fds[3];
+
+	if (rpc_send(sock, &req, sizeof(req)) <= 0)
+		return;
+	if (recvmsg(sock, &msg, MSG_WAITALL) != sizeof(rep))
+		return;
+	c = CMSG_FIRSTHDR(&msg);
+	if ((rep.ret != 0) || (c == NULL) || (c->cmsg_type != SCM_RIGHTS) ||
+	    (c->cmsg_len != CMSG_LEN(sizeof(fds))))
+		return;
+	memcpy(fds, CMSG_DATA(c), sizeof(fds));
+
+	void *p = mmap(NULL, RING_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+		       fds[0], 0);
+	close(fds[0]);
+	if (p == MAP_FAILED) {
+		close(fds[1]);
+		close(fds[2]);
+		return;
+	}
+	ring = p;
+	ring_sq = fds[1];
+	ring_cq = fds[2];
+}
+
+/* Publica n peticiones nuevas de sq y avisa al demonio (una vez para todas) */
+static int ring_submit(int n)
+{
+	uint64_t one = 1;
+
+	__atomic_store_n(&ring->sq_tail, ring->sq_tail + n, __ATOMIC_RELEASE);
+	if (write(ring_sq, &one, sizeof(one)) != sizeof(one))
+		return -1;
+	return 0;
+}
+
+/* Espera a la siguiente respuesta de cq. Se mira también el socket: si el
+ * demonio se muere no va a avisar por el eventfd
+ */
+static int ring_reap(struct rpc_cqe *cqe)
+{
+	struct pollfd pfd[2] = {
+		{ .fd = ring_cq, .events = POLLIN },
+		{ .fd = sock, .events = POLLIN },
+	};
+	uint32_t head = ring->cq_head;
+	uint64_t v;
+
+	while (__atomic_load_n(&ring->cq_tail, __ATOMIC_ACQUIRE) == head) {
+		if (poll(pfd, 2, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (pfd[1].revents)
+			return -1;
+		if (pfd[0].revents & POLLIN)
+			read(ring_cq, &v, sizeof(v));
+	}
+	*cqe = ring->cq[head % RING_ENTRIES];
+	__atomic_store_n(&ring->cq_head, head + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* Deja una petición en la entrada k de las que se van a mandar juntas (los
+ * datos tienen que estar ya en su hueco)
+ */
+static void ring_prep(int k, int op, int64_t a0, int64_t a1, int64_t a2,
+		      size_t datalen)
+{
+	uint32_t i = (ring->sq_tail + k) % RING_ENTRIES;
+	struct rpc_sqe *sqe = &ring->sq[i];
+
+	sqe->req.op = op;
+	sqe->req.len = datalen;
+	sqe->req.arg[0] = a0;
+	sqe->req.arg[1] = a1;
+	sqe->req.arg[2] = a2;
+	sqe->slot = i;
+}
+
+static int64_t ring_call(int op, int64_t a0, int64_t a1, int64_t a2,
+			 const void *data, size_t datalen, void *out, size_t outlen)
+{
+	uint32_t i = ring->sq_tail % RING_ENTRIES;
+	struct rpc_cqe cqe;
+
+	if (datalen > RING_SLOT) {
+		errno = EINVAL;
+		return -1;
+	}
+	memcpy(ring_slot(ring, i), data, datalen);
+	ring_prep(0, op, a0, a1, a2, datalen);
+	if ((ring_submit(1) == -1) || (ring_reap(&cqe) == -1))
+		return rpc_broken();
+	if (cqe.rep.len > outlen)
+		return rpc_broken();
+	memcpy(out, ring_slot(ring, cqe.slot), cqe.rep.len);
+
+	errno = cqe.rep.err;
+	return cqe.rep.ret;
+}
+
+/* Un read o write grande se parte en huecos y se manda todo junto (hasta
+ * RING_ENTRIES cada vez): el demonio los hace seguidos sin esperar a que el
+ * cliente copie cada uno. Como van en orden sobre el mismo fd es lo mismo
+ * que hacerlos de uno en uno, salvo que si uno se queda corto los que van
+ * detrás ya se hicieron: en un read se vuelve atrás con lseek, en un write
+ * (se quedó sin sitio) no se puede deshacer lo que se haya escrito después
+ */
+static int ring_rw(int op, int fd, char *buf, size_t count)
+{
+	struct rpc_cqe cqe;
+	int64_t ret[RING_ENTRIES];
+	size_t done = 0;
+	int k, n;
+
+	while (done < count) {
+		size_t sent = done;
+		uint32_t first = ring->sq_tail;
+
+		for (n = 0; (n < RING_ENTRIES) && (sent < count); n++) {
+			size_t len = (count - sent > RING_SLOT)? RING_SLOT: count - sent;
+			if (op == RPC_WRITE) {
+				memcpy(ring_slot(ring, (first + n) % RING_ENTRIES), buf + sent, len);
+				ring_prep(n, op, fd, 0, 0, len);
+			} else
+				ring_prep(n, op, fd, len, 0, 0);
+			sent += len;
+		}
+		if (ring_submit(n) == -1)
+			return (done == 0)? rpc_broken(): done;
+		for (k = 0; k < n; k++) {
+			if (ring_reap(&cqe) == -1)
+				return (done == 0)? rpc_broken(): done;
+			ret[(cqe.slot - first) % RING_ENTRIES] = cqe.rep.ret;
+			if (cqe.rep.ret < 0)
+				errno = cqe.rep.err;
+		}
+
+		int64_t extra = 0; /* lo que se hizo detrás de uno que se quedó corto */
+		bool stop = false;
+		for (k = 0; k < n; k++) {
+			size_t len = (count - done > RING_SLOT)? RING_SLOT: count - done;
+			if (stop) {
+				if (ret[k] > 0)
+					extra += ret[k];
+				continue;
+			}
+			if (ret[k] < 0)
+				return (done == 0)? ret[k]: done;
+			if (op == RPC_READ)
+				memcpy(buf + done, ring_slot(ring, (first + k) % RING_ENTRIES),
+				       ret[k]);
+			done += ret[k];
+			stop = (ret[k] < len);
+		}
+		if ((extra > 0) && (op == RPC_READ))
+			ring_call(RPC_LSEEK, fd, -extra, SEEK_CUR, NULL, 0, NULL, 0);
+		if (stop)
+			break;
+	}
+	return done;
+}
+
+int64_t rpc_call(int op, int64_t a0, int64_t a1, int64_t a2,
+		 const void *data, size_t datalen, void *out, size_t outlen)
+{
+	struct rpc_request req = {
+		.op = op,
+		.len = datalen,
+		.arg = {a0, a1, a2},
+	};
+	struct rpc_reply rep;
+	struct iovec iov[2] = {
+		{ .iov_base = &req, .iov_len = sizeof(req) },
+		{ .iov_base = (void *) data, .iov_len = datalen },
+	};
+	struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2 };
+
+	if (sock < 0)
+		return rpc_broken();
+	if (ring != NULL)
+		return ring_call(op, a0, a1, a2, data, datalen, out, outlen);
+	/* cabecera y datos de una vez: un write pequeño no sale en dos paquetes */
+	while (msg.msg_iovlen > 0) {
+		ssize_t n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return rpc_broken();
+		}
+		while ((msg.msg_iovlen > 0) && (n >= msg.msg_iov->iov_len)) {
+			n -= msg.msg_iov->iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+		if (msg.msg_iovlen > 0) {
+			msg.msg_iov->iov_base += n;
+			msg.msg_iov->iov_len -= n;
+		}
+	}
+
+	if (rpc_recv(sock, &rep, sizeof(rep)) <= 0)
+		return rpc_broken();
+	if (rep.len > outlen) /* no debería pasar nunca */
+		return rpc_broken();
+	if ((rep.len > 0) && (rpc_recv(sock, out, rep.len) <= 0))
+		return rpc_broken();
+
+	errno = rep.err;
+	return rep.ret;
+}
+
+int64_t rpc_path(int op, const char *a, const char *b, int64_t arg,
+		 void *out, size_t outlen)
+{
+	size_t la = strlen(a) + 1;
+	size_t lb = (b == NULL)? 0: strlen(b) + 1;
+	char buf[la + lb];
+
+	memcpy(buf, a, la);
+	if (b != NULL)
+		memcpy(buf + la, b, lb);
+
+	return rpc_call(op, arg, 0, 0, buf, la + lb, out, outlen);
+}
+
+/* Los read y write grandes van en trozos de RPC_MAX_DATA: se para en el
+ * primero que no se hace entero, como haría una sola llamada
+ */
+int rpc_read(int fd, void *buf, size_t count)
+{
+	size_t done = 0;
+
+	if (ring != NULL)
+		return ring_rw(RPC_READ, fd, buf, count);
+	while (done < count) {
+		size_t n = (count - done > RPC_MAX_DATA)? RPC_MAX_DATA: count - done;
+		int64_t r = rpc_call(RPC_READ, fd, n, 0, NULL, 0, (char *) buf + done, n);
+		if (r < 0)
+			return (done == 0)? r: done;
+		done += r;
+		if (r < n)
+			break;
+	}
+	return done;
+}
+
+int rpc_write(int fd, const void *buf, size_t count)
+{
+	size_t done = 0;
+
+	if (ring != NULL)
+		return ring_rw(RPC_WRITE, fd, (char *) buf, count);
+	while (done < count) {
+		size_t n = (count - done > RPC_MAX_DATA)? RPC_MAX_DATA: count - done;
+		int64_t r = rpc_call(RPC_WRITE, fd, 0, 0, (const char *) buf + done, n,
+				     NULL, 0);
+		if (r < 0)
+			return (done == 0)? r: done;
+		done += r;
+		if (r < n)
+			break;
+	}
+	return done;
+}
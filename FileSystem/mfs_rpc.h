@@ -0,0 +1,116 @@
+#ifndef __mfs_rpc_h
+#define __mfs_rpc_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Protocolo entre mfsd y las herramientas. Cada petición es una cabecera
+ * fija seguida de len bytes (los paths terminados en '\0' o los datos de un
+ * write) y cada respuesta otra cabecera seguida de len bytes (lo leído, el
+ * stat, las entradas de un directorio...). Cliente y demonio están en la
+ * misma máquina, así que todo va en el formato nativo
+ */
+enum rpc_op {
+	RPC_OPEN = 1,	/* path, arg[0] = flags */
+	RPC_CLOSE,	/* arg[0] = fd */
+	RPC_READ,	/* arg[0] = fd, arg[1] = count */
+	RPC_WRITE,	/* arg[0] = fd, datos */
+	RPC_LSEEK,	/* arg[0] = fd, arg[1] = offset, arg[2] = whence */
+	RPC_FSYNC,	/* arg[0] = fd */
+	RPC_COPY_RANGE,	/* arg[0] = fd_in, arg[1] = fd_out, arg[2] = count */
+	RPC_LINK,	/* dos paths */
+	RPC_UNLINK,	/* path */
+	RPC_RENAME,	/* dos paths */
+	RPC_CLONE,	/* dos paths */
+	RPC_STAT,	/* path -> struct stat */
+	RPC_MKDIR,	/* path, arg[0] = mode */
+	RPC_MKDIR_BTREE,/* path */
+	RPC_RMDIR,	/* path */
+	RPC_COMPACTDIR,	/* path */
+	RPC_OPENDIR,	/* path y prefijo (o solo path) -> manejador e inodo */
+	RPC_READDIR,	/* arg[0] = manejador, arg[1] = máximo -> mfs_direntplus */
+	RPC_CLOSEDIR,	/* arg[0] = manejador */
+	RPC_FRAGSTATS,	/* -> struct mfs_frag_stats */
+	RPC_DEFRAG,	/* -> dos struct mfs_frag_stats */
+	RPC_DEDUP,	/* -> struct mfs_dedup_stats */
+	RPC_RING,	/* -> el memfd del anillo y sus dos eventfd (SCM_RIGHTS) */
+	RPC_OPS
+};
+
+struct rpc_request {
+	uint32_t op;
+	uint32_t len; /* bytes que vienen detrás */
+	int64_t arg[3];
+};
+
+struct rpc_reply {
+	int64_t ret; /* lo que devolvió la función en el demonio */
+	int32_t err; /* su errno */
+	uint32_t len; /* bytes que vienen detrás */
+};
+
+#define RPC_MAX_DATA (1024 * 1024) /* lo más que lleva un read o write */
+#define RPC_DIRENTS 64 /* entradas de directorio por cada RPC_READDIR */
+
+/* Anillos en memoria compartida (como io_uring). El cliente deja peticiones
+ * en sq, avisa al demonio por un eventfd y espera las respuestas en cq, que
+ * le avisa por otro. Cada entrada de sq tiene su hueco de RING_SLOT bytes
+ * detrás de la cabecera: ahí van los paths y lo que se escribe y ahí deja
+ * el demonio lo que se lee, así que los datos no pasan por el socket. Con
+ * varias peticiones seguidas basta un aviso para todas
+ */
+#define RING_ENTRIES 32
+#define RING_SLOT (256 * 1024)
+
+struct rpc_sqe {
+	struct rpc_request req;
+	uint32_t slot; /* hueco con los datos de la petición */
+	uint32_t pad;
+};
+
+struct rpc_cqe {
+	struct rpc_reply rep;
+	uint32_t slot; /* el de la petición: ahí está la respuesta */
+	uint32_t pad;
+};
+
+/* sq_tail y cq_head los mueve el cliente, sq_head y cq_tail el demonio */
+struct rpc_ring {
+	uint32_t sq_head;
+	uint32_t sq_tail;
+	uint32_t cq_head;
+	uint32_t cq_tail;
+	struct rpc_sqe sq[RING_ENTRIES];
+	struct rpc_cqe cq[RING_ENTRIES];
+};
+
+#define RING_HEADER ((sizeof(struct rpc_ring) + 4095) & ~4095UL)
+#define RING_SIZE (RING_HEADER + (size_t) RING_ENTRIES * RING_SLOT)
+#define ring_slot(r, i) ((char *) (r) + RING_HEADER + (size_t) (i) * RING_SLOT)
+
+/* true si las llamadas se mandan a mfsd: está puesto MFS_SOCKET y el
+ * demonio contesta. Se conecta la primera vez que se llama y pide los
+ * anillos (salvo con MFS_RING=0: entonces todo va por el socket)
+ */
+bool rpc_client(void);
+
+/* Manda una petición con los datos data (datalen bytes) y deja la respuesta
+ * en out (como mucho outlen bytes). Devuelve el ret de la respuesta con
+ * errno puesto, o -1 si falló la conexión
+ */
+int64_t rpc_call(int op, int64_t a0, int64_t a1, int64_t a2,
+		 const void *data, size_t datalen, void *out, size_t outlen);
+
+/* Lo mismo con uno o dos paths como datos (b puede ser NULL) */
+int64_t rpc_path(int op, const char *a, const char *b, int64_t arg,
+		 void *out, size_t outlen);
+
+int rpc_read(int fd, void *buf, size_t count);
+int rpc_write(int fd, const void *buf, size_t count);
+
+/* Leer y escribir exactamente len bytes de un socket (0 si se cerró) */
+int rpc_recv(int sock, void *buf, size_t len);
+int rpc_send(int sock, const void *buf, size_t len);
+
+#endif /* __mfs_rpc_h */
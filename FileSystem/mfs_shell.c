@@ -0,0 +1,325 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mfs.h"
+
+#define MAX_ARGS 8
+#define BUFFER_SIZE (64 * 1024)
+
+bool transaction = false;
+bool stop_on_error = false;
+char buffer[BUFFER_SIZE];
+
+static struct option long_options[] = {
+	{ .name = "transaction",
+	  .has_arg = no_argument,
+	  .flag = NULL,
+	  .val = 't'},
+	{ .name = "stop",
+	  .has_arg = no_argument,
+	  .flag = NULL,
+	  .val = 'e'},
+	{ .name = "help",
+	  .has_arg = no_argument,
+	  .flag = NULL,
+	  .val = 'h'},
+	{0, 0, 0, 0}
+};
+
+static void usage(int i)
+{
+	printf(
+		"Usage:  mfs_shell [OPTION] [SCRIPT]\n"
+		"Ejecuta las órdenes de SCRIPT (o de la entrada estándar) sobre\n"
+		"$MFS_NAME cargándolo una sola vez y dice lo que tardó cada una\n"
+		"Órdenes (una por línea, '#' para comentarios):\n"
+		"  mkdir [-b] DIR      rmdir DIR        compact DIR\n"
+		"  ls [-l] [DIR]       stat PATH        cat PATH\n"
+		"  put FICHERO PATH    get PATH FICHERO\n"
+		"  cp ORIGEN DESTINO   clone ORIGEN DESTINO\n"
+		"  mv VIEJO NUEVO      ln VIEJO NUEVO   rm PATH\n"
+		"Opciones:\n"
+		"  -t, --transaction: todo el script es un lote: la imagen se marca\n"
+		"      sucia al empezar y limpia al acabar; si falla alguna orden\n"
+		"      se queda sucia para que la revise mfs_debug (implica --stop)\n"
+		"  -e, --stop: para en la primera orden que falle\n"
+		"  -h, --help: muestra esta ayuda\n\n"
+	);
+	exit(i);
+}
+
+static int handle_options(int argc, char **argv)
+{
+	while (1) {
+		int c = getopt_long(argc, argv, "teh", long_options, NULL);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 't':
+			transaction = true;
+			stop_on_error = true;
+			break;
+		case 'e':
+			stop_on_error = true;
+			break;
+		case '?':
+		case 'h':
+			usage(0);
+			break;
+		default:
+			printf ("?? getopt returned character code 0%o ??\n", c);
+			usage(-1);
+		}
+	}
+	return 0;
+}
+
+static double now(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static int cmd_ls(char *name, bool list_long)
+{
+	struct mfs_direntplus *plus;
+	MFS_DIR *dir = mfs_opendir(name);
+
+	if (dir == NULL)
+		return -1;
+	while ((plus = mfs_readdirplus(dir)) != NULL)
+		if (list_long)
+			printf("%s %7ld %7ld %s\n",
+			       S_ISDIR(plus->st.st_mode)?"d":"-",
+			       plus->st.st_size,
+			       plus->st.st_ino,
+			       plus->d.d_name);
+		else
+			printf("%s\n", plus->d.d_name);
+	return mfs_closedir(dir);
+}
+
+static int cmd_stat(char *name)
+{
+	struct stat st;
+
+	if (mfs_stat(name, &st) < 0)
+		return -1;
+	printf("%s: inodo %ld, %s, %ld bytes, %ld bloques, %ld enlaces\n",
+	       name, (long) st.st_ino, S_ISDIR(st.st_mode)? "directorio": "fichero",
+	       (long) st.st_size, (long) st.st_blocks, (long) st.st_nlink);
+	return 0;
+}
+
+/* Copia de un fichero de fuera a la imagen */
+static int cmd_put(char *source, char *target)
+{
+	int in, out, n = 0;
+
+	in = open(source, O_RDONLY);
+	if (in == -1)
+		return -1;
+	out = mfs_open(target, O_WRONLY | O_CREAT | O_TRUNC);
+	if (out == -1) {
+		close(in);
+		return -1;
+	}
+	while ((n = read(in, buffer, BUFFER_SIZE)) > 0)
+		if (mfs_write(out, buffer, n) != n) {
+			n = -1;
+			break;
+		}
+	close(in);
+	if ((mfs_close(out) == -1) || (n == -1))
+		return -1;
+	return 0;
+}
+
+/* De la imagen a fd (un fichero de fuera o la salida estándar) */
+static int copy_out(char *source, int fd)
+{
+	int in, n;
+
+	in = mfs_open(source, O_RDONLY);
+	if (in == -1)
+		return -1;
+	while ((n = mfs_read(in, buffer, BUFFER_SIZE)) > 0)
+		if (write(fd, buffer, n) != n) {
+			n = -1;
+			break;
+		}
+	if ((mfs_close(in) == -1) || (n == -1))
+		return -1;
+	return 0;
+}
+
+static int cmd_get(char *source, char *target)
+{
+	int out = open(target, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	int ret;
+
+	if (out == -1)
+		return -1;
+	ret = copy_out(source, out);
+	close(out);
+	return ret;
+}
+
+/* Copia dentro de la imagen: los bloques los comparte copy_file_range */
+static int cmd_cp(char *source, char *target)
+{
+	int in, out, n;
+
+	in = mfs_open(source, O_RDONLY);
+	if (in == -1)
+		return -1;
+	out = mfs_open(target, O_WRONLY | O_CREAT | O_TRUNC);
+	if (out == -1) {
+		mfs_close(in);
+		return -1;
+	}
+	while ((n = mfs_copy_file_range(in, out, BUFFER_SIZE)) > 0)
+		;
+	mfs_close(in);
+	if ((mfs_close(out) == -1) || (n == -1))
+		return -1;
+	return 0;
+}
+
+/* Ejecuta una línea ya partida en palabras */
+static int run(int argc, char **argv)
+{
+	char *cmd = argv[0];
+
+	if (!strcmp(cmd, "mkdir") && (argc == 3) && !strcmp(argv[1], "-b"))
+		return mfs_mkdir_btree(argv[2]);
+	if (!strcmp(cmd, "mkdir") && (argc == 2))
+		return mfs_mkdir(argv[1], 0777);
+	if (!strcmp(cmd, "rmdir") && (argc == 2))
+		return mfs_rmdir(argv[1]);
+	if (!strcmp(cmd, "compact") && (argc == 2))
+		return mfs_compactdir(argv[1]);
+	if (!strcmp(cmd, "ls") && (argc <= 3)) {
+		bool list_long = (argc > 1) && !strcmp(argv[1], "-l");
+		if (argc == 3 && !list_long)
+			goto bad;
+		return cmd_ls((argc > 1 + list_long)? argv[1 + list_long]: "/", list_long);
+	}
+	if (!strcmp(cmd, "stat") && (argc == 2))
+		return cmd_stat(argv[1]);
+	if (!strcmp(cmd, "cat") && (argc == 2))
+		return copy_out(argv[1], fileno(stdout));
+	if (!strcmp(cmd, "rm") && (argc == 2))
+		return mfs_unlink(argv[1]);
+	if (argc != 3)
+		goto bad;
+	if (!strcmp(cmd, "put"))
+		return cmd_put(argv[1], argv[2]);
+	if (!strcmp(cmd, "get"))
+		return cmd_get(argv[1], argv[2]);
+	if (!strcmp(cmd, "cp"))
+		return cmd_cp(argv[1], argv[2]);
+	if (!strcmp(cmd, "clone"))
+		return mfs_clone(argv[1], argv[2]);
+	if (!strcmp(cmd, "mv"))
+		return mfs_rename(argv[1], argv[2]);
+	if (!strcmp(cmd, "ln"))
+		return mfs_link(argv[1], argv[2]);
+bad:
+	errno = EINVAL;
+	return -1;
+}
+
+int main(int argc, char **argv)
+{
+	char line[1024], copy[1024];
+	char *args[MAX_ARGS + 1];
+	int lineno = 0, commands = 0, errors = 0;
+	double start, total = 0;
+	FILE *in = stdin;
+
+	handle_options(argc, argv);
+	if (argc - optind > 1) {
+		printf("Solo se admite un script\n\n");
+		usage(-2);
+	}
+	if ((argc - optind == 1) && ((in = fopen(argv[optind], "r")) == NULL)) {
+		printf("No puedo abrir '%s'. Error %s\n", argv[optind], strerror(errno));
+		exit(-4);
+	}
+	if (transaction && (mfs_begin() == -1)) {
+		printf("No se puede empezar el lote. Error %s\n", strerror(errno));
+		exit(-4);
+	}
+
+	while (fgets(line, sizeof(line), in) != NULL) {
+		int n = 0, ret;
+		char *p;
+
+		lineno++;
+		line[strcspn(line, "\n")] = '\0';
+		strcpy(copy, line);
+		for (p = strtok(line, " \t"); p != NULL; p = strtok(NULL, " \t")) {
+			if ((*p == '#') || (n == MAX_ARGS + 1))
+				break;
+			args[n++] = p;
+		}
+		if (n == 0)
+			continue;
+		if (n > MAX_ARGS) {
+			printf("%d: demasiados argumentos\n", lineno);
+			errors++;
+			if (stop_on_error)
+				break;
+			continue;
+		}
+		fflush(stdout); /* lo que escriba cat va detrás */
+
+		start = now();
+		ret = run(n, args);
+		double t = now() - start;
+
+		fflush(stdout);
+		total += t;
+		commands++;
+		if (ret < 0) {
+			printf("%d: %-40s %9.3f ms  Error %s\n", lineno, copy,
+			       t * 1000, strerror(errno));
+			errors++;
+			if (stop_on_error)
+				break;
+		} else
+			printf("%d: %-40s %9.3f ms\n", lineno, copy, t * 1000);
+	}
+	if (in != stdin)
+		fclose(in);
+
+	if (transaction && (errors > 0)) {
+		/* lo hecho hasta el fallo queda, pero el lote no se cierra */
+		printf("lote sin cerrar: la imagen se queda sucia hasta que la repare mfs_debug -r\n");
+	} else if (transaction) {
+		start = now();
+		if (mfs_commit() == -1) {
+			printf("Error cerrando el lote: %s\n", strerror(errno));
+			errors++;
+		}
+		printf("lote cerrado en %.3f ms\n", (now() - start) * 1000);
+	}
+	printf("%d órdenes en %.3f ms (%.3f ms de media), %d errores\n",
+	       commands, total * 1000, (commands == 0)? 0: total * 1000 / commands,
+	       errors);
+
+	exit((errors == 0)? 0: -1);
+}
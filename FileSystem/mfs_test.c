@@ -0,0 +1,458 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mfs.h"
+#include "mfs_rpc.h"
+
+#define BUFFER_SIZE (1024 * 1024)
+
+char buffer[BUFFER_SIZE];
+
+static void usage(int i)
+{
+	printf(
+		"Usage:  mfs_test ORDEN [ARGUMENTOS]\n"
+		"Pruebas sobre $MFS_NAME que no se pueden hacer con las otras\n"
+		"herramientas (las usa test.sh). Sale con 0 si todo fue bien\n"
+		"Órdenes:\n"
+		"  write PATH OFFSET FICHERO TROZO: escribe FICHERO en PATH a\n"
+		"      partir de OFFSET en trozos de TROZO bytes (crea PATH si\n"
+		"      no existe y no lo trunca)\n"
+		"  map PATH: dice el tamaño y los trozos con datos de PATH\n"
+		"  size PATH TROZO VECES: escribe VECES trozos y comprueba que\n"
+		"      mfs_stat ve el tamaño antes de cerrar\n"
+		"  types DIR: lista DIR con el tipo que da mfs_getdents\n"
+		"  btree DIR N: crea N ficheros en DIR (que debe ser un árbol B+)\n"
+		"      y comprueba búsquedas, orden, prefijos y borrados\n"
+		"  busy defrag|dedup PATH: con PATH abierto pasa mfs_defrag o\n"
+		"      mfs_dedup, escribe por el fd, lo cierra, crea otro fichero\n"
+		"      y comprueba que PATH tiene lo que se escribió\n"
+		"  clone PATH COPIA: escribe en PATH y lo clona sin cerrarlo; la\n"
+		"      copia tiene que tener lo escrito\n"
+		"  badread PATH: la lectura de PATH (con un bloque estropeado)\n"
+		"      tiene que fallar sin mover la posición\n"
+		"  rpc PATH: manda a mfsd peticiones con cuentas negativas sobre\n"
+		"      PATH y comprueba que las rechaza y sigue contestando\n"
+		"  -h, --help: muestra esta ayuda\n\n"
+	);
+	exit(i);
+}
+
+static int test_write(char *path, off_t offset, char *source, int chunk)
+{
+	int in, fd, n, done, w;
+	struct stat st;
+
+	in = open(source, O_RDONLY);
+	if (in == -1) {
+		printf("No puedo abrir '%s'. Error %s\n", source, strerror(errno));
+		return -1;
+	}
+	if (mfs_stat(path, &st) == 0)
+		fd = mfs_open(path, O_WRONLY);
+	else
+		fd = mfs_open(path, O_WRONLY | O_CREAT);
+	if (fd == -1) {
+		printf("No puedo abrir '%s'. Error %s\n", path, strerror(errno));
+		close(in);
+		return -1;
+	}
+	if (mfs_lseek(fd, offset, SEEK_SET) != offset) {
+		printf("No puedo ir a %ld en '%s'\n", (long) offset, path);
+		goto out;
+	}
+	while ((n = read(in, buffer, BUFFER_SIZE)) > 0) {
+		for (done = 0; done < n; done += w) {
+			w = mfs_write(fd, buffer + done, (n - done > chunk)? chunk: n - done);
+			if (w <= 0) {
+				printf("Error escribiendo '%s': %s\n", path, strerror(errno));
+				goto out;
+			}
+		}
+	}
+	close(in);
+	return mfs_close(fd);
+out:
+	close(in);
+	mfs_close(fd);
+	return -1;
+}
+
+/* Saca el mapa con SEEK_DATA/SEEK_HOLE, p.e. "size 9000: [0,1024) [8192,9000)" */
+static int test_map(char *path)
+{
+	off_t data = 0, hole;
+	int fd = mfs_open(path, O_RDONLY);
+
+	if (fd == -1) {
+		printf("No puedo abrir '%s'. Error %s\n", path, strerror(errno));
+		return -1;
+	}
+	printf("size %ld:", (long) mfs_lseek(fd, 0, SEEK_END));
+	while ((data = mfs_lseek(fd, data, SEEK_DATA)) != -1) {
+		hole = mfs_lseek(fd, data, SEEK_HOLE);
+		if (hole <= data) {
+			printf(" hueco mal en %ld\n", (long) data);
+			mfs_close(fd);
+			return -1;
+		}
+		printf(" [%ld,%ld)", (long) data, (long) hole);
+		data = hole;
+	}
+	printf("\n");
+	/* al acabar los datos lseek tiene que decir ENXIO */
+	if (errno != ENXIO) {
+		printf("SEEK_DATA acaba con %s\n", strerror(errno));
+		mfs_close(fd);
+		return -1;
+	}
+	return mfs_close(fd);
+}
+
+/* Lo que está en el buffer de escritura también cuenta en el tamaño */
+static int test_size(char *path, int chunk, int times)
+{
+	struct stat st;
+	int fd, i, ret = 0;
+
+	if (chunk > BUFFER_SIZE)
+		chunk = BUFFER_SIZE;
+	fd = mfs_open(path, O_WRONLY | O_CREAT | O_TRUNC);
+	if (fd == -1) {
+		printf("No puedo abrir '%s'. Error %s\n", path, strerror(errno));
+		return -1;
+	}
+	memset(buffer, 'x', chunk);
+	for (i = 1; i <= times; i++) {
+		if (mfs_write(fd, buffer, chunk) != chunk) {
+			printf("Error escribiendo '%s': %s\n", path, strerror(errno));
+			ret = -1;
+			break;
+		}
+		if ((mfs_stat(path, &st) == -1) || (st.st_size != (off_t) i * chunk)) {
+			printf("tamaño abierto %ld, tendría que ser %ld\n",
+			       (long) st.st_size, (long) i * chunk);
+			ret = -1;
+			break;
+		}
+	}
+	if (mfs_close(fd) == -1)
+		return -1;
+	if (ret == 0 && ((mfs_stat(path, &st) == -1) ||
+			 (st.st_size != (off_t) times * chunk))) {
+		printf("tamaño cerrado %ld, tendría que ser %ld\n",
+		       (long) st.st_size, (long) times * chunk);
+		ret = -1;
+	}
+	return ret;
+}
+
+static int test_types(char *path)
+{
+	struct dirent entries[16];
+	MFS_DIR *dir = mfs_opendir(path);
+	int n, i;
+
+	if (dir == NULL) {
+		printf("No puedo abrir el directorio '%s'. Error %s\n", path, strerror(errno));
+		return -1;
+	}
+	while ((n = mfs_getdents(dir, entries, 16)) > 0)
+		for (i = 0; i < n; i++)
+			printf("%s %s\n", (entries[i].d_type == DT_DIR)? "d":
+			       (entries[i].d_type == DT_REG)? "-": "?",
+			       entries[i].d_name);
+	mfs_closedir(dir);
+	return (n < 0)? -1: 0;
+}
+
+/* Nombres desordenados y de tamaños distintos para que se partan las hojas */
+static void btree_name(char *name, char *dir, int i, int n)
+{
+	sprintf(name, "%s/%c%05d_%s", dir, 'a' + (i * 7) % 26, (i * 7919) % n,
+		(i % 5)? "x": "un_nombre_bastante_largo_para_que_las_entradas_ocupen_mas_de_lo_normal");
+}
+
+static int btree_count(char *path, char *prefix, bool *sorted)
+{
+	char last[MAXNAMLEN + 1] = "";
+	struct dirent *entry;
+	MFS_DIR *dir;
+	int count = 0;
+
+	if (prefix == NULL)
+		dir = mfs_opendir(path);
+	else
+		dir = mfs_opendir_prefix(path, prefix);
+	if (dir == NULL)
+		return -1;
+	*sorted = true;
+	while ((entry = mfs_readdir(dir)) != NULL) {
+		if (strcmp(last, entry->d_name) >= 0)
+			*sorted = false;
+		if ((prefix != NULL) && strncmp(entry->d_name, prefix, strlen(prefix)))
+			*sorted = false;
+		strcpy(last, entry->d_name);
+		count++;
+	}
+	mfs_closedir(dir);
+	return count;
+}
+
+static int test_btree(char *path, int n)
+{
+	char name[1024];
+	struct stat st;
+	int i, fd, count, prefix = 0, bad = 0;
+	bool sorted;
+
+	for (i = 0; i < n; i++) {
+		btree_name(name, path, i, n);
+		fd = mfs_open(name, O_WRONLY | O_CREAT);
+		if (fd == -1) {
+			printf("No puedo crear '%s'. Error %s\n", name, strerror(errno));
+			return -1;
+		}
+		mfs_write(fd, name, strlen(name));
+		mfs_close(fd);
+		if (name[strlen(path) + 1] == 'c')
+			prefix++;
+	}
+	for (i = 0; i < n; i++) {
+		btree_name(name, path, i, n);
+		if ((mfs_stat(name, &st) == -1) || (st.st_size != (off_t) strlen(name)))
+			bad++;
+	}
+	if (bad > 0) {
+		printf("%d ficheros no se encuentran\n", bad);
+		return -1;
+	}
+	/* "." y ".." van primero y ya están en orden */
+	count = btree_count(path, NULL, &sorted);
+	if ((count != n + 2) || !sorted) {
+		printf("readdir: %d entradas (tendrían que ser %d)%s\n", count, n + 2,
+		       sorted? "": ", desordenadas");
+		return -1;
+	}
+	count = btree_count(path, "c", &sorted);
+	if ((count != prefix) || !sorted) {
+		printf("prefijo 'c': %d entradas (tendrían que ser %d)%s\n", count,
+		       prefix, sorted? "": ", mal");
+		return -1;
+	}
+	for (i = 0; i < n; i += 2) {
+		btree_name(name, path, i, n);
+		if (mfs_unlink(name) == -1) {
+			printf("No puedo borrar '%s'. Error %s\n", name, strerror(errno));
+			return -1;
+		}
+	}
+	count = btree_count(path, NULL, &sorted);
+	if ((count != n / 2 + 2) || !sorted) {
+		printf("tras borrar: %d entradas (tendrían que ser %d)%s\n", count,
+		       n / 2 + 2, sorted? "": ", desordenadas");
+		return -1;
+	}
+	return 0;
+}
+
+/* Lo que cambia los bloques de todos los ficheros no puede dejar mal a uno
+ * que esté abierto (con mfsd lo puede tener abierto otro cliente) */
+static int test_busy(char *op, char *path)
+{
+	struct mfs_dedup_stats st;
+	char name[1024], check[4096];
+	int fd, n, ret;
+
+	fd = mfs_open(path, O_RDWR);
+	if (fd == -1) {
+		printf("No puedo abrir '%s'. Error %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (!strcmp(op, "defrag"))
+		ret = mfs_defrag(NULL, NULL);
+	else
+		ret = mfs_dedup(&st);
+	if (ret == -1) {
+		printf("mfs_%s: %s\n", op, strerror(errno));
+		mfs_close(fd);
+		return -1;
+	}
+	memset(buffer, 'Z', sizeof(check));
+	if ((mfs_write(fd, buffer, sizeof(check)) != sizeof(check)) ||
+	    (mfs_close(fd) == -1)) {
+		printf("Error escribiendo '%s': %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	/* si quedaron bloques sueltos, el fichero nuevo se los lleva */
+	sprintf(name, "%s.new", path);
+	fd = mfs_open(name, O_WRONLY | O_CREAT);
+	if (fd == -1) {
+		printf("No puedo crear '%s'. Error %s\n", name, strerror(errno));
+		return -1;
+	}
+	memset(buffer, 'C', BUFFER_SIZE);
+	mfs_write(fd, buffer, 64 * 1024);
+	mfs_close(fd);
+
+	fd = mfs_open(path, O_RDONLY);
+	if (fd == -1)
+		return -1;
+	n = mfs_read(fd, check, sizeof(check));
+	mfs_close(fd);
+	for (ret = 0; ret < n; ret++)
+		if (check[ret] != 'Z')
+			break;
+	if ((n != sizeof(check)) || (ret < n)) {
+		printf("'%s' tiene '%c' en %d\n", path, check[ret], ret);
+		return -1;
+	}
+	return 0;
+}
+
+/* Un clon de un fichero abierto lleva también lo que sigue en memoria */
+static int test_clone(char *path, char *copy)
+{
+	char check[4096];
+	int fd, n, i;
+
+	fd = mfs_open(path, O_RDWR);
+	if (fd == -1) {
+		printf("No puedo abrir '%s'. Error %s\n", path, strerror(errno));
+		return -1;
+	}
+	memset(buffer, 'N', sizeof(check));
+	if (mfs_write(fd, buffer, sizeof(check)) != sizeof(check)) {
+		printf("Error escribiendo '%s': %s\n", path, strerror(errno));
+		mfs_close(fd);
+		return -1;
+	}
+	if (mfs_clone(path, copy) == -1) {
+		printf("No puedo clonar '%s'. Error %s\n", path, strerror(errno));
+		mfs_close(fd);
+		return -1;
+	}
+	if (mfs_close(fd) == -1)
+		return -1;
+
+	fd = mfs_open(copy, O_RDONLY);
+	if (fd == -1)
+		return -1;
+	n = mfs_read(fd, check, sizeof(check));
+	mfs_close(fd);
+	for (i = 0; i < n; i++)
+		if (check[i] != 'N')
+			break;
+	if ((n != sizeof(check)) || (i < n)) {
+		printf("'%s' tiene '%c' en %d\n", copy, check[i], i);
+		return -1;
+	}
+	return 0;
+}
+
+/* Si la lectura falla la posición se queda donde estaba */
+static int test_badread(char *path)
+{
+	off_t pos;
+	int fd, n;
+
+	fd = mfs_open(path, O_RDONLY);
+	if (fd == -1) {
+		printf("No puedo abrir '%s'. Error %s\n", path, strerror(errno));
+		return -1;
+	}
+	n = mfs_read(fd, buffer, BUFFER_SIZE);
+	pos = mfs_lseek(fd, 0, SEEK_CUR);
+	mfs_close(fd);
+	if ((n != -1) || (pos != 0)) {
+		printf("La lectura devolvió %d y dejó la posición en %ld\n", n, (long) pos);
+		return -1;
+	}
+	return 0;
+}
+
+/* Lo que llega a mfsd no lo ha mirado mfs_read: una cuenta negativa no
+ * puede pasar como size_t */
+static int test_rpc(char *path)
+{
+	int64_t ret;
+	int fd, h[2];
+
+	if (!rpc_client()) {
+		printf("Hace falta MFS_SOCKET con mfsd escuchando\n");
+		return -1;
+	}
+	fd = mfs_open(path, O_RDWR);
+	if (fd == -1) {
+		printf("No puedo abrir '%s'. Error %s\n", path, strerror(errno));
+		return -1;
+	}
+	ret = rpc_call(RPC_READ, fd, -1, 0, NULL, 0, buffer, BUFFER_SIZE);
+	if ((ret != -1) || (errno != EINVAL)) {
+		printf("read de -1 bytes: %ld (%s)\n", (long) ret, strerror(errno));
+		return -1;
+	}
+	ret = rpc_call(RPC_COPY_RANGE, fd, fd, -1, NULL, 0, NULL, 0);
+	if ((ret != -1) || (errno != EINVAL)) {
+		printf("copy_file_range de -1 bytes: %ld (%s)\n", (long) ret,
+		       strerror(errno));
+		return -1;
+	}
+	if (rpc_path(RPC_OPENDIR, "/", NULL, 0, h, sizeof(h)) == -1) {
+		printf("No puedo abrir '/'. Error %s\n", strerror(errno));
+		return -1;
+	}
+	ret = rpc_call(RPC_READDIR, h[0], -1, 0, NULL, 0, buffer, BUFFER_SIZE);
+	if ((ret != -1) || (errno != EINVAL)) {
+		printf("readdir de -1 entradas: %ld (%s)\n", (long) ret, strerror(errno));
+		return -1;
+	}
+	rpc_call(RPC_CLOSEDIR, h[0], 0, 0, NULL, 0, NULL, 0);
+
+	/* y sigue vivo */
+	if (mfs_read(fd, buffer, 100) < 0) {
+		printf("mfsd ya no contesta: %s\n", strerror(errno));
+		return -1;
+	}
+	return mfs_close(fd);
+}
+
+int main (int argc, char **argv)
+{
+	int ret;
+
+	if ((argc < 2) || !strcmp(argv[1], "-h") || !strcmp(argv[1], "--help"))
+		usage(argc < 2);
+
+	if (!strcmp(argv[1], "write") && (argc == 6))
+		ret = test_write(argv[2], atol(argv[3]), argv[4], atoi(argv[5]));
+	else if (!strcmp(argv[1], "map") && (argc == 3))
+		ret = test_map(argv[2]);
+	else if (!strcmp(argv[1], "size") && (argc == 5))
+		ret = test_size(argv[2], atoi(argv[3]), atoi(argv[4]));
+	else if (!strcmp(argv[1], "types") && (argc == 3))
+		ret = test_types(argv[2]);
+	else if (!strcmp(argv[1], "btree") && (argc == 4))
+		ret = test_btree(argv[2], atoi(argv[3]));
+	else if (!strcmp(argv[1], "busy") && (argc == 4) &&
+		 (!strcmp(argv[2], "defrag") || !strcmp(argv[2], "dedup")))
+		ret = test_busy(argv[2], argv[3]);
+	else if (!strcmp(argv[1], "clone") && (argc == 4))
+		ret = test_clone(argv[2], argv[3]);
+	else if (!strcmp(argv[1], "badread") && (argc == 3))
+		ret = test_badread(argv[2]);
+	else if (!strcmp(argv[1], "rpc") && (argc == 3))
+		ret = test_rpc(argv[2]);
+	else
+		usage(-1);
+
+	exit((ret == 0)? 0: 1);
+}
@@ -0,0 +1,610 @@
+#define _GNU_SOURCE /* memfd_create */
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "mfs.h"
+#include "mfs_rpc.h"
+
+#define MAX_CLIENTS 64
+#define MAX_DIRS 64 /* directorios abiertos entre todos los clientes */
+#define MAX_REQUEST (RPC_MAX_DATA + 2 * PATH_MAX)
+
+/* Un cliente conectado y lo que tiene abierto, para cerrarlo si se va sin
+ * hacerlo (la tabla de ficheros del sistema es una para todos)
+ */
+struct client {
+	int sock;
+	unsigned long long fds; /* un bit por cada fd suyo */
+	struct rpc_ring *ring; /* sus anillos (NULL: usa el socket) */
+	int ring_sq; /* eventfd por el que avisa de peticiones nuevas */
+	int ring_cq; /* eventfd para avisarle de las respuestas */
+};
+
+struct client clients[MAX_CLIENTS];
+int num_clients = 0;
+MFS_DIR *dirs[MAX_DIRS];
+int dir_owner[MAX_DIRS];
+
+char *socket_name = NULL;
+volatile sig_atomic_t stop = 0;
+
+static struct option long_options[] = {
+	{ .name = "socket",
+	  .has_arg = required_argument,
+	  .flag = NULL,
+	  .val = 's'},
+	{ .name = "help",
+	  .has_arg = no_argument,
+	  .flag = NULL,
+	  .val = 'h'},
+	{0, 0, 0, 0}
+};
+
+static void usage(int i)
+{
+	printf(
+		"Usage:  mfsd [OPTION]\n"
+		"Sirve el sistema de ficheros $MFS_NAME por un socket Unix. Las\n"
+		"herramientas con MFS_SOCKET apuntando al socket le mandan las\n"
+		"llamadas en vez de abrir la imagen: no se vuelve a cargar en\n"
+		"cada orden y las cachés siguen llenas entre una y otra. Los\n"
+		"clientes piden además unos anillos en memoria compartida por los\n"
+		"que van las peticiones y los datos sin pasar por el socket\n"
+		"Opciones:\n"
+		"  -s, --socket=<path>: socket donde escucha (por defecto $MFS_SOCKET)\n"
+		"  -h, --help: muestra esta ayuda\n\n"
+	);
+	exit(i);
+}
+
+static int handle_options(int argc, char **argv)
+{
+	while (1) {
+		int c = getopt_long(argc, argv, "s:h", long_options, NULL);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 's':
+			socket_name = optarg;
+			break;
+		case '?':
+		case 'h':
+			usage(0);
+			break;
+		default:
+			printf ("?? getopt returned character code 0%o ??\n", c);
+			usage(-1);
+		}
+	}
+	return 0;
+}
+
+static void handle_signal(int sig)
+{
+	stop = 1;
+}
+
+static bool owns_fd(struct client *c, int64_t fd)
+{
+	return (fd >= 0) && (fd < 64) && (c->fds & (1ULL << fd));
+}
+
+static bool owns_dir(struct client *c, int64_t h)
+{
+	return (h >= 0) && (h < MAX_DIRS) && (dirs[h] != NULL) &&
+		(dir_owner[h] == c->sock);
+}
+
+static int64_t serve_opendir(struct client *c, const char *name,
+			     const char *prefix, void *out, uint32_t *outlen)
+{
+	struct stat st;
+	int h;
+
+	for (h = 0; h < MAX_DIRS; h++)
+		if (dirs[h] == NULL)
+			break;
+	if (h == MAX_DIRS) {
+		errno = EMFILE;
+		return -1;
+	}
+	dirs[h] = (prefix == NULL)? mfs_opendir(name):
+		mfs_opendir_prefix(name, prefix);
+	if (dirs[h] == NULL)
+		return -1;
+	dir_owner[h] = c->sock;
+
+	/* el cliente escribe el inodo como lo haría mfs_opendir */
+	int r[2] = {h, (mfs_stat(name, &st) < 0)? -1: st.st_ino};
+	memcpy(out, r, sizeof(r));
+	*outlen = sizeof(r);
+	return 0;
+}
+
+static int64_t serve_readdir(struct client *c, int h, int64_t max,
+			     void *out, uint32_t *outlen)
+{
+	struct mfs_direntplus *plus, *buf = out;
+	int n = 0;
+
+	if (max > RPC_DIRENTS)
+		max = RPC_DIRENTS;
+	while ((n < max) && ((plus = mfs_readdirplus(dirs[h])) != NULL))
+		buf[n++] = *plus;
+	*outlen = n * sizeof(struct mfs_direntplus);
+	return n;
+}
+
+/* true si la llamada op trae uno o dos paths */
+static bool path_op(uint32_t op)
+{
+	switch (op) {
+	case RPC_OPEN:
+	case RPC_LINK:
+	case RPC_UNLINK:
+	case RPC_RENAME:
+	case RPC_CLONE:
+	case RPC_STAT:
+	case RPC_MKDIR:
+	case RPC_MKDIR_BTREE:
+	case RPC_RMDIR:
+	case RPC_COMPACTDIR:
+	case RPC_OPENDIR:
+		return true;
+	}
+	return false;
+}
+
+/* Hace la llamada que pide req y deja en out lo que hay que devolver */
+static int64_t serve(struct client *c, struct rpc_request *req, char *data,
+		     void *out, uint32_t *outlen)
+{
+	int64_t *arg = req->arg;
+	char *a = data; /* los paths vienen uno detrás de otro */
+	char *b = NULL;
+	int64_t ret;
+	size_t n;
+
+	*outlen = 0;
+	/* solo las llamadas con paths traen cadenas: lo que se escribe no
+	 * acaba en '\0' (y en el anillo no hay nada detrás) */
+	if (path_op(req->op)) {
+		n = strnlen(a, req->len);
+		if (n == req->len) {
+			errno = EINVAL;
+			return -1;
+		}
+		if (n + 1 < req->len) {
+			b = a + n + 1;
+			if (strnlen(b, req->len - n - 1) == req->len - n - 1) {
+				errno = EINVAL;
+				return -1;
+			}
+		}
+	}
+
+	switch (req->op) {
+	case RPC_OPEN:
+		ret = mfs_open(a, arg[0]);
+		if (ret >= 64) { /* no cabe en c->fds */
+			mfs_close(ret);
+			errno = EMFILE;
+			return -1;
+		}
+		if (ret >= 0)
+			c->fds |= 1ULL << ret;
+		return ret;
+	case RPC_CLOSE:
+		if (!owns_fd(c, arg[0]))
+			break;
+		c->fds &= ~(1ULL << arg[0]);
+		return mfs_close(arg[0]);
+	case RPC_READ:
+		if (!owns_fd(c, arg[0]))
+			break;
+		if (arg[1] < 0) { /* como size_t sería enorme y out es de 1 MiB */
+			errno = EINVAL;
+			return -1;
+		}
+		ret = mfs_read(arg[0], out, (arg[1] > RPC_MAX_DATA)? RPC_MAX_DATA: arg[1]);
+		if (ret > 0)
+			*outlen = ret;
+		return ret;
+	case RPC_WRITE:
+		if (!owns_fd(c, arg[0]))
+			break;
+		return mfs_write(arg[0], data, req->len);
+	case RPC_LSEEK:
+		if (!owns_fd(c, arg[0]))
+			break;
+		return mfs_lseek(arg[0], arg[1], arg[2]);
+	case RPC_FSYNC:
+		if (!owns_fd(c, arg[0]))
+			break;
+		return mfs_fsync(arg[0]);
+	case RPC_COPY_RANGE:
+		if (!owns_fd(c, arg[0]) || !owns_fd(c, arg[1]))
+			break;
+		if (arg[2] < 0) {
+			errno = EINVAL;
+			return -1;
+		}
+		return mfs_copy_file_range(arg[0], arg[1], arg[2]);
+	case RPC_LINK:
+	case RPC_RENAME:
+	case RPC_CLONE:
+		if (b == NULL) {
+			errno = EINVAL;
+			return -1;
+		}
+		if (req->op == RPC_LINK)
+			return mfs_link(a, b);
+		return (req->op == RPC_RENAME)? mfs_rename(a, b): mfs_clone(a, b);
+	case RPC_UNLINK:
+		return mfs_unlink(a);
+	case RPC_STAT:
+		ret = mfs_stat(a, out);
+		if (ret >= 0)
+			*outlen = sizeof(struct stat);
+		return ret;
+	case RPC_MKDIR:
+		return mfs_mkdir(a, arg[0]);
+	case RPC_MKDIR_BTREE:
+		return mfs_mkdir_btree(a);
+	case RPC_RMDIR:
+		return mfs_rmdir(a);
+	case RPC_COMPACTDIR:
+		return mfs_compactdir(a);
+	case RPC_OPENDIR:
+		return serve_opendir(c, a, b, out, outlen);
+	case RPC_READDIR:
+		if (!owns_dir(c, arg[0]))
+			break;
+		if (arg[1] < 0) {
+			errno = EINVAL;
+			return -1;
+		}
+		return serve_readdir(c, arg[0], arg[1], out, outlen);
+	case RPC_CLOSEDIR:
+		if (!owns_dir(c, arg[0]))
+			break;
+		ret = mfs_closedir(dirs[arg[0]]);
+		dirs[arg[0]] = NULL;
+		return ret;
+	case RPC_FRAGSTATS:
+		memset(out, '\0', sizeof(struct mfs_frag_stats));
+		*outlen = sizeof(struct mfs_frag_stats);
+		return mfs_fragstats(out);
+	case RPC_DEFRAG: {
+		struct mfs_frag_stats *st = out;
+		memset(st, '\0', 2 * sizeof(*st));
+		*outlen = 2 * sizeof(*st);
+		return mfs_defrag(&st[0], &st[1]);
+	}
+	case RPC_DEDUP:
+		memset(out, '\0', sizeof(struct mfs_dedup_stats));
+		*outlen = sizeof(struct mfs_dedup_stats);
+		return mfs_dedup(out);
+	default:
+		errno = ENOSYS;
+		return -1;
+	}
+
+	errno = EBADF; /* fd o directorio que no es de este cliente */
+	return -1;
+}
+
+/* El cliente se fue: se cierra lo que dejó abierto */
+static void client_gone(int i)
+{
+	struct client *c = &clients[i];
+	int fd, h;
+
+	for (fd = 0; fd < 64; fd++)
+		if (c->fds & (1ULL << fd))
+			mfs_close(fd);
+	for (h = 0; h < MAX_DIRS; h++)
+		if ((dirs[h] != NULL) && (dir_owner[h] == c->sock)) {
+			mfs_closedir(dirs[h]);
+			dirs[h] = NULL;
+		}
+	if (c->ring != NULL) {
+		munmap(c->ring, RING_SIZE);
+		close(c->ring_sq);
+		close(c->ring_cq);
+	}
+	close(c->sock);
+	clients[i] = clients[--num_clients];
+}
+
+/* Crea los anillos del cliente y le manda el memfd y los dos eventfd */
+static int ring_create(struct client *c)
+{
+	struct rpc_reply rep = { .ret = -1 };
+	union {
+		struct cmsghdr h;
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+	} cmsg;
+	struct iovec iov = { .iov_base = &rep, .iov_len = sizeof(rep) };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+	int fds[3] = {-1, -1, -1};
+	void *p = MAP_FAILED;
+
+	if (c->ring != NULL) {
+		rep.err = EEXIST;
+		goto reply;
+	}
+	fds[0] = memfd_create("mfsd-ring", 0);
+	fds[1] = eventfd(0, EFD_NONBLOCK);
+	fds[2] = eventfd(0, EFD_NONBLOCK);
+	if ((fds[0] == -1) || (fds[1] == -1) || (fds[2] == -1) ||
+	    (ftruncate(fds[0], RING_SIZE) == -1) ||
+	    ((p = mmap(NULL, RING_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+		       fds[0], 0)) == MAP_FAILED)) {
+		rep.err = errno;
+		goto reply;
+	}
+	c->ring = p;
+	c->ring_sq = fds[1];
+	c->ring_cq = fds[2];
+	rep.ret = 0;
+	msg.msg_control = cmsg.buf;
+	msg.msg_controllen = sizeof(cmsg.buf);
+	struct cmsghdr *h = CMSG_FIRSTHDR(&msg);
+	h->cmsg_level = SOL_SOCKET;
+	h->cmsg_type = SCM_RIGHTS;
+	h->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(h), fds, sizeof(fds));
+reply:
+	if (sendmsg(c->sock, &msg, MSG_NOSIGNAL) != sizeof(rep))
+		return -1;
+	/* el cliente ya tiene su copia del memfd: aquí basta con el mapa */
+	if (fds[0] != -1)
+		close(fds[0]);
+	if (c->ring == NULL) {
+		if (fds[1] != -1)
+			close(fds[1]);
+		if (fds[2] != -1)
+			close(fds[2]);
+	}
+	return 0;
+}
+
+/* Atiende todo lo que haya en sq del cliente i y le avisa una vez. Los
+ * reads van directos al hueco de la petición y los writes se hacen desde el
+ * suyo; los paths se copian a data, que se puede escribir la respuesta
+ * encima mientras se usan. El anillo lo puede tocar el cliente: si los
+ * índices no tienen sentido se le echa, y si cq está lleno lo que quede
+ * en sq se atiende en el siguiente aviso
+ *
+ * Devuelve -1 si hay que echar al cliente
+ */
+static int ring_drain(int i, char *data)
+{
+	struct client *c = &clients[i];
+	struct rpc_ring *r = c->ring;
+	uint32_t head = r->sq_head;
+	uint32_t tail = __atomic_load_n(&r->sq_tail, __ATOMIC_ACQUIRE);
+	uint32_t cq_tail = r->cq_tail;
+	uint64_t v;
+	int n = 0;
+
+	read(c->ring_sq, &v, sizeof(v));
+	if ((tail - head > RING_ENTRIES) ||
+	    (cq_tail - __atomic_load_n(&r->cq_head, __ATOMIC_ACQUIRE) > RING_ENTRIES)) {
+		printf("mfsd: el anillo del cliente está mal, se cierra el cliente\n");
+		return -1;
+	}
+	for (; head != tail; head++, n++) {
+		if (cq_tail - __atomic_load_n(&r->cq_head, __ATOMIC_ACQUIRE) == RING_ENTRIES)
+			break; /* cq lleno */
+		struct rpc_sqe *sqe = &r->sq[head % RING_ENTRIES];
+		struct rpc_request req = sqe->req;
+		uint32_t slot = sqe->slot % RING_ENTRIES;
+		char *buf = ring_slot(r, slot);
+		struct rpc_cqe cqe = { .slot = slot };
+		uint32_t outlen;
+
+		errno = 0;
+		/* lo leído va al hueco: la cuenta tiene que caber en él */
+		if ((req.len > RING_SLOT) ||
+		    ((req.op == RPC_READ) && (req.arg[1] < 0))) {
+			cqe.rep.ret = -1;
+			errno = EINVAL;
+			outlen = 0;
+		} else {
+			if (req.op == RPC_READ && req.arg[1] > RING_SLOT)
+				req.arg[1] = RING_SLOT;
+			if (req.op != RPC_WRITE) {
+				memcpy(data, buf, req.len);
+				data[req.len] = '\0';
+			}
+			cqe.rep.ret = serve(c, &req, (req.op == RPC_WRITE)? buf: data,
+					    buf, &outlen);
+		}
+		cqe.rep.err = errno;
+		cqe.rep.len = outlen;
+		r->cq[cq_tail % RING_ENTRIES] = cqe;
+		__atomic_store_n(&r->cq_tail, ++cq_tail, __ATOMIC_RELEASE);
+		__atomic_store_n(&r->sq_head, head + 1, __ATOMIC_RELEASE);
+	}
+	if (n > 0) {
+		v = 1;
+		write(c->ring_cq, &v, sizeof(v));
+	}
+	return 0;
+}
+
+/* Atiende una petición del cliente i. Devuelve -1 si hay que echarlo */
+static int client_request(int i, char *data, void *out)
+{
+	struct client *c = &clients[i];
+	struct rpc_request req;
+	struct rpc_reply rep;
+	uint32_t outlen;
+
+	if (rpc_recv(c->sock, &req, sizeof(req)) <= 0)
+		return -1;
+	if (req.len > MAX_REQUEST) {
+		printf("mfsd: petición de %u bytes, se cierra el cliente\n", req.len);
+		return -1;
+	}
+	if ((req.len > 0) && (rpc_recv(c->sock, data, req.len) <= 0))
+		return -1;
+	data[req.len] = '\0';
+	if (req.op == RPC_RING)
+		return ring_create(c);
+
+	errno = 0;
+	rep.ret = serve(c, &req, data, out, &outlen);
+	rep.err = errno;
+	rep.len = outlen;
+	if (rpc_send(c->sock, &rep, sizeof(rep)) == -1)
+		return -1;
+	if ((outlen > 0) && (rpc_send(c->sock, out, outlen) == -1))
+		return -1;
+	return 0;
+}
+
+static int listen_on(const char *name)
+{
+	struct sockaddr_un addr;
+	int s;
+
+	if (strlen(name) >= sizeof(addr.sun_path)) {
+		printf("'%s': nombre de socket demasiado largo\n", name);
+		return -1;
+	}
+	memset(&addr, '\0', sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, name);
+
+	s = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (s == -1) {
+		perror("socket");
+		return -1;
+	}
+	unlink(name); /* el de una ejecución anterior que no se borró */
+	if ((bind(s, (struct sockaddr *) &addr, sizeof(addr)) == -1) ||
+	    (listen(s, 16) == -1)) {
+		printf("No se puede escuchar en %s (%s)\n", name, strerror(errno));
+		close(s);
+		return -1;
+	}
+	return s;
+}
+
+int main(int argc, char **argv)
+{
+	struct pollfd pfd[1 + 2 * MAX_CLIENTS];
+	struct sigaction sa;
+	struct stat st;
+	char *data, *out;
+	int s, i;
+
+	handle_options(argc, argv);
+	if (socket_name == NULL)
+		socket_name = getenv("MFS_SOCKET");
+	if (socket_name == NULL) {
+		printf("Hace falta el socket: -s o MFS_SOCKET\n\n");
+		usage(-2);
+	}
+	/* el propio demonio usa la imagen directamente */
+	socket_name = strdup(socket_name);
+	unsetenv("MFS_SOCKET");
+
+	/* se carga ya: así un error sale ahora y no en el primer cliente */
+	if (mfs_stat("/", &st) < 0) {
+		printf("No se puede cargar el sistema de ficheros\n");
+		exit(-1);
+	}
+
+	data = malloc(MAX_REQUEST + 1);
+	out = malloc(RPC_MAX_DATA);
+	if ((data == NULL) || (out == NULL)) {
+		printf("No hay memoria para los buffers\n");
+		exit(-1);
+	}
+
+	memset(&sa, '\0', sizeof(sa));
+	sa.sa_handler = handle_signal; /* sin SA_RESTART: que poll vuelva */
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	if ((s = listen_on(socket_name)) == -1)
+		exit(-1);
+	printf("mfsd: sirviendo en %s\n", socket_name);
+	fflush(stdout);
+
+	/* Un solo hilo: las peticiones se atienden de una en una y no hace
+	 * falta proteger nada de mfs.c */
+	while (!stop) {
+		pfd[0].fd = s;
+		pfd[0].events = POLLIN;
+		/* por cada cliente su socket y el eventfd de sus anillos (-1 si
+		 * no tiene: poll no lo mira) */
+		for (i = 0; i < num_clients; i++) {
+			pfd[2 * i + 1].fd = clients[i].sock;
+			pfd[2 * i + 1].events = POLLIN;
+			pfd[2 * i + 2].fd = (clients[i].ring == NULL)? -1: clients[i].ring_sq;
+			pfd[2 * i + 2].events = POLLIN;
+		}
+		if (poll(pfd, 2 * num_clients + 1, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			break;
+		}
+		/* de atrás hacia delante: client_gone mueve el último a su sitio */
+		for (i = num_clients - 1; i >= 0; i--) {
+			if ((pfd[2 * i + 2].revents & POLLIN) &&
+			    (ring_drain(i, data) == -1)) {
+				client_gone(i);
+				continue;
+			}
+			if (pfd[2 * i + 1].revents & (POLLIN | POLLHUP | POLLERR))
+				if (client_request(i, data, out) == -1)
+					client_gone(i);
+		}
+		if (pfd[0].revents & POLLIN) {
+			int c = accept(s, NULL, NULL);
+			if (c == -1)
+				continue;
+			if (num_clients == MAX_CLIENTS) {
+				printf("mfsd: demasiados clientes\n");
+				close(c);
+				continue;
+			}
+			clients[num_clients].sock = c;
+			clients[num_clients].fds = 0;
+			clients[num_clients].ring = NULL;
+			num_clients++;
+		}
+	}
+
+	while (num_clients > 0)
+		client_gone(num_clients - 1);
+	close(s);
+	unlink(socket_name);
+	printf("mfsd: parado\n");
+	free(data);
+	free(out);
+	exit(0);
+}
@@ -0,0 +1,73 @@
+#include <string.h>
+
+#include "murmur3.h"
+
+#define C1 0x87c37b91114253d5ULL
+#define C2 0x4cf5ad432745937fULL
+
+static uint64_t rotl(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t fmix(uint64_t k)
+{
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+	return k;
+}
+
+void murmur3_128(const void *key, size_t len, uint32_t seed, uint64_t out[2])
+{
+	const unsigned char *p = key;
+	size_t i, nblocks = len / 16;
+	uint64_t h1 = seed, h2 = seed, k1, k2;
+
+	for (i = 0; i < nblocks; i++, p += 16) {
+		memcpy(&k1, p, 8);
+		memcpy(&k2, p + 8, 8);
+
+		k1 *= C1; k1 = rotl(k1, 31); k1 *= C2; h1 ^= k1;
+		h1 = rotl(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+		k2 *= C2; k2 = rotl(k2, 33); k2 *= C1; h2 ^= k2;
+		h2 = rotl(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+	}
+
+	/* lo que sobra (menos de 16 bytes) */
+	k1 = k2 = 0;
+	switch (len & 15) {
+	case 15: k2 ^= (uint64_t) p[14] << 48; /* fall through */
+	case 14: k2 ^= (uint64_t) p[13] << 40; /* fall through */
+	case 13: k2 ^= (uint64_t) p[12] << 32; /* fall through */
+	case 12: k2 ^= (uint64_t) p[11] << 24; /* fall through */
+	case 11: k2 ^= (uint64_t) p[10] << 16; /* fall through */
+	case 10: k2 ^= (uint64_t) p[9] << 8; /* fall through */
+	case 9:  k2 ^= (uint64_t) p[8];
+		k2 *= C2; k2 = rotl(k2, 33); k2 *= C1; h2 ^= k2;
+		/* fall through */
+	case 8:  k1 ^= (uint64_t) p[7] << 56; /* fall through */
+	case 7:  k1 ^= (uint64_t) p[6] << 48; /* fall through */
+	case 6:  k1 ^= (uint64_t) p[5] << 40; /* fall through */
+	case 5:  k1 ^= (uint64_t) p[4] << 32; /* fall through */
+	case 4:  k1 ^= (uint64_t) p[3] << 24; /* fall through */
+	case 3:  k1 ^= (uint64_t) p[2] << 16; /* fall through */
+	case 2:  k1 ^= (uint64_t) p[1] << 8; /* fall through */
+	case 1:  k1 ^= (uint64_t) p[0];
+		k1 *= C1; k1 = rotl(k1, 31); k1 *= C2; h1 ^= k1;
+	}
+
+	h1 ^= len;
+	h2 ^= len;
+	h1 += h2;
+	h2 += h1;
+	h1 = fmix(h1);
+	h2 = fmix(h2);
+	h1 += h2;
+	h2 += h1;
+
+	out[0] = h1;
+	out[1] = h2;
+}
@@ -0,0 +1,12 @@
+#ifndef __murmur3_h
+#define __murmur3_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* MurmurHash3 de 128 bits (la versión x64): rápido y con pocas colisiones,
+ * pero no criptográfico. Sirve de huella, no para fiarse sin comparar
+ */
+void murmur3_128(const void *key, size_t len, uint32_t seed, uint64_t out[2]);
+
+#endif /* __murmur3_h */
@@ -0,0 +1,396 @@
+#!/bin/bash
+# Pruebas de mfs: crea imágenes en un directorio temporal y las maneja con
+# las herramientas (y con mfs_test para lo que no se puede hacer con
+# ellas). Dice "ok" o "FAIL" de cada prueba y sale con el número de fallos.
+# Uso: ./test.sh [DIRECTORIO_TEMPORAL]
+
+B=$(cd "$(dirname "$0")" && pwd)
+T=${1:-$(mktemp -d /tmp/mfs_test.XXXXXX)}
+mkdir -p "$T" && cd "$T" || exit 1
+export MFS_NAME=$T/mfs.img
+unset MFS_SOCKET MFS_RING MFS_AIO
+
+fails=0
+daemon=
+
+ok() { echo "ok   $1"; }
+fail() { echo "FAIL $1"; fails=$((fails + 1)); }
+# q ORDEN...: ejecuta sin ensuciar la salida, pero guarda lo que dijo
+q() { "$@" > out 2>&1; }
+# same A B PRUEBA: A y B tienen que ser iguales
+same() { if cmp -s "$1" "$2"; then ok "$3"; else fail "$3"; fi; }
+# check PRUEBA ORDEN...: la orden tiene que salir con 0
+check() { local t=$1; shift; if "$@" > out 2>&1; then ok "$t"; else fail "$t"; cat out; fi; }
+# clean PRUEBA [-l]: mfs_debug no encuentra nada raro
+clean() {
+	$B/mfs_debug -c $2 > dbg 2>&1
+	if grep -q "Inodes right" dbg && grep -q "Data right" dbg ||
+	   grep -q "Clean file system" dbg; then
+		ok "$1"
+	else
+		fail "$1"; cat dbg
+	fi
+}
+# info CAMPO: el número que da mfs_info -a, p.e. info '"inline"'
+info() { $B/mfs_info -a | grep "$1" | head -1 | sed 's/.*'"$1"': *\([0-9]*\).*/\1/'; }
+used() { $B/mfs_info -a | sed -n 's/.*"used": \([0-9]*\), "free".*/\1/p'; }
+# patch FICHERO OFFSET TROZO: lo que tendría que quedar tras mfs_test write
+patch() { dd if="$3" of="$1" bs=1 seek="$2" conv=notrunc 2> /dev/null; }
+mkfs() { q $B/mfs_mkfs "$@" || { fail "mfs_mkfs $*"; cat out; }; }
+
+stop_daemon() {
+	[ -n "$daemon" ] && kill $daemon 2> /dev/null && wait $daemon 2> /dev/null
+	daemon=
+}
+trap 'stop_daemon' EXIT
+
+head -c 3000 /dev/urandom > f3k
+head -c 50 /dev/urandom > f50
+head -c 1100 /dev/urandom > f1100
+head -c 100000 /dev/urandom > f100k
+head -c 300000 /dev/urandom > f300k
+yes "una línea de texto que se comprime muy bien" | head -c 200000 > text
+: > empty
+
+echo "== put/ls/get/debug"
+mkfs -n 2000 -b 512 -i 10
+q $B/mfs_put f3k /a; q $B/mfs_get /a g; same f3k g "put-get"
+q $B/mfs_mkdir /d
+q $B/mfs_put -s 100 f100k /d/b; q $B/mfs_get -s 77 /d/b g; same f100k g "put-get in small pieces"
+q $B/mfs_put empty /e; q $B/mfs_get /e g; same empty g "empty file"
+q $B/mfs_cp /d/b /c; q $B/mfs_get /c g; same f100k g "cp"
+q $B/mfs_mv /c /d/c; q $B/mfs_get /d/c g; same f100k g "mv"
+q $B/mfs_put f100k /o; cp f100k exp; patch exp 100000 f3k
+check "small writes at the end" $B/mfs_test write /o 100000 f3k 100
+q $B/mfs_get /o g; same exp g "small writes read back"
+q $B/mfs_put f100k /p; cp f100k exp; patch exp 5000 f3k
+check "small writes over the middle" $B/mfs_test write /p 5000 f3k 100
+q $B/mfs_get /p g; same exp g "overwrite keeps the size"
+q $B/mfs_ln /a /d/l; q $B/mfs_rm /a; q $B/mfs_get /d/l g; same f3k g "ln and rm"
+$B/mfs_ls -l /d | grep "^-" > ls
+if grep -q " b$" ls && grep -q " c$" ls && grep -q " l$" ls && [ $(wc -l < ls) = 3 ]; then
+	ok "ls"
+else
+	fail "ls"; cat ls
+fi
+$B/mfs_test types / > types
+if grep -qx "d d" types && grep -qx -- "- e" types; then ok "d_type"; else fail "d_type"; cat types; fi
+check "stat sees buffered writes" $B/mfs_test size /w 100 7
+clean "debug after put/ls/get"
+
+echo "== inline and tail"
+mkfs -n 2000 -b 512 -i 10
+q $B/mfs_put f50 /s; q $B/mfs_put f1100 /t
+[ "$(info '"inline"')" = 1 ] && ok "inline packed" || fail "inline packed"
+[ "$(info '"tail"')" = 1 ] && ok "tail packed" || fail "tail packed"
+q $B/mfs_get /s g; same f50 g "inline read"
+q $B/mfs_get /t g; same f1100 g "tail read"
+cp f1100 exp; cat f3k >> exp
+check "tail append" $B/mfs_test write /t 1100 f3k 1000
+q $B/mfs_get /t g; same exp g "tail unpacked"
+cp f50 exp; patch exp 50 f3k
+check "inline append" $B/mfs_test write /s 50 f3k 30
+q $B/mfs_get /s g; same exp g "inline promoted"
+q $B/mfs_cp -r /t /t2; q $B/mfs_get /t2 g; cp f1100 exp; cat f3k >> exp; same exp g "tail clone"
+# una cola que se quita una y otra vez con otras detrás: su sitio se vuelve
+# a usar y no se quedan bloques de fragmentos con una cola y el resto muerto
+head -c 612 f3k > exp; head -c 532 f3k > k; head -c 512 f100k > p512
+q $B/mfs_put exp /g
+before=$(used)
+for i in $(seq 1 16); do
+	q $B/mfs_put k /k$i
+	q $B/mfs_test write /g $((100 + 512 * i)) p512 512; cat p512 >> exp
+done
+q $B/mfs_get /g g; same exp g "tail rewritten between others"
+n=$(($(used) - before - 32)) # 16 bloques de /k* y 16 más de /g
+[ $n -le 1 ] && ok "fragment space reused ($n new blocks)" ||
+	fail "fragment space reused ($n new blocks)"
+clean "debug after inline/tail"
+
+echo "== copy on write"
+mkfs -n 2000 -b 512 -i 10
+q $B/mfs_put f100k /o
+before=$(used)
+check "clone" $B/mfs_cp -r /o /c
+[ $(($(used) - before)) -lt 10 ] && ok "clone shares blocks" || fail "clone shares blocks"
+cp f100k exp; patch exp 5000 f3k
+check "write to clone" $B/mfs_test write /c 5000 f3k 512
+q $B/mfs_get /c g; same exp g "clone modified"
+q $B/mfs_get /o g; same f100k g "original intact"
+clean "refcounts after cow"
+q $B/mfs_rm /o; q $B/mfs_get /c g; same exp g "clone survives rm"
+clean "refcounts after rm"
+
+echo "== directory compaction"
+mkfs -n 2000 -b 512 -i 10
+q $B/mfs_mkdir /d
+for i in $(seq 1 60); do q $B/mfs_put f50 /d/f$i; done
+[ $($B/mfs_ls /d | grep -c "^f") = 60 ] && ok "directory grows" || fail "directory grows"
+for i in $(seq 1 50); do q $B/mfs_rm /d/f$i; done
+before=$(used)
+check "compact" $B/mfs_compact /d
+[ $(used) -lt $before ] && ok "compact frees blocks" || fail "compact frees blocks"
+$B/mfs_ls /d | grep "^f" | sort > ls; seq 51 60 | sed 's/^/f/' | sort > exp
+same exp ls "entries kept"
+q $B/mfs_get /d/f55 g; same f50 g "files kept"
+for i in $(seq 61 70); do q $B/mfs_put f50 /d/f$i; done
+[ $($B/mfs_ls /d | grep -c "^f") = 20 ] && ok "compacted directory grows" || fail "compacted directory grows"
+clean "debug after compact"
+
+echo "== B+ tree directories"
+mkfs -n 6000 -b 1024 -i 30
+q $B/mfs_mkdir -b /big || fail "mkdir -b"
+check "btree insert/lookup/readdir/prefix/unlink" $B/mfs_test btree /big 1500
+q $B/mfs_put f3k /big/zz; q $B/mfs_get /big/zz g; same f3k g "btree put-get"
+clean "debug after btree"
+
+echo "== defrag"
+mkfs -n 2000 -b 512 -i 10
+head -c 3072 f100k > b3k; cat b3k b3k > exp
+q $B/mfs_put b3k /a; q $B/mfs_put b3k /x; q $B/mfs_test write /a 3072 b3k 512
+check "defrag" $B/mfs_defrag
+grep -q "fragmentados: *1$" out && grep -q "1 ficheros movidos" out &&
+	ok "fragmented file moved" || { fail "fragmented file moved"; cat out; }
+q $B/mfs_get /a g; same exp g "defragmented file read"
+q $B/mfs_get /x g; same b3k g "other file read"
+q $B/mfs_defrag; grep -q "0 ficheros movidos" out && ok "nothing left to move" || fail "nothing left to move"
+clean "debug after defrag"
+mkfs -n 2000 -b 512 -i 10
+q $B/mfs_put f3k /a; q $B/mfs_put f3k /x; q $B/mfs_test write /a 3000 f3k 512
+# /a está abierto mientras se mueve: el fd no puede quedarse con lo viejo
+check "defrag with the file open" $B/mfs_test busy defrag /a
+clean "debug after defrag with the file open"
+
+echo "== analysis"
+mkfs -n 2000 -b 512 -i 10
+q $B/mfs_put f3k /a; q $B/mfs_put f50 /s; q $B/mfs_put f1100 /t; q $B/mfs_put f3k /b
+[ "$(info '"runs"')" = 1 ] && ok "one free run" || fail "one free run"
+q $B/mfs_rm /a
+$B/mfs_info -a > json
+if ! command -v python3 > /dev/null || python3 -m json.tool json > /dev/null 2>&1; then
+	ok "valid JSON"
+else
+	fail "valid JSON"; cat json
+fi
+[ "$(used)" = "$($B/mfs_info -hide=i -hide=d | grep -c "used: Yes")" ] &&
+	ok "used blocks match the bitmap" || fail "used blocks match the bitmap"
+[ "$(info '"runs"')" = 2 ] && ok "removed file leaves a free run" || fail "removed file leaves a free run"
+[ "$(info '"count"')" = 3 ] && ok "files counted" || fail "files counted"
+n=$(sed -n 's/.*"extents_per_file": {\(.*\)}.*/\1/p' json | sed 's/"[0-9]*": //g; s/, /+/g')
+[ $((n)) = 3 ] && ok "extents per file" || { fail "extents per file"; cat json; }
+grep -q '"inodes": {"total": [0-9]*, "used": 4,' json && ok "inodes counted" || fail "inodes counted"
+
+echo "== resize"
+mkfs -n 2000 -b 512 -i 10
+q $B/mfs_put f100k /a
+check "grow" $B/mfs_resize -n 4000 -i 10
+[ "$(info '"total"')" = 3791 ] && ok "data blocks added" || fail "data blocks added"
+$B/mfs_info -a | grep -q '"inodes": {"total": 840,' && ok "inodes added" || fail "inodes added"
+q $B/mfs_get /a g; same f100k g "data kept after resize"
+# el bitmap y la tabla de inodos ya no caben al principio: extensión
+check "grow past the fixed tables" $B/mfs_resize -n 20000 -i 100
+for i in 1 2 3 4; do q $B/mfs_put f300k /b$i; done
+q $B/mfs_get /b4 g; same f300k g "new space used"
+q $B/mfs_get /a g; same f100k g "data kept after the extension"
+clean "debug after resize"
+
+echo "== checker"
+mkfs -n 3000 -b 512 -i 10
+q $B/mfs_mkdir /d
+for i in $(seq 1 20); do q $B/mfs_put f3k /d/f$i; done
+q $B/mfs_put f100k /d/big
+$B/mfs_debug -c > serial; $B/mfs_debug -c -j 4 > parallel
+same serial parallel "serial and parallel agree (clean)"
+q $B/my_fake -i=3; q $B/my_fake -d=3
+$B/mfs_debug -c > serial; $B/mfs_debug -c -j 4 > parallel
+same serial parallel "serial and parallel agree (damaged)"
+grep -q "Inodes right" serial && grep -q "Data right" serial && fail "damage found" || ok "damage found"
+cp mfs.img serial.img
+q $B/mfs_debug -r -j 4
+MFS_NAME=$T/serial.img q $B/mfs_debug -r
+same mfs.img serial.img "serial and parallel repair agree"
+# si borra la entrada de un inodo libre, sus bloques quedan para otra pasada
+q $B/mfs_debug -r -j 4
+clean "repaired"
+
+echo "== change log"
+mkfs -n 2000 -b 512 -i 10
+q $B/mfs_mkdir /d; q $B/mfs_put f3k /d/x; q $B/mfs_put f100k /d/y
+$B/mfs_debug -c -l | grep -q "Clean file system" && ok "clean image needs no check" || fail "clean image needs no check"
+clean "incremental check" -l
+q $B/mfs_rm /d/x; q $B/mfs_get /d/y g; same f100k g "data kept with the log"
+printf 'mkdir /e\nput f3k /e/x\nput f100k /e/y\n' | $B/mfs_shell -t > out
+$B/mfs_debug -c -l | grep -q "Clean file system" && ok "batch leaves it clean" || fail "batch leaves it clean"
+q $B/mfs_get /e/y g; same f100k g "batch data kept"
+printf 'put f3k /d/z\nrm /d/nope\nput f3k /d/w\n' | $B/mfs_shell -t > out
+$B/mfs_debug -c -l > dbg
+grep -q "Incremental check" dbg && ok "failed batch leaves it dirty" || { fail "failed batch leaves it dirty"; cat dbg; }
+q $B/mfs_debug -r -l
+clean "incremental repair" -l
+$B/mfs_debug -c -l | grep -q "Clean file system" && ok "clean after repair" || fail "clean after repair"
+q $B/mfs_get /d/z g; same f3k g "batch runs up to the error"
+q $B/mfs_get /d/w g && fail "batch stops at the error" || ok "batch stops at the error"
+clean "full check after log"
+
+echo "== checksums"
+mkfs -n 2000 -b 512 -i 10 -k crc32c
+yes MARCA_CRC | head -c 3000 > mark
+q $B/mfs_put mark /m; q $B/mfs_get /m g; same mark g "crc put-get"
+q $B/mfs_put f100k /b; q $B/mfs_get /b g; same f100k g "crc big file"
+clean "debug with crc"
+off=$(grep -obUa MARCA_CRC mfs.img | head -1 | cut -d: -f1)
+printf 'Z' | dd of=mfs.img bs=1 seek=$((off + 600)) conv=notrunc 2> /dev/null
+$B/mfs_get /m g > out 2>&1
+grep -q "bad checksum" out && ok "corruption detected" || { fail "corruption detected"; cat out; }
+check "failed read leaves the position" $B/mfs_test badread /m
+q $B/mfs_get /b g; same f100k g "other files still read"
+
+echo "== compression"
+mkfs -n 3000 -b 512 -i 10 -z 4
+q $B/mfs_put text /z; q $B/mfs_get /z g; same text g "compressed put-get"
+[ "$(info '"compressed": {"count"')" = 1 ] && ok "file compressed" || fail "file compressed"
+zb=$($B/mfs_info -a | sed -n 's/.*"compressed": {"count": [0-9]*, "blocks": \([0-9]*\), "raw_blocks": \([0-9]*\).*/\1 \2/p')
+[ ${zb% *} -lt $((${zb#* } / 2)) ] && ok "compressed size ($zb)" || fail "compressed size ($zb)"
+cp text exp; patch exp 10000 f3k
+check "compressed rewrite" $B/mfs_test write /z 10000 f3k 700
+q $B/mfs_get /z g; same exp g "compressed rewrite read"
+patch exp 200000 f100k
+check "compressed append" $B/mfs_test write /z 200000 f100k 4096
+q $B/mfs_get /z g; same exp g "compressed append read"
+q $B/mfs_put f100k /r; q $B/mfs_get /r g; same f100k g "incompressible data"
+q $B/mfs_cp /z /z2; q $B/mfs_get /z2 g; same exp g "compressed cp"
+mkfs -n 3000 -b 512 -i 10 -z 8
+# dos clusters que pasan de comprimidos a no y al revés: los sitios que
+# dejan se vuelven a usar o se juntan al cerrar, así nunca ocupa más que sin
+# comprimir (16 + el mapa) y 1/8 de huecos; antes se iba a 20 y 24
+head -c 4096 text > t4k; head -c 4096 /dev/urandom > r4k
+before=$(($(used) + 1)) # el bloque del directorio
+head -c 8192 text > exp; q $B/mfs_put exp /s
+most=0
+for round in 1 2 3; do
+	for piece in 0:r4k 4096:t4k 0:t4k 4096:r4k; do
+		patch exp ${piece%:*} ${piece#*:}
+		q $B/mfs_test write /s ${piece%:*} ${piece#*:} 4096
+		[ $(($(used) - before)) -gt $most ] && most=$(($(used) - before))
+	done
+done
+q $B/mfs_get /s g; same exp g "compressed clusters that change size"
+[ $most -le 19 ] && ok "freed cluster slots reused ($most blocks)" ||
+	fail "freed cluster slots reused ($most blocks)"
+q $B/mfs_put text /z
+check "clone of an open compressed file" $B/mfs_test clone /z /c
+clean "debug after compression"
+
+echo "== dedup"
+mkfs -n 3000 -b 512 -i 10 -d on
+q $B/mfs_put f100k /a
+before=$(used)
+q $B/mfs_put f100k /b
+[ $(($(used) - before)) -lt 10 ] && ok "identical file shared" || fail "identical file shared"
+q $B/mfs_get /b g; same f100k g "dedup read"
+cp f100k exp; patch exp 0 f3k
+check "write to deduplicated file" $B/mfs_test write /b 0 f3k 512
+q $B/mfs_get /b g; same exp g "dedup cow"
+q $B/mfs_get /a g; same f100k g "dedup original intact"
+clean "refcounts after dedup"
+mkfs -n 3000 -b 512 -i 10
+q $B/mfs_put f100k /a; q $B/mfs_put f100k /b
+before=$(used)
+q $B/mfs_dedup
+# la tabla de huellas que se crea ahora también ocupa
+grep -q "bloques libres: *19[0-9] " out && [ $(used) -lt $before ] &&
+	ok "mfs_dedup frees blocks" || { fail "mfs_dedup frees blocks"; cat out; }
+q $B/mfs_get /b g; same f100k g "mfs_dedup read"
+clean "debug after mfs_dedup"
+mkfs -n 3000 -b 512 -i 10
+q $B/mfs_put f100k /a; q $B/mfs_put f100k /b
+check "mfs_dedup with the file open" $B/mfs_test busy dedup /b
+clean "debug after mfs_dedup with the file open"
+
+echo "== holes"
+mkfs -n 3000 -b 1024 -i 10
+: > exp; patch exp 0 f3k; patch exp 200000 f3k
+q $B/mfs_put empty /h
+check "write with gap" $B/mfs_test write /h 0 f3k 1000
+check "write past the end" $B/mfs_test write /h 200000 f3k 4096
+q $B/mfs_get /h g; same exp g "sparse read"
+$B/mfs_test map /h > map
+grep -q "^size 203000: \[0,3072) \[199680,203000)$" map && ok "SEEK_DATA/SEEK_HOLE" || { fail "SEEK_DATA/SEEK_HOLE"; cat map; }
+[ "$(info '"sparse": {"count"')" = 1 ] && ok "sparse counted" || fail "sparse counted"
+q $B/mfs_cp /h /h2; $B/mfs_test map /h2 > map2; same map map2 "cp keeps holes"
+patch exp 100000 f3k
+check "fill a hole" $B/mfs_test write /h 100000 f3k 512
+q $B/mfs_get /h g; same exp g "hole filled"
+# bloques enteros de ceros que caen en un hueco o tras el final no ocupan
+cp f3k z; head -c 204800 /dev/zero >> z; cat f3k >> z
+before=$(used)
+q $B/mfs_put -s 4096 z /z; q $B/mfs_get /z g; same z g "zero blocks read back"
+[ $(($(used) - before)) -lt 10 ] && ok "zero blocks stored as a hole" ||
+	fail "zero blocks stored as a hole ($(($(used) - before)) blocks)"
+$B/mfs_test map /z > map
+grep -q "^size 210800: \[0,[0-9]*) \[[0-9]*,210800)$" map && ok "zero blocks map" || { fail "zero blocks map"; cat map; }
+head -c 3072 /dev/zero > zeros; cp z exp; patch exp 0 zeros
+check "zeros over data" $B/mfs_test write /z 0 zeros 1024
+q $B/mfs_get /z g; same exp g "zeros over data kept"
+clean "debug after holes"
+
+echo "== asynchronous I/O"
+mkfs -n 3000 -b 1024 -i 10
+# con trozos grandes los bloques van por data_queue
+for engine in io_uring threads; do
+	MFS_AIO=$engine q $B/mfs_put -s 65536 f300k /$engine
+	MFS_AIO=$engine q $B/mfs_get -s 65536 /$engine g; same f300k g "aio $engine"
+done
+MFS_AIO=threads q $B/mfs_get -s 65536 /io_uring g; same f300k g "aio mixed engines"
+MFS_AIO=threads q $B/mfs_defrag
+q $B/mfs_get -s 65536 /threads g; same f300k g "aio defrag"
+MFS_AIO=nope q $B/mfs_get -s 65536 /threads g
+grep -q Error out && ok "aio bad engine refused" || fail "aio bad engine refused"
+clean "debug after aio"
+
+echo "== mfsd"
+mkfs -n 16000 -b 512 -i 10
+head -c 3000000 /dev/urandom > f3m
+for ring in 1 0; do
+	$B/mfsd -s $T/sock > mfsd.log 2>&1 &
+	daemon=$!
+	for i in $(seq 1 50); do [ -S $T/sock ] && break; sleep 0.1; done
+	export MFS_SOCKET=$T/sock MFS_RING=$ring
+	q $B/mfs_mkdir /d$ring
+	q $B/mfs_put f100k /d$ring/a; q $B/mfs_get /d$ring/a g; same f100k g "mfsd ring=$ring put-get"
+	q $B/mfs_put -s 100 f3k /d$ring/b; q $B/mfs_get -s 33 /d$ring/b g; same f3k g "mfsd ring=$ring small pieces"
+	q $B/mfs_cp -r /d$ring/a /d$ring/c; q $B/mfs_get /d$ring/c g; same f100k g "mfsd ring=$ring clone"
+	[ $($B/mfs_ls /d$ring | tail -n +3 | wc -l) = 5 ] && ok "mfsd ring=$ring ls" || fail "mfsd ring=$ring ls"
+	q $B/mfs_rm /d$ring/c; q $B/mfs_get /d$ring/c g && fail "mfsd ring=$ring rm" || ok "mfsd ring=$ring rm"
+	q $B/mfs_put f3m /d$ring/m
+	check "mfsd ring=$ring negative counts" $B/mfs_test rpc /d$ring/m
+	q $B/mfs_mkfs -n 100 && fail "mfsd ring=$ring mkfs refused" || ok "mfsd ring=$ring mkfs refused"
+	unset MFS_SOCKET MFS_RING
+	stop_daemon
+	rm -f $T/sock
+done
+q $B/mfs_get /d1/a g; same f100k g "data kept after mfsd"
+clean "debug after mfsd"
+
+echo "== format"
+mkfs -n 2000 -b 512 -i 10
+# sin MFS_MAGIC (justo detrás de los campos del formato original, en el
+# primer bloque tras la cabecera del dispositivo) es una imagen vieja
+printf '\0\0\0\0' | dd of=mfs.img bs=1 seek=$((512 + 24)) conv=notrunc 2> /dev/null
+$B/mfs_ls / > out 2>&1 && fail "unversioned image refused" ||
+	{ grep -q "formato antiguo" out && ok "unversioned image refused" ||
+	  { fail "unversioned image refused"; cat out; }; }
+mkfs -n 2000 -b 512 -i 10
+printf '\143\0\0\0' | dd of=mfs.img bs=1 seek=$((512 + 28)) conv=notrunc 2> /dev/null
+$B/mfs_ls / > out 2>&1
+grep -q "versión 99 del formato" out && ok "other version refused" ||
+	{ fail "other version refused"; cat out; }
+
+echo
+if [ $fails = 0 ]; then
+	echo "todas las pruebas bien"
+	[ -z "$1" ] && rm -rf "$T"
+else
+	echo "$fails pruebas mal (las imágenes están en $T)"
+fi
+exit $fails